@@ -100,6 +100,9 @@ This variable will typically contain include paths, e.g., (\"-I~/MyProject\" \"-
 (defconst ac-clang-completion-pattern
   "^COMPLETION: \\(%s[^\s\n:]*\\)\\(?: : \\)*\\(.*$\\)")
 
+(defconst ac-clang-candidate-pattern
+  "^CANDIDATE:\\(%s[^\t\n]*\\)\t[^\t\n]*\t\\([0-9]+\\.[0-9]+\\)$")
+
 (defun ac-clang-parse-output (prefix)
   (goto-char (point-min))
   (let ((pattern (format ac-clang-completion-pattern
@@ -128,6 +131,70 @@ This variable will typically contain include paths, e.g., (\"-I~/MyProject\" \"-
           (push match lines))))
     lines))
 
+(defconst ac-clang-identifier-pattern
+  "^IDENTIFIER:\\(%s.*\\)$")
+
+(defun ac-clang-parse-identifiers (prefix)
+  "Parse the IDENTIFIER lines of the current buffer starting with PREFIX.
+They come from the text of the source, there's nothing to tell about them."
+  (goto-char (point-min))
+  (let ((pattern (format ac-clang-identifier-pattern (regexp-quote prefix)))
+        lines)
+    (while (re-search-forward pattern nil t)
+      (push (propertize (match-string-no-properties 1) 'ac-clang-help "") lines))
+    lines))
+
+(defun ac-clang-parse-candidates (prefix)
+  "Parse the CANDIDATE lines of the current buffer starting with PREFIX.
+The ids of overloads sharing a name are kept together, their details are
+fetched by `ac-clang-fetch-details' when they are documented."
+  (goto-char (point-min))
+  (let ((pattern (format ac-clang-candidate-pattern (regexp-quote prefix)))
+        lines match
+        (prev-match ""))
+    (while (re-search-forward pattern nil t)
+      (setq match (match-string-no-properties 1))
+      (if (string= match prev-match)
+          (put-text-property 0 (length (car lines)) 'ac-clang-candidate-ids
+                             (append (get-text-property 0 'ac-clang-candidate-ids (car lines))
+                                     (list (match-string-no-properties 2)))
+                             (car lines))
+        (setq prev-match match)
+        (push (propertize match 'ac-clang-candidate-ids
+                          (list (match-string-no-properties 2)))
+              lines)))
+    lines))
+
+(defun ac-clang-parse-sexp-results (response start prefix)
+  "Read the candidates of a SEXP RESPONSE, from START on, starting with PREFIX.
+It is a list of (NAME OVERLOAD...), the overloads of a candidate are kept
+in its `ac-clang-overloads' property, each one as
+(KIND PRIORITY RESULT-TYPE CHUNKS ID)."
+  (let (candidates)
+    (dolist (candidate (car (read-from-string response start)) candidates)
+      (when (string-prefix-p prefix (car candidate))
+        (push (propertize (car candidate) 'ac-clang-overloads (cdr candidate))
+              candidates)))))
+
+(defun ac-clang-render-chunks (name chunks &optional without-optional)
+  "Render the CHUNKS of an overload of NAME in the markup of COMPLETION lines.
+Optional parts are left out if WITHOUT-OPTIONAL is non-nil."
+  (mapconcat (lambda (chunk)
+               (cond ((stringp chunk) chunk)
+                     ((eq chunk 'name) name)
+                     ((eq (car chunk) 'p) (concat "<#" (cadr chunk) "#>"))
+                     ((eq (car chunk) 'o)
+                      (if without-optional
+                          ""
+                        (concat "{#" (ac-clang-render-chunks name (cdr chunk)) "#}")))
+                     (t (cadr chunk))))
+             chunks ""))
+
+(defun ac-clang-overload-signature (name overload)
+  "Render OVERLOAD of NAME as the SIGNATURE of a DETAIL response would be."
+  (concat (if (nth 2 overload) (concat "[#" (nth 2 overload) "#]") "")
+          (ac-clang-render-chunks name (nth 3 overload))))
+
 
 (defconst ac-clang-error-buffer-name "*clang error*")
 
@@ -143,27 +210,30 @@ This variable will typically contain include paths, e.g., (\"-I~/MyProject\" \"-
                 (message "clang failed with error %d:\n%s" res cmd)
                 (buffer-string))))
 
+    ;; The failures are logged one after the other, the last one is shown.
     (with-current-buffer buf
-      (let ((inhibit-read-only t))
-        (erase-buffer)
+      (let ((inhibit-read-only t)
+            (start (goto-char (point-max))))
         (insert (current-time-string)
                 (format "\nclang failed with error %d:\n" res)
                 cmd "\n\n")
-        (insert err)
+        (insert err "\n\n")
         (setq buffer-read-only t)
-        (goto-char (point-min))))))
+        (goto-char start)))))
 
 (defun ac-clang-call-process (prefix &rest args)
-  (let ((buf (get-buffer-create "*clang-output*"))
+  (let ((buf (generate-new-buffer " *clang-output*"))
         res)
-    (with-current-buffer buf (erase-buffer))
-    (setq res (apply 'call-process-region (point-min) (point-max)
-                     ac-clang-executable nil buf nil args))
-    (with-current-buffer buf
-      (unless (eq 0 res)
-        (ac-clang-handle-error res args))
-      ;; Still try to get any useful input.
-      (ac-clang-parse-output prefix))))
+    (unwind-protect
+        (progn
+          (setq res (apply 'call-process-region (point-min) (point-max)
+                           ac-clang-executable nil buf nil args))
+          (with-current-buffer buf
+            (unless (eq 0 res)
+              (ac-clang-handle-error res args))
+            ;; Still try to get any useful input.
+            (ac-clang-parse-output prefix)))
+      (kill-buffer buf))))
 
 
 (defsubst ac-clang-create-position-string (pos)
@@ -202,11 +272,67 @@ This variable will typically contain include paths, e.g., (\"-I~/MyProject\" \"-
     (setq s (replace-regexp-in-string "#\\]" " " s)))
   s)
 
+(defun ac-clang-fetch-details (item ids)
+  "Ask the server for the details of the candidates IDS of ITEM, without
+waiting for them. See `ac-clang-take-detail' for where they are kept."
+  (when (ac-clang-process-live-p ac-clang-completion-process)
+    ;; (REMAINING SIGNATURES BRIEFS), filled in as the responses come
+    (put-text-property 0 (length item) 'ac-clang-details (list (length ids) nil nil) item)
+    (dolist (id ids)
+      (ac-clang-send-query ac-clang-completion-process "DETAIL"
+                           'ac-clang-take-detail item
+                           (format "id:%s\n" id)))))
+
+(defun ac-clang-take-detail (item response)
+  "Keep the details of ITEM in the DETAIL RESPONSE. Once they are all in, the
+signatures are kept in the `ac-clang-help' property of ITEM (unless it has
+them already) and the brief comments in its `ac-clang-brief' property."
+  (let ((details (get-text-property 0 'ac-clang-details item)))
+    (when (string-match "^SIGNATURE:\\(.*\\)$" response)
+      (push (match-string 1 response) (nth 1 details))
+      (when (string-match "^BRIEF:\\(.*\\)$" response)
+        (push (match-string 1 response) (nth 2 details))))
+    (when (= (setcar details (1- (car details))) 0)
+      (when (and (nth 1 details) (not (get-text-property 0 'ac-clang-help item)))
+        (put-text-property 0 (length item) 'ac-clang-help
+                           (mapconcat 'identity (reverse (nth 1 details)) "\n") item))
+      (put-text-property 0 (length item) 'ac-clang-brief
+                         (mapconcat 'identity (delete-dups (reverse (nth 2 details))) "\n") item)
+      ;; the popup showed what was known so far
+      (when (and (fboundp 'ac-quick-help) (ac-menu-live-p)
+                 (eq item (ac-selected-candidate)))
+        (ac-quick-help t)))))
+
+(defun ac-clang-candidate-help (item)
+  "Return the signatures of the candidate ITEM, one per line, or nil if they
+aren't known yet. Those of a SEXP response are rendered from its overloads,
+those of the other candidates come from `ac-clang-fetch-details'."
+  (let ((overloads (get-text-property 0 'ac-clang-overloads item))
+        (name (substring-no-properties item)))
+    (when (and overloads (not (get-text-property 0 'ac-clang-help item)))
+      (put-text-property 0 (length item) 'ac-clang-help
+                         (mapconcat (lambda (overload)
+                                      (ac-clang-overload-signature name overload))
+                                    overloads "\n")
+                         item))
+    (get-text-property 0 'ac-clang-help item)))
+
+(defun ac-clang-document-details (item)
+  "Fetch the details of ITEM missing from its documentation, once."
+  (let ((ids (or (get-text-property 0 'ac-clang-candidate-ids item)
+                 (mapcar (lambda (overload) (nth 4 overload))
+                         (get-text-property 0 'ac-clang-overloads item)))))
+    (when (and ids (not (get-text-property 0 'ac-clang-details item)))
+      (ac-clang-fetch-details item ids))))
+
 (defun ac-clang-document (item)
-  (if (stringp item)
-      (let (s)
-        (setq s (get-text-property 0 'ac-clang-help item))
-        (ac-clang-clean-document s)))
+  (when (stringp item)
+    (ac-clang-document-details item)
+    (let ((s (ac-clang-clean-document (ac-clang-candidate-help item)))
+          (brief (get-text-property 0 'ac-clang-brief item)))
+      (if (and s brief (not (string= brief "")))
+          (concat s "\n\n" brief)
+        s)))
   ;; (popup-item-property item 'ac-clang-help)
   )
 
@@ -229,13 +355,47 @@ This variable will typically contain include paths, e.g., (\"-I~/MyProject\" \"-
 (defvar ac-clang-template-start-point nil)
 (defvar ac-clang-template-candidates (list "ok" "no" "yes:)"))
 
+(defun ac-clang-overload-templates (name overloads)
+  "Return the argument lists of the OVERLOADS of NAME, last first, as
+`ac-clang-template-action' expects them: with and without their optional
+parts and variadic arguments."
+  (let (candidates chunks args ret-t)
+    (dolist (overload overloads candidates)
+      (setq chunks (cdr (memq 'name (nth 3 overload)))
+            args (ac-clang-render-chunks name chunks)
+            ret-t (or (nth 2 overload) ""))
+      (cond ((string-match-p "[(:]" args)
+             (push (propertize (ac-clang-clean-document args) 'ac-clang-help ret-t
+                               'raw-args args) candidates)
+             (when (string-match-p "{#" args)
+               (setq args (ac-clang-render-chunks name chunks t))
+               (push (propertize (ac-clang-clean-document args) 'ac-clang-help ret-t
+                                 'raw-args args) candidates))
+             (when (string-match-p ", \\.\\.\\." args)
+               (setq args (replace-regexp-in-string ", \\.\\.\\." "" args))
+               (push (propertize (ac-clang-clean-document args) 'ac-clang-help ret-t
+                                 'raw-args args) candidates)))
+            ((string-match "^\\([^(]*\\)(\\*)\\((.*)\\)" ret-t) ;; a function ptr
+             (let ((ret-f (match-string 1 ret-t))
+                   (args (match-string 2 ret-t)))
+               (push (propertize args 'ac-clang-help ret-f 'raw-args "") candidates)
+               (when (string-match ", \\.\\.\\." args)
+                 (setq args (replace-regexp-in-string ", \\.\\.\\." "" args))
+                 (push (propertize args 'ac-clang-help ret-f 'raw-args "") candidates))))))))
+
 (defun ac-clang-action ()
   (interactive)
   ;; (ac-last-quick-help)
-  (let ((help (ac-clang-clean-document (get-text-property 0 'ac-clang-help (cdr ac-last-completion))))
-        (raw-help (get-text-property 0 'ac-clang-help (cdr ac-last-completion)))
-        (candidates (list)) ss fn args (ret-t "") ret-f)
-    (setq ss (split-string raw-help "\n"))
+  ;; Only what the client holds is used, the server isn't asked for anything.
+  (let* ((raw-help (or (ac-clang-candidate-help (cdr ac-last-completion)) ""))
+         (help (ac-clang-clean-document raw-help))
+         (overloads (get-text-property 0 'ac-clang-overloads (cdr ac-last-completion)))
+         (candidates (list)) ss fn args (ret-t "") ret-f)
+    ;; the chunks of a SEXP response tell the arguments apart already
+    (if overloads
+        (setq candidates (ac-clang-overload-templates
+                          (substring-no-properties (cdr ac-last-completion)) overloads))
+      (setq ss (split-string raw-help "\n")))
     (dolist (s ss)
       (when (string-match "\\[#\\(.*\\)#\\]" s)
         (setq ret-t (match-string 1 s)))
@@ -404,54 +564,428 @@ This variable will typically contain include paths, e.g., (\"-I~/MyProject\" \"-
 (make-variable-buffer-local 'ac-clang-current-candidate)
 (make-variable-buffer-local 'ac-clang-completion-process)
 
+(defcustom ac-clang-async-send-source-deltas t
+  "If non-nil, send only the edits made since the last request instead of
+the whole buffer, the server keeps its own copy of the source up to date."
+  :group 'auto-complete
+  :type 'boolean)
+
+(defcustom ac-clang-async-max-pending-deltas 256
+  "Number of unsent edits after which the whole buffer is sent instead."
+  :group 'auto-complete
+  :type 'integer)
+
+(defcustom ac-clang-async-candidate-limit 500
+  "Maximum number of completion candidates the server sends back.
+Candidates are filtered by the typed prefix and ranked by the server, nil
+means no limit."
+  :group 'auto-complete
+  :type '(choice (const :tag "No limit" nil) integer))
+
+(defcustom ac-clang-async-daemon-socket nil
+  "Unix domain socket of a shared clang-complete daemon.
+If non-nil, all buffers are served by one daemon listening on this socket
+(started on demand) instead of one clang-complete process per buffer."
+  :group 'auto-complete
+  :type '(choice (const :tag "One process per buffer" nil) file))
+
+(defcustom ac-clang-async-daemon-memory-budget 2048
+  "Megabytes of translation units the daemon keeps before evicting idle ones."
+  :group 'auto-complete
+  :type 'integer)
+
+(defcustom ac-clang-async-zygote-socket nil
+  "Unix domain socket of a clang-complete zygote.
+If non-nil (and `ac-clang-async-daemon-socket' is nil), the server of each
+buffer is forked by a zygote listening on this socket (started on demand),
+which has libclang loaded and the headers of `ac-clang-async-zygote-prelude'
+parsed already, instead of being started from scratch."
+  :group 'auto-complete
+  :type '(choice (const :tag "Start every server from scratch" nil) file))
+
+(defcustom ac-clang-async-zygote-prelude nil
+  "File including the headers most of your files include, parsed by the
+zygote when it starts."
+  :group 'auto-complete
+  :type '(choice (const :tag "None" nil) file))
+
+(defcustom ac-clang-async-ast-cache-directory nil
+  "Directory where the server keeps precompiled preambles of source files.
+If non-nil, reopening a file parses it against the headers precompiled by an
+earlier server, instead of parsing all of them again."
+  :group 'auto-complete
+  :type '(choice (const :tag "No cache" nil) directory))
+
+(defcustom ac-clang-async-ast-cache-size 1024
+  "Megabytes of precompiled preambles kept in the AST cache."
+  :group 'auto-complete
+  :type 'integer)
+
+(defcustom ac-clang-async-ast-cache-age 30
+  "Days after which unused precompiled preambles are removed from the cache."
+  :group 'auto-complete
+  :type 'integer)
+
+(defcustom ac-clang-async-compile-commands-directory nil
+  "Directory of the compile_commands.json to take compile flags from.
+The flags of each file in the compilation database are used in addition to
+`ac-clang-cflags'. If t, it's looked for in the parent directories of the
+file."
+  :group 'auto-complete
+  :type '(choice (const :tag "None" nil)
+                 (const :tag "Look for it" t)
+                 directory))
+
+(defcustom ac-clang-async-trace-directory nil
+  "Directory where each server records the messages it receives.
+The traces could be replayed by bench/replay to benchmark the server. Not
+supported by the daemon."
+  :group 'auto-complete
+  :type '(choice (const :tag "Don't record" nil) directory))
+
+(defcustom ac-clang-async-hibernate-after nil
+  "Seconds of idleness after which the server frees the translation unit of a
+buffer. It's rebuilt from a precompiled preamble on the next request."
+  :group 'auto-complete
+  :type '(choice (const :tag "Never" nil) integer))
+
+(defcustom ac-clang-async-symbol-index nil
+  "File of the project-wide symbol index, built by `ac-clang-index-project'.
+Symbols are looked up in it by `ac-clang-find-symbol'."
+  :group 'auto-complete
+  :type '(choice (const :tag "None" nil) file))
+
+(defcustom ac-clang-async-parse-profile nil
+  "Parse profile of the server, trading the accuracy of diagnostics for speed.
+\"interactive\" skips the function bodies of the headers, \"accurate\" parses
+everything, and \"low-memory\" skips every function body but the one being
+completed in. nil leaves it to the server, which defaults to interactive."
+  :group 'auto-complete
+  :type '(choice (const :tag "Server default" nil)
+                 (const "interactive")
+                 (const "accurate")
+                 (const "low-memory")))
+(make-variable-buffer-local 'ac-clang-async-parse-profile)
+
+(defcustom ac-clang-async-send-unsaved-headers t
+  "If non-nil, the contents of modified header buffers are sent to the server,
+so that completion sees the edits to a header before it's saved."
+  :group 'auto-complete
+  :type 'boolean)
+
+(defcustom ac-clang-async-lazy-details t
+  "If non-nil, the server only sends the names of the completion candidates.
+The signature and brief comment of a candidate are asked for when it's
+documented or inserted."
+  :group 'auto-complete
+  :type 'boolean)
+
+(defcustom ac-clang-async-sexp-results t
+  "If non-nil, the server sends the completion candidates as one s-expression.
+It is loaded with a single `read', and carries the signatures of the
+candidates, so only their brief comments are asked for later. This takes
+precedence over `ac-clang-async-lazy-details'."
+  :group 'auto-complete
+  :type 'boolean)
+
+(defcustom ac-clang-async-lexical-budget nil
+  "Milliseconds to wait for the semantic completion candidates.
+If non-nil, the server answers a completion it can't compute that fast (say
+while the headers are being parsed) with the identifiers of the buffer and
+of the headers it includes first, and with the semantic candidates when
+they're in. So it does when there are no semantic candidates at all."
+  :group 'auto-complete
+  :type '(choice (const :tag "Never" nil) integer))
+
+(defcustom ac-clang-async-speculative-completion nil
+  "If non-nil, tell the server where the cursor is whenever Emacs is idle, so
+that it computes the completions around it before they are asked for."
+  :group 'auto-complete
+  :type 'boolean)
+
+(defcustom ac-clang-async-structured-diagnostics nil
+  "If non-nil, have the server send diagnostics as structured records, only
+the ones which changed since the last syntax check."
+  :group 'auto-complete
+  :type 'boolean)
+
+(defcustom ac-clang-async-diagnostics-visible-only nil
+  "If non-nil, syntax checks only report diagnostics in the visible part of
+the buffer."
+  :group 'auto-complete
+  :type 'boolean)
+
+(defvar ac-clang-diagnostics nil
+  "Structured diagnostics of the buffer, by id: (TYPE LINE MESSAGE).")
+(defvar ac-clang-diagnostics-set-id 0
+  "Id of the last set of structured diagnostics received.")
+(make-variable-buffer-local 'ac-clang-diagnostics)
+(make-variable-buffer-local 'ac-clang-diagnostics-set-id)
+
+(defun ac-clang-compile-commands-directory ()
+  "Directory of compile_commands.json for the current buffer, if any."
+  (if (eq ac-clang-async-compile-commands-directory t)
+      (and buffer-file-name
+           (locate-dominating-file buffer-file-name "compile_commands.json"))
+    ac-clang-async-compile-commands-directory))
+
+(defun ac-clang-server-args ()
+  "Command line options of the server itself."
+  (let ((compile-commands (ac-clang-compile-commands-directory)))
+    (append
+     (when compile-commands
+       (list "--compile-commands" (expand-file-name compile-commands)))
+     (when ac-clang-async-ast-cache-directory
+       (list "--ast-cache" (expand-file-name ac-clang-async-ast-cache-directory)
+             "--ast-cache-size" (number-to-string ac-clang-async-ast-cache-size)
+             "--ast-cache-age" (number-to-string ac-clang-async-ast-cache-age)))
+     (when (and ac-clang-async-trace-directory (not ac-clang-async-daemon-socket))
+       (list "--record"
+             (expand-file-name
+              (format "%s-%s.trace" (buffer-name) (format-time-string "%Y%m%d-%H%M%S"))
+              ac-clang-async-trace-directory)))
+     (when ac-clang-async-hibernate-after
+       (list "--hibernate-after" (number-to-string ac-clang-async-hibernate-after)))
+     (when ac-clang-async-symbol-index
+       (list "--symbol-index" (expand-file-name ac-clang-async-symbol-index)))
+     (when ac-clang-async-parse-profile
+       (list "--profile" ac-clang-async-parse-profile)))))
+
+(defvar ac-clang-session-id nil
+  "Session id of this buffer in the daemon, nil if not using the daemon.")
+(make-variable-buffer-local 'ac-clang-session-id)
+
+(defvar ac-clang-source-synced nil
+  "Non-nil if the server holds a copy of this buffer at `ac-clang-source-version'.")
+(defvar ac-clang-source-version 0)
+(defvar ac-clang-pending-deltas nil)
+(defvar ac-clang-deleted-bytes 0)
+
+(defvar ac-clang-request-id 0
+  "Id of the last request sent to the server.")
+(defvar ac-clang-pending-completion-id nil
+  "Id of the completion request the server hasn't answered yet.")
+(defvar ac-clang-pending-syntaxcheck-id nil
+  "Id of the syntax check request the server hasn't answered yet.")
+(defvar ac-clang-completion-point nil
+  "Where the prefix of the last completion request sent starts.")
+(defvar ac-clang-lexical-completion nil
+  "(REQUEST-ID . POINT) of the completion answered with lexical candidates,
+whose semantic candidates are still to come.")
+(make-variable-buffer-local 'ac-clang-request-id)
+(make-variable-buffer-local 'ac-clang-pending-completion-id)
+(make-variable-buffer-local 'ac-clang-pending-syntaxcheck-id)
+(make-variable-buffer-local 'ac-clang-completion-point)
+(make-variable-buffer-local 'ac-clang-lexical-completion)
+
+(defconst ac-clang-header-file-regexp
+  "\\.\\(h\\|hh\\|hpp\\|hxx\\|h\\+\\+\\|inl\\|ipp\\|tcc\\)\\'")
+(defvar ac-clang-sent-unsaved-files nil
+  "Alist of (FILE . TICK) of the unsaved headers the server has a copy of.")
+(make-variable-buffer-local 'ac-clang-sent-unsaved-files)
+
+(make-variable-buffer-local 'ac-clang-source-synced)
+(make-variable-buffer-local 'ac-clang-source-version)
+(make-variable-buffer-local 'ac-clang-pending-deltas)
+(make-variable-buffer-local 'ac-clang-deleted-bytes)
+
 ;;;
 ;;; Functions to speak with the clang-complete process
 ;;;
 
-(defun ac-clang-send-source-code (proc)
-  (save-restriction
-    (widen)
-    (process-send-string 
-     proc (format "source_length:%d\n" 
-                  (length (string-as-unibyte   ; fix non-ascii character problem
-                           (buffer-substring-no-properties (point-min) (point-max)))
-                          )))
-    (process-send-string proc (buffer-substring-no-properties (point-min) (point-max)))
-    (process-send-string proc "\n\n")))
+(defun ac-clang-process-live-p (proc)
+  (and proc (memq (process-status proc) '(run open))))
+
+(defun ac-clang-send-message (proc &rest parts)
+  "Send the message made up of PARTS to PROC.
+A message to the daemon is framed with the session id and its length."
+  (let ((message (apply 'concat parts)))
+    (when ac-clang-session-id
+      (setq message (concat (format "%d %d\n" ac-clang-session-id
+                                    (length (string-as-unibyte message)))
+                            message)))
+    (process-send-string proc message)))
+
+(defun ac-clang-source-code ()
+  "Return the source code segment of a message."
+  (if ac-clang-source-synced
+      ;; The server has been following our edits through SOURCEDELTA messages.
+      (format "source_version:%d\n" ac-clang-source-version)
+    (prog1
+        (save-restriction
+          (widen)
+          (let ((source (buffer-substring-no-properties (point-min) (point-max))))
+            (concat (format "source_length:%d\n"
+                            (length (string-as-unibyte source))) ; fix non-ascii character problem
+                    source
+                    "\n\n")))
+      (setq ac-clang-source-synced ac-clang-async-send-source-deltas
+            ac-clang-source-version 0
+            ac-clang-pending-deltas nil))))
+
+(defun ac-clang-send-pending-deltas (proc)
+  "Send the edits recorded since the last request as SOURCEDELTA messages."
+  (when ac-clang-source-synced
+    (dolist (delta (nreverse ac-clang-pending-deltas))
+      (destructuring-bind (offset deleted-length result-length text) delta
+        (ac-clang-send-message
+         proc
+         (format (concat "SOURCEDELTA\n"
+                         "base_version:%d\n"
+                         "offset:%d\n"
+                         "deleted_length:%d\n"
+                         "result_length:%d\n"
+                         "inserted_length:%d\n")
+                 ac-clang-source-version offset deleted-length
+                 result-length (string-bytes text))
+         text
+         "\n"))
+      (setq ac-clang-source-version (1+ ac-clang-source-version))))
+  (setq ac-clang-pending-deltas nil))
+
+(defun ac-clang-before-change (beg end)
+  (when ac-clang-source-synced
+    (setq ac-clang-deleted-bytes (- (position-bytes end) (position-bytes beg)))))
+
+(defun ac-clang-after-change (beg end _old-len)
+  (when ac-clang-source-synced
+    (if (>= (length ac-clang-pending-deltas) ac-clang-async-max-pending-deltas)
+        ;; Resending the whole buffer is cheaper than replaying this many edits.
+        (setq ac-clang-source-synced nil
+              ac-clang-pending-deltas nil)
+      (push (list (1- (position-bytes beg))
+                  ac-clang-deleted-bytes
+                  (save-restriction (widen) (1- (position-bytes (point-max))))
+                  (buffer-substring-no-properties beg end))
+            ac-clang-pending-deltas))))
+
+(defun ac-clang-send-unsaved-files (proc)
+  "Send PROC the modified header buffers it hasn't seen in their current state,
+and tell it to drop the ones which have been saved or killed since."
+  (when ac-clang-async-send-unsaved-headers
+    (let ((sent ac-clang-sent-unsaved-files)
+          unsaved file tick contents)
+      (dolist (buffer (buffer-list))
+        (setq file (buffer-file-name buffer))
+        (when (and file
+                   (not (eq buffer (current-buffer)))
+                   (buffer-modified-p buffer)
+                   (string-match-p ac-clang-header-file-regexp file))
+          (setq tick (buffer-chars-modified-tick buffer))
+          (unless (eql tick (cdr (assoc file sent)))
+            (setq contents (with-current-buffer buffer
+                             (save-restriction
+                               (widen)
+                               (buffer-substring-no-properties (point-min) (point-max)))))
+            (ac-clang-send-message
+             proc
+             "UNSAVED\n"
+             (format "path:%s\nversion:%d\nlength:%d\n"
+                     file tick (length (string-as-unibyte contents)))
+             contents
+             "\n\n"))
+          (push (cons file tick) unsaved)))
+      (dolist (entry sent)
+        (unless (assoc (car entry) unsaved)
+          (ac-clang-send-message proc "UNSAVED\n" (format "path:%s\ndrop:yes\n\n" (car entry)))))
+      (setq ac-clang-sent-unsaved-files unsaved))))
 
 (defun ac-clang-send-reparse-request (proc)
-  (if (eq (process-status "clang-complete") 'run)
+  (if (ac-clang-process-live-p proc)
       (save-restriction
 	(widen)
-	(process-send-string proc "SOURCEFILE\n")
-	(ac-clang-send-source-code proc)
-	(process-send-string proc "REPARSE\n\n"))))
+	(ac-clang-send-pending-deltas proc)
+	(ac-clang-send-unsaved-files proc)
+	(unless ac-clang-source-synced
+	  (ac-clang-send-message proc "SOURCEFILE\n" (ac-clang-source-code)))
+	(ac-clang-send-message proc "REPARSE\n\n"))))
 
 (defun ac-clang-send-completion-request (proc)
   (save-restriction
     (widen)
-    (process-send-string proc "COMPLETION\n")
-    (process-send-string proc (ac-clang-create-position-string (- (point) (length ac-prefix))))
-    (ac-clang-send-source-code proc)))
+    (ac-clang-send-pending-deltas proc)
+    (ac-clang-send-unsaved-files proc)
+    (setq ac-clang-request-id (1+ ac-clang-request-id)
+          ac-clang-pending-completion-id ac-clang-request-id
+          ac-clang-completion-point (- (point) (length ac-prefix)))
+    (ac-clang-send-message
+     proc
+     (format "COMPLETION %d\n" ac-clang-request-id)
+     (ac-clang-create-position-string ac-clang-completion-point)
+     (format "prefix:%s\n" ac-prefix)
+     (if ac-clang-async-candidate-limit
+         (format "limit:%d\n" ac-clang-async-candidate-limit)
+       "")
+     (cond (ac-clang-async-sexp-results "format:sexp\n")
+           (ac-clang-async-lazy-details "details:lazy\n")
+           (t ""))
+     (if ac-clang-async-lexical-budget
+         (format "budget:%d\n" ac-clang-async-lexical-budget)
+       "")
+     (ac-clang-source-code))))
+
+(defun ac-clang-send-cancel-request (proc)
+  "Ask the server to drop the completion request it hasn't answered yet."
+  (when (and ac-clang-pending-completion-id (ac-clang-process-live-p proc))
+    (ac-clang-send-message proc (format "CANCEL %d\n\n" ac-clang-pending-completion-id))))
+
+(defvar ac-clang-cursor-timer nil
+  "Idle timer reporting the cursor to the server.")
+(defvar ac-clang-reported-cursor nil
+  "Position and modification tick of the buffer last reported to the server.")
+(make-variable-buffer-local 'ac-clang-reported-cursor)
+
+(defun ac-clang-send-cursor ()
+  "Report the cursor to the server, unless it hasn't moved since last time."
+  (let ((cursor (list (point) (buffer-chars-modified-tick))))
+    (when (and ac-clang-async-speculative-completion
+               (eq ac-clang-status 'idle)
+               (ac-clang-process-live-p ac-clang-completion-process)
+               (not (equal cursor ac-clang-reported-cursor)))
+      (setq ac-clang-reported-cursor cursor)
+      (save-restriction
+        (widen)
+        (ac-clang-send-pending-deltas ac-clang-completion-process)
+        (ac-clang-send-message
+         ac-clang-completion-process
+         "CURSOR\n"
+         (ac-clang-create-position-string (point))
+         (ac-clang-source-code))))))
 
 (defun ac-clang-send-syntaxcheck-request (proc)
   (save-restriction
     (widen)
-    (process-send-string proc "SYNTAXCHECK\n")
-    (ac-clang-send-source-code proc)))
+    (ac-clang-send-pending-deltas proc)
+    (ac-clang-send-unsaved-files proc)
+    (setq ac-clang-request-id (1+ ac-clang-request-id)
+          ac-clang-pending-syntaxcheck-id ac-clang-request-id)
+    (ac-clang-send-message
+     proc
+     (format "SYNTAXCHECK %d\n" ac-clang-request-id)
+     (if ac-clang-async-structured-diagnostics
+         (format "diagnostics:structured\nbase:%d\n" ac-clang-diagnostics-set-id)
+       "")
+     (ac-clang-diagnostics-range-string)
+     (ac-clang-source-code))))
+
+(defun ac-clang-diagnostics-range-string ()
+  "Return the line range headers of a SYNTAXCHECK message."
+  (let ((window (get-buffer-window (current-buffer))))
+    (if (and ac-clang-async-diagnostics-visible-only window)
+        (format "first_line:%d\nlast_line:%d\n"
+                (line-number-at-pos (window-start window))
+                (line-number-at-pos (window-end window t)))
+      "")))
+
+(defun ac-clang-cmdline-args-string ()
+  "Return num_args and the arguments of a CMDLINEARGS or OPEN message."
+  (concat (format "num_args:%d\n" (length (ac-clang-build-complete-args)))
+          (mapconcat (lambda (arg) (format "%s " arg))
+                     (ac-clang-build-complete-args) "")
+          "\n"))
 
 (defun ac-clang-send-cmdline-args (proc)
-  ;; send message head and num_args
-  (process-send-string proc "CMDLINEARGS\n")
-  (process-send-string
-   proc (format "num_args:%d\n" (length (ac-clang-build-complete-args))))
-
-  ;; send arguments
-  (mapc
-   (lambda (arg)
-     (process-send-string proc (format "%s " arg)))
-   (ac-clang-build-complete-args))
-  (process-send-string proc "\n"))
+  (ac-clang-send-message proc "CMDLINEARGS\n" (ac-clang-cmdline-args-string)))
 
 (defun ac-clang-update-cmdlineargs ()
   (interactive)
@@ -459,9 +993,23 @@ This variable will typically contain include paths, e.g., (\"-I~/MyProject\" \"-
          (ac-clang-send-cmdline-args ac-clang-completion-process)
          (message "`ac-clang-cflags' should be a list of strings")))
 
+(defun ac-clang-send-profile (proc)
+  (when ac-clang-async-parse-profile
+    (ac-clang-send-message proc (format "PROFILE\nprofile:%s\n"
+                                        ac-clang-async-parse-profile))))
+
+(defun ac-clang-set-parse-profile (profile)
+  "Have the server parse the current buffer with PROFILE from now on."
+  (interactive
+   (list (completing-read "Parse profile: "
+                          '("interactive" "accurate" "low-memory") nil t)))
+  (setq ac-clang-async-parse-profile profile)
+  (when (ac-clang-process-live-p ac-clang-completion-process)
+    (ac-clang-send-profile ac-clang-completion-process)))
+
 (defun ac-clang-send-shutdown-command (proc)
-  (if (eq (process-status "clang-complete") 'run)
-    (process-send-string proc "SHUTDOWN\n"))
+  (if (ac-clang-process-live-p proc)
+    (ac-clang-send-message proc "SHUTDOWN\n"))
   )
 
 
@@ -479,26 +1027,206 @@ This variable will typically contain include paths, e.g., (\"-I~/MyProject\" \"-
 ;;
 ;;  Receive server responses (completion candidates) and fire auto-complete
 ;;
-(defun ac-clang-parse-completion-results (proc)
+(defvar ac-clang-response-id nil
+  "Request id of the last response taken by `ac-clang-take-response'.")
+
+(defvar ac-clang-pending-queries nil
+  "Queries waiting for their response, as (PROCESS REQUEST-ID RESPONSE), or
+as (PROCESS REQUEST-ID nil HANDLER DATA) for those sent by `ac-clang-send-query'.")
+
+(defun ac-clang-take-response (proc)
+  "Remove the first response from the process buffer of PROC and return its body.
+Notices of the server are shown as messages and skipped, see
+`ac-clang-take-frame'. Return nil if the response hasn't arrived in full yet."
+  (let ((response (ac-clang-take-frame proc)))
+    (while (and response (ac-clang-notice-p response))
+      (dolist (line (split-string response "\n" t))
+        (message "clang-complete: %s" (substring line (length "NOTICE: "))))
+      (setq response (ac-clang-take-frame proc)))
+    response))
+
+(defun ac-clang-notice-p (response)
+  "Return non-nil if RESPONSE holds warnings the server sent on its own."
+  (and (eql ac-clang-response-id 0)
+       (string-match-p "\\`NOTICE: " response)))
+
+(defun ac-clang-take-frame (proc)
+  "Remove the first frame from the process buffer of PROC and return its body.
+Every frame starts with a \"REQUEST-ID LENGTH\" line, LENGTH counts the
+bytes of the body. Return nil if the frame hasn't arrived in full yet."
   (with-current-buffer (process-buffer proc)
-    (ac-clang-parse-output ac-clang-saved-prefix)))
+    (goto-char (point-min))
+    (when (looking-at "\\([0-9]+\\) \\([0-9]+\\)\n")
+      (setq ac-clang-response-id (string-to-number (match-string 1)))
+      (let* ((start (match-end 0))
+             (end (byte-to-position (+ (position-bytes start)
+                                       (string-to-number (match-string 2))))))
+        (when end
+          (prog1 (buffer-substring-no-properties start end)
+            (delete-region (point-min) end)))))))
+
+(defun ac-clang-parse-completion-results (response)
+  (if (string-match "^SEXP\n" response)
+      (ac-clang-parse-sexp-results response (match-end 0) ac-clang-saved-prefix)
+    (with-temp-buffer
+      (insert response)
+      (cond ((ac-clang-lexical-response-p response)
+             (ac-clang-parse-identifiers ac-clang-saved-prefix))
+            (ac-clang-async-lazy-details
+             (ac-clang-parse-candidates ac-clang-saved-prefix))
+            (t
+             (ac-clang-parse-output ac-clang-saved-prefix))))))
+
+(defun ac-clang-resync-requested-p (response)
+  "Return non-nil if the server lost track of our buffer in RESPONSE."
+  (string-match-p "\\`RESYNC$" response))
+
+(defun ac-clang-profile-error-p (response)
+  "Return non-nil if RESPONSE tells the parse profile sent is unknown."
+  (string-match-p "\\`ERROR: UNKNOWN PROFILE$" response))
+
+(defun ac-clang-lexical-response-p (response)
+  "Return non-nil if RESPONSE holds lexical candidates, not semantic ones."
+  (string-match-p "\\`LEXICAL$" response))
+
+(defun ac-clang-handle-completion-response (response)
+  "Show the candidates of RESPONSE if they answer the outstanding completion
+request. The answers of the requests superseded since are dropped."
+  (cond ((eql ac-clang-response-id (car ac-clang-lexical-completion))
+         (ac-clang-upgrade-completion response))
+        ((eql ac-clang-response-id ac-clang-pending-completion-id)
+         (setq ac-clang-pending-completion-id nil)
+         (setq ac-clang-lexical-completion
+               (when (ac-clang-lexical-response-p response)
+                 (cons ac-clang-response-id ac-clang-completion-point)))
+         (ac-clang-show-completion-response response))))
+
+(defun ac-clang-upgrade-completion (response)
+  "Show the semantic candidates of RESPONSE in place of the lexical ones,
+unless the user has moved on to another completion since."
+  (let ((point (cdr ac-clang-lexical-completion)))
+    (setq ac-clang-lexical-completion nil)
+    (when (and (null ac-clang-pending-completion-id)
+               (eq ac-clang-status 'idle)
+               (eql (ac-clang-prefix) point))
+      (ac-clang-show-completion-response response))))
+
+(defun ac-clang-show-completion-response (response)
+  (case (if (ac-clang-resync-requested-p response) 'resync ac-clang-status)
+    (resync
+     ;; ask again, this time with the whole buffer
+     (setq ac-clang-source-synced nil)
+     (setq ac-clang-status 'idle)
+     (ac-start :force-init t)
+     (ac-update))
+
+    (preempted
+     (setq ac-clang-status 'idle)
+     (ac-start)
+     (ac-update))
+
+    (otherwise
+     (setq ac-clang-current-candidate (ac-clang-parse-completion-results response))
+     ;; (message "ac-clang results arrived")
+     (setq ac-clang-status 'acknowledged)
+     (ac-start :force-init t)
+     (ac-update)
+     (setq ac-clang-status 'idle))))
 
 (defun ac-clang-filter-output (proc string)
   (ac-clang-append-process-output-to-process-buffer proc string)
-  (if (string= (substring string -1 nil) "$")
-      (case ac-clang-status
-        (preempted
-         (setq ac-clang-status 'idle)
-         (ac-start)
-         (ac-update))
-        
-        (otherwise
-         (setq ac-clang-current-candidate (ac-clang-parse-completion-results proc))
-         ;; (message "ac-clang results arrived")
-         (setq ac-clang-status 'acknowledged)
-         (ac-start :force-init t)
-         (ac-update)
-         (setq ac-clang-status 'idle)))))
+  (let (response)
+    (while (setq response (ac-clang-take-response proc))
+      (let ((query (find-if (lambda (query)
+                              (and (eq (car query) proc)
+                                   (eql (cadr query) ac-clang-response-id)))
+                            ac-clang-pending-queries)))
+        (cond ((nth 3 query)
+               (setq ac-clang-pending-queries (delq query ac-clang-pending-queries))
+               (funcall (nth 3 query) (nth 4 query) response))
+              (query
+               (setcar (cddr query) response))
+              ((eql ac-clang-response-id ac-clang-pending-syntaxcheck-id)
+               (ac-clang-handle-syntaxcheck-response response))
+              ((ac-clang-profile-error-p response)
+               (message "clang-complete: unknown parse profile %s"
+                        ac-clang-async-parse-profile))
+              (t
+               (ac-clang-handle-completion-response response)))))))
+
+(defun ac-clang-send-query (proc head handler data &rest parts)
+  "Send the message HEAD followed by PARTS to PROC without waiting for its
+response. HANDLER is called with DATA and the response once it comes."
+  (let ((query (list proc (setq ac-clang-request-id (1+ ac-clang-request-id)) nil
+                     handler data)))
+    (push query ac-clang-pending-queries)
+    (apply 'ac-clang-send-message proc (format "%s %d\n" head (cadr query)) parts)))
+
+(defun ac-clang-query (proc head &rest parts)
+  "Send the message HEAD followed by PARTS to PROC, and return its response.
+Return nil if it doesn't come within a few seconds."
+  (let ((query (list proc (setq ac-clang-request-id (1+ ac-clang-request-id)) nil))
+        (retries 50))
+    (push query ac-clang-pending-queries)
+    (unwind-protect
+        (progn
+          (apply 'ac-clang-send-message proc (format "%s %d\n" head (cadr query)) parts)
+          (while (and (not (nth 2 query)) (> retries 0))
+            (accept-process-output proc 0.1)
+            (setq retries (1- retries)))
+          (nth 2 query))
+      (setq ac-clang-pending-queries (delq query ac-clang-pending-queries)))))
+
+
+;;
+;;  Project-wide symbol index
+;;
+(defun ac-clang-index-project ()
+  "Index the project of the current buffer into `ac-clang-async-symbol-index'.
+The files to index are taken from its compile_commands.json."
+  (interactive)
+  (let ((compile-commands (ac-clang-compile-commands-directory)))
+    (unless ac-clang-async-symbol-index
+      (error "`ac-clang-async-symbol-index' is not set"))
+    (unless compile-commands
+      (error "No compile_commands.json for this buffer"))
+    (start-process "clang-complete-index" "*clang-complete-index*"
+                   ac-clang-complete-executable
+                   "--index" (expand-file-name ac-clang-async-symbol-index)
+                   "--compile-commands" (expand-file-name compile-commands))))
+
+(defun ac-clang-parse-symbols (response)
+  "Parse the SYMBOL lines of RESPONSE into (LABEL FILE LINE COLUMN)."
+  (let (symbols)
+    (dolist (line (split-string response "\n" t) (nreverse symbols))
+      (when (string-match "^SYMBOL:" line)
+        (destructuring-bind (name kind file line column &rest _)
+            (split-string (substring line (match-end 0)) "\t")
+          (push (list (format "%s  %s  %s:%s" name kind (file-name-nondirectory file) line)
+                      file (string-to-number line) (string-to-number column))
+                symbols))))))
+
+(defun ac-clang-find-symbol (prefix)
+  "Jump to a symbol of the project whose name starts with PREFIX."
+  (interactive (list (read-string "Symbol: " (thing-at-point 'symbol))))
+  (unless (ac-clang-process-live-p ac-clang-completion-process)
+    (error "No clang-complete server for this buffer"))
+  (let ((response (ac-clang-query ac-clang-completion-process "SYMBOLS"
+                                  (format "prefix:%s\n" prefix))))
+    (cond ((null response)
+           (error "The server didn't answer"))
+          ((string-match-p "\\`ERROR:" response)
+           (error "No symbol index, see `ac-clang-index-project'")))
+    (let* ((symbols (or (ac-clang-parse-symbols response)
+                        (error "No symbol starts with %s" prefix)))
+           (symbol (assoc (if (cdr symbols)
+                              (completing-read "Symbol: " symbols nil t)
+                            (caar symbols))
+                          symbols)))
+      (find-file (nth 1 symbol))
+      (goto-char (point-min))
+      (forward-line (1- (nth 2 symbol)))
+      (forward-char (1- (nth 3 symbol))))))
 
 
 (defun ac-clang-candidate ()
@@ -509,12 +1237,14 @@ This variable will typically contain include paths, e.g., (\"-I~/MyProject\" \"-
 
      ;; NOTE: although auto-complete would filter the result for us, but when there's
      ;;       a HUGE number of candidates avaliable it would cause auto-complete to
-     ;;       block. So we filter it uncompletely here, then let auto-complete filter
-     ;;       the rest later, this would ease the feeling of being "stalled" at some degree.
+     ;;       block. So the server filters them by the prefix and sends back only the
+     ;;       best `ac-clang-async-candidate-limit' of them, auto-complete filters the
+     ;;       rest later, this would ease the feeling of being "stalled" at some degree.
 
      ;; (message "saved prefix: %s" ac-clang-saved-prefix)
-     (with-current-buffer (process-buffer ac-clang-completion-process)
-       (erase-buffer))
+     ;; NOTE: the process buffer is left alone, it may hold part of a response
+     ;;       still arriving. The answers to older requests are dropped by their
+     ;;       id once they're in, see `ac-clang-handle-completion-response'.
      (setq ac-clang-status 'wait)
      (setq ac-clang-current-candidate nil)
 
@@ -548,24 +1278,74 @@ This variable will typically contain include paths, e.g., (\"-I~/MyProject\" \"-
   (flymake-delete-own-overlays)
   (flymake-highlight-err-lines flymake-err-info))
 
-(defun ac-clang-flymake-process-filter (process output)
-  (ac-clang-append-process-output-to-process-buffer process output)
-  (flymake-log 3 "received %d byte(s) of output from process %d"
-               (length output) (process-id process))
-  (flymake-parse-output-and-residual output)
-  (when (string= (substring output -1 nil) "$")
-    (flymake-parse-residual)
-    (ac-clang-flymake-process-sentinel)
-    (setq ac-clang-status 'idle)
-    (set-process-filter ac-clang-completion-process 'ac-clang-filter-output)))
+(defun ac-clang-unescape-field (field)
+  (replace-regexp-in-string
+   "\\\\[tn\\\\]"
+   (lambda (escape)
+     (cdr (assoc escape '(("\\t" . "\t") ("\\n" . "\n") ("\\\\" . "\\")))))
+   field t t))
+
+(defun ac-clang-apply-structured-diagnostics (response)
+  "Update `ac-clang-diagnostics' with the set of diagnostics in RESPONSE."
+  (let ((lines (split-string response "\n" t)))
+    (when (and lines
+               (string-match "\\`DIAGNOSTICS:\\([0-9]+\\) \\([0-9]+\\)" (car lines)))
+      (when (or (null ac-clang-diagnostics)
+                (string= (match-string 2 (car lines)) "0"))
+        (setq ac-clang-diagnostics (make-hash-table :test 'equal)))
+      (setq ac-clang-diagnostics-set-id (string-to-number (match-string 1 (car lines))))
+      (dolist (line (cdr lines))
+        (let* ((fields (mapcar 'ac-clang-unescape-field (split-string line "\t")))
+               (kind (nth 0 fields))
+               (id (nth 1 fields)))
+          (cond
+           ((string= kind "REMOVE")
+            (remhash id ac-clang-diagnostics))
+           ((and (string= kind "DIAG")
+                 buffer-file-name
+                 (string= (file-truename (nth 3 fields)) (file-truename buffer-file-name)))
+            (puthash id
+                     (list (if (member (nth 2 fields) '("error" "fatal")) "e" "w")
+                           (string-to-number (nth 4 fields))
+                           (nth 10 fields))
+                     ac-clang-diagnostics))
+           ((and (string= kind "NOTE") (gethash id ac-clang-diagnostics))
+            (let ((diagnostic (gethash id ac-clang-diagnostics)))
+              (setcar (nthcdr 2 diagnostic)
+                      (format "%s\n%s: %s" (nth 2 diagnostic) (nth 2 fields) (nth 6 fields)))))))))))
+
+(defun ac-clang-structured-diagnostics-err-info ()
+  "Return the flymake error info of `ac-clang-diagnostics'."
+  (let (err-info)
+    (when ac-clang-diagnostics
+      (maphash (lambda (_id diagnostic)
+                 (destructuring-bind (type line message) diagnostic
+                   (setq err-info
+                         (flymake-add-err-info
+                          err-info (flymake-ler-make-ler nil line type message)))))
+               ac-clang-diagnostics))
+    err-info))
+
+(defun ac-clang-handle-syntaxcheck-response (response)
+  "Show the diagnostics of RESPONSE, the answer to the last SYNTAXCHECK."
+  (flymake-log 3 "received %d byte(s) of diagnostics" (length response))
+  (setq ac-clang-pending-syntaxcheck-id nil)
+  (cond
+   ((ac-clang-resync-requested-p response)
+    (setq ac-clang-source-synced nil))
+   ((string-match-p "\\`DIAGNOSTICS:" response)
+    (ac-clang-apply-structured-diagnostics response)
+    (setq flymake-new-err-info (ac-clang-structured-diagnostics-err-info)))
+   (t
+    (flymake-parse-output-and-residual response)))
+  (flymake-parse-residual)
+  (ac-clang-flymake-process-sentinel)
+  (setq ac-clang-status 'idle))
 
 (defun ac-clang-syntax-check ()
   (interactive)
   (when (eq ac-clang-status 'idle)
-    (with-current-buffer (process-buffer ac-clang-completion-process)
-      (erase-buffer))
     (setq ac-clang-status 'wait)
-    (set-process-filter ac-clang-completion-process 'ac-clang-flymake-process-filter)
     (ac-clang-send-syntaxcheck-request ac-clang-completion-process)))
 
 
@@ -593,6 +1373,8 @@ This variable will typically contain include paths, e.g., (\"-I~/MyProject\" \"-
   (self-insert-command 1)
   (if (eq ac-clang-status 'idle)
       (ac-start)
+    ;; the answer would be out of date, don't let the server compute it
+    (ac-clang-send-cancel-request ac-clang-completion-process)
     (setq ac-clang-status 'preempted)))
 
 (defun ac-clang-launch-completion-process ()
@@ -600,22 +1382,171 @@ This variable will typically contain include paths, e.g., (\"-I~/MyProject\" \"-
 	(if filename
 		(ac-clang-launch-completion-process-with-file filename))))
 
+(defun ac-clang-connect-daemon ()
+  "Connect to the daemon, starting it if nobody is listening yet."
+  (let ((socket (expand-file-name ac-clang-async-daemon-socket))
+        (buffer (generate-new-buffer-name "*clang-complete*"))
+        (retries 50)
+        conn)
+    (unless (ignore-errors
+              (setq conn (make-network-process :name "clang-complete"
+                                               :buffer buffer
+                                               :family 'local
+                                               :service socket)))
+      (let ((process-connection-type nil))
+        (set-process-query-on-exit-flag
+         (apply 'start-process "clang-complete-daemon" nil
+                ac-clang-complete-executable
+                "--daemon" socket
+                "--memory-budget"
+                (number-to-string ac-clang-async-daemon-memory-budget)
+                (ac-clang-server-args))
+         nil))
+      (while (and (not conn) (> retries 0))
+        (sleep-for 0.1)
+        (setq retries (1- retries))
+        (setq conn (ignore-errors
+                     (make-network-process :name "clang-complete"
+                                           :buffer buffer
+                                           :family 'local
+                                           :service socket)))))
+    (unless conn
+      (when (get-buffer buffer)
+        (kill-buffer buffer))
+      (error "Cannot connect to clang-complete daemon at %s" socket))
+    conn))
+
+(defun ac-clang-connect-zygote ()
+  "Connect to the zygote, starting it if nobody is listening yet."
+  (let ((socket (expand-file-name ac-clang-async-zygote-socket))
+        (buffer (generate-new-buffer-name "*clang-complete*"))
+        (retries 300)
+        conn)
+    (unless (ignore-errors
+              (setq conn (make-network-process :name "clang-complete"
+                                               :buffer buffer
+                                               :family 'local
+                                               :service socket)))
+      (let ((process-connection-type nil))
+        (set-process-query-on-exit-flag
+         (apply 'start-process "clang-complete-zygote" nil
+                ac-clang-complete-executable
+                "--zygote" socket
+                (append
+                 (when ac-clang-async-zygote-prelude
+                   (list "--prelude" (expand-file-name ac-clang-async-zygote-prelude)))
+                 (ac-clang-build-complete-args)))
+         nil))
+      ;; It listens once the prelude is parsed.
+      (while (and (not conn) (> retries 0))
+        (sleep-for 0.1)
+        (setq retries (1- retries))
+        (setq conn (ignore-errors
+                     (make-network-process :name "clang-complete"
+                                           :buffer buffer
+                                           :family 'local
+                                           :service socket)))))
+    (unless conn
+      (when (get-buffer buffer)
+        (kill-buffer buffer))
+      (error "Cannot connect to clang-complete zygote at %s" socket))
+    conn))
+
+(defun ac-clang-spawn-from-zygote (filename)
+  "Have the zygote fork the server of FILENAME, and return the connection."
+  (let ((conn (ac-clang-connect-zygote))
+        (args (append (ac-clang-server-args)
+                      (ac-clang-build-complete-args)
+                      (list filename))))
+    (process-send-string
+     conn (concat "SPAWN\n"
+                  (format "num_args:%d\n" (length args))
+                  (mapconcat 'identity args "\n")
+                  "\n"))
+    conn))
+
+(defun ac-clang-open-daemon-session (conn filename)
+  "Open the session of FILENAME on CONN and return its id."
+  (process-send-string
+   conn (let ((message (concat "OPEN\n"
+                               (format "filename:%s\n" filename)
+                               (ac-clang-cmdline-args-string))))
+          (concat (format "0 %d\n" (length (string-as-unibyte message)))
+                  message)))
+  (let ((retries 100)
+        response)
+    (while (and (not (setq response (ac-clang-take-response conn)))
+                (> retries 0))
+      (accept-process-output conn 0.1)
+      (setq retries (1- retries)))
+    (when (and response (string-match "^SESSION:\\([0-9]+\\)" response))
+      (string-to-number (match-string 1 response)))))
+
+(defun ac-clang-start-server-process (args)
+  "Start a server reading its requests on stdin, with ARGS.
+Its stderr goes to the *clang-complete-stderr* buffer where `make-process'
+is available, as anything mixed into the responses would break their
+framing."
+  (let ((process-connection-type nil)
+        (buffer (generate-new-buffer-name "*clang-complete*")))
+    (if (fboundp 'make-process)
+        (make-process :name "clang-complete"
+                      :buffer buffer
+                      :command (cons ac-clang-complete-executable args)
+                      :connection-type 'pipe
+                      :stderr (make-pipe-process
+                               :name "clang-complete-stderr"
+                               :buffer (get-buffer-create "*clang-complete-stderr*")
+                               :noquery t))
+      (apply 'start-process "clang-complete" buffer
+             ac-clang-complete-executable args))))
+
+(defun ac-clang-process-sentinel (proc _event)
+  "Kill the buffer of PROC once it's closed, every connection has its own."
+  (unless (ac-clang-process-live-p proc)
+    (when (buffer-live-p (process-buffer proc))
+      (kill-buffer (process-buffer proc)))))
+
 (defun ac-clang-launch-completion-process-with-file (filename)
+  (setq ac-clang-session-id nil)
   (setq ac-clang-completion-process
-        (let ((process-connection-type nil))
-          (apply 'start-process
-                 "clang-complete" "*clang-complete*"
-                 ac-clang-complete-executable
-                 (append (ac-clang-build-complete-args)
-                         (list filename)))))
+        (cond
+         (ac-clang-async-daemon-socket
+          (let ((conn (ac-clang-connect-daemon)))
+            (when conn
+              (setq ac-clang-session-id
+                    (ac-clang-open-daemon-session conn filename)))
+            conn))
+         (ac-clang-async-zygote-socket
+          (ac-clang-spawn-from-zygote filename))
+         (t
+          (ac-clang-start-server-process
+           (append (ac-clang-server-args)
+                   (ac-clang-build-complete-args)
+                   (list filename))))))
+
+  ;; Response lengths are counted in utf-8 bytes.
+  (set-process-coding-system ac-clang-completion-process 'utf-8-unix 'utf-8-unix)
 
   (set-process-filter ac-clang-completion-process 'ac-clang-filter-output)
+  (set-process-sentinel ac-clang-completion-process 'ac-clang-process-sentinel)
   (set-process-query-on-exit-flag ac-clang-completion-process nil)
+  ;; A fresh server knows nothing about this buffer yet.
+  (setq ac-clang-source-synced nil
+        ac-clang-sent-unsaved-files nil)
+  ;; A daemon session starts with the profile the daemon was given.
+  (when ac-clang-session-id
+    (ac-clang-send-profile ac-clang-completion-process))
   ;; Pre-parse source code.
   (ac-clang-send-reparse-request ac-clang-completion-process)
 
+  (when (and ac-clang-async-speculative-completion (not ac-clang-cursor-timer))
+    (setq ac-clang-cursor-timer (run-with-idle-timer 0.2 t 'ac-clang-send-cursor)))
+
   (add-hook 'kill-buffer-hook 'ac-clang-shutdown-process nil t)
   (add-hook 'before-save-hook 'ac-clang-reparse-buffer)
+  (add-hook 'before-change-functions 'ac-clang-before-change nil t)
+  (add-hook 'after-change-functions 'ac-clang-after-change nil t)
 
   (local-set-key (kbd ".") 'ac-clang-async-autocomplete-autotrigger)
   (local-set-key (kbd ":") 'ac-clang-async-autocomplete-autotrigger)
@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "completion_input.h"
+
+
+/* Ingest micro-benchmark: how fast a SOURCEFILE message carrying a 5MB source
+   file is read into the source buffer, with the old stdio reader (fscanf for
+   the header, one fgetc per byte) and with completion_Input. */
+
+#define  SOURCE_SIZE   (5 << 20)    /* 5MB */
+#define  ITERATIONS    20
+
+
+/* Seconds since some point in the past */
+static double __now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Write a SOURCEFILE message with a generated source of about size bytes to
+   a temporary file, returns its descriptor */
+static int __generate_message(size_t size, size_t *source_length)
+{
+    char path[] = "/tmp/ingest_benchXXXXXX", line[128];
+    char *source = (char*)malloc(size + sizeof(line));
+    size_t length = 0;
+    int fd = mkstemp(path), i_line = 0;
+    FILE *fp;
+
+    if (fd < 0) {
+        perror("mkstemp");
+        exit(1);
+    }
+    unlink(path);
+
+    while (length < size)
+    {
+        length += (size_t)sprintf(source + length,
+            "static int variable_%d = %d;    /* generated line %d */\n",
+            i_line, i_line * 7, i_line);
+        i_line++;
+    }
+
+    fp = fdopen(dup(fd), "w");
+    fprintf(fp, "SOURCEFILE\nsource_length:%lu\n", (unsigned long)length);
+    fwrite(source, 1, length, fp);
+    fprintf(fp, "\n\n");
+    fclose(fp);
+
+    free(source);
+    *source_length = length;
+    return fd;
+}
+
+
+/* The reader before completion_Input */
+static size_t __read_with_stdio(int fd, char *buffer)
+{
+    FILE *fp = fdopen(dup(fd), "r");
+    char head[64], crlf[4096], segment_type[16];
+    unsigned long value = 0, i_byte = 0;
+
+    fscanf(fp, "%s", head);
+    fgets(crlf, sizeof(crlf), fp);
+    fscanf(fp, "source_%15[a-z]:%lu", segment_type, &value);
+    fgets(crlf, sizeof(crlf), fp);
+
+    for ( ; i_byte < value; i_byte++) {
+        buffer[i_byte] = (char)fgetc(fp);
+    }
+
+    fclose(fp);
+    return value;
+}
+
+/* The reader with completion_Input */
+static size_t __read_with_input(int fd, char *buffer)
+{
+    completion_Input in;
+    char *key, *value;
+    size_t length;
+
+    completion_openInput(&in, fd);
+    completion_readLine(&in, NULL);
+    key = completion_readHeader(&in, &value);
+    length = (key != NULL) ? (size_t)strtoull(value, NULL, 10) : 0;
+    length = completion_readBytes(&in, buffer, length);
+    completion_closeInput(&in);
+
+    return length;
+}
+
+/* Run reader ITERATIONS times, and report its throughput */
+static void __run(const char *name, size_t (*reader)(int, char*),
+                  int fd, char *buffer, size_t source_length)
+{
+    double started, elapsed;
+    int i_iteration = 0;
+
+    started = __now();
+    for ( ; i_iteration < ITERATIONS; i_iteration++)
+    {
+        lseek(fd, 0, SEEK_SET);
+        if (reader(fd, buffer) != source_length)
+        {
+            fprintf(stderr, "%s: short read\n", name);
+            exit(1);
+        }
+    }
+    elapsed = __now() - started;
+
+    printf("%-24s %8.1f MB/s\n", name,
+           (double)source_length * ITERATIONS / elapsed / (1 << 20));
+}
+
+
+int main(void)
+{
+    size_t source_length;
+    int fd = __generate_message(SOURCE_SIZE, &source_length);
+    char *buffer = (char*)malloc(source_length);
+
+    printf("ingest of a %.1f MB SOURCEFILE message, %d iterations\n",
+           (double)source_length / (1 << 20), ITERATIONS);
+    __run("fscanf + fgetc (before)", __read_with_stdio, fd, buffer, source_length);
+    __run("completion_Input (after)", __read_with_input, fd, buffer, source_length);
+
+    free(buffer);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,91 @@
+;;; parse_bench.el --- Client-side parse time of completion responses
+
+;; Times `ac-clang-parse-completion-results' on one completion response of
+;; 20000 candidates sent in each format of the server: COMPLETION lines,
+;; CANDIDATE lines (details:lazy) and a SEXP response (format:sexp). The
+;; candidates are generated, with the mix of functions (some of them
+;; overloaded, some with default arguments), fields and macros of a global
+;; completion in C++. Run it with `make parse-bench', or
+;;
+;;     emacs -Q --batch -L . -l bench/parse_bench.el
+;;
+;; auto-complete is taken from the installed packages.
+
+(require 'package)
+(package-initialize)
+(require 'benchmark)
+(require 'auto-complete-clang-async)
+
+(defconst ac-clang-bench-candidates 20000)
+
+(defun ac-clang-bench-candidate (i)
+  "The I-th generated candidate, as (NAME OVERLOAD...) of a SEXP response."
+  (let ((name (format "candidate_%05d" i))
+        (id (format "1.%d" i)))
+    (case (% i 10)
+      ((0 1 2)
+       (list name (list "macro definition" 70 nil '(name) id)))
+      ((3 4)
+       (list name (list "FieldDecl" 35 "int" '(name) id)))
+      (5
+       ;; overloaded, one more id is taken by the second overload
+       (list name
+             (list "CXXMethod" 34 "void" '(name "(" (p "const value_type &x") ")")
+                   id)
+             (list "CXXMethod" 34 "void" '(name "(" (p "value_type &&x") ")")
+                   (format "1.%d" (+ i ac-clang-bench-candidates)))))
+      (6
+       (list name (list "FunctionDecl" 50 "std::size_t"
+                        '(name "(" (p "const char *s") (o ", " (p "std::size_t n = 0")) ")")
+                        id)))
+      (t
+       (list name (list "FunctionTemplate" 50 "iterator"
+                        '(name "(" (p "const_iterator pos") ", " (p "Args &&args...") ")")
+                        id))))))
+
+(defun ac-clang-bench-completion-line (candidate)
+  "CANDIDATE as the COMPLETION lines of its overloads."
+  (mapconcat (lambda (overload)
+               (if (and (null (nth 2 overload)) (equal (nth 3 overload) '(name)))
+                   (format "COMPLETION: %s\n" (car candidate))
+                 (format "COMPLETION: %s : %s\n" (car candidate)
+                         (ac-clang-overload-signature (car candidate) overload))))
+             (cdr candidate) ""))
+
+(defun ac-clang-bench-candidate-line (candidate)
+  "CANDIDATE as the CANDIDATE lines of its overloads."
+  (mapconcat (lambda (overload)
+               (format "CANDIDATE:%s\t%s\t%s\n" (car candidate) (car overload) (nth 4 overload)))
+             (cdr candidate) ""))
+
+(defun ac-clang-bench-responses ()
+  "The generated response in each format, as (FORMAT LAZY-DETAILS RESPONSE)."
+  (let (candidates)
+    (dotimes (i ac-clang-bench-candidates)
+      (push (ac-clang-bench-candidate i) candidates))
+    (setq candidates (nreverse candidates))
+    (list (list "COMPLETION lines" nil
+                (mapconcat 'ac-clang-bench-completion-line candidates ""))
+          (list "CANDIDATE lines" t
+                (mapconcat 'ac-clang-bench-candidate-line candidates ""))
+          (list "SEXP" nil
+                (concat "SEXP\n" (let ((print-escape-newlines t))
+                                   (prin1-to-string candidates))
+                        "\n")))))
+
+(defun ac-clang-bench-parse ()
+  "Print the mean time to parse the response in each format, over 10 runs."
+  (let ((ac-clang-saved-prefix ""))
+    (dolist (response (ac-clang-bench-responses))
+      (let* ((ac-clang-async-lazy-details (nth 1 response))
+             (n-candidates 0)
+             (timing (benchmark-run 10
+                       (setq n-candidates
+                             (length (ac-clang-parse-completion-results (nth 2 response)))))))
+        (princ (format "%-17s %8d bytes %6d candidates %8.1f ms (%d GCs, %.1f ms)\n"
+                       (nth 0 response) (string-bytes (nth 2 response)) n-candidates
+                       (* 100 (nth 0 timing)) (nth 1 timing) (* 100 (nth 2 timing))))))))
+
+(ac-clang-bench-parse)
+
+;;; parse_bench.el ends here
@@ -0,0 +1,869 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+/* Replay benchmark: feed messages to a completion server over the same pipes
+   emacs uses, one at a time, and report the throughput and the latency of
+   each message type, from the moment a message is sent until its response
+   has been read.
+
+   The messages come either from a trace recorded by the server (--record,
+   see completion_input.h), or from a synthetic workload built from a source
+   file with markers (comments holding '@'):
+
+   --complete FILE   completion at every marker, with the identifier after the
+                     marker typed one character at a time
+   --paste FILE      syntax check of the part of FILE before the marker, then
+                     of the whole of it, as if the rest had just been pasted
+
+   With --zygote SOCKET, the server is forked by the zygote listening on
+   SOCKET (see completion_daemon.h) instead of being run by replay. Either
+   way, the time from the start of the server to the first response is
+   reported, which tells a cold start from a zygote one.
+
+   With --stats, the parse and reparse times and the memory the server
+   reports in the end (STATS) are shown as well, along with its resident
+   and peak memory.
+
+   Usage:
+       replay [--server PATH | --zygote SOCKET] [--repeat N] [--stats] [--paced] --trace TRACE
+       replay [--server PATH | --zygote SOCKET] [--repeat N] [--stats] --complete FILE [-- CLANG ARGS]
+       replay [--server PATH | --zygote SOCKET] [--repeat N] [--stats] --paste FILE [-- CLANG ARGS]
+*/
+
+
+#define  MARKER             "/*@*/"
+#define  MAX_TYPED_PREFIX   3         /* characters typed at each marker */
+#define  RESPONSE_TIMEOUT   120000    /* ms */
+#define  CONNECT_RETRIES    100       /* tries, 100ms apart, to reach a zygote */
+#define  MAX_MESSAGE_TYPES  16
+
+
+/* A message to send */
+typedef struct __replay_Message_struct
+{
+    unsigned long time_us;    /* when it was recorded, relative to the first one */
+    char         *data;
+    size_t        length;
+    char          type[16];   /* name of the message */
+    int           has_response;
+
+} replay_Message;
+
+/* Messages to replay and the arguments to run the server with */
+typedef struct __replay_Workload_struct
+{
+    replay_Message *messages;
+    size_t          n_messages;
+    size_t          capacity;
+
+    char          **args;
+    int             n_args;
+
+} replay_Workload;
+
+/* Latencies of a message type */
+typedef struct __replay_Latencies_struct
+{
+    char           type[16];
+    unsigned long  count;
+    double        *values;    /* ms, only of the messages with a response */
+    size_t         n_values;
+
+} replay_Latencies;
+
+/* Responses read from the server but not consumed yet */
+typedef struct __replay_Responses_struct
+{
+    int     fd;
+    char   *data;
+    size_t  length;
+    size_t  capacity;
+
+} replay_Responses;
+
+
+
+static double __now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+static void __fail(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+/* Contents of the file at path (malloc'd, terminated by '\0') */
+static char *__read_file(const char *path, size_t *length)
+{
+    FILE  *fp = fopen(path, "rb");
+    char  *data = NULL;
+    size_t capacity = 0, n_read;
+
+    if (fp == NULL) {
+        __fail(path);
+    }
+
+    *length = 0;
+    do {
+        if (capacity - *length < 65536)
+        {
+            capacity = capacity * 2 + 65536;
+            data = (char*)realloc(data, capacity + 1);
+        }
+        n_read = fread(data + *length, 1, capacity - *length, fp);
+        *length += n_read;
+    } while (n_read > 0);
+
+    fclose(fp);
+    data[*length] = '\0';
+    return data;
+}
+
+
+/* Append a copy of length bytes of data as a message sent at time_us */
+static void __add_message(
+    replay_Workload *workload, unsigned long time_us, const char *data, size_t length)
+{
+    static const char *silent[] = {
+        "SOURCEFILE", "SOURCEDELTA", "CMDLINEARGS", "REPARSE", "SHUTDOWN", "CANCEL", NULL
+    };
+    replay_Message *message;
+    size_t n_type = strcspn(data, " \n");
+    int i_silent = 0;
+
+    if (workload->n_messages == workload->capacity)
+    {
+        workload->capacity = workload->capacity * 2 + 64;
+        workload->messages = (replay_Message*)realloc(
+            workload->messages, workload->capacity * sizeof(replay_Message));
+    }
+
+    message = &workload->messages[workload->n_messages++];
+    message->time_us = time_us;
+    message->data = (char*)malloc(length);
+    message->length = length;
+    memcpy(message->data, data, length);
+
+    if (n_type >= sizeof(message->type)) {
+        n_type = sizeof(message->type) - 1;
+    }
+    memcpy(message->type, data, n_type);
+    message->type[n_type] = '\0';
+
+    /* everything else is answered, if only with an error */
+    message->has_response = 1;
+    for ( ; silent[i_silent] != NULL; i_silent++)
+    {
+        if (strcmp(message->type, silent[i_silent]) == 0) {
+            message->has_response = 0;
+        }
+    }
+}
+
+/* Append a message built from format, followed by length bytes of payload */
+static void __add_built_message(
+    replay_Workload *workload, const char *payload, size_t length, const char *format, ...)
+{
+    char    head[512];
+    char   *data;
+    int     n_head;
+    va_list args;
+
+    va_start(args, format);
+    n_head = vsnprintf(head, sizeof(head), format, args);
+    va_end(args);
+
+    data = (char*)malloc((size_t)n_head + length + 1);
+    memcpy(data, head, (size_t)n_head);
+    memcpy(data + n_head, payload, length);
+    data[n_head + length] = '\n';
+
+    __add_message(workload, 0, data, (size_t)n_head + length + 1);
+    free(data);
+}
+
+
+/* Offset of the line after the one at stream[offset], or 0 if it's incomplete */
+static size_t __next_line(const char *stream, size_t length, size_t offset)
+{
+    const char *newline = (const char*)memchr(stream + offset, '\n', length - offset);
+    return (newline != NULL) ? (size_t)(newline - stream) + 1 : 0;
+}
+
+/* Length of the message at the beginning of stream, parsed the way the server
+   does (see msg_callback.h), or 0 if it's incomplete */
+static size_t __message_length(const char *stream, size_t length)
+{
+    size_t offset = __next_line(stream, length, 0), next;
+    unsigned long value, n_args;
+    const char *colon;
+
+    if (offset == 0) {
+        return 0;
+    }
+
+    if (strncmp(stream, "COMPLETION", 10) == 0 || strncmp(stream, "SYNTAXCHECK", 11) == 0 ||
+        strncmp(stream, "SOURCEFILE", 10) == 0 || strncmp(stream, "SOURCEDELTA", 11) == 0)
+    {
+        /* headers until the source segment, or the inserted text */
+        while ((next = __next_line(stream, length, offset)) != 0)
+        {
+            colon = (const char*)memchr(stream + offset, ':', next - offset);
+            value = (colon != NULL) ? strtoul(colon + 1, NULL, 10) : 0;
+
+            if (strncmp(stream + offset, "source_version", 14) == 0) {
+                return next;
+            }
+            if (strncmp(stream + offset, "source_length", 13) == 0 ||
+                strncmp(stream + offset, "inserted_length", 15) == 0) {
+                return (next + value <= length) ? next + value : 0;
+            }
+            offset = next;
+        }
+        return 0;
+    }
+
+    if (strncmp(stream, "CMDLINEARGS", 11) == 0)
+    {
+        /* num_args, and that many tokens */
+        if ((next = __next_line(stream, length, offset)) == 0) {
+            return 0;
+        }
+        colon = (const char*)memchr(stream + offset, ':', next - offset);
+        n_args = (colon != NULL) ? strtoul(colon + 1, NULL, 10) : 0;
+
+        for (offset = next; n_args > 0; n_args--)
+        {
+            while (offset < length && isspace((unsigned char)stream[offset])) {
+                offset++;
+            }
+            while (offset < length && !isspace((unsigned char)stream[offset])) {
+                offset++;
+            }
+            if (offset == length) {
+                return 0;
+            }
+        }
+        return offset;
+    }
+
+    return offset;    /* no message body */
+}
+
+/* Load a trace recorded by the server */
+static void __load_trace(const char *path, replay_Workload *workload)
+{
+    size_t trace_length, offset, stream_length = 0, n_chunks = 0, i_chunk = 0, start;
+    size_t message_length;
+    char  *trace = __read_file(path, &trace_length), *stream = (char*)malloc(trace_length + 1);
+    unsigned long *chunk_times = NULL, first_time = 0, time_us, chunk_length;
+    size_t *chunk_offsets = NULL;
+    int    i_arg = 0;
+
+    /* clang-complete-trace [#n_args#], and the arguments one per line */
+    if (sscanf(trace, "clang-complete-trace %d", &workload->n_args) != 1)
+    {
+        fprintf(stderr, "%s is not a trace\n", path);
+        exit(1);
+    }
+    offset = __next_line(trace, trace_length, 0);
+    workload->args = (char**)calloc(sizeof(char*), workload->n_args + 1);
+    for ( ; i_arg < workload->n_args && offset != 0; i_arg++)
+    {
+        workload->args[i_arg] = strndup(trace + offset, strcspn(trace + offset, "\n"));
+        offset = __next_line(trace, trace_length, offset);
+    }
+
+    /* [#time_us#] [#length#], the bytes read, and a newline */
+    while (offset != 0 && offset < trace_length &&
+           sscanf(trace + offset, "%lu %lu", &time_us, &chunk_length) == 2)
+    {
+        /* not "\n" in the format, the bytes read could start with spaces */
+        if ((offset = __next_line(trace, trace_length, offset)) == 0 ||
+            offset + chunk_length > trace_length) {
+            break;    /* the server was killed while recording */
+        }
+
+        chunk_times = (unsigned long*)realloc(chunk_times, (n_chunks + 1) * sizeof(unsigned long));
+        chunk_offsets = (size_t*)realloc(chunk_offsets, (n_chunks + 1) * sizeof(size_t));
+        if (n_chunks == 0) {
+            first_time = time_us;
+        }
+        chunk_times[n_chunks] = time_us - first_time;
+        chunk_offsets[n_chunks] = stream_length;
+        n_chunks++;
+
+        memcpy(stream + stream_length, trace + offset, chunk_length);
+        stream_length += chunk_length;
+        offset += chunk_length + 1;
+    }
+
+    /* split the stream into messages, each one is sent when the first chunk
+       it's in was read */
+    for (offset = 0; ; offset += message_length)
+    {
+        while (offset < stream_length && isspace((unsigned char)stream[offset])) {
+            offset++;
+        }
+        if (offset == stream_length ||
+            (message_length = __message_length(stream + offset, stream_length - offset)) == 0) {
+            break;
+        }
+
+        start = offset;
+        while (i_chunk + 1 < n_chunks && chunk_offsets[i_chunk + 1] <= start) {
+            i_chunk++;
+        }
+        __add_message(workload, chunk_times[i_chunk], stream + offset, message_length);
+    }
+
+    free(chunk_offsets);
+    free(chunk_times);
+    free(stream);
+    free(trace);
+}
+
+
+/* Remove the markers of source in place, their offsets are stored to
+   markers (malloc'd), returns the number of markers */
+static size_t __take_markers(char *source, size_t *length, size_t **markers)
+{
+    size_t n_markers = 0, marker_length = strlen(MARKER);
+    char  *marker;
+
+    *markers = NULL;
+    while ((marker = strstr(source, MARKER)) != NULL)
+    {
+        *markers = (size_t*)realloc(*markers, (n_markers + 1) * sizeof(size_t));
+        (*markers)[n_markers++] = (size_t)(marker - source);
+
+        memmove(marker, marker + marker_length, *length - (size_t)(marker - source) - marker_length + 1);
+        *length -= marker_length;
+    }
+
+    return n_markers;
+}
+
+/* The server is run with clang args followed by path */
+static void __set_workload_args(replay_Workload *workload, int n_clang_args, char **clang_args,
+                                const char *path)
+{
+    workload->n_args = n_clang_args + 1;
+    workload->args = (char**)calloc(sizeof(char*), workload->n_args + 1);
+    memcpy(workload->args, clang_args, n_clang_args * sizeof(char*));
+    workload->args[n_clang_args] = (char*)path;
+}
+
+/* Completion at every marker of the file at path */
+static void __load_completion_workload(const char *path, replay_Workload *workload)
+{
+    size_t length, *markers, n_markers, i_marker = 0, offset, n_ident, n_typed;
+    char  *source = __read_file(path, &length);
+    unsigned long request_id = 0;
+    int    row, column;
+
+    n_markers = __take_markers(source, &length, &markers);
+    __add_built_message(workload, source, length, "SOURCEFILE\nsource_length:%lu\n",
+                        (unsigned long)length);
+
+    for ( ; i_marker < n_markers; i_marker++)
+    {
+        row = 1;
+        column = 1;
+        for (offset = 0; offset < markers[i_marker]; offset++)
+        {
+            column++;
+            if (source[offset] == '\n') {
+                row++;
+                column = 1;
+            }
+        }
+
+        for (n_ident = 0; isalnum((unsigned char)source[markers[i_marker] + n_ident]) ||
+                          source[markers[i_marker] + n_ident] == '_'; n_ident++) {
+            ;
+        }
+
+        for (n_typed = 0; n_typed <= n_ident && n_typed <= MAX_TYPED_PREFIX; n_typed++)
+        {
+            __add_built_message(workload, source, length,
+                "COMPLETION %lu\nrow:%d\ncolumn:%d\nprefix:%.*s\nsource_length:%lu\n",
+                ++request_id, row, column, (int)n_typed, source + markers[i_marker],
+                (unsigned long)length);
+        }
+    }
+
+    free(markers);
+    free(source);
+}
+
+/* Syntax check before and after pasting the part of the file at path after
+   its marker */
+static void __load_paste_workload(const char *path, replay_Workload *workload)
+{
+    size_t length, *markers;
+    char  *source = __read_file(path, &length);
+
+    if (__take_markers(source, &length, &markers) == 0)
+    {
+        fprintf(stderr, "%s has no marker\n", path);
+        exit(1);
+    }
+
+    __add_built_message(workload, source, markers[0],
+                        "SYNTAXCHECK 1\nsource_length:%lu\n", (unsigned long)markers[0]);
+    __add_built_message(workload, source, length,
+                        "SYNTAXCHECK 2\nsource_length:%lu\n", (unsigned long)length);
+
+    free(markers);
+    free(source);
+}
+
+
+/* Run server with the arguments of workload, its stdin and stdout are
+   connected to to_server and from_server */
+static pid_t __start_server(const char *server, replay_Workload *workload,
+                            int *to_server, int *from_server)
+{
+    int    input[2], output[2];
+    char **argv = (char**)calloc(sizeof(char*), workload->n_args + 2);
+    pid_t  pid;
+
+    argv[0] = (char*)server;
+    memcpy(argv + 1, workload->args, workload->n_args * sizeof(char*));
+
+    if (pipe(input) != 0 || pipe(output) != 0) {
+        __fail("pipe");
+    }
+
+    if ((pid = fork()) < 0) {
+        __fail("fork");
+    }
+    if (pid == 0)
+    {
+        dup2(input[0], STDIN_FILENO);
+        dup2(output[1], STDOUT_FILENO);
+        close(input[0]); close(input[1]); close(output[0]); close(output[1]);
+        execv(server, argv);
+        __fail(server);
+    }
+
+    close(input[0]);
+    close(output[1]);
+    *to_server = input[1];
+    *from_server = output[0];
+    free(argv);
+    return pid;
+}
+
+static void __write_all(int fd, const char *data, size_t length)
+{
+    ssize_t n_written;
+
+    while (length > 0)
+    {
+        n_written = write(fd, data, length);
+        if (n_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n_written <= 0) {
+            __fail("write to server");
+        }
+        data += n_written;
+        length -= (size_t)n_written;
+    }
+}
+
+/* Have the zygote listening on socket_path fork a server with the arguments
+   of workload, the connection is both its stdin and stdout */
+static void __spawn_from_zygote(const char *socket_path, replay_Workload *workload,
+                                int *to_server, int *from_server)
+{
+    struct sockaddr_un addr;
+    char   head[64];
+    int    fd, i_arg = 0, i_try = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    /* the zygote may still be parsing its prelude */
+    for ( ; ; i_try++)
+    {
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+            __fail("socket");
+        }
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+            break;
+        }
+        close(fd);
+        if (i_try == CONNECT_RETRIES) {
+            __fail(socket_path);
+        }
+        usleep(100000);
+    }
+
+    snprintf(head, sizeof(head), "SPAWN\nnum_args:%d\n", workload->n_args);
+    __write_all(fd, head, strlen(head));
+    for ( ; i_arg < workload->n_args; i_arg++)
+    {
+        __write_all(fd, workload->args[i_arg], strlen(workload->args[i_arg]));
+        __write_all(fd, "\n", 1);
+    }
+
+    *to_server = *from_server = fd;
+}
+
+/* Wait for the next response, framed as [#id#] [#length#]\n<body>, and drop
+   it, unless body is not NULL: a copy of it (malloc'd, terminated by '\0')
+   is stored there then */
+static void __read_response(replay_Responses *responses, char **body)
+{
+    struct pollfd pfd;
+    unsigned long id, body_length;
+    ssize_t n_read;
+    int     n_header;
+
+    for ( ; ; )
+    {
+        if (memchr(responses->data, '\n', responses->length) != NULL &&
+            sscanf(responses->data, "%lu %lu\n%n", &id, &body_length, &n_header) == 2 &&
+            responses->length >= (size_t)n_header + body_length)
+        {
+            if (body != NULL)
+            {
+                *body = (char*)malloc(body_length + 1);
+                memcpy(*body, responses->data + n_header, body_length);
+                (*body)[body_length] = '\0';
+            }
+            responses->length -= (size_t)n_header + body_length;
+            memmove(responses->data, responses->data + n_header + body_length, responses->length);
+            return;
+        }
+
+        if (responses->capacity - responses->length < 65536)
+        {
+            responses->capacity = responses->capacity * 2 + 65536;
+            responses->data = (char*)realloc(responses->data, responses->capacity + 1);
+        }
+
+        pfd.fd = responses->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, RESPONSE_TIMEOUT) <= 0)
+        {
+            fprintf(stderr, "no response from the server\n");
+            exit(1);
+        }
+
+        n_read = read(responses->fd, responses->data + responses->length,
+                      responses->capacity - responses->length);
+        if (n_read <= 0)
+        {
+            fprintf(stderr, "the server has gone\n");
+            exit(1);
+        }
+        responses->length += (size_t)n_read;
+        responses->data[responses->length] = '\0';
+    }
+}
+
+
+static replay_Latencies *__latencies_of(
+    replay_Latencies *latencies, int *n_types, const char *type, size_t n_messages)
+{
+    int i_type = 0;
+
+    for ( ; i_type < *n_types; i_type++)
+    {
+        if (strcmp(latencies[i_type].type, type) == 0) {
+            return &latencies[i_type];
+        }
+    }
+
+    if (*n_types == MAX_MESSAGE_TYPES) {
+        return &latencies[MAX_MESSAGE_TYPES - 1];
+    }
+
+    latencies = &latencies[(*n_types)++];
+    strcpy(latencies->type, type);
+    latencies->values = (double*)malloc((n_messages + 1) * sizeof(double));
+    return latencies;
+}
+
+static int __compare_doubles(const void *a, const void *b)
+{
+    double left = *(const double*)a, right = *(const double*)b;
+    return (left < right) ? -1 : (left > right);
+}
+
+static double __percentile(const replay_Latencies *latencies, double fraction)
+{
+    size_t rank = (size_t)(fraction * latencies->n_values + 0.999999);
+    return latencies->values[(rank > 0) ? rank - 1 : 0];
+}
+
+/* Value in kB of the field of /proc/[#pid#]/status, 0 if it can't be read */
+static unsigned long __process_memory(pid_t pid, const char *field)
+{
+    char  path[64], line[256];
+    unsigned long value = 0;
+    size_t length = strlen(field);
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (strncmp(line, field, length) == 0 && line[length] == ':') {
+            value = strtoul(line + length + 1, NULL, 10);
+        }
+    }
+
+    fclose(fp);
+    return value;
+}
+
+/* Ask the server for its STATS, and print the time it took to parse and
+   reparse, and the memory of its translation unit. The resident memory of
+   the server is printed as well, unless it's been forked by a zygote. */
+static void __print_server_stats(int to_server, replay_Responses *responses, pid_t pid)
+{
+    static const char *shown[] = { "parse ", "reparse", "memory " };
+    char  *body, *line, *end, *shown_end, *peak;
+    size_t i_shown;
+
+    if (pid > 0)
+    {
+        printf("  server resident %lu kB, peak %lu kB\n",
+               __process_memory(pid, "VmRSS"), __process_memory(pid, "VmHWM"));
+    }
+
+    __write_all(to_server, "STATS\n\n", 7);
+    __read_response(responses, &body);
+
+    for (line = body; *line != '\0'; line = (*end != '\0') ? end + 1 : end)
+    {
+        if ((end = strchr(line, '\n')) == NULL) {
+            end = line + strlen(line);
+        }
+
+        for (i_shown = 0; i_shown < sizeof(shown) / sizeof(shown[0]); i_shown++)
+        {
+            if (strncmp(line, shown[i_shown], strlen(shown[i_shown])) != 0) {
+                continue;
+            }
+
+            /* the memory line goes on with every kind of memory, only its
+               total and peak are shown */
+            shown_end = end;
+            if (i_shown == 2 && (peak = strstr(line, " peak:")) != NULL && peak < end &&
+                (peak = strchr(peak + 1, ' ')) != NULL && peak < end) {
+                shown_end = peak;
+            }
+            printf("  server %.*s\n", (int)(shown_end - line), line);
+            break;
+        }
+    }
+
+    free(body);
+}
+
+/* Replay the messages of workload repeat times, and report. The server is
+   forked by the zygote listening on zygote, unless it's NULL. With stats,
+   the parse and reparse times and memory of the server are reported too. */
+static void __replay(const char *server, const char *zygote, const char *name,
+                     replay_Workload *workload, int repeat, int paced, int stats)
+{
+    replay_Latencies latencies[MAX_MESSAGE_TYPES], *of_type;
+    replay_Responses responses = { -1, NULL, 0, 0 };
+    replay_Message  *message;
+    int    to_server, n_types = 0, i_round = 0, i_type, status;
+    size_t i_message, n_sent = 0;
+    double started, sent_at, elapsed, first_response = -1;
+    const char *first_type = NULL;
+    pid_t  pid = -1;
+
+    started = __now_ms();
+    if (zygote != NULL) {
+        __spawn_from_zygote(zygote, workload, &to_server, &responses.fd);
+    }
+    else {
+        pid = __start_server(server, workload, &to_server, &responses.fd);
+    }
+
+    memset(latencies, 0, sizeof(latencies));
+
+    for ( ; i_round < repeat; i_round++)
+    {
+        for (i_message = 0; i_message < workload->n_messages; i_message++)
+        {
+            message = &workload->messages[i_message];
+            if (strcmp(message->type, "SHUTDOWN") == 0) {
+                continue;    /* the server is shut down after the last round */
+            }
+
+            /* keep the pace of the recording */
+            elapsed = __now_ms() - started;
+            if (paced && i_round == 0 && message->time_us / 1e3 > elapsed) {
+                usleep((useconds_t)((message->time_us / 1e3 - elapsed) * 1e3));
+            }
+
+            sent_at = __now_ms();
+            __write_all(to_server, message->data, message->length);
+            __write_all(to_server, "\n", 1);
+            if (message->has_response) {
+                __read_response(&responses, NULL);
+            }
+            if (message->has_response && first_type == NULL)
+            {
+                first_response = __now_ms() - started;
+                first_type = message->type;
+            }
+
+            of_type = __latencies_of(latencies, &n_types, message->type, workload->n_messages * repeat);
+            of_type->count++;
+            if (message->has_response) {
+                of_type->values[of_type->n_values++] = __now_ms() - sent_at;
+            }
+            n_sent++;
+        }
+    }
+
+    elapsed = __now_ms() - started;
+
+    printf("%s: %lu messages in %.3f s, %.1f messages/s\n",
+           name, (unsigned long)n_sent, elapsed / 1e3, n_sent / (elapsed / 1e3));
+    if (first_type != NULL) {
+        printf("  first response (%s) %.3f ms after the %s start\n",
+               first_type, first_response, (zygote != NULL) ? "zygote" : "cold");
+    }
+    printf("  %-12s %8s %10s %10s %10s %10s\n",
+           "message", "count", "p50_ms", "p95_ms", "p99_ms", "max_ms");
+
+    for (i_type = 0; i_type < n_types; i_type++)
+    {
+        of_type = &latencies[i_type];
+        if (of_type->n_values == 0)
+        {
+            printf("  %-12s %8lu %10s %10s %10s %10s\n",
+                   of_type->type, of_type->count, "-", "-", "-", "-");
+            continue;
+        }
+
+        qsort(of_type->values, of_type->n_values, sizeof(double), __compare_doubles);
+        printf("  %-12s %8lu %10.3f %10.3f %10.3f %10.3f\n",
+               of_type->type, of_type->count,
+               __percentile(of_type, 0.50), __percentile(of_type, 0.95),
+               __percentile(of_type, 0.99), of_type->values[of_type->n_values - 1]);
+        free(of_type->values);
+    }
+
+    if (stats) {
+        __print_server_stats(to_server, &responses, pid);
+    }
+
+    close(to_server);
+    if (pid > 0) {
+        waitpid(pid, &status, 0);
+    }
+    free(responses.data);
+}
+
+
+static void __usage(void)
+{
+    fprintf(stderr,
+        "usage: replay [--server PATH | --zygote SOCKET] [--repeat N] [--stats] [--paced] --trace TRACE\n"
+        "       replay [--server PATH | --zygote SOCKET] [--repeat N] [--stats] --complete FILE [-- CLANG ARGS]\n"
+        "       replay [--server PATH | --zygote SOCKET] [--repeat N] [--stats] --paste FILE [-- CLANG ARGS]\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    replay_Workload workload;
+    const char *server = "./clang-complete", *zygote = NULL, *mode = NULL, *path = NULL;
+    int i_arg = 1, repeat = 1, paced = 0, stats = 0, n_clang_args = 0;
+    char **clang_args = NULL;
+
+    for ( ; i_arg < argc; i_arg++)
+    {
+        if (strcmp(argv[i_arg], "--") == 0)
+        {
+            clang_args = argv + i_arg + 1;
+            n_clang_args = argc - i_arg - 1;
+            break;
+        }
+        else if (strcmp(argv[i_arg], "--paced") == 0) {
+            paced = 1;
+        }
+        else if (strcmp(argv[i_arg], "--stats") == 0) {
+            stats = 1;
+        }
+        else if (i_arg + 1 >= argc) {
+            __usage();
+        }
+        else if (strcmp(argv[i_arg], "--server") == 0) {
+            server = argv[++i_arg];
+        }
+        else if (strcmp(argv[i_arg], "--zygote") == 0) {
+            zygote = argv[++i_arg];
+        }
+        else if (strcmp(argv[i_arg], "--repeat") == 0) {
+            repeat = atoi(argv[++i_arg]);
+        }
+        else if (strcmp(argv[i_arg], "--trace") == 0 ||
+                 strcmp(argv[i_arg], "--complete") == 0 ||
+                 strcmp(argv[i_arg], "--paste") == 0)
+        {
+            mode = argv[i_arg];
+            path = argv[++i_arg];
+        }
+        else {
+            __usage();
+        }
+    }
+
+    if (mode == NULL || repeat < 1) {
+        __usage();
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&workload, 0, sizeof(workload));
+
+    if (strcmp(mode, "--trace") == 0) {
+        __load_trace(path, &workload);
+    }
+    else
+    {
+        __set_workload_args(&workload, n_clang_args, clang_args, path);
+        if (strcmp(mode, "--complete") == 0) {
+            __load_completion_workload(path, &workload);
+        }
+        else {
+            __load_paste_workload(path, &workload);
+        }
+    }
+
+    __replay(server, zygote, path, &workload, repeat, paced, stats);
+    return 0;
+}
@@ -0,0 +1,393 @@
+// Replay workload: a syntax check right after a large paste. The part of
+// the file before the marker (a comment holding '@') is checked first, then
+// the whole file, as if everything after the marker had just been pasted.
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace events
+{
+
+struct Event
+{
+    std::string   kind;
+    std::uint64_t timestamp;
+    std::map<std::string, std::string> attributes;
+};
+
+class Handler
+{
+public:
+    virtual ~Handler() {}
+    virtual bool accepts(const Event &event) const = 0;
+    virtual std::string handle(const Event &event) = 0;
+};
+
+/*@*/
+class ClickHandler : public Handler
+{
+public:
+    explicit ClickHandler(std::function<void(const std::string &)> sink)
+        : sink_(sink), handled_(0) {}
+
+    bool accepts(const Event &event) const override
+    {
+        return event.kind == "click";
+    }
+
+    std::string handle(const Event &event) override
+    {
+        std::ostringstream summary;
+        summary << "click #" << ++handled_ << " at " << event.timestamp;
+        for (const auto &attribute : event.attributes) {
+            summary << ' ' << attribute.first << '=' << attribute.second;
+        }
+        sink_(summary.str());
+        return summary.str();
+    }
+
+    std::size_t handled() const { return handled_; }
+
+private:
+    std::function<void(const std::string &)> sink_;
+    std::size_t handled_;
+};
+
+class ScrollHandler : public Handler
+{
+public:
+    explicit ScrollHandler(std::function<void(const std::string &)> sink)
+        : sink_(sink), handled_(0) {}
+
+    bool accepts(const Event &event) const override
+    {
+        return event.kind == "scroll";
+    }
+
+    std::string handle(const Event &event) override
+    {
+        std::ostringstream summary;
+        summary << "scroll #" << ++handled_ << " at " << event.timestamp;
+        for (const auto &attribute : event.attributes) {
+            summary << ' ' << attribute.first << '=' << attribute.second;
+        }
+        sink_(summary.str());
+        return summary.str();
+    }
+
+    std::size_t handled() const { return handled_; }
+
+private:
+    std::function<void(const std::string &)> sink_;
+    std::size_t handled_;
+};
+
+class KeyPressHandler : public Handler
+{
+public:
+    explicit KeyPressHandler(std::function<void(const std::string &)> sink)
+        : sink_(sink), handled_(0) {}
+
+    bool accepts(const Event &event) const override
+    {
+        return event.kind == "keypress";
+    }
+
+    std::string handle(const Event &event) override
+    {
+        std::ostringstream summary;
+        summary << "keypress #" << ++handled_ << " at " << event.timestamp;
+        for (const auto &attribute : event.attributes) {
+            summary << ' ' << attribute.first << '=' << attribute.second;
+        }
+        sink_(summary.str());
+        return summary.str();
+    }
+
+    std::size_t handled() const { return handled_; }
+
+private:
+    std::function<void(const std::string &)> sink_;
+    std::size_t handled_;
+};
+
+class ResizeHandler : public Handler
+{
+public:
+    explicit ResizeHandler(std::function<void(const std::string &)> sink)
+        : sink_(sink), handled_(0) {}
+
+    bool accepts(const Event &event) const override
+    {
+        return event.kind == "resize";
+    }
+
+    std::string handle(const Event &event) override
+    {
+        std::ostringstream summary;
+        summary << "resize #" << ++handled_ << " at " << event.timestamp;
+        for (const auto &attribute : event.attributes) {
+            summary << ' ' << attribute.first << '=' << attribute.second;
+        }
+        sink_(summary.str());
+        return summary.str();
+    }
+
+    std::size_t handled() const { return handled_; }
+
+private:
+    std::function<void(const std::string &)> sink_;
+    std::size_t handled_;
+};
+
+class FocusHandler : public Handler
+{
+public:
+    explicit FocusHandler(std::function<void(const std::string &)> sink)
+        : sink_(sink), handled_(0) {}
+
+    bool accepts(const Event &event) const override
+    {
+        return event.kind == "focus";
+    }
+
+    std::string handle(const Event &event) override
+    {
+        std::ostringstream summary;
+        summary << "focus #" << ++handled_ << " at " << event.timestamp;
+        for (const auto &attribute : event.attributes) {
+            summary << ' ' << attribute.first << '=' << attribute.second;
+        }
+        sink_(summary.str());
+        return summary.str();
+    }
+
+    std::size_t handled() const { return handled_; }
+
+private:
+    std::function<void(const std::string &)> sink_;
+    std::size_t handled_;
+};
+
+class BlurHandler : public Handler
+{
+public:
+    explicit BlurHandler(std::function<void(const std::string &)> sink)
+        : sink_(sink), handled_(0) {}
+
+    bool accepts(const Event &event) const override
+    {
+        return event.kind == "blur";
+    }
+
+    std::string handle(const Event &event) override
+    {
+        std::ostringstream summary;
+        summary << "blur #" << ++handled_ << " at " << event.timestamp;
+        for (const auto &attribute : event.attributes) {
+            summary << ' ' << attribute.first << '=' << attribute.second;
+        }
+        sink_(summary.str());
+        return summary.str();
+    }
+
+    std::size_t handled() const { return handled_; }
+
+private:
+    std::function<void(const std::string &)> sink_;
+    std::size_t handled_;
+};
+
+class DragHandler : public Handler
+{
+public:
+    explicit DragHandler(std::function<void(const std::string &)> sink)
+        : sink_(sink), handled_(0) {}
+
+    bool accepts(const Event &event) const override
+    {
+        return event.kind == "drag";
+    }
+
+    std::string handle(const Event &event) override
+    {
+        std::ostringstream summary;
+        summary << "drag #" << ++handled_ << " at " << event.timestamp;
+        for (const auto &attribute : event.attributes) {
+            summary << ' ' << attribute.first << '=' << attribute.second;
+        }
+        sink_(summary.str());
+        return summary.str();
+    }
+
+    std::size_t handled() const { return handled_; }
+
+private:
+    std::function<void(const std::string &)> sink_;
+    std::size_t handled_;
+};
+
+class DropHandler : public Handler
+{
+public:
+    explicit DropHandler(std::function<void(const std::string &)> sink)
+        : sink_(sink), handled_(0) {}
+
+    bool accepts(const Event &event) const override
+    {
+        return event.kind == "drop";
+    }
+
+    std::string handle(const Event &event) override
+    {
+        std::ostringstream summary;
+        summary << "drop #" << ++handled_ << " at " << event.timestamp;
+        for (const auto &attribute : event.attributes) {
+            summary << ' ' << attribute.first << '=' << attribute.second;
+        }
+        sink_(summary.str());
+        return summary.str();
+    }
+
+    std::size_t handled() const { return handled_; }
+
+private:
+    std::function<void(const std::string &)> sink_;
+    std::size_t handled_;
+};
+
+class TimerHandler : public Handler
+{
+public:
+    explicit TimerHandler(std::function<void(const std::string &)> sink)
+        : sink_(sink), handled_(0) {}
+
+    bool accepts(const Event &event) const override
+    {
+        return event.kind == "timer";
+    }
+
+    std::string handle(const Event &event) override
+    {
+        std::ostringstream summary;
+        summary << "timer #" << ++handled_ << " at " << event.timestamp;
+        for (const auto &attribute : event.attributes) {
+            summary << ' ' << attribute.first << '=' << attribute.second;
+        }
+        sink_(summary.str());
+        return summary.str();
+    }
+
+    std::size_t handled() const { return handled_; }
+
+private:
+    std::function<void(const std::string &)> sink_;
+    std::size_t handled_;
+};
+
+class NetworkHandler : public Handler
+{
+public:
+    explicit NetworkHandler(std::function<void(const std::string &)> sink)
+        : sink_(sink), handled_(0) {}
+
+    bool accepts(const Event &event) const override
+    {
+        return event.kind == "network";
+    }
+
+    std::string handle(const Event &event) override
+    {
+        std::ostringstream summary;
+        summary << "network #" << ++handled_ << " at " << event.timestamp;
+        for (const auto &attribute : event.attributes) {
+            summary << ' ' << attribute.first << '=' << attribute.second;
+        }
+        sink_(summary.str());
+        return summary.str();
+    }
+
+    std::size_t handled() const { return handled_; }
+
+private:
+    std::function<void(const std::string &)> sink_;
+    std::size_t handled_;
+};
+
+class StorageHandler : public Handler
+{
+public:
+    explicit StorageHandler(std::function<void(const std::string &)> sink)
+        : sink_(sink), handled_(0) {}
+
+    bool accepts(const Event &event) const override
+    {
+        return event.kind == "storage";
+    }
+
+    std::string handle(const Event &event) override
+    {
+        std::ostringstream summary;
+        summary << "storage #" << ++handled_ << " at " << event.timestamp;
+        for (const auto &attribute : event.attributes) {
+            summary << ' ' << attribute.first << '=' << attribute.second;
+        }
+        sink_(summary.str());
+        return summary.str();
+    }
+
+    std::size_t handled() const { return handled_; }
+
+private:
+    std::function<void(const std::string &)> sink_;
+    std::size_t handled_;
+};
+
+class ErrorHandler : public Handler
+{
+public:
+    explicit ErrorHandler(std::function<void(const std::string &)> sink)
+        : sink_(sink), handled_(0) {}
+
+    bool accepts(const Event &event) const override
+    {
+        return event.kind == "error";
+    }
+
+    std::string handle(const Event &event) override
+    {
+        std::ostringstream summary;
+        summary << "error #" << ++handled_ << " at " << event.timestamp;
+        for (const auto &attribute : event.attributes) {
+            summary << ' ' << attribute.first << '=' << attribute.second;
+        }
+        sink_(summary.str());
+        return summary.str();
+    }
+
+    std::size_t handled() const { return handled_; }
+
+private:
+    std::function<void(const std::string &)> sink_;
+    std::size_t handled_;
+};
+
+std::vector<std::string> dispatch(std::vector<Handler*> &handlers, const std::vector<Event> &log)
+{
+    std::vector<std::string> summaries;
+    for (const auto &event : log)
+    {
+        for (auto *handler : handlers)
+        {
+            if (handler->accepts(event)) {
+                summaries.push_back(handler->handle(event));
+            }
+        }
+    }
+    return summaries;
+}
+
+} // namespace events
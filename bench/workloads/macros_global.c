@@ -0,0 +1,64 @@
+/* Replay workload: global-scope completion with lots of macros. Completion
+   is asked for at every marker (a comment holding '@'), with the identifier
+   after it typed one character at a time. */
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define  BUFFER_SIZE       4096
+#define  MAX_FIELDS        64
+#define  FIELD_SEPARATOR   ','
+#define  ARRAY_LENGTH(a)   (sizeof(a) / sizeof((a)[0]))
+#define  MIN(a, b)         ((a) < (b) ? (a) : (b))
+#define  MAX(a, b)         ((a) > (b) ? (a) : (b))
+#define  CHECK(cond, msg)  do { if (!(cond)) { fprintf(stderr, "%s\n", msg); exit(1); } } while (0)
+
+typedef struct csv_row
+{
+    char *fields[MAX_FIELDS];
+    int   n_fields;
+} csv_row;
+
+static int split_row(char *line, csv_row *row)
+{
+    char *field = line;
+
+    row->n_fields = 0;
+    while (row->n_fields < MAX_FIELDS)
+    {
+        char *separator = /*@*/strchr(field, FIELD_SEPARATOR);
+        row->fields[row->n_fields++] = field;
+        if (separator == NULL) {
+            break;
+        }
+        *separator = '\0';
+        field = separator + 1;
+    }
+    return row->n_fields;
+}
+
+int main(int argc, char *argv[])
+{
+    char line[BUFFER_SIZE];
+    csv_row row;
+    long widest = 0;
+    FILE *fp;
+
+    /*@*/CHECK(argc > 1, "usage: csv file");
+    fp = /*@*/fopen(argv[1], "r");
+    CHECK(fp != NULL, strerror(errno));
+
+    while (/*@*/fgets(line, sizeof(line), fp) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        widest = /*@*/MAX(widest, split_row(line, &row));
+        /*@*/printf("%d fields, first %.*s\n", row.n_fields,
+               /*@*/MIN(16, (int)strlen(row.fields[0])), row.fields[0]);
+    }
+
+    /*@*/fclose(fp);
+    return widest > /*@*/INT_MAX ? 1 : 0;
+}
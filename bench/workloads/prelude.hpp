@@ -0,0 +1,9 @@
+// Zygote prelude: the headers most C++ files of a project include,
+// precompiled once by the zygote so that the servers forked from it parse
+// over it.
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
@@ -0,0 +1,62 @@
+// Replay workload: member completion on STL-heavy code. Completion is asked
+// for at every marker (a comment holding '@'), with the identifier after it
+// typed one character at a time.
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Record
+{
+    std::string name;
+    std::vector<int> values;
+    std::map<std::string, double> weights;
+};
+
+class Registry
+{
+public:
+    void add(const std::string &key, std::shared_ptr<Record> record)
+    {
+        records_./*@*/emplace(key, record);
+        order_./*@*/push_back(key);
+    }
+
+    double total(const std::string &key) const
+    {
+        auto found = records_./*@*/find(key);
+        if (found == records_.end()) {
+            return 0.0;
+        }
+
+        double sum = 0.0;
+        for (const auto &weight : found->second->/*@*/weights) {
+            sum += weight./*@*/second;
+        }
+        return sum;
+    }
+
+    std::vector<std::string> sorted() const
+    {
+        std::vector<std::string> keys(order_);
+        std::sort(keys./*@*/begin(), keys.end());
+        keys./*@*/erase(std::unique(keys.begin(), keys.end()), keys.end());
+        return keys;
+    }
+
+private:
+    std::unordered_map<std::string, std::shared_ptr<Record>> records_;
+    std::vector<std::string> order_;
+};
+
+int main()
+{
+    Registry registry;
+    auto record = std::make_shared<Record>();
+    record->/*@*/name = "first";
+    record->values./*@*/reserve(16);
+    registry./*@*/add(record->name, record);
+    return static_cast<int>(registry./*@*/sorted().size());
+}
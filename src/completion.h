@@ -2,7 +2,148 @@
 #define _COMPLETION_SESSION_H_
 
 
+#include <stdio.h>
 #include <clang-c/Index.h>
+#include "completion_filter.h"
+#include "completion_output.h"
+#include "completion_flags.h"
+#include "completion_stats.h"
+
+
+/* Completion results of the last COMPLETION request, kept around to answer
+   follow-up requests at the same completion point without libclang */
+typedef struct __completion_Cache_struct
+{
+    int valid;                     /* nonzero if results can be reused, stale
+                                    * results of the last COMPLETION are still
+                                    * held for DETAIL */
+    int row, column;               /* where the results were computed */
+    size_t start_offset;           /* offset of (row, column) in src_buffer */
+    unsigned long context_hash;    /* hash of src_buffer[0..start_offset) */
+    unsigned long tu_generation;   /* TU generation the results came from */
+    unsigned long results_id;      /* tells result sets apart in candidate ids */
+    int context;                   /* CONTEXT_* of the completion point */
+    unsigned options;              /* clang_codeCompleteAt options used */
+
+    CXCodeCompleteResults     *results;  /* sorted completion results */
+    completion_CandidateTable  table;    /* candidate table of results */
+
+    unsigned long hits;            /* requests answered from the cache */
+    unsigned long misses;          /* requests that went to libclang */
+    unsigned long speculative_hits;  /* hits on results computed in advance */
+
+} completion_Cache;
+
+
+/* How the diagnostics asked for by SYNTAXCHECK are sent, all zero means the
+   whole list of formatted diagnostics */
+typedef struct __completion_DiagnosticsOptions_struct
+{
+    int structured;              /* nonzero for the structured format */
+    int first_line, last_line;   /* only diagnostics of the main file in this
+                                  * range of lines (0 for no limit) are sent */
+    unsigned long base;          /* structured diagnostics are sent as a diff
+                                  * against this set, if it's the last one sent */
+
+} completion_DiagnosticsOptions;
+
+
+/* A client waiting for the response to one of its requests */
+typedef struct __completion_Receiver_struct
+{
+    int           fd;            /* where the response is sent, -1 if closed */
+    unsigned long request_id;
+    unsigned long received_at;   /* completion_statsNow() when it was read */
+    completion_DiagnosticsOptions options;    /* of diagnostics responses */
+
+} completion_Receiver;
+
+
+/* A translation unit parked with the flags it was parsed with, so that
+   switching back to them doesn't have to parse from scratch */
+typedef struct __completion_PooledUnit_struct
+{
+    int                num_args;
+    char             **cmdline_args;
+    CXTranslationUnit  cx_tu;
+    unsigned long      tu_hash;
+    unsigned long      tu_pch;
+
+} completion_PooledUnit;
+
+#define  MAX_POOLED_UNITS   3    /* parked translation units of a session */
+
+#define  MAX_SPECULATIONS   4    /* completion points precomputed while idle */
+
+
+/* Completion contexts, told apart by the text before the completion point
+   (see completion_classifyContext), each one with its own options of
+   clang_codeCompleteAt */
+#define  CONTEXT_GLOBAL        0    /* statement or global scope */
+#define  CONTEXT_MEMBER        1    /* after "." or "->" */
+#define  CONTEXT_QUALIFIED     2    /* after "::" */
+#define  CONTEXT_PREPROCESSOR  3    /* in a preprocessor directive */
+
+#define  CONTEXT_COUNT         4
+
+
+/* An unsaved file other than the main one, such as a header being edited in
+   another buffer of the client, see completion_setOverlay */
+typedef struct __completion_Overlay_struct
+{
+    char          *path;
+    char          *contents;
+    size_t         length;
+    unsigned long  version;    /* given by the client */
+    unsigned long  hash;       /* completion_hashBytes of contents */
+    int            included;   /* nonzero if cx_tu includes it */
+
+} completion_Overlay;
+
+
+/* An identifier of the lexicon, see completion_printLexicalCandidates */
+typedef struct __completion_LexiconWord_struct
+{
+    char          *name;         /* NULL for a free slot */
+    size_t         length;
+    unsigned long  hash;
+    unsigned       in_source;    /* occurrences in src_buffer */
+    unsigned long  unit_stamp;   /* unit_stamp of the lexicon when it's been
+                                  * seen in the headers of the translation unit */
+
+} completion_LexiconWord;
+
+/* Identifiers of src_buffer and of the headers of the last good translation
+   unit, answering completions lexically when libclang can't in time */
+typedef struct __completion_Lexicon_struct
+{
+    completion_LexiconWord *words;   /* open addressing hash table */
+    size_t capacity;                 /* number of slots, a power of two */
+    size_t n_words;                  /* slots taken */
+    int    source_valid;             /* nonzero if in_source counts src_buffer */
+    size_t edit_start, edit_tail;    /* of the edit being applied, see
+                                      * completion_noteLexiconEdit */
+    unsigned long unit_stamp;        /* bumped whenever the headers are read */
+    unsigned long unit_generation;   /* tu_generation they've been read from */
+
+} completion_Lexicon;
+
+#define  MAX_LEXICON_HEADERS       32            /* headers read identifiers from */
+#define  MAX_LEXICON_HEADER_SIZE   (1UL << 20)   /* bigger ones are skipped */
+
+
+/* Where the preprocessor directives at the top of a source file end, see
+   completion_scanPreamble */
+typedef struct __completion_PreambleBounds_struct
+{
+    size_t length;           /* of the preamble, up to the end of the last
+                              * directive outside conditionals */
+    size_t directives_end;   /* end of the last directive */
+    size_t body_start;       /* the first token of the program, (size_t)-1 if
+                              * the directives end in an unterminated comment */
+    int    has_include;      /* nonzero if an #include or #import is among them */
+
+} completion_PreambleBounds;
 
 
 typedef struct __completion_Session_struct
@@ -10,29 +151,174 @@ typedef struct __completion_Session_struct
     /* <source file properties> */
     const char *src_filename;  /* filename of the source file */
     char *src_buffer;          /* buffer holding the source code */
-    int   src_length;          /* length of the source code <including the trailing '\0'> */
-    int   buffer_capacity;     /* size of source code buffer */
+    size_t src_length;         /* length of the source code <including the trailing '\0'> */
+    size_t buffer_capacity;    /* size of source code buffer */
+    unsigned long src_version; /* version of src_buffer, reset to 0 on every full
+                                * source update and bumped by each SOURCEDELTA */
+    int   src_in_sync;         /* nonzero if src_buffer is known to be identical
+                                * to the client's buffer at src_version */
+    unsigned long src_updates; /* bumped by every write to src_buffer */
+
+    /* <preamble of src_buffer, see completion_classifyEdit> */
+    completion_PreambleBounds preamble;
+    unsigned long preamble_hash;   /* hash of the directives, 0 if not scanned yet */
+
+    /* <unsaved files other than the main one, see completion_setOverlay> */
+    completion_Overlay   *overlays;
+    int                   n_overlays;
+    struct CXUnsavedFile *unsaved_files;   /* main file first, then the overlays */
 
     /* <clang args properties> */
     int  num_args;         /* number of command line arguments */
     char **cmdline_args;   /* command line arguments to pass to the clang
-                            * driver */
+                            * driver, canonical (see completion_flags.h) */
 
     /* <clang parser objects> */
     CXIndex           cx_index;
     CXTranslationUnit cx_tu;
+    unsigned long     tu_generation;  /* bumped on every parse and reparse */
+    unsigned long     tu_hash;        /* hash of the unsaved files cx_tu has been
+                                       * (re)parsed with, 0 if it still has to be
+                                       * reparsed, see completion_hashUnsavedFiles */
+    unsigned long     tu_preamble;    /* preamble_hash cx_tu has been (re)parsed
+                                       * with, 0 if its preamble is yet to be built */
+    unsigned long     tu_pch;         /* cached PCH cx_tu has been parsed over, 0 if
+                                       * none, see completion_parseWithAstCache */
+    int               hibernated;     /* translation units disposed while idle,
+                                       * see completion_hibernate */
+
+    /* <diagnostics of cx_tu, formatted on demand> */
+    completion_Output diagnostics;
+    unsigned long     diagnostics_generation;   /* tu_generation they're of */
+
+    /* <the last set of structured diagnostics sent, which the next one is a
+        diff against, touched by the worker while it's reparsing session> */
+    unsigned long    *diag_ids;                 /* sorted */
+    size_t            n_diag_ids;
+    unsigned long     diag_set_id;
+
+    /* <translation units of other flags, least recently used first> */
+    completion_PooledUnit tu_pool[MAX_POOLED_UNITS];
+    int                   n_pooled_units;
+
+    /* <background reparse, guarded by the lock of the reparse worker> */
+    int               reparse_state;   /* REPARSE_QUEUED and/or REPARSE_RUNNING */
+    CXTranslationUnit spare_tu;        /* previous generation, recycled by the worker,
+                                        * dropped when idle */
+    CXTranslationUnit ready_tu;        /* reparsed by the worker, not swapped in yet */
+    unsigned long spare_hash;          /* tu_hash of spare_tu and ready_tu */
+    unsigned long ready_hash;
+    unsigned long spare_preamble;      /* tu_preamble of spare_tu and ready_tu */
+    unsigned long ready_preamble;
+    unsigned long spare_pch;           /* tu_pch of spare_tu and ready_tu */
+    unsigned long ready_pch;
+    char *snapshot;                    /* copy of src_buffer to be reparsed */
+    size_t snapshot_length;
+    unsigned long snapshot_hash;
+    unsigned long snapshot_preamble;   /* preamble_hash of the snapshot */
+    struct CXUnsavedFile *snapshot_files;   /* copies of the overlays, after */
+    unsigned n_snapshot_files;              /* a free slot for the main file */
+    completion_Receiver *diag_outs;    /* clients waiting for the diagnostics of */
+    int   n_diag_outs;                 /* the queued reparse */
+    unsigned long reparse_cost;        /* moving averages of reparse time (ms), */
+    unsigned long preamble_cost;       /* when the preamble is kept or rebuilt */
+    unsigned long reparse_queued_at;   /* when the queued reparse was requested */
+    unsigned long reparse_due;         /* when the queued reparse should start */
+    struct __completion_Session_struct *reparse_next;   /* worker queue link */
+
+    /* <completion result cache> */
+    completion_Cache  cache;
+
+    /* <speculative completion, see completion_speculate> */
+    completion_Cache  speculations[MAX_SPECULATIONS];  /* results computed in advance */
+    int  spec_rows[MAX_SPECULATIONS];       /* points to compute them at, the */
+    int  spec_columns[MAX_SPECULATIONS];    /* nearest to the cursor first */
+    int  n_spec_points;
+    int  i_spec_point;                      /* the next one */
+
+    /* <lexical fallback, see completion_printLexicalCandidates> */
+    completion_Lexicon lexicon;
+    unsigned long complete_cost[CONTEXT_COUNT];   /* moving averages of completion
+                                                   * time (ms) by context */
+
+    /* <response being built by the main thread> */
+    completion_Output response;
 
     /* <clang parse options> */
+    int       parse_profile;    /* PROFILE_* ParseOptions are taken from */
     unsigned  ParseOptions;
-    unsigned  CompleteAtOptions;
+    unsigned  CompleteAtOptions[CONTEXT_COUNT];   /* by completion context */
+    unsigned  complete_on, complete_off;   /* options forced on and off by the
+                                            * last COMPLETION, speculative
+                                            * completion follows them too */
 
 } completion_Session;
 
 
 /* COMPLETION SERVER DEFAULT SETTINGS */
 
-#define  DEFAULT_PARSE_OPTIONS       CXTranslationUnit_PrecompiledPreamble
-#define  DEFAULT_COMPLETEAT_OPTIONS  CXCodeComplete_IncludeMacros
+/* libclang 3.9 and later could build the preamble PCH on the first parse,
+   older ones build it on the first reparse */
+#if CINDEX_VERSION_MINOR >= 35
+#define  PREAMBLE_ON_FIRST_PARSE     CXTranslationUnit_CreatePreambleOnFirstParse
+#else
+#define  PREAMBLE_ON_FIRST_PARSE     0
+#endif
+
+/* brief comments are attached to the results so that DETAIL could show them */
+#define  DEFAULT_PARSE_OPTIONS       (CXTranslationUnit_PrecompiledPreamble | \
+                                      CXTranslationUnit_IncludeBriefCommentsInCodeCompletion | \
+                                      PREAMBLE_ON_FIRST_PARSE)
+
+/* libclang 8 and later could skip the function bodies of the preamble only,
+   the ones of the source file are still parsed and checked */
+#if CINDEX_VERSION_MINOR >= 50
+#define  SKIP_PREAMBLE_BODIES        (CXTranslationUnit_SkipFunctionBodies | \
+                                      CXTranslationUnit_LimitSkipFunctionBodiesToPreamble)
+#else
+#define  SKIP_PREAMBLE_BODIES        0
+#endif
+
+/* Parse profiles, see completion_setParseProfile */
+#define  PROFILE_INTERACTIVE         0
+#define  PROFILE_ACCURATE            1
+#define  PROFILE_LOW_MEMORY          2
+
+#define  PROFILE_COUNT               3
+
+/* interactive: the global completions are cached by libclang on every
+   reparse, and the function bodies of the headers are skipped */
+#define  INTERACTIVE_PARSE_OPTIONS   (DEFAULT_PARSE_OPTIONS | \
+                                      CXTranslationUnit_CacheCompletionResults | \
+                                      SKIP_PREAMBLE_BODIES)
+/* accurate: everything is parsed */
+#define  ACCURATE_PARSE_OPTIONS      DEFAULT_PARSE_OPTIONS
+/* low-memory: every function body is skipped but the one being completed
+   in, templates are not instantiated at the end of the translation unit,
+   and there are no brief comments */
+#define  LOW_MEMORY_PARSE_OPTIONS    (CXTranslationUnit_PrecompiledPreamble | \
+                                      CXTranslationUnit_SkipFunctionBodies | \
+                                      CXTranslationUnit_Incomplete | \
+                                      PREAMBLE_ON_FIRST_PARSE)
+
+#define  DEFAULT_PARSE_PROFILE       PROFILE_INTERACTIVE
+
+/* libclang 8 and later could leave out the declarations of the preamble,
+   which doesn't lose any member of a class */
+#if CINDEX_VERSION_MINOR >= 50
+#define  SKIP_PREAMBLE_DECLS         CXCodeComplete_SkipPreamble
+#else
+#define  SKIP_PREAMBLE_DECLS         0
+#endif
+
+/* clang_codeCompleteAt options of each completion context. Macros make up
+   most of the results at global scope, and can't follow "." or "::". Brief
+   comments are only asked for by COMPLETION with lazy details or s-expression
+   results, which are the only ones to show them (in DETAIL responses). */
+#define  GLOBAL_COMPLETEAT_OPTIONS        CXCodeComplete_IncludeMacros
+#define  MEMBER_COMPLETEAT_OPTIONS        SKIP_PREAMBLE_DECLS
+#define  QUALIFIED_COMPLETEAT_OPTIONS     0
+#define  PREPROCESSOR_COMPLETEAT_OPTIONS  CXCodeComplete_IncludeMacros
 #define  INITIAL_SRC_BUFFER_SIZE     4096    /* 4KB */
 
 
@@ -48,25 +334,454 @@ typedef struct __completion_Session_struct
 void 
 __initialize_completionSession(int argc, char *argv[], completion_Session *session);
 
-/* Initialize session object and launch the completion server, preparse the source file and 
-   build the AST for furture code completion requests  */
-void startup_completionSession(int argc, char *argv[], completion_Session *session);
+/* Initialize session object and launch the completion server, the AST is
+   built by the first request which needs it. cx_index is created by the
+   caller, or inherited from the zygote. */
+void startup_completionSession(
+    int argc, char *argv[], CXIndex cx_index, completion_Session *session);
 
+/* Initialize session object for filename, which shares cx_index with other
+   sessions. The translation unit is not built until it is needed. */
+void startup_sharedCompletionSession(
+    CXIndex cx_index, const char *filename, int num_args, char **args, 
+    completion_Session *session);
 
-/* Print specified completion string to fp. */
-void completion_printCompletionLine(CXCompletionString completion_string, FILE *fp);
+/* Free everything owned by session except the (probably shared) cx_index */
+void shutdown_completionSession(completion_Session *session);
 
-/* Print all completion results to fp */
-void completion_printCodeCompletionResults(CXCodeCompleteResults *res, FILE *fp);
+/* dispose command line arguments of session */
+void completion_freeCmdlineArgs(completion_Session *session);
 
 
-/* Simple wrappers for clang parser functions */
+/* Use num_args canonical flags (which session takes ownership of) from now on.
+   Returns 0 if they're the same as cmdline_args, nothing is done then.
+   Otherwise the current translation unit is parked in the pool, and the one
+   of the new flags is taken from it (and reparsed) or parsed from scratch. */
+int completion_switchCmdlineArgs(completion_Session *session, int num_args, char **args);
+
+/* Dispose the translation units parked in the pool of session */
+void completion_releasePooledUnits(completion_Session *session);
+
+
+/* Parse profiles: named sets of parse options, trading the accuracy of the
+   diagnostics for parse time and memory
+       interactive   skips the function bodies of the headers, and has
+                     libclang cache the global completions (the default)
+       accurate      parses everything
+       low-memory    skips every function body but the one being completed
+                     in, and leaves out the brief comments */
+
+/* PROFILE_* named name, -1 if there's none */
+int completion_findParseProfile(const char *name);
+
+/* Name of profile */
+const char *completion_parseProfileName(int profile);
+
+/* Profile of the sessions started from now on, DEFAULT_PARSE_PROFILE unless
+   told otherwise */
+void completion_setDefaultParseProfile(int profile);
+
+/* Parse the source of session with the options of profile from now on.
+   Returns 0 if it's the profile of session already. Otherwise the
+   translation units of session (pooled ones included) are disposed, as
+   libclang keeps the options they have been parsed with, and the current
+   one is parsed again right away unless there was none. */
+int completion_setParseProfile(completion_Session *session, int profile);
+
+
+/* Print specified completion string to out. */
+void completion_printCompletionLine(
+    CXCompletionString completion_string, completion_Output *out);
+
+/* Print all completion results to out */
+void completion_printCodeCompletionResults(
+    CXCodeCompleteResults *res, completion_Output *out);
+
+/* Print the short form of result, the index-th one of the result set
+   results_id, to out:
+       CANDIDATE:[#typed_text#]\t[#cursor_kind#]\t[#results_id#].[#index#] */
+void completion_printCandidateLine(
+    const CXCompletionResult *result, unsigned long results_id, unsigned index,
+    completion_Output *out);
+
+/* Print result, the index-th one of the result set results_id, as an
+   overload of the s-expression of a SEXP response, after previous (the last
+   result printed, NULL if none). Returns 0 if it has no typed text. See
+   parse_results.c for the format. */
+int completion_printSexpCandidate(
+    const CXCompletionResult *result, const CXCompletionResult *previous,
+    unsigned long results_id, unsigned index, completion_Output *out);
+
+/* Print the details of completion_string left out of its CANDIDATE line */
+void completion_printCandidateDetail(
+    CXCompletionString completion_string, completion_Output *out);
+
+/* Print all diagnostic messages of tu to out */
+void completion_printDiagnostics(CXTranslationUnit tu, completion_Output *out);
+
+/* Print the diagnostics of tu (a translation unit of session) to out, as
+   asked for by options, see completion_diagnostics.c */
+void completion_printRequestedDiagnostics(
+    completion_Session *session, CXTranslationUnit tu,
+    const completion_DiagnosticsOptions *options, completion_Output *out);
+
+
+/* Simple wrappers for clang parser functions, a reparse is skipped if cx_tu
+   is up to date with src_buffer (see tu_hash) */
 
 CXTranslationUnit completion_parseTranslationUnit(completion_Session *session);
 int completion_reparseTranslationUnit(completion_Session *session);
 CXCodeCompleteResults* completion_codeCompleteAt(
+    completion_Session *session, int line, int column, unsigned options);
+
+/* Make sure that session has a translation unit, it would be rebuilt from
+   src_buffer if it had been released */
+CXTranslationUnit completion_ensureTranslationUnit(completion_Session *session);
+
+/* Dispose the translation units of session (pooled ones included) to save
+   memory, src_buffer and command line arguments are kept so it could be
+   rebuilt later */
+void completion_releaseTranslationUnit(completion_Session *session);
+
+/* Memory used by the translation units of session in bytes */
+unsigned long completion_getTranslationUnitMemory(completion_Session *session);
+
+/* Hibernate an idle session: dispose its translation units like
+   completion_releaseTranslationUnit, and give the memory back to the system.
+   Only src_buffer and the flags are kept, the next request restores cx_tu by
+   parsing against the PCH of its preamble if the AST cache holds one, which
+   is much faster than parsing the headers again. No PCH is built while
+   hibernating, the restore goes through completion_parseWithAstCache like
+   any other parse. Returns nonzero if
+   it's been hibernated, a session without translation unit or with a
+   background reparse in progress is not. */
+int completion_hibernate(completion_Session *session);
+
+
+/* Completion result cache */
+
+/* Return the candidate table of completion results at (line, column), reusing
+   the cached results if neither the translation unit nor the source code
+   before the completion point changed since they were computed. Returns NULL
+   if code completion failed. */
+completion_CandidateTable* completion_cachedCompleteAt(
     completion_Session *session, int line, int column);
 
+/* The index-th completion result of the cached result set results_id, or NULL
+   if that result set has been dropped since */
+CXCompletionResult* completion_cachedCandidate(
+    completion_Session *session, unsigned long results_id, unsigned index);
+
+/* Called after src_buffer has been replaced: drop cached results if the source
+   code before the completion point has changed */
+void completion_validateCache(completion_Session *session);
+
+/* Called before the edit at offset is applied to src_buffer */
+void completion_noteSourceEdit(completion_Session *session, size_t offset);
+
+/* Drop cached completion results, speculative ones included, the last ones
+   are kept for DETAIL until the next COMPLETION */
+void completion_invalidateCache(completion_Session *session);
+
+/* Free all completion results held by session */
+void completion_freeCache(completion_Session *session);
+
+
+/* Completion contexts: the options of clang_codeCompleteAt are picked by
+   the context of the completion point, so that a member access doesn't pay
+   for the tens of thousands of macros and declarations of global scope, and
+   the results are cut down to the kinds which could appear in the contexts
+   reported by clang_codeCompleteGetContexts before they're sorted. The time
+   taken and the number of results in each context are recorded in STATS. */
+
+/* CONTEXT_* of the completion point at offset of source, found by looking
+   back at the text before it */
+int completion_classifyContext(const char *source, size_t offset);
+
+/* clang_codeCompleteAt options of session in context, with the ones forced
+   on and off by the last COMPLETION */
+unsigned completion_completeAtOptions(const completion_Session *session, int context);
+
+/* Copy the default options of each context (*_COMPLETEAT_OPTIONS) to the
+   CONTEXT_COUNT entries of options */
+void completion_defaultCompleteAtOptions(unsigned *options);
+
+/* Drop the results of res which couldn't appear in any of contexts (as
+   given by clang_codeCompleteGetContexts), keeping the others in order.
+   Returns the number of results left. */
+unsigned completion_dropIrrelevantResults(
+    CXCodeCompleteResults *res, unsigned long long contexts);
+
+
+/* Lexical fallback: a completion libclang can't answer within the latency
+   budget of the client (the translation unit has yet to be built, or its
+   preamble is out of date) is answered right away with the identifiers of
+   the lexicon starting with the typed prefix, and again with the semantic
+   results once they're in. So are the ones libclang has no results for,
+   which happens when the source is badly broken.
+
+   The identifiers of src_buffer are counted by a raw lexer, which doesn't
+   tell comments and literals from code so that an edit only relexes the
+   words it touches. The ones of the headers the source file includes (but
+   system headers) are taken from clang_tokenize over the last good
+   translation unit. Nothing is done until the lexicon is first used. */
+
+/* Milliseconds completion_cachedCompleteAt is expected to take at
+   (line, column), 0 if the results are cached and (unsigned long)-1 if
+   there's no telling */
+unsigned long completion_expectedCompletionTime(
+    completion_Session *session, int line, int column);
+
+/* Print the identifiers of the lexicon starting with prefix (and longer
+   than it) as IDENTIFIER:[#name#] lines to out, the limit (0 for no limit)
+   most frequent of them in alphabetical order. The identifier at (line,
+   column) itself is not counted. Returns the number of identifiers printed. */
+unsigned completion_printLexicalCandidates(
+    completion_Session *session, int line, int column, const char *prefix,
+    unsigned limit, completion_Output *out);
+
+/* Called after src_buffer has been replaced as a whole */
+void completion_invalidateLexicon(completion_Session *session);
+
+/* Called before the deleted_length bytes at offset of src_buffer are
+   replaced, and after inserted_length bytes have taken their place */
+void completion_noteLexiconEdit(completion_Session *session, size_t offset, size_t deleted_length);
+void completion_applyLexiconEdit(completion_Session *session, size_t offset, size_t inserted_length);
+
+/* Free the lexicon of session */
+void completion_freeLexicon(completion_Session *session);
+
+
+/* Speculative completion: the client reports where its cursor is (CURSOR
+   message), and while no request is waiting the server computes the results
+   at the completion points around it in advance, so that the COMPLETION
+   which follows is answered from the cache. libclang can't abort
+   clang_codeCompleteAt, so speculation is only given up between two points
+   when a request comes in. */
+
+/* Precompute completions at the points around (line, column) of src_buffer
+   from now on: where the identifier under the cursor starts, and after the
+   member accesses (".", "->" and "::") on the same line */
+void completion_setSpeculationPoints(completion_Session *session, int line, int column);
+
+/* Give up the speculative work left */
+void completion_cancelSpeculation(completion_Session *session);
+
+/* Nonzero if there are speculative points left to precompute */
+int completion_isSpeculating(const completion_Session *session);
+
+/* Precompute the completion results at the next speculative point, returns
+   nonzero if there are more points left. Must be called from the main
+   thread, when no request is waiting. */
+int completion_speculate(completion_Session *session);
+
+/* 64-bit hash of length bytes of data (xxHash64) */
+unsigned long completion_hashBytes(const char *data, size_t length);
+
+/* Hash of the unsaved files a translation unit of session would be parsed
+   with, when source is the contents of the main file: source and the
+   overlays included by cx_tu. Never 0, which stands for a translation unit
+   in unknown state. */
+unsigned long completion_hashUnsavedFiles(
+    const completion_Session *session, const char *source, size_t length);
+
+
+
+/* Overlays: the client could send the unsaved contents of other files than
+   the main one (the headers it's editing), which are passed to every parse,
+   reparse and code completion of the session in place of the files on
+   disk. Only the overlays cx_tu includes count in tu_hash and invalidate
+   the cached completion results, editing an unrelated header costs nothing.
+
+   Overlays are owned by the main thread, the worker gets copies of them
+   along with the snapshot of src_buffer. */
+
+/* Replace the unsaved contents of the file at path with the length bytes of
+   contents (which session takes ownership of) at version. Returns nonzero
+   if the translation unit includes it. */
+int completion_setOverlay(
+    completion_Session *session, const char *path, unsigned long version,
+    char *contents, size_t length);
+
+/* Go back to the contents of the file at path on disk. Returns nonzero if
+   the translation unit includes it. */
+int completion_dropOverlay(completion_Session *session, const char *path);
+
+/* The overlay of the file at path, NULL if there's none */
+completion_Overlay* completion_findOverlay(completion_Session *session, const char *path);
+
+/* Find out which overlays cx_tu includes, after it has been (re)parsed */
+void completion_noteInclusions(completion_Session *session);
+
+/* The unsaved files to pass to libclang, with source as the contents of the
+   main file, valid until the overlays change. Their number is returned. */
+unsigned completion_getUnsavedFiles(
+    completion_Session *session, const char *source, size_t length,
+    struct CXUnsavedFile **files);
+
+/* Copy the overlays for the worker, after a free slot for the main file.
+   Their number (the slot included) is stored to n_files. */
+struct CXUnsavedFile* completion_copyOverlays(
+    const completion_Session *session, unsigned *n_files);
+
+/* Free files copied by completion_copyOverlays */
+void completion_freeOverlayCopies(struct CXUnsavedFile *files, unsigned n_files);
+
+/* Free the overlays of session */
+void completion_freeOverlays(completion_Session *session);
+
+
+/* On-disk AST cache: the preamble of a source file (the preprocessor
+   directives at its top, which pull in the headers where nearly all of the
+   parse time goes) is precompiled into a PCH kept in a cache directory, so
+   reopening a file, even days later, parses it against the PCH instead of
+   parsing every header again. A translation unit loaded back with
+   clang_createTranslationUnit can't be reparsed nor code-completed, that's
+   why preambles are cached instead of whole translation units.
+
+   Entries are named by a hash of the preamble text, cmdline_args, the
+   directory of the source file and the clang version, and made of
+        [#hash#].h      the preamble text the PCH is compiled from
+        [#hash#].pch    the PCH, saved with clang_saveTranslationUnit
+        [#hash#].deps   headers of the preamble, one per line:
+                        [#mtime#] [#size#] [#content hash#] [#path#]
+        [#hash#].miss   marker of a preamble which has missed once, or which
+                        can't be cached (then it's not empty)
+   An entry is used only if none of its headers has changed, touched headers
+   are hashed again. It's built on the second miss of its preamble, a first
+   one parses without the cache. The source file keeps its own preamble, so
+   the headers it includes are seen twice: a preamble is only cached if all
+   of them have include guards or #pragma once, which skip the second time.
+   A translation unit parsed over a PCH whose headers have changed since is
+   parsed again rather than reparsed, see completion_isCachedPchStale. */
+
+#define  DEFAULT_AST_CACHE_SIZE      (1024UL << 20)        /* 1GB */
+#define  DEFAULT_AST_CACHE_MAX_AGE   (30UL * 24 * 3600)    /* 30 days */
+
+/* Cache preambles in directory (created if it doesn't exist), NULL disables
+   the cache, which is the default. Entries unused for max_age seconds are
+   removed, and then the least recently used ones while the PCHs take more
+   than size_limit bytes, 0 means no limit. Returns nonzero if directory
+   can't be used. */
+int completion_configureAstCache(
+    const char *directory, unsigned long size_limit, unsigned long max_age);
+
+/* Length of the preamble of source: the preprocessor directives, comments
+   and whitespaces before its first token, 0 if it includes no headers */
+size_t completion_getPreambleLength(const char *source, size_t length);
+
+/* Find the bounds of the preamble of source with a lexer scan, which stops
+   at the first token of the program */
+void completion_scanPreamble(
+    const char *source, size_t length, completion_PreambleBounds *bounds);
+
+/* Parse a new translation unit of session with the n_files unsaved files,
+   the main file first, against the cached PCH of its preamble (which is
+   built on a repeated cache miss) when the cache is enabled. The cache is
+   bypassed if there are other unsaved files, which the PCH couldn't have
+   seen. Without a cached PCH, the PCH of the prelude of the zygote is used
+   if it fits (see completion_precompilePrelude). The PCH used goes to pch,
+   0 if none. */
+CXTranslationUnit completion_parseWithAstCache(
+    completion_Session *session, struct CXUnsavedFile *files, unsigned n_files,
+    unsigned long *pch);
+
+/* Precompile the preamble of the prelude of the zygote, held by session, as
+   prefix.pch (along with prefix.h and prefix.deps, see above). Sessions
+   forked from the zygote parse over it when their flags are the same as the
+   ones of the prelude, and their own preamble includes every header of the
+   prelude and has no other directives than #include and #pragma. Returns
+   nonzero if the prelude can't be shared that way: it includes headers with
+   "" or without include guards, or it has other directives or errors. */
+int completion_precompilePrelude(completion_Session *session, const char *prefix);
+
+/* Nonzero if the headers of the cached PCH a translation unit has been
+   parsed over (pch, see completion_parseWithAstCache) have changed since.
+   The translation unit would keep using the old declarations, since the
+   include guards defined by the PCH skip the headers. */
+int completion_isCachedPchStale(unsigned long pch);
+
+
+/* Edit classification: an edit of the preamble (the directives at the top
+   of the source) makes the next reparse rebuild its PCH, which costs about
+   as much as parsing every header again, while an edit of the body only
+   reparses the source file itself against the PCH. Every source update is
+   classified on arrival, and recorded as STATS_UPDATE_BODY or
+   STATS_UPDATE_PREAMBLE, and the reparses that follow as STATS_REPARSE_BODY
+   or STATS_REPARSE_PREAMBLE. */
+
+#define  EDIT_BODY       0
+#define  EDIT_PREAMBLE   1
+
+/* Classify the update of src_buffer which has just been applied, starting
+   at offset (0 for a full copy of the source). An edit past the first token
+   of the program is in the body without looking any further, the preamble
+   is scanned again otherwise. Returns EDIT_BODY or EDIT_PREAMBLE. */
+int completion_classifyEdit(completion_Session *session, size_t offset);
+
+
+/* Background reparse: the worker thread reparses a spare translation unit of
+   a session while its current one (cx_tu) keeps serving completion requests,
+   then the main thread swaps the reparsed one in between two requests. The
+   spare one is parsed by the first background reparse, and disposed again
+   once the session has been idle for SPARE_IDLE_TIMEOUT, so that a session
+   only holds two translation units while it's being edited. Should the
+   worker thread fail to start, reparses are done in place on the main
+   thread. */
+
+#define  REPARSE_QUEUED    1
+#define  REPARSE_RUNNING   2
+
+/* A reparse nobody is waiting for is held back until the source has stayed
+   unchanged for a while, proportional to how long a reparse takes, so that
+   typing doesn't keep the worker busy with reparses outdated on arrival */
+#define  REPARSE_DELAY_RATIO   2       /* wait reparse_cost / 2 */
+#define  MAX_REPARSE_DELAY     1000    /* but never hold a reparse back longer (ms) */
+
+/* A reparse which rebuilds the preamble is held back longer, so that the
+   edits of an #include being typed are batched into a single rebuild rather
+   than one for each half-typed header name */
+#define  MIN_PREAMBLE_DELAY     300    /* wait at least this long (ms), */
+#define  MAX_PREAMBLE_DELAY    3000    /* or preamble_cost, up to this long */
+
+/* The spare translation unit is disposed after this long without a request (ms) */
+#define  SPARE_IDLE_TIMEOUT   10000
+
+/* Queue a reparse of the current src_buffer. If receiver is not NULL, the
+   diagnostics of the reparsed translation unit are sent to it by the worker,
+   and the reparse starts as soon as possible. Nothing is queued if cx_tu is
+   up to date with src_buffer, its diagnostics are sent right away then. */
+void completion_scheduleReparse(
+    completion_Session *session, const completion_Receiver *receiver);
+
+/* Swap the translation unit reparsed by the worker in, returns nonzero if
+   cx_tu has been replaced. Must be called from the main thread. */
+int completion_swapTranslationUnit(completion_Session *session);
+
+/* Nonzero if a background reparse of session is queued or running, which
+   means cx_tu is older than src_buffer */
+int completion_isReparsePending(completion_Session *session);
+
+/* Moving average of the background reparses of session which rebuilt its
+   preamble (ms), 0 if there hasn't been any */
+unsigned long completion_preambleCost(completion_Session *session);
+
+/* Wait until the background reparses of session are done */
+void completion_waitReparse(completion_Session *session);
+
+/* Dispose the spare translation units of session, after waiting for its
+   background reparses */
+void completion_releaseSpareTranslationUnits(completion_Session *session);
+
+/* Dispose the spare translation unit of session, unless the worker is
+   reparsing it. Doesn't wait for the worker, returns nonzero if one has been
+   disposed. */
+int completion_dropSpareTranslationUnit(completion_Session *session);
+
+/* Forget about out before it is closed: diagnostics would no longer be
+   sent to it */
+void completion_detachOutput(int out);
+
 
 
 #endif /* _COMPLETION_SESSION_H_ */
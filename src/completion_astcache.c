@@ -0,0 +1,955 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#include "completion.h"
+
+
+/* Settings of the AST cache, written once at startup */
+static char          *__cache_directory = NULL;    /* NULL if disabled */
+static unsigned long  __cache_size_limit = DEFAULT_AST_CACHE_SIZE;
+static unsigned long  __cache_max_age = DEFAULT_AST_CACHE_MAX_AGE;
+
+
+/* The prelude of the zygote (see completion_precompilePrelude), the sessions
+   it forks inherit it */
+static char          *__prelude_pch = NULL;       /* NULL if there's none */
+static char          *__prelude_deps = NULL;
+static unsigned long  __prelude_hash = 0;         /* tells its PCH apart in tu_pch */
+static char          *__prelude_includes = NULL;  /* see __include_targets */
+static char           __prelude_language[64];
+static int            __prelude_num_args = 0;
+static char         **__prelude_args = NULL;
+
+
+/* A cache entry seen while enforcing the limits */
+typedef struct __astcache_Entry_struct
+{
+    char          key[32];
+    time_t        last_used;    /* mtime of the PCH, touched on every hit */
+    unsigned long size;
+
+} astcache_Entry;
+
+
+/* Headers of a preamble, gathered while its PCH is built */
+typedef struct __astcache_Manifest_struct
+{
+    CXTranslationUnit tu;
+    completion_Output lines;    /* of the .deps file */
+    int unguarded;              /* a header included by the preamble itself
+                                 * has neither include guards nor #pragma once */
+
+} astcache_Manifest;
+
+
+/* Number of options added in front of cmdline_args to use a preamble PCH */
+#define  PCH_ARGS_COUNT   6
+
+
+
+/* Cache preambles in directory */
+int completion_configureAstCache(
+    const char *directory, unsigned long size_limit, unsigned long max_age)
+{
+    free(__cache_directory);
+    __cache_directory = NULL;
+    __cache_size_limit = size_limit;
+    __cache_max_age = max_age;
+
+    if (directory == NULL) {
+        return 0;
+    }
+
+    if (mkdir(directory, 0700) != 0 && access(directory, W_OK) != 0) {
+        return -1;
+    }
+
+    __cache_directory = strdup(directory);
+    return 0;
+}
+
+
+/* Length of the preprocessing directive starting at source[offset] (at '#'),
+   including continuation lines and the final '\n' */
+static size_t __directive_length(const char *source, size_t length, size_t offset)
+{
+    size_t end = offset;
+
+    for ( ; end < length; end++)
+    {
+        if (source[end] == '\\' && end + 1 < length && source[end + 1] == '\n') {
+            end++;    /* continued on the next line */
+        }
+        else if (source[end] == '\n') {
+            return end + 1 - offset;
+        }
+    }
+
+    return end - offset;
+}
+
+/* Name of the preprocessing directive starting at source[offset], written to
+   name (at most size - 1 characters) */
+static void __directive_name(
+    const char *source, size_t length, size_t offset, char *name, size_t size)
+{
+    size_t n_copied = 0;
+
+    for (offset++; offset < length && (source[offset] == ' ' || source[offset] == '\t'); offset++) {
+        ;
+    }
+    for ( ; offset < length && isalpha((unsigned char)source[offset]) && n_copied + 1 < size;
+          offset++) {
+        name[n_copied++] = source[offset];
+    }
+
+    name[n_copied] = '\0';
+}
+
+/* Scan the preamble of source */
+void completion_scanPreamble(
+    const char *source, size_t length, completion_PreambleBounds *bounds)
+{
+    size_t offset = 0;
+    int    n_open_conditionals = 0;
+    const char *comment_end;
+    char   name[16];
+
+    memset(bounds, 0, sizeof(completion_PreambleBounds));
+
+    while (offset < length)
+    {
+        if (isspace((unsigned char)source[offset])) {
+            offset++;
+        }
+        else if (source[offset] == '/' && offset + 1 < length && source[offset + 1] == '/')
+        {
+            comment_end = (const char*)memchr(source + offset, '\n', length - offset);
+            offset = (comment_end != NULL) ? (size_t)(comment_end - source) + 1 : length;
+        }
+        else if (source[offset] == '/' && offset + 1 < length && source[offset + 1] == '*')
+        {
+            for (offset += 2;
+                 offset + 1 < length && !(source[offset] == '*' && source[offset + 1] == '/');
+                 offset++) {
+                ;
+            }
+            if (offset + 1 >= length)
+            {
+                /* unterminated comment, closing it anywhere below could
+                   bring more directives in */
+                bounds->body_start = (size_t)-1;
+                return;
+            }
+            offset += 2;
+        }
+        else if (source[offset] == '#')
+        {
+            __directive_name(source, length, offset, name, sizeof(name));
+            if (strncmp(name, "if", 2) == 0) {
+                n_open_conditionals++;
+            }
+            else if (strcmp(name, "endif") == 0) {
+                n_open_conditionals--;
+            }
+            else if (strncmp(name, "include", 7) == 0 || strcmp(name, "import") == 0) {
+                bounds->has_include = 1;
+            }
+
+            offset += __directive_length(source, length, offset);
+            bounds->directives_end = offset;
+
+            /* the preamble never ends within a conditional */
+            if (n_open_conditionals == 0) {
+                bounds->length = offset;
+            }
+        }
+        else {
+            break;    /* the first token of the program */
+        }
+    }
+
+    bounds->body_start = offset;
+}
+
+/* Length of the preamble of source */
+size_t completion_getPreambleLength(const char *source, size_t length)
+{
+    completion_PreambleBounds bounds;
+
+    completion_scanPreamble(source, length, &bounds);
+
+    /* nothing worth precompiling without headers */
+    return bounds.has_include ? bounds.length : 0;
+}
+
+/* Classify the update of src_buffer which has just been applied at offset */
+int completion_classifyEdit(completion_Session *session, size_t offset)
+{
+    unsigned long started = completion_statsNow(), hash;
+
+    /* the directives above the first token of the program are intact */
+    if (session->preamble_hash != 0 && offset > session->preamble.body_start)
+    {
+        completion_recordStats(STATS_UPDATE_BODY, started);
+        return EDIT_BODY;
+    }
+
+    completion_scanPreamble(session->src_buffer, session->src_length, &session->preamble);
+    hash = completion_hashBytes(session->src_buffer, session->preamble.directives_end);
+    if (hash == 0) {
+        hash = 1;    /* 0 stands for not scanned */
+    }
+
+    if (hash == session->preamble_hash)
+    {
+        completion_recordStats(STATS_UPDATE_BODY, started);
+        return EDIT_BODY;
+    }
+
+    session->preamble_hash = hash;
+    completion_recordStats(STATS_UPDATE_PREAMBLE, started);
+    return EDIT_PREAMBLE;
+}
+
+
+/* prefix followed by suffix (malloc'd) */
+static char *__suffixed_path(const char *prefix, const char *suffix)
+{
+    size_t size = strlen(prefix) + strlen(suffix) + 1;
+    char  *path = (char*)malloc(size);
+
+    snprintf(path, size, "%s%s", prefix, suffix);
+    return path;
+}
+
+/* Path of the file of cache entry key with suffix (malloc'd) */
+static char *__entry_path(const char *key, const char *suffix)
+{
+    size_t size = strlen(__cache_directory) + strlen(key) + strlen(suffix) + 2;
+    char  *path = (char*)malloc(size);
+
+    snprintf(path, size, "%s/%s%s", __cache_directory, key, suffix);
+    return path;
+}
+
+/* Remove all files of cache entry key */
+static void __remove_entry(const char *key)
+{
+    static const char *suffixes[] = { ".pch", ".deps", ".h", ".miss" };
+    char *path;
+    int   i_suffix = 0;
+
+    for ( ; i_suffix < 4; i_suffix++)
+    {
+        path = __entry_path(key, suffixes[i_suffix]);
+        unlink(path);
+        free(path);
+    }
+}
+
+/* Name of a temporary file to be renamed over path, unique to this thread,
+   so that other servers sharing the cache never see a partial file */
+static void __temporary_path(const char *path, char *temporary, size_t size)
+{
+    snprintf(temporary, size, "%s.%d.%lx",
+             path, (int)getpid(), (unsigned long)pthread_self());
+}
+
+/* Write length bytes of data to path, through a temporary file */
+static int __write_file(const char *path, const char *data, size_t length)
+{
+    char  temporary[PATH_MAX];
+    FILE *fp;
+    int   status = 0;
+
+    __temporary_path(path, temporary, sizeof(temporary));
+    if ((fp = fopen(temporary, "wb")) == NULL) {
+        return -1;
+    }
+
+    if (fwrite(data, 1, length, fp) != length) {
+        status = -1;
+    }
+    if (fclose(fp) != 0 || status != 0 || rename(temporary, path) != 0)
+    {
+        unlink(temporary);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Hash of the contents of the file at path, returns -1 if it can't be read */
+static int __hash_file(const char *path, unsigned long *hash)
+{
+    completion_Output contents = { NULL, 0, 0 };
+    FILE  *fp = fopen(path, "rb");
+    size_t n_read;
+
+    if (fp == NULL) {
+        return -1;
+    }
+
+    do {
+        n_read = fread(completion_reserveOutput(&contents, 65536), 1, 65536, fp);
+        completion_commitOutput(&contents, n_read);
+    } while (n_read > 0);
+    fclose(fp);
+
+    *hash = completion_hashBytes(contents.data, contents.length);
+    completion_freeOutput(&contents);
+    return 0;
+}
+
+
+/* Directory of filename (malloc'd), "." if it has none */
+static char *__source_directory(const char *filename)
+{
+    char  resolved[PATH_MAX];
+    const char *slash;
+
+    if (realpath(filename, resolved) != NULL) {
+        filename = resolved;
+    }
+
+    if ((slash = strrchr(filename, '/')) == NULL) {
+        return strdup(".");
+    }
+    if (slash == filename) {
+        return strdup("/");
+    }
+
+    return strndup(filename, (size_t)(slash - filename));
+}
+
+/* Language to precompile the preamble as: the one given with -x, or the one
+   implied by the extension of filename, as a header */
+static void __header_language(
+    const char *filename, int num_args, char **args, char *language, size_t size)
+{
+    const char *extension = strrchr(filename, '.'), *given = NULL;
+    int i_arg = 0;
+
+    for ( ; i_arg < num_args; i_arg++)
+    {
+        if (strcmp(args[i_arg], "-x") == 0 && i_arg + 1 < num_args) {
+            given = args[++i_arg];
+        }
+        else if (strncmp(args[i_arg], "-x", 2) == 0 && args[i_arg][2] != '\0') {
+            given = args[i_arg] + 2;
+        }
+    }
+
+    if (given == NULL)
+    {
+        given = "c++";
+        if (extension != NULL && strcmp(extension, ".c") == 0) {
+            given = "c";
+        }
+        else if (extension != NULL && strcmp(extension, ".m") == 0) {
+            given = "objective-c";
+        }
+        else if (extension != NULL && strcmp(extension, ".mm") == 0) {
+            given = "objective-c++";
+        }
+    }
+
+    if (strstr(given, "-header") != NULL) {
+        snprintf(language, size, "%s", given);
+    }
+    else {
+        snprintf(language, size, "%s-header", given);
+    }
+}
+
+/* Name of the cache entry of a preamble: a hash of everything the PCH
+   depends on except the headers, which are checked by __is_entry_fresh.
+   Returns the hash the name is made of. */
+static unsigned long __entry_key(
+    const char *directory, int num_args, char **args,
+    const char *preamble, size_t length, char *key, size_t size)
+{
+    completion_Output material = { NULL, 0, 0 };
+    CXString version = clang_getClangVersion();
+    unsigned long hash;
+    int i_arg = 0;
+
+    completion_appendOutput(&material, clang_getCString(version),
+                            strlen(clang_getCString(version)) + 1);
+    completion_appendOutput(&material, directory, strlen(directory) + 1);
+    for ( ; i_arg < num_args; i_arg++) {
+        completion_appendOutput(&material, args[i_arg], strlen(args[i_arg]) + 1);
+    }
+    completion_appendOutput(&material, preamble, length);
+
+    hash = completion_hashBytes(material.data, material.length);
+    snprintf(key, size, "%016lx", hash);
+
+    completion_freeOutput(&material);
+    clang_disposeString(version);
+    return hash;
+}
+
+
+/* Nonzero if the PCH at pch_path exists and none of the headers listed in
+   deps_path has changed */
+static int __is_pch_fresh(const char *pch_path, const char *deps_path)
+{
+    char  line[PATH_MAX + 64], *header;
+    FILE  *fp;
+    long   mtime;
+    unsigned long size, hash, current_hash;
+    struct stat info;
+    int    fresh = (stat(pch_path, &info) == 0), n_scanned;
+
+    fp = fresh ? fopen(deps_path, "r") : NULL;
+    if (fp == NULL) {
+        return 0;
+    }
+
+    /* [#mtime#] [#size#] [#content hash#] [#path#] */
+    while (fresh && fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (sscanf(line, "%ld %lu %lx %n", &mtime, &size, &hash, &n_scanned) < 3) {
+            continue;
+        }
+        header = line + n_scanned;
+        header[strcspn(header, "\n")] = '\0';
+
+        if (stat(header, &info) != 0 || (unsigned long)info.st_size != size) {
+            fresh = 0;
+        }
+        else if ((long)info.st_mtime != mtime) {
+            /* touched, but the contents could be the same */
+            fresh = (__hash_file(header, &current_hash) == 0 && current_hash == hash);
+        }
+    }
+
+    fclose(fp);
+    return fresh;
+}
+
+/* Nonzero if cache entry key exists and none of its headers has changed */
+static int __is_entry_fresh(const char *key)
+{
+    char *pch_path = __entry_path(key, ".pch"), *deps_path = __entry_path(key, ".deps");
+    int   fresh = __is_pch_fresh(pch_path, deps_path);
+
+    free(deps_path);
+    free(pch_path);
+    return fresh;
+}
+
+
+/* Record a header included by the preamble in the manifest of its entry */
+static void __record_inclusion(
+    CXFile included_file, CXSourceLocation *inclusion_stack, unsigned include_len,
+    CXClientData client_data)
+{
+    astcache_Manifest *manifest = (astcache_Manifest*)client_data;
+    CXString filename;
+    struct stat info;
+    unsigned long hash;
+
+    (void) inclusion_stack;
+    if (include_len == 0) {
+        return;    /* the preamble itself */
+    }
+
+    /* the source file includes it again after the PCH, which only its
+       guards make harmless */
+    if (include_len == 1 &&
+        !clang_isFileMultipleIncludeGuarded(manifest->tu, included_file)) {
+        manifest->unguarded = 1;
+    }
+
+    filename = clang_getFileName(included_file);
+    if (stat(clang_getCString(filename), &info) == 0 &&
+        __hash_file(clang_getCString(filename), &hash) == 0)
+    {
+        completion_printOutput(&manifest->lines, "%ld %lu %016lx %s\n",
+            (long)info.st_mtime, (unsigned long)info.st_size, hash,
+            clang_getCString(filename));
+    }
+    clang_disposeString(filename);
+}
+
+/* Nonzero if tu has errors, its PCH would break every parse using it */
+static int __has_errors(CXTranslationUnit tu)
+{
+    unsigned i_diag = 0, n_diags = clang_getNumDiagnostics(tu);
+    CXDiagnostic diag;
+    int failed = 0;
+
+    for ( ; i_diag < n_diags && !failed; i_diag++)
+    {
+        diag = clang_getDiagnostic(tu, i_diag);
+        failed = (clang_getDiagnosticSeverity(diag) >= CXDiagnostic_Error);
+        clang_disposeDiagnostic(diag);
+    }
+
+    return failed;
+}
+
+/* Precompile preamble, written to header_path, as pch_path and list its
+   headers in deps_path. Returns nonzero on failure: the preamble has errors,
+   or includes a header without include guards. */
+static int __precompile(
+    const char *header_path, const char *pch_path, const char *deps_path,
+    const char *filename, const char *directory,
+    int num_args, char **args, const char *preamble, size_t length)
+{
+    char   temporary[PATH_MAX], language[64];
+    char **header_args = (char**)calloc(sizeof(char*), num_args + 4);
+    astcache_Manifest manifest;
+    CXIndex cx_index = clang_createIndex(0, 0);
+    CXTranslationUnit tu = NULL;
+    int status = -1;
+
+    memset(&manifest, 0, sizeof(manifest));
+
+    /* quoted includes are searched for next to the source file first, but
+       the preamble is compiled from the cache directory */
+    header_args[0] = "-iquote";
+    header_args[1] = (char*)directory;
+    memcpy(header_args + 2, args, sizeof(char*) * num_args);
+    __header_language(filename, num_args, args, language, sizeof(language));
+    header_args[num_args + 2] = "-x";
+    header_args[num_args + 3] = language;
+
+    if (__write_file(header_path, preamble, length) == 0)
+    {
+        tu = clang_parseTranslationUnit(
+            cx_index, header_path, (const char * const *) header_args, num_args + 4,
+            NULL, 0, CXTranslationUnit_Incomplete | CXTranslationUnit_ForSerialization);
+    }
+
+    if (tu != NULL && !__has_errors(tu))
+    {
+        manifest.tu = tu;
+        clang_getInclusions(tu, __record_inclusion, &manifest);
+    }
+
+    if (manifest.tu != NULL && !manifest.unguarded)
+    {
+        __temporary_path(pch_path, temporary, sizeof(temporary));
+
+        /* the manifest goes last, an entry without it is never used */
+        if (clang_saveTranslationUnit(tu, temporary, clang_defaultSaveOptions(tu)) == 0 &&
+            rename(temporary, pch_path) == 0 &&
+            __write_file(deps_path, manifest.lines.data, manifest.lines.length) == 0) {
+            status = 0;
+        }
+        unlink(temporary);
+    }
+
+    if (tu != NULL) {
+        clang_disposeTranslationUnit(tu);
+    }
+    clang_disposeIndex(cx_index);
+    completion_freeOutput(&manifest.lines);
+    free(header_args);
+
+    return status;
+}
+
+/* Precompile preamble as cache entry key, see __precompile */
+static int __build_entry(
+    const char *key, const char *filename, const char *directory,
+    int num_args, char **args, const char *preamble, size_t length)
+{
+    char *header_path = __entry_path(key, ".h");
+    char *pch_path = __entry_path(key, ".pch"), *deps_path = __entry_path(key, ".deps");
+    int   status = __precompile(header_path, pch_path, deps_path, filename, directory,
+                                num_args, args, preamble, length);
+
+    free(deps_path);
+    free(pch_path);
+    free(header_path);
+    return status;
+}
+
+
+static int __compare_last_used(const void *a, const void *b)
+{
+    time_t left = ((const astcache_Entry*)a)->last_used;
+    time_t right = ((const astcache_Entry*)b)->last_used;
+    return (left < right) ? -1 : (left > right);
+}
+
+/* Length of the key of the cache file named name, 0 if it's not the PCH or
+   the miss marker of an entry */
+static size_t __entry_key_length(const char *name)
+{
+    size_t length = strlen(name);
+
+    if (length > 4 && strcmp(name + length - 4, ".pch") == 0) {
+        return length - 4;
+    }
+    if (length > 5 && strcmp(name + length - 5, ".miss") == 0) {
+        return length - 5;
+    }
+
+    return 0;
+}
+
+/* Remove entries unused for longer than max_age, and then the least recently
+   used ones until the PCHs fit in size_limit. Miss markers are entries of
+   size 0, which only age out. */
+static void __enforce_cache_limits(void)
+{
+    DIR *dir = opendir(__cache_directory);
+    struct dirent *file;
+    struct stat info;
+    astcache_Entry *entries = NULL;
+    size_t n_entries = 0, capacity = 0, i_entry = 0, key_length;
+    unsigned long total = 0;
+    time_t now = time(NULL);
+    char *path;
+
+    if (dir == NULL) {
+        return;
+    }
+
+    while ((file = readdir(dir)) != NULL)
+    {
+        key_length = __entry_key_length(file->d_name);
+        if (key_length == 0 || key_length >= sizeof(entries->key)) {
+            continue;
+        }
+
+        path = __entry_path(file->d_name, "");
+        if (stat(path, &info) == 0)
+        {
+            if (n_entries == capacity)
+            {
+                capacity = (capacity == 0) ? 64 : capacity * 2;
+                entries = (astcache_Entry*)realloc(entries, capacity * sizeof(astcache_Entry));
+            }
+
+            memcpy(entries[n_entries].key, file->d_name, key_length);
+            entries[n_entries].key[key_length] = '\0';
+            entries[n_entries].last_used = info.st_mtime;
+            entries[n_entries].size = (file->d_name[key_length + 1] == 'p') ?
+                (unsigned long)info.st_size : 0;
+            total += entries[n_entries].size;
+            n_entries++;
+        }
+        free(path);
+    }
+    closedir(dir);
+
+    qsort(entries, n_entries, sizeof(astcache_Entry), __compare_last_used);
+    for ( ; i_entry < n_entries; i_entry++)
+    {
+        if ((__cache_max_age == 0 ||
+             (unsigned long)(now - entries[i_entry].last_used) <= __cache_max_age) &&
+            (__cache_size_limit == 0 || total <= __cache_size_limit)) {
+            continue;
+        }
+
+        __remove_entry(entries[i_entry].key);
+        total -= entries[i_entry].size;
+    }
+
+    free(entries);
+}
+
+
+/* Nonzero if the missing entry key should be built now: its PCH went stale,
+   or the preamble has missed before. A first miss is only marked, most files
+   are opened once, and building the PCH of a cold parse costs as much as the
+   parse itself. The marker of a preamble which couldn't be cached tells why,
+   it's not built again until the marker ages out. */
+static int __should_build_entry(const char *key)
+{
+    char  *pch_path = __entry_path(key, ".pch"), *miss_path = __entry_path(key, ".miss");
+    struct stat info;
+    int    build = 0;
+
+    if (stat(pch_path, &info) == 0) {
+        build = 1;
+    }
+    else if (stat(miss_path, &info) == 0) {
+        build = (info.st_size == 0);
+    }
+    else {
+        __write_file(miss_path, "", 0);
+    }
+
+    free(miss_path);
+    free(pch_path);
+    return build;
+}
+
+/* Path of the PCH of the preamble of source (malloc'd), or NULL if there's
+   none. A missing one is built and saved if __should_build_entry agrees. The
+   hash of the entry key goes to pch. */
+static char *__get_preamble_pch(
+    completion_Session *session, const char *source, size_t length,
+    const char *directory, unsigned long *pch)
+{
+    size_t preamble = completion_getPreambleLength(source, length);
+    char   key[32], *pch_path, *miss_path;
+    unsigned long hash;
+
+    if (__cache_directory == NULL || preamble == 0) {
+        return NULL;
+    }
+
+    hash = __entry_key(directory, session->num_args, session->cmdline_args,
+                       source, preamble, key, sizeof(key));
+    pch_path = __entry_path(key, ".pch");
+
+    if (__is_entry_fresh(key)) {
+        utime(pch_path, NULL);    /* mark it as recently used */
+    }
+    else if (!__should_build_entry(key))
+    {
+        free(pch_path);
+        return NULL;
+    }
+    else if (__build_entry(key, session->src_filename, directory,
+                           session->num_args, session->cmdline_args, source, preamble) != 0)
+    {
+        __remove_entry(key);
+        miss_path = __entry_path(key, ".miss");
+        __write_file(miss_path, "rejected\n", 9);
+        free(miss_path);
+        free(pch_path);
+        return NULL;
+    }
+    else
+    {
+        miss_path = __entry_path(key, ".miss");
+        unlink(miss_path);
+        free(miss_path);
+        __enforce_cache_limits();
+    }
+
+    *pch = hash;
+    return pch_path;
+}
+
+
+/* Append the headers included by the preamble of source, as written between
+   <> or "", to targets: one per line, after a leading newline. Returns
+   nonzero if the preamble has other directives than #include, #import and
+   #pragma, which could change what the headers declare. */
+static int __include_targets(const char *source, size_t length, completion_Output *targets)
+{
+    size_t offset = 0, end;
+    const char *line_end, *open, *close;
+    char   name[16];
+
+    completion_appendOutput(targets, "\n", 1);
+    while (offset < length)
+    {
+        line_end = (const char*)memchr(source + offset, '\n', length - offset);
+        end = (line_end != NULL) ? (size_t)(line_end - source) : length;
+        for ( ; offset < end && isspace((unsigned char)source[offset]); offset++) {
+            ;
+        }
+
+        if (offset < end && source[offset] == '#')
+        {
+            __directive_name(source, length, offset, name, sizeof(name));
+            if (strncmp(name, "include", 7) == 0 || strcmp(name, "import") == 0)
+            {
+                for (open = source + offset + 1;
+                     open < source + end && *open != '<' && *open != '"'; open++) {
+                    ;
+                }
+                close = (open < source + end) ?
+                    (const char*)memchr(open + 1, (*open == '<') ? '>' : '"',
+                                        (size_t)(source + end - open - 1)) : NULL;
+                if (close == NULL) {
+                    return -1;    /* a macro names the header */
+                }
+                completion_appendOutput(targets, open, (size_t)(close - open) + 1);
+                completion_appendOutput(targets, "\n", 1);
+            }
+            else if (strcmp(name, "pragma") != 0) {
+                return -1;
+            }
+        }
+
+        offset = end + 1;
+    }
+
+    return 0;
+}
+
+/* Precompile the preamble of the prelude held by session */
+int completion_precompilePrelude(completion_Session *session, const char *prefix)
+{
+    size_t length = completion_getPreambleLength(session->src_buffer, session->src_length);
+    completion_Output includes = { NULL, 0, 0 };
+    char  *header_path = __suffixed_path(prefix, ".h");
+    char  *pch_path = __suffixed_path(prefix, ".pch"), *deps_path = __suffixed_path(prefix, ".deps");
+    char  *directory = __source_directory(session->src_filename);
+    int    i_arg = 0, status = -1;
+
+    /* quoted includes would be looked for next to each source file */
+    if (length > 0 &&
+        __include_targets(session->src_buffer, length, &includes) == 0 &&
+        memchr(includes.data, '"', includes.length) == NULL &&
+        __precompile(header_path, pch_path, deps_path, session->src_filename, directory,
+                     session->num_args, session->cmdline_args,
+                     session->src_buffer, length) == 0)
+    {
+        completion_appendOutput(&includes, "", 1);
+        __prelude_includes = includes.data;
+        __prelude_pch = pch_path;
+        __prelude_deps = deps_path;
+        __prelude_hash = completion_hashBytes(pch_path, strlen(pch_path));
+        __header_language(session->src_filename, session->num_args, session->cmdline_args,
+                          __prelude_language, sizeof(__prelude_language));
+
+        __prelude_num_args = session->num_args;
+        __prelude_args = (char**)calloc(sizeof(char*), session->num_args + 1);
+        for ( ; i_arg < session->num_args; i_arg++) {
+            __prelude_args[i_arg] = strdup(session->cmdline_args[i_arg]);
+        }
+
+        status = 0;
+    }
+    else
+    {
+        completion_freeOutput(&includes);
+        free(deps_path);
+        free(pch_path);
+    }
+
+    free(directory);
+    free(header_path);
+    return status;
+}
+
+/* Path of the PCH of the prelude (malloc'd) if the source of session can be
+   parsed over it, NULL otherwise. The hash of the prelude goes to pch. */
+static char *__get_prelude_pch(
+    completion_Session *session, const char *source, size_t length, unsigned long *pch)
+{
+    completion_Output targets = { NULL, 0, 0 };
+    char   language[64], wanted[PATH_MAX + 4];
+    const char *target = NULL, *next;
+    int    fits;
+
+    if (__prelude_pch == NULL ||
+        !completion_sameFlags(session->num_args, session->cmdline_args,
+                              __prelude_num_args, __prelude_args)) {
+        return NULL;
+    }
+
+    __header_language(session->src_filename, session->num_args, session->cmdline_args,
+                      language, sizeof(language));
+    fits = (strcmp(language, __prelude_language) == 0 &&
+            __include_targets(source, completion_getPreambleLength(source, length),
+                              &targets) == 0);
+    completion_appendOutput(&targets, "", 1);
+
+    /* the source must include every header of the prelude itself, the PCH
+       would declare them all otherwise */
+    for (target = __prelude_includes + 1; fits && *target != '\0'; target = next + 1)
+    {
+        next = strchr(target, '\n');
+        snprintf(wanted, sizeof(wanted), "\n%.*s\n", (int)(next - target), target);
+        fits = (strstr(targets.data, wanted) != NULL);
+    }
+    completion_freeOutput(&targets);
+
+    if (!fits || !__is_pch_fresh(__prelude_pch, __prelude_deps)) {
+        return NULL;
+    }
+
+    *pch = __prelude_hash;
+    return strdup(__prelude_pch);
+}
+
+/* Nonzero if a translation unit parsed over the cached PCH pch (see
+   completion_parseWithAstCache) should be parsed again */
+int completion_isCachedPchStale(unsigned long pch)
+{
+    char key[32];
+
+    if (pch != 0 && pch == __prelude_hash) {
+        return !__is_pch_fresh(__prelude_pch, __prelude_deps);
+    }
+
+    if (pch == 0 || __cache_directory == NULL) {
+        return 0;
+    }
+
+    snprintf(key, sizeof(key), "%016lx", pch);
+    return !__is_entry_fresh(key);
+}
+
+/* Parse a new translation unit of session */
+CXTranslationUnit completion_parseWithAstCache(
+    completion_Session *session, struct CXUnsavedFile *files, unsigned n_files,
+    unsigned long *pch)
+{
+    CXTranslationUnit tu = NULL;
+    char  *directory = ((__cache_directory != NULL || __prelude_pch != NULL) && n_files == 1) ?
+                       __source_directory(session->src_filename) : NULL;
+    char  *pch_path;
+    char **parse_args;
+    unsigned long started = completion_statsNow();
+
+    *pch = 0;
+    pch_path = (directory != NULL) ?
+        __get_preamble_pch(session, files[0].Contents, files[0].Length, directory, pch) :
+        NULL;
+    if (pch_path == NULL && directory != NULL) {
+        pch_path = __get_prelude_pch(session, files[0].Contents, files[0].Length, pch);
+    }
+
+    if (pch_path != NULL)
+    {
+        /* the headers have been validated by __is_pch_fresh, by contents
+           rather than mtime */
+        parse_args = (char**)calloc(sizeof(char*), session->num_args + PCH_ARGS_COUNT);
+        parse_args[0] = "-iquote";
+        parse_args[1] = directory;
+        parse_args[2] = "-include-pch";
+        parse_args[3] = pch_path;
+        parse_args[4] = "-Xclang";
+        parse_args[5] = "-fno-validate-pch";
+        memcpy(parse_args + PCH_ARGS_COUNT, session->cmdline_args,
+               sizeof(char*) * session->num_args);
+
+        tu = clang_parseTranslationUnit(
+            session->cx_index, session->src_filename,
+            (const char * const *) parse_args, session->num_args + PCH_ARGS_COUNT,
+            files, n_files, session->ParseOptions);
+
+        free(parse_args);
+        free(pch_path);
+    }
+    free(directory);
+
+    /* without the cache, or if the PCH was rejected */
+    if (tu == NULL)
+    {
+        *pch = 0;
+        tu = clang_parseTranslationUnit(
+            session->cx_index, session->src_filename,
+            (const char * const *) session->cmdline_args, session->num_args,
+            files, n_files, session->ParseOptions);
+    }
+
+    completion_recordStats(STATS_PARSE, started);
+    completion_sampleMemory(tu);
+    return tu;
+}
@@ -0,0 +1,580 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "completion.h"
+
+
+
+/* Primes of xxHash64 */
+#define  PRIME64_1   11400714785074694791ULL
+#define  PRIME64_2   14029467366897019727ULL
+#define  PRIME64_3   1609587929392839161ULL
+#define  PRIME64_4   9650029242287828579ULL
+#define  PRIME64_5   2870177450012600261ULL
+
+typedef unsigned long long u64;
+
+/* Id of the last result set computed, candidate ids are made of it */
+static unsigned long __last_results_id = 0;
+
+
+static u64 __rotate_left(u64 value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+/* Unaligned native-endian loads */
+static u64 __load64(const char *data)
+{
+    u64 value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static u64 __load32(const char *data)
+{
+    unsigned int value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static u64 __round(u64 accumulator, u64 input)
+{
+    accumulator += input * PRIME64_2;
+    return __rotate_left(accumulator, 31) * PRIME64_1;
+}
+
+static u64 __merge_round(u64 hash, u64 accumulator)
+{
+    hash ^= __round(0, accumulator);
+    return hash * PRIME64_1 + PRIME64_4;
+}
+
+/* 64-bit hash of length bytes of data (xxHash64 with seed 0), it's cheap
+   enough to hash the whole source buffer on every request */
+unsigned long completion_hashBytes(const char *data, size_t length)
+{
+    const char *end = data + length;
+    u64 hash, v1, v2, v3, v4;
+
+    if (length >= 32)
+    {
+        /* four independent lanes of 8 bytes */
+        v1 = PRIME64_1 + PRIME64_2;
+        v2 = PRIME64_2;
+        v3 = 0;
+        v4 = 0 - PRIME64_1;
+
+        do {
+            v1 = __round(v1, __load64(data));
+            v2 = __round(v2, __load64(data + 8));
+            v3 = __round(v3, __load64(data + 16));
+            v4 = __round(v4, __load64(data + 24));
+            data += 32;
+        } while (data + 32 <= end);
+
+        hash = __rotate_left(v1, 1) + __rotate_left(v2, 7) +
+               __rotate_left(v3, 12) + __rotate_left(v4, 18);
+        hash = __merge_round(hash, v1);
+        hash = __merge_round(hash, v2);
+        hash = __merge_round(hash, v3);
+        hash = __merge_round(hash, v4);
+    }
+    else {
+        hash = PRIME64_5;
+    }
+
+    hash += (u64)length;
+
+    for ( ; data + 8 <= end; data += 8) {
+        hash = __rotate_left(hash ^ __round(0, __load64(data)), 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (data + 4 <= end)
+    {
+        hash = __rotate_left(hash ^ (__load32(data) * PRIME64_1), 23) * PRIME64_2 + PRIME64_3;
+        data += 4;
+    }
+    for ( ; data < end; data++) {
+        hash = __rotate_left(hash ^ ((unsigned char)*data * PRIME64_5), 11) * PRIME64_1;
+    }
+
+    /* avalanche */
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+
+    return (unsigned long)hash;
+}
+
+/* Hash of the unsaved files a translation unit of session would be parsed
+   with, when source is the contents of the main file. Overlays the
+   translation unit doesn't include don't count. */
+unsigned long completion_hashUnsavedFiles(
+    const completion_Session *session, const char *source, size_t length)
+{
+    u64 hash = completion_hashBytes(source, length);
+    int i_overlay = 0;
+
+    for ( ; i_overlay < session->n_overlays; i_overlay++)
+    {
+        if (session->overlays[i_overlay].included) {
+            hash = __merge_round(hash, session->overlays[i_overlay].hash);
+        }
+    }
+
+    return (hash != 0) ? (unsigned long)hash : 1;    /* 0 stands for unknown */
+}
+
+/* Offset of (line, column) in src_buffer, both of them start from 1 */
+static size_t __offset_of(const completion_Session *session, int line, int column)
+{
+    size_t offset = 0;
+
+    /* skip line - 1 lines */
+    while (--line > 0 && offset < session->src_length)
+    {
+        const char *newline = (const char*)memchr(
+            session->src_buffer + offset, '\n', session->src_length - offset);
+        if (newline == NULL) {
+            return session->src_length;
+        }
+        offset = (size_t)(newline - session->src_buffer) + 1;
+    }
+
+    if (column > 1) {
+        offset += (size_t)(column - 1);
+    }
+    return (offset < session->src_length) ? offset : session->src_length;
+}
+
+
+/* Drop the results held by cache */
+static void __drop_results(completion_Cache *cache)
+{
+    if (cache->results != NULL)
+    {
+        completion_freeCandidateTable(&cache->table);
+        clang_disposeCodeCompleteResults(cache->results);
+        cache->results = NULL;
+    }
+
+    cache->valid = 0;
+}
+
+/* Nonzero if the source code before the completion point of cache is still
+   the same in src_buffer */
+static int __is_context_intact(const completion_Session *session, const completion_Cache *cache)
+{
+    return cache->start_offset <= session->src_length &&
+           completion_hashBytes(session->src_buffer, cache->start_offset) == cache->context_hash;
+}
+
+/* Nonzero if cache holds the results at (line, column) of the current
+   translation unit, computed with the options a request would use now */
+static int __is_cached_at(
+    const completion_Session *session, const completion_Cache *cache, int line, int column)
+{
+    return cache->valid && cache->row == line && cache->column == column &&
+           cache->tu_generation == session->tu_generation &&
+           cache->options == completion_completeAtOptions(session, cache->context);
+}
+
+/* Nonzero if cx_tu has been (re)parsed with the preamble of src_buffer, so
+   that clang_codeCompleteAt only parses the body of the source against it */
+static int __has_current_preamble(const completion_Session *session)
+{
+    return session->cx_tu != NULL && session->tu_preamble != 0 &&
+           session->tu_preamble == session->preamble_hash;
+}
+
+/* Compute the completion results at (line, column) into cache, which must be
+   empty. Returns nonzero if code completion failed. */
+static int __fill_cache(
+    completion_Session *session, completion_Cache *cache, int line, int column)
+{
+    CXCodeCompleteResults *res;
+    size_t start_offset = __offset_of(session, line, column);
+    int context = completion_classifyContext(session->src_buffer, start_offset);
+    unsigned options = completion_completeAtOptions(session, context);
+    unsigned n_results;
+    unsigned long started, elapsed;
+
+    started = completion_statsNow();
+    res = completion_codeCompleteAt(session, line, column, options);
+    if (res == NULL) {
+        return -1;
+    }
+
+    /* leave out the kinds of results which don't fit the context before
+       paying for sorting and printing them */
+    n_results = res->NumResults;
+    completion_dropIrrelevantResults(res, clang_codeCompleteGetContexts(res));
+    completion_recordStats(STATS_COMPLETE_GLOBAL + context, started);
+    completion_countResults(STATS_COMPLETE_GLOBAL + context, n_results, res->NumResults);
+
+    /* a completion without an up to date preamble parses every header, it
+       says nothing about the next ones */
+    if (__has_current_preamble(session))
+    {
+        elapsed = (completion_statsNow() - started) / 1000;
+        session->complete_cost[context] = (session->complete_cost[context] == 0) ? elapsed :
+            (session->complete_cost[context] * 3 + elapsed) / 4;
+    }
+
+    /* sort the results before building the table, so that the table indexes
+       stay valid for both filtered and unfiltered output */
+    started = completion_statsNow();
+    clang_sortCodeCompletionResults(res->Results, res->NumResults);
+    completion_recordStats(STATS_SORT_RESULTS, started);
+    completion_buildCandidateTable(&cache->table, res);
+
+    cache->results       = res;
+    cache->row           = line;
+    cache->column        = column;
+    cache->start_offset  = start_offset;
+    cache->context_hash  = completion_hashBytes(session->src_buffer, cache->start_offset);
+    cache->context       = context;
+    cache->options       = options;
+    cache->tu_generation = session->tu_generation;
+    cache->results_id    = ++__last_results_id;
+    cache->valid         = 1;
+
+    return 0;
+}
+
+
+/* Drop cached completion results, speculative ones included. The results
+   of the last COMPLETION are only marked stale: the candidate ids the client
+   got point into them, they are kept for DETAIL until the next COMPLETION
+   replaces them. */
+void completion_invalidateCache(completion_Session *session)
+{
+    int i_spec = 0;
+
+    session->cache.valid = 0;
+    for ( ; i_spec < MAX_SPECULATIONS; i_spec++) {
+        __drop_results(&session->speculations[i_spec]);
+    }
+}
+
+/* Free all completion results held by session, the ones kept for DETAIL
+   included */
+void completion_freeCache(completion_Session *session)
+{
+    int i_spec = 0;
+
+    __drop_results(&session->cache);
+    for ( ; i_spec < MAX_SPECULATIONS; i_spec++) {
+        __drop_results(&session->speculations[i_spec]);
+    }
+}
+
+/* Called after src_buffer has been replaced: drop cached results if the source
+   code before the completion point has changed */
+void completion_validateCache(completion_Session *session)
+{
+    int i_spec = 0;
+
+    if (session->cache.valid && !__is_context_intact(session, &session->cache)) {
+        session->cache.valid = 0;    /* kept for DETAIL */
+    }
+
+    for ( ; i_spec < MAX_SPECULATIONS; i_spec++)
+    {
+        if (session->speculations[i_spec].valid &&
+            !__is_context_intact(session, &session->speculations[i_spec])) {
+            __drop_results(&session->speculations[i_spec]);
+        }
+    }
+}
+
+/* Called before the edit at offset is applied to src_buffer. Edits at or
+   behind the completion point (typing the rest of the identifier) keep the
+   cached results alive, any edit before it moves or changes the context. */
+void completion_noteSourceEdit(completion_Session *session, size_t offset)
+{
+    int i_spec = 0;
+
+    if (session->cache.valid && offset < session->cache.start_offset) {
+        session->cache.valid = 0;    /* kept for DETAIL */
+    }
+
+    for ( ; i_spec < MAX_SPECULATIONS; i_spec++)
+    {
+        if (session->speculations[i_spec].valid &&
+            offset < session->speculations[i_spec].start_offset) {
+            __drop_results(&session->speculations[i_spec]);
+        }
+    }
+}
+
+/* Return the candidate table of completion results at (line, column), reusing
+   the cached (or speculatively computed) results if possible */
+completion_CandidateTable* completion_cachedCompleteAt(
+    completion_Session *session, int line, int column)
+{
+    completion_Cache *cache = &session->cache;
+    completion_Cache  taken;
+    int i_spec = 0;
+
+    if (__is_cached_at(session, cache, line, column))
+    {
+        cache->hits++;
+        return &cache->table;
+    }
+
+    __drop_results(cache);
+
+    /* the results could have been computed while the client was idle */
+    for ( ; i_spec < MAX_SPECULATIONS; i_spec++)
+    {
+        if (__is_cached_at(session, &session->speculations[i_spec], line, column))
+        {
+            taken = session->speculations[i_spec];
+            memset(&session->speculations[i_spec], 0, sizeof(completion_Cache));
+
+            taken.hits = cache->hits + 1;
+            taken.misses = cache->misses;
+            taken.speculative_hits = cache->speculative_hits + 1;
+            *cache = taken;
+            return &cache->table;
+        }
+    }
+
+    cache->misses++;
+    if (__fill_cache(session, cache, line, column) != 0) {
+        return NULL;
+    }
+
+    return &cache->table;
+}
+
+
+/* Milliseconds completion_cachedCompleteAt is expected to take at (line,
+   column): nothing if it's cached, about a parse of every header if the
+   preamble has to be built, and as long as the last completions in the
+   same context otherwise */
+unsigned long completion_expectedCompletionTime(
+    completion_Session *session, int line, int column)
+{
+    unsigned long cost;
+    int i_spec = 0;
+
+    if (__is_cached_at(session, &session->cache, line, column)) {
+        return 0;
+    }
+    for ( ; i_spec < MAX_SPECULATIONS; i_spec++)
+    {
+        if (__is_cached_at(session, &session->speculations[i_spec], line, column)) {
+            return 0;
+        }
+    }
+
+    if (!__has_current_preamble(session))
+    {
+        cost = completion_preambleCost(session);
+        return (cost != 0) ? cost : (unsigned long)-1;
+    }
+
+    return session->complete_cost[
+        completion_classifyContext(session->src_buffer, __offset_of(session, line, column))];
+}
+
+
+/* The index-th result of the result set results_id, if it's still the one
+   in the cache. It doesn't matter if the results are out of date, they're
+   only looked up to show the details of a candidate sent before. */
+CXCompletionResult* completion_cachedCandidate(
+    completion_Session *session, unsigned long results_id, unsigned index)
+{
+    completion_Cache *cache = &session->cache;
+
+    if (cache->results == NULL || cache->results_id != results_id ||
+        index >= cache->results->NumResults) {
+        return NULL;
+    }
+
+    return &cache->results->Results[index];
+}
+
+
+/* Nonzero if c could be part of an identifier */
+static int __is_identifier_char(char c)
+{
+    return isalnum((unsigned char)c) || c == '_' || c == '$';
+}
+
+/* Line and column of offset in src_buffer, both of them start from 1 */
+static void __position_of(
+    const completion_Session *session, size_t offset, int *line, int *column)
+{
+    const char *source = session->src_buffer, *newline;
+    size_t line_start = 0;
+
+    *line = 1;
+    while ((newline = (const char*)memchr(
+                source + line_start, '\n', offset - line_start)) != NULL)
+    {
+        line_start = (size_t)(newline - source) + 1;
+        (*line)++;
+    }
+    *column = (int)(offset - line_start) + 1;
+}
+
+/* Add the completion point at offset to the speculative points of session,
+   unless it's there already */
+static void __add_speculation_point(completion_Session *session, size_t offset)
+{
+    int line, column, i_point = 0;
+
+    if (session->n_spec_points >= MAX_SPECULATIONS) {
+        return;
+    }
+
+    __position_of(session, offset, &line, &column);
+    for ( ; i_point < session->n_spec_points; i_point++)
+    {
+        if (session->spec_rows[i_point] == line && session->spec_columns[i_point] == column) {
+            return;
+        }
+    }
+
+    session->spec_rows[session->n_spec_points] = line;
+    session->spec_columns[session->n_spec_points] = column;
+    session->n_spec_points++;
+}
+
+/* Offset just after the member access operator (".", "->" or "::") ending at
+   source[offset - 1], or 0 if there's none */
+static size_t __after_member_access(const char *source, size_t offset)
+{
+    if (offset >= 1 && source[offset - 1] == '.' &&
+        !(offset >= 2 && isdigit((unsigned char)source[offset - 2]))) {
+        return offset;    /* not a floating point literal */
+    }
+    if (offset >= 2 && ((source[offset - 2] == '-' && source[offset - 1] == '>') ||
+                        (source[offset - 2] == ':' && source[offset - 1] == ':'))) {
+        return offset;
+    }
+
+    return 0;
+}
+
+/* Precompute completions at the points around (line, column) from now on:
+   where the identifier under the cursor starts, which is where the client
+   would complete it at, and the member accesses of the same line, the
+   nearest to the cursor first */
+void completion_setSpeculationPoints(completion_Session *session, int line, int column)
+{
+    const char *source = session->src_buffer;
+    size_t cursor = __offset_of(session, line, column), start = cursor;
+    size_t line_start = cursor, line_end = cursor, before, after, point;
+
+    completion_cancelSpeculation(session);
+
+    while (start > 0 && __is_identifier_char(source[start - 1])) {
+        start--;
+    }
+    __add_speculation_point(session, start);
+
+    while (line_start > 0 && source[line_start - 1] != '\n') {
+        line_start--;
+    }
+    while (line_end < session->src_length && source[line_end] != '\n') {
+        line_end++;
+    }
+
+    /* walk away from the cursor in both directions at once */
+    for (before = start, after = cursor + 1;
+         (before > line_start || after <= line_end) &&
+         session->n_spec_points < MAX_SPECULATIONS; )
+    {
+        if (before > line_start)
+        {
+            if ((point = __after_member_access(source, before)) != 0) {
+                __add_speculation_point(session, point);
+            }
+            before--;
+        }
+        if (after <= line_end)
+        {
+            if ((point = __after_member_access(source, after)) != 0 &&
+                session->n_spec_points < MAX_SPECULATIONS) {
+                __add_speculation_point(session, point);
+            }
+            after++;
+        }
+    }
+}
+
+/* Give up the speculative work left */
+void completion_cancelSpeculation(completion_Session *session)
+{
+    session->n_spec_points = 0;
+    session->i_spec_point = 0;
+}
+
+/* Nonzero if there are speculative points left to precompute */
+int completion_isSpeculating(const completion_Session *session)
+{
+    return session->i_spec_point < session->n_spec_points;
+}
+
+/* Precompute the completion results at the next speculative point, returns
+   nonzero if there are more points left */
+int completion_speculate(completion_Session *session)
+{
+    completion_Cache *slot = NULL;
+    int line, column, i_spec = 0, i_point;
+    unsigned long started;
+
+    if (!completion_isSpeculating(session)) {
+        return 0;
+    }
+
+    /* pick up the translation unit reparsed in background first, as the
+       next request would */
+    completion_swapTranslationUnit(session);
+
+    line = session->spec_rows[session->i_spec_point];
+    column = session->spec_columns[session->i_spec_point];
+    session->i_spec_point++;
+
+    /* done already */
+    if (__is_cached_at(session, &session->cache, line, column)) {
+        return completion_isSpeculating(session);
+    }
+    for ( ; i_spec < MAX_SPECULATIONS; i_spec++)
+    {
+        if (__is_cached_at(session, &session->speculations[i_spec], line, column)) {
+            return completion_isSpeculating(session);
+        }
+    }
+
+    /* a slot not holding the results of another current point */
+    for (i_spec = 0; i_spec < MAX_SPECULATIONS && slot == NULL; i_spec++)
+    {
+        slot = &session->speculations[i_spec];
+        for (i_point = 0; i_point < session->n_spec_points; i_point++)
+        {
+            if (__is_cached_at(session, slot,
+                               session->spec_rows[i_point], session->spec_columns[i_point]))
+            {
+                slot = NULL;
+                break;
+            }
+        }
+    }
+
+    if (slot != NULL)
+    {
+        started = completion_statsNow();
+        __drop_results(slot);
+        __fill_cache(session, slot, line, column);
+        completion_recordStats(STATS_SPECULATE, started);
+    }
+
+    return completion_isSpeculating(session);
+}
@@ -0,0 +1,200 @@
+#include <ctype.h>
+#include "completion.h"
+
+
+
+/* Options of clang_codeCompleteAt in each completion context, in the order
+   of CONTEXT_* */
+static const unsigned __context_options[CONTEXT_COUNT] = {
+    GLOBAL_COMPLETEAT_OPTIONS, MEMBER_COMPLETEAT_OPTIONS,
+    QUALIFIED_COMPLETEAT_OPTIONS, PREPROCESSOR_COMPLETEAT_OPTIONS
+};
+
+/* Contexts where a macro could be expanded */
+#define  MACRO_CONTEXTS  (CXCompletionContext_AnyType | CXCompletionContext_AnyValue | \
+                          CXCompletionContext_ObjCObjectValue | \
+                          CXCompletionContext_ObjCSelectorValue | \
+                          CXCompletionContext_CXXClassTypeValue | \
+                          CXCompletionContext_MacroName)
+
+/* Contexts where a type could be named, constructors and casts make it any
+   value context, and base classes qualify members */
+#define  TYPE_CONTEXTS   (CXCompletionContext_AnyType | CXCompletionContext_AnyValue | \
+                          CXCompletionContext_ObjCObjectValue | \
+                          CXCompletionContext_CXXClassTypeValue | \
+                          CXCompletionContext_DotMemberAccess | \
+                          CXCompletionContext_ArrowMemberAccess | \
+                          CXCompletionContext_EnumTag | CXCompletionContext_UnionTag | \
+                          CXCompletionContext_StructTag | CXCompletionContext_ClassTag | \
+                          CXCompletionContext_NestedNameSpecifier | \
+                          CXCompletionContext_ObjCInterface | \
+                          CXCompletionContext_ObjCClassMessage)
+
+/* Contexts where a function, a variable or a member could be named */
+#define  VALUE_CONTEXTS  (CXCompletionContext_AnyValue | \
+                          CXCompletionContext_ObjCObjectValue | \
+                          CXCompletionContext_ObjCSelectorValue | \
+                          CXCompletionContext_CXXClassTypeValue | \
+                          CXCompletionContext_DotMemberAccess | \
+                          CXCompletionContext_ArrowMemberAccess | \
+                          CXCompletionContext_ObjCPropertyAccess | \
+                          CXCompletionContext_NestedNameSpecifier | \
+                          CXCompletionContext_ObjCInstanceMessage | \
+                          CXCompletionContext_ObjCClassMessage)
+
+/* Contexts where a namespace could be named */
+#define  NAMESPACE_CONTEXTS  (CXCompletionContext_AnyType | CXCompletionContext_AnyValue | \
+                              CXCompletionContext_Namespace | \
+                              CXCompletionContext_NestedNameSpecifier)
+
+
+/* Nonzero if the logical line holding source[offset] is a preprocessor
+   directive, lines continued with a backslash are followed back */
+static int __is_in_directive(const char *source, size_t offset)
+{
+    size_t line_start = offset, first;
+
+    for (;;)
+    {
+        while (line_start > 0 && source[line_start - 1] != '\n') {
+            line_start--;
+        }
+
+        /* the previous line ends with a backslash */
+        if (line_start >= 2 && source[line_start - 2] == '\\') {
+            line_start--;
+        }
+        else if (line_start >= 3 && source[line_start - 2] == '\r' &&
+                 source[line_start - 3] == '\\') {
+            line_start -= 2;
+        }
+        else {
+            break;
+        }
+    }
+
+    for (first = line_start; first < offset && (source[first] == ' ' || source[first] == '\t');
+         first++) {
+    }
+
+    return first < offset && source[first] == '#';
+}
+
+/* CONTEXT_* of the completion point at offset of source: the client
+   completes at the start of an identifier, what comes before it (spaces
+   aside) tells a member access or a qualified name from the rest */
+int completion_classifyContext(const char *source, size_t offset)
+{
+    size_t before = offset;
+
+    if (__is_in_directive(source, offset)) {
+        return CONTEXT_PREPROCESSOR;
+    }
+
+    while (before > 0 && isspace((unsigned char)source[before - 1])) {
+        before--;
+    }
+
+    if (before >= 2 && source[before - 2] == ':' && source[before - 1] == ':') {
+        return CONTEXT_QUALIFIED;
+    }
+    if (before >= 2 && source[before - 2] == '-' && source[before - 1] == '>') {
+        return CONTEXT_MEMBER;
+    }
+    if (before >= 1 && source[before - 1] == '.' &&
+        !(before >= 2 && isdigit((unsigned char)source[before - 2]))) {
+        return CONTEXT_MEMBER;    /* not a floating point literal */
+    }
+
+    return CONTEXT_GLOBAL;
+}
+
+/* clang_codeCompleteAt options of session in context */
+unsigned completion_completeAtOptions(const completion_Session *session, int context)
+{
+    return (session->CompleteAtOptions[context] | session->complete_on) &
+           ~session->complete_off;
+}
+
+/* Copy the default options of every context to options */
+void completion_defaultCompleteAtOptions(unsigned *options)
+{
+    int context = 0;
+
+    for ( ; context < CONTEXT_COUNT; context++) {
+        options[context] = __context_options[context];
+    }
+}
+
+
+/* Contexts where a result of kind could appear, 0 if it's not known */
+static unsigned long long __contexts_of_kind(enum CXCursorKind kind)
+{
+    switch (kind)
+    {
+    case CXCursor_MacroDefinition:
+        return MACRO_CONTEXTS;
+
+    case CXCursor_Namespace:
+    case CXCursor_NamespaceAlias:
+        return NAMESPACE_CONTEXTS;
+
+    case CXCursor_StructDecl:
+    case CXCursor_UnionDecl:
+    case CXCursor_ClassDecl:
+    case CXCursor_EnumDecl:
+    case CXCursor_TypedefDecl:
+    case CXCursor_TypeAliasDecl:
+    case CXCursor_ClassTemplate:
+    case CXCursor_ClassTemplatePartialSpecialization:
+    case CXCursor_TemplateTypeParameter:
+    case CXCursor_TemplateTemplateParameter:
+        return TYPE_CONTEXTS;
+
+    case CXCursor_FieldDecl:
+    case CXCursor_EnumConstantDecl:
+    case CXCursor_FunctionDecl:
+    case CXCursor_VarDecl:
+    case CXCursor_ParmDecl:
+    case CXCursor_CXXMethod:
+    case CXCursor_FunctionTemplate:
+    case CXCursor_ConversionFunction:
+    case CXCursor_NonTypeTemplateParameter:
+        return VALUE_CONTEXTS;
+
+    default:
+        /* keywords, code patterns, constructors and the like */
+        return 0;
+    }
+}
+
+/* Drop the results of res which couldn't appear in any of contexts */
+unsigned completion_dropIrrelevantResults(
+    CXCodeCompleteResults *res, unsigned long long contexts)
+{
+    unsigned long long kind_contexts;
+    unsigned i_result = 0, n_kept = 0;
+
+    /* nothing is known about the context */
+    if (contexts == CXCompletionContext_Unexposed ||
+        (contexts & CXCompletionContext_Unknown) == CXCompletionContext_Unknown) {
+        return res->NumResults;
+    }
+
+    /* libclang only frees the array of results, whose completion strings
+       are owned by the result set, so they could be moved around */
+    for ( ; i_result < res->NumResults; i_result++)
+    {
+        kind_contexts = __contexts_of_kind(res->Results[i_result].CursorKind);
+        if (kind_contexts != 0 && (kind_contexts & contexts) == 0) {
+            continue;
+        }
+        if (n_kept != i_result) {
+            res->Results[n_kept] = res->Results[i_result];
+        }
+        n_kept++;
+    }
+
+    res->NumResults = n_kept;
+    return n_kept;
+}
@@ -0,0 +1,640 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "completion.h"
+#include "msg_callback.h"
+#include "completion_daemon.h"
+#include "completion_flags.h"
+
+
+/* A completion session shared by all clients working on the same file with
+   the same flags */
+typedef struct __daemon_SessionEntry_struct
+{
+    unsigned       id;          /* session id carried by request frames */
+    char          *path;        /* canonical path of the source file */
+    int            refcount;    /* number of OPENs not released yet */
+    unsigned long  last_used;   /* tick of the last request, for LRU eviction */
+    unsigned long  last_active; /* completion_statsNow() of the last request */
+    unsigned long  tu_memory;   /* memory used by its TU when last measured */
+
+    completion_Session session;
+
+    struct __daemon_SessionEntry_struct *next;
+
+} daemon_SessionEntry;
+
+/* A client connected to the daemon */
+typedef struct __daemon_Connection_struct
+{
+    int     fd;           /* requests are read from and responses sent to fd */
+
+    char   *buffer;       /* received bytes not yet dispatched */
+    size_t  length;
+    size_t  capacity;
+
+    unsigned *opened;     /* sessions opened by this client */
+    int       n_opened;
+
+} daemon_Connection;
+
+/* State of the daemon */
+typedef struct __daemon_State_struct
+{
+    CXIndex              cx_index;       /* shared by all sessions */
+    daemon_SessionEntry *sessions;
+    unsigned             next_id;
+    unsigned long        tick;
+    unsigned long        memory_budget;
+    unsigned long        hibernate_after;  /* ms, 0 for never */
+
+    daemon_Connection   *connections;
+    int                  n_connections;
+
+    char                *joined;          /* messages of consecutive frames */
+    size_t               joined_capacity; /* sent to the same session */
+
+    completion_Output    response;        /* response of the daemon itself */
+
+} daemon_State;
+
+
+#define  DAEMON_READ_SIZE   65536
+
+
+
+/* Find session entry by id */
+static daemon_SessionEntry *__find_session(daemon_State *daemon, unsigned id)
+{
+    daemon_SessionEntry *entry = daemon->sessions;
+    for ( ; entry != NULL; entry = entry->next)
+    {
+        if (entry->id == id) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Find the session of the file at path parsed with num_flags canonical
+   flags, a client asking for other flags doesn't share it */
+static daemon_SessionEntry *__find_file_session(
+    daemon_State *daemon, const char *path, int num_flags, char **flags)
+{
+    daemon_SessionEntry *entry = daemon->sessions;
+    for ( ; entry != NULL; entry = entry->next)
+    {
+        if (strcmp(entry->path, path) == 0 &&
+            completion_sameFlags(num_flags, flags,
+                                 entry->session.num_args, entry->session.cmdline_args)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Drop a reference to session id, and destroy the session when nobody uses it */
+static void __release_session(daemon_State *daemon, unsigned id)
+{
+    daemon_SessionEntry **link = &daemon->sessions, *entry;
+
+    for ( ; (entry = *link) != NULL; link = &entry->next)
+    {
+        if (entry->id != id) {
+            continue;
+        }
+
+        if (--entry->refcount <= 0)
+        {
+            *link = entry->next;
+            shutdown_completionSession(&entry->session);
+            free(entry->path);
+            free(entry);
+        }
+        return;
+    }
+}
+
+
+/* Dispose translation units of least recently used sessions (except current)
+   until the memory used by all of them fits in the memory budget */
+static void __enforce_memory_budget(daemon_State *daemon, daemon_SessionEntry *current)
+{
+    daemon_SessionEntry *entry, *victim;
+    unsigned long total = 0;
+
+    if (daemon->memory_budget == 0) {
+        return;
+    }
+
+    /* spare translation units go first, they're only there to speed up
+       background reparses */
+    for (entry = daemon->sessions; entry != NULL; entry = entry->next)
+    {
+        if (entry != current && completion_dropSpareTranslationUnit(&entry->session)) {
+            entry->tu_memory = completion_getTranslationUnitMemory(&entry->session);
+        }
+        total += entry->tu_memory;
+    }
+
+    while (total > daemon->memory_budget)
+    {
+        victim = NULL;
+        for (entry = daemon->sessions; entry != NULL; entry = entry->next)
+        {
+            if (entry != current && entry->session.cx_tu != NULL &&
+                !completion_isReparsePending(&entry->session) &&
+                (victim == NULL || entry->last_used < victim->last_used)) {
+                victim = entry;
+            }
+        }
+
+        if (victim == NULL) {
+            return;    /* the current session alone is over budget */
+        }
+
+        completion_hibernate(&victim->session);
+        total -= victim->tu_memory;
+        victim->tu_memory = 0;
+    }
+}
+
+
+/* Drop the spare translation units of the sessions which have been idle for
+   SPARE_IDLE_TIMEOUT, and hibernate the ones idle for hibernate_after */
+static void __release_idle_sessions(daemon_State *daemon)
+{
+    daemon_SessionEntry *entry;
+    unsigned long now = completion_statsNow();
+
+    for (entry = daemon->sessions; entry != NULL; entry = entry->next)
+    {
+        if (entry->session.cx_tu == NULL) {
+            continue;
+        }
+
+        if (daemon->hibernate_after > 0 &&
+            now - entry->last_active >= daemon->hibernate_after * 1000 &&
+            completion_hibernate(&entry->session)) {
+            entry->tu_memory = 0;
+        }
+        else if (now - entry->last_active >= SPARE_IDLE_TIMEOUT * 1000UL &&
+                 completion_dropSpareTranslationUnit(&entry->session)) {
+            entry->tu_memory = completion_getTranslationUnitMemory(&entry->session);
+        }
+    }
+}
+
+
+/* The most recently used session with speculative completions left to
+   precompute, or NULL */
+static daemon_SessionEntry *__find_speculating_session(daemon_State *daemon)
+{
+    daemon_SessionEntry *entry, *latest = NULL;
+
+    for (entry = daemon->sessions; entry != NULL; entry = entry->next)
+    {
+        if (completion_isSpeculating(&entry->session) &&
+            (latest == NULL || entry->last_used > latest->last_used)) {
+            latest = entry;
+        }
+    }
+
+    return latest;
+}
+
+
+/* Read the head line of the message in in, returns its request id */
+static unsigned long __read_request_id(completion_Input *in)
+{
+    char *head_line = completion_readLine(in, NULL), *request_id;
+
+    if (head_line == NULL || (request_id = strchr(head_line, ' ')) == NULL) {
+        return 0;
+    }
+    return strtoul(request_id, NULL, 10);
+}
+
+/* Send the response of the daemon itself */
+static void __respond(daemon_State *daemon, daemon_Connection *conn,
+                      unsigned long request_id, const char *format, unsigned value)
+{
+    completion_resetOutput(&daemon->response);
+    completion_printOutput(&daemon->response, format, value);
+    completion_sendResponse(conn->fd, request_id, &daemon->response);
+}
+
+/* Handle OPEN message: find or create the session of a source file with
+   the flags asked for */
+static void __handle_open(daemon_State *daemon, daemon_Connection *conn, completion_Input *in)
+{
+    char filename[PATH_MAX] = "", canonical[PATH_MAX];
+    char **args = NULL, **flags, *key, *value, *arg;
+    int num_args = 0, num_flags, i_arg = 0;
+    unsigned long request_id = __read_request_id(in);
+    daemon_SessionEntry *entry;
+
+    /* num_args is the last header, the arguments follow */
+    while ((key = completion_readHeader(in, &value)) != NULL)
+    {
+        if (strcmp(key, "filename") == 0) {
+            strncpy(filename, value, sizeof(filename) - 1);
+        }
+        else if (strcmp(key, "num_args") == 0) {
+            num_args = atoi(value);
+            break;
+        }
+    }
+    if (num_args < 0) {
+        num_args = 0;
+    }
+
+    args = (char**)calloc(sizeof(char*), num_args + 1);
+    for ( ; i_arg < num_args && (arg = completion_readToken(in, NULL)) != NULL; i_arg++) {
+        args[i_arg] = strdup(arg);
+    }
+    num_args = i_arg;
+
+    if (realpath(filename, canonical) == NULL) {
+        strcpy(canonical, filename);    /* not saved yet, use it as is */
+    }
+
+    /* the flags the session would be parsed with, the compilation database
+       and the client args combined */
+    num_flags = completion_buildCompileFlags(canonical, num_args, args, &flags);
+    entry = __find_file_session(daemon, canonical, num_flags, flags);
+    for (i_arg = 0; i_arg < num_flags; i_arg++) {
+        free(flags[i_arg]);
+    }
+    free(flags);
+
+    if (entry == NULL)
+    {
+        entry = (daemon_SessionEntry*)calloc(1, sizeof(daemon_SessionEntry));
+        entry->id   = ++daemon->next_id;
+        entry->path = strdup(canonical);
+        startup_sharedCompletionSession(
+            daemon->cx_index, entry->path, num_args, args, &entry->session);
+
+        entry->next = daemon->sessions;
+        daemon->sessions = entry;
+    }
+
+    entry->refcount++;
+    entry->last_used = ++daemon->tick;
+    entry->last_active = completion_statsNow();
+
+    conn->opened = (unsigned*)realloc(conn->opened, (conn->n_opened + 1) * sizeof(unsigned));
+    conn->opened[conn->n_opened++] = entry->id;
+
+    __respond(daemon, conn, request_id, "SESSION:%u\n", entry->id);
+
+    for (i_arg = 0; i_arg < num_args; i_arg++) {
+        free(args[i_arg]);
+    }
+    free(args);
+}
+
+/* Handle SHUTDOWN message: release session id opened by this connection */
+static void __handle_close(daemon_State *daemon, daemon_Connection *conn, unsigned id)
+{
+    int i = 0;
+    for ( ; i < conn->n_opened; i++)
+    {
+        if (conn->opened[i] == id)
+        {
+            conn->opened[i] = conn->opened[--conn->n_opened];
+            __release_session(daemon, id);
+            return;
+        }
+    }
+}
+
+/* Dispatch one framed message to the daemon or to its session */
+static void __dispatch_frame(
+    daemon_State *daemon, daemon_Connection *conn,
+    unsigned id, char *message, size_t length)
+{
+    daemon_SessionEntry *entry;
+    completion_Input in;
+
+    /* the messages are parsed in place */
+    completion_openMemoryInput(&in, message, length);
+
+    if (length >= 4 && strncmp(message, "OPEN", 4) == 0) {
+        __handle_open(daemon, conn, &in);
+    }
+    else if (length >= 8 && strncmp(message, "SHUTDOWN", 8) == 0) {
+        __handle_close(daemon, conn, id);
+    }
+    else if ((entry = __find_session(daemon, id)) == NULL) {
+        __respond(daemon, conn, __read_request_id(&in), "ERROR: UNKNOWN SESSION: %u\n", id);
+    }
+    else
+    {
+        entry->last_used = ++daemon->tick;
+        entry->last_active = completion_statsNow();
+
+        /* the message could hold more requests than one call would take */
+        while (completion_inputPending(&in)) {
+            completion_AcceptRequest(&entry->session, &in, conn->fd);
+        }
+
+        entry->tu_memory = completion_getTranslationUnitMemory(&entry->session);
+        __enforce_memory_budget(daemon, entry);
+    }
+
+    completion_closeInput(&in);
+}
+
+/* Parse the frame header at buffer[offset], returns the offset of the message
+   or 0 if the frame is incomplete, and -1 if it's not a frame at all */
+static long __parse_frame(
+    daemon_Connection *conn, size_t offset, unsigned *id, unsigned long *length)
+{
+    char *newline = (char*)memchr(conn->buffer + offset, '\n', conn->length - offset);
+    int parsed;
+
+    if (newline == NULL) {
+        return 0;    /* header line is incomplete */
+    }
+
+    *newline = '\0';
+    parsed = sscanf(conn->buffer + offset, "%u %lu", id, length);
+    *newline = '\n';
+
+    if (parsed != 2) {
+        return -1;
+    }
+
+    if ((size_t)(newline + 1 - conn->buffer) + *length > conn->length) {
+        return 0;    /* message body is incomplete */
+    }
+
+    return (long)(newline + 1 - conn->buffer);
+}
+
+/* Nonzero if the message is handled by the daemon rather than a session */
+static int __is_daemon_message(const char *message, size_t length)
+{
+    return (length >= 4 && strncmp(message, "OPEN", 4) == 0) ||
+           (length >= 8 && strncmp(message, "SHUTDOWN", 8) == 0);
+}
+
+/* Append length bytes of message to the joined messages, leaving a byte
+   after them for the input parser */
+static void __join_message(
+    daemon_State *daemon, size_t *joined_length, const char *message, size_t length)
+{
+    if (daemon->joined_capacity < *joined_length + length + 1)
+    {
+        daemon->joined_capacity = (*joined_length + length + 1) * 2;
+        daemon->joined = (char*)realloc(daemon->joined, daemon->joined_capacity);
+    }
+
+    memcpy(daemon->joined + *joined_length, message, length);
+    *joined_length += length;
+}
+
+/* Dispatch all complete frames received by conn, returns -1 if conn sent
+   something that is not a frame. Consecutive frames sent to the same session
+   are dispatched together, so that the session could drop the requests
+   superseded by newer ones. */
+static int __dispatch_frames(daemon_State *daemon, daemon_Connection *conn)
+{
+    size_t consumed = 0, joined_length;
+    unsigned id, next_id;
+    unsigned long length, next_length;
+    long message, next_message;
+
+    while ((message = __parse_frame(conn, consumed, &id, &length)) > 0)
+    {
+        consumed = (size_t)message + length;
+        joined_length = 0;
+
+        /* join the messages of the following frames to the same session */
+        for ( ; ; )
+        {
+            __join_message(daemon, &joined_length, conn->buffer + message, length);
+            if (__is_daemon_message(conn->buffer + message, length)) {
+                break;
+            }
+
+            next_message = __parse_frame(conn, consumed, &next_id, &next_length);
+            if (next_message <= 0 || next_id != id ||
+                __is_daemon_message(conn->buffer + next_message, next_length)) {
+                break;
+            }
+
+            message  = next_message;
+            length   = next_length;
+            consumed = (size_t)message + length;
+        }
+
+        __dispatch_frame(daemon, conn, id, daemon->joined, joined_length);
+    }
+
+    if (message < 0) {
+        return -1;
+    }
+
+    /* keep the incomplete frame at the beginning of buffer */
+    memmove(conn->buffer, conn->buffer + consumed, conn->length - consumed);
+    conn->length -= consumed;
+    return 0;
+}
+
+
+/* Accept a new client on listen_fd */
+static void __accept_connection(daemon_State *daemon, int listen_fd)
+{
+    daemon_Connection *conn;
+    int fd = accept(listen_fd, NULL, NULL);
+
+    if (fd < 0) {
+        return;
+    }
+
+    daemon->connections = (daemon_Connection*)realloc(
+        daemon->connections, (daemon->n_connections + 1) * sizeof(daemon_Connection));
+
+    conn = &daemon->connections[daemon->n_connections++];
+    memset(conn, 0, sizeof(daemon_Connection));
+    conn->fd = fd;
+}
+
+/* Disconnect the i-th client and release all sessions it opened */
+static void __close_connection(daemon_State *daemon, int i)
+{
+    daemon_Connection *conn = &daemon->connections[i];
+
+    while (conn->n_opened > 0) {
+        __handle_close(daemon, conn, conn->opened[0]);
+    }
+
+    completion_detachOutput(conn->fd);
+    close(conn->fd);
+    free(conn->buffer);
+    free(conn->opened);
+
+    daemon->connections[i] = daemon->connections[--daemon->n_connections];
+}
+
+/* Read whatever conn has sent and dispatch the completed frames, returns -1 if
+   conn should be closed */
+static int __receive(daemon_State *daemon, daemon_Connection *conn)
+{
+    ssize_t n_read;
+
+    if (conn->capacity - conn->length < DAEMON_READ_SIZE)
+    {
+        conn->capacity = conn->capacity * 2 + DAEMON_READ_SIZE;
+        conn->buffer = (char*)realloc(conn->buffer, conn->capacity);
+    }
+
+    n_read = read(conn->fd, conn->buffer + conn->length, conn->capacity - conn->length);
+    if (n_read <= 0) {
+        return -1;
+    }
+
+    conn->length += (size_t)n_read;
+    return __dispatch_frames(daemon, conn);
+}
+
+
+/* Create a unix domain socket listening on socket_path */
+static int __listen_on(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+
+    unlink(socket_path);    /* remove the stale socket of a dead daemon */
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Listen on socket_path and serve requests until the process is killed */
+int completion_runDaemon(
+    const char *socket_path, unsigned long memory_budget, unsigned long hibernate_after)
+{
+    daemon_State daemon;
+    struct pollfd *fds = NULL;
+    daemon_SessionEntry *speculating;
+    int listen_fd, i_conn, n_fds, n_ready, timeout;
+
+    if ((listen_fd = __listen_on(socket_path)) < 0) {
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);    /* a vanished client is noticed by read() */
+
+    memset(&daemon, 0, sizeof(daemon));
+    daemon.cx_index      = clang_createIndex(0, 0);
+    daemon.memory_budget = memory_budget;
+    daemon.hibernate_after = hibernate_after;
+
+    for ( ; ; )
+    {
+        n_fds = daemon.n_connections + 1;
+        fds = (struct pollfd*)realloc(fds, n_fds * sizeof(struct pollfd));
+
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (i_conn = 0; i_conn < daemon.n_connections; i_conn++)
+        {
+            fds[i_conn + 1].fd = daemon.connections[i_conn].fd;
+            fds[i_conn + 1].events = POLLIN;
+        }
+
+        /* speculative completions are only worked on while nobody is waiting */
+        speculating = __find_speculating_session(&daemon);
+        timeout = DAEMON_IDLE_CHECK_INTERVAL;
+        if ((n_ready = poll(fds, n_fds, (speculating != NULL) ? 0 : timeout)) < 0) {
+            continue;    /* interrupted by a signal */
+        }
+
+        if (n_ready == 0 && speculating != NULL) {
+            completion_speculate(&speculating->session);
+        }
+
+        __release_idle_sessions(&daemon);
+
+        /* serve clients in reverse order, so that closing one of them (which
+           moves the last connection into its slot) doesn't skip anyone */
+        for (i_conn = daemon.n_connections - 1; i_conn >= 0; i_conn--)
+        {
+            if (fds[i_conn + 1].revents & (POLLIN | POLLHUP | POLLERR) &&
+                __receive(&daemon, &daemon.connections[i_conn]) != 0) {
+                __close_connection(&daemon, i_conn);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            __accept_connection(&daemon, listen_fd);
+        }
+    }
+
+    return 0;
+}
+
+
+/* Listen on socket_path and fork a child for every client */
+int completion_runZygote(const char *socket_path)
+{
+    int listen_fd, client;
+    pid_t pid;
+
+    if ((listen_fd = __listen_on(socket_path)) < 0) {
+        return -1;
+    }
+
+    signal(SIGCHLD, SIG_IGN);    /* children are reaped by the system */
+
+    for ( ; ; )
+    {
+        if ((client = accept(listen_fd, NULL, NULL)) < 0) {
+            continue;
+        }
+
+        if ((pid = fork()) == 0)
+        {
+            close(listen_fd);
+            signal(SIGCHLD, SIG_DFL);
+            return client;
+        }
+
+        if (pid < 0) {
+            fprintf(stderr, "Cannot fork a server for a new client\n");
+        }
+        close(client);    /* it's the child's */
+    }
+
+    return -1;
+}
+
@@ -0,0 +1,93 @@
+#ifndef _COMPLETION_DAEMON_H_
+#define _COMPLETION_DAEMON_H_
+
+
+
+/*
+   DAEMON MODE: one server process serves many source files, it listens on a
+   unix domain socket and keeps a table of completion sessions keyed by file
+   path and compile flags, all of them share a single CXIndex.
+
+   Every request sent to the daemon is framed with a header line:
+        [#session_id#] [#length#]
+        <# MESSAGE: [#length#] bytes #>
+
+   where MESSAGE is one of the messages described in msg_callback.h, with the
+   exception of two messages handled by the daemon itself. Responses are
+   framed as described in completion_output.h.
+
+   OPEN: Open the session of a source file, session_id should be 0. It's
+   shared with the clients which opened the same file with the same flags
+   (the ones of the compilation database included), a client with other
+   flags gets a session of its own.
+   Message format:
+        filename:[#path#]
+        num_args:[#n_args#]
+        arg1 arg2 ...... (there should be n_args items here)
+   Response:
+        SESSION:[#session_id#]
+
+   SHUTDOWN: Release the session, it is destroyed when all clients which opened
+   it have released it or disconnected.
+
+   Translation units of idle sessions are disposed in least recently used order
+   when the memory used by all translation units exceeds the memory budget,
+   their spare ones (see completion_dropSpareTranslationUnit) first. They are
+   rebuilt from the kept source buffer on the next request. Sessions
+   which have had no request for a while are hibernated as well, whatever the
+   memory used (see completion_hibernate). While no client has sent anything,
+   the daemon precomputes the completions around the cursor of the session
+   used last (see completion_speculate).
+
+   Requests are carried out one at a time, in the order the clients sent
+   them. Reparses and syntax checks run on the background worker (see
+   completion_scheduleReparse), but a completion holds up the requests of
+   every other client until it's done.
+*/
+
+
+/* Default memory budget of all translation units held by the daemon */
+#define  DEFAULT_DAEMON_MEMORY_BUDGET   (2048UL << 20)    /* 2GB */
+
+
+/* Listen on socket_path and serve requests until the process is killed,
+   returns nonzero if the socket could not be set up. memory_budget is in
+   bytes, 0 means unlimited. Sessions idle for hibernate_after milliseconds
+   are hibernated, 0 means never. */
+int completion_runDaemon(
+    const char *socket_path, unsigned long memory_budget, unsigned long hibernate_after);
+
+/* How often idle sessions are looked for (ms) */
+#define  DAEMON_IDLE_CHECK_INTERVAL   1000
+
+
+/*
+   ZYGOTE MODE: a fork server for the one-process-per-buffer setup. Starting
+   a server means loading libclang and LLVM, and parsing the same system
+   headers as every other server did. The zygote does that once: it loads
+   libclang, creates a CXIndex and precompiles a prelude of common headers
+   (see completion_precompilePrelude), then listens on a unix domain socket
+   and forks a child for every client that connects. The child starts with
+   everything the zygote has done, shared copy-on-write, parses over the PCH
+   of the prelude if its flags and headers fit, and serves its client as if
+   it was a server run with the arguments of the SPAWN message the client
+   starts with:
+
+   SPAWN: the arguments (after the program name) to run the server with
+   Message format:
+        SPAWN
+        num_args:[#n_args#]
+        arg1 arg2 ...... (there should be n_args items here)
+
+   Everything after it is read and answered as described in msg_callback.h,
+   until the client disconnects or sends SHUTDOWN.
+*/
+
+/* Listen on socket_path and fork a child for every client, the zygote
+   itself never returns unless the socket can't be set up (-1 then). Returns
+   the connection to the client in the children. */
+int completion_runZygote(const char *socket_path);
+
+
+
+#endif /* _COMPLETION_DAEMON_H_ */
@@ -0,0 +1,321 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "completion.h"
+
+
+/*
+   STRUCTURED DIAGNOSTICS: one diagnostic per line, fields separated by tabs,
+   tabs, newlines and backslashes in text escaped as \t, \n and \\.
+
+        DIAGNOSTICS:[#set_id#] [#base#]
+        DIAG  [#id#] [#severity#] [#file#] [#line#] [#column#] [#end_line#] [#end_column#] [#category#] [#option#] [#message#]
+        FIXIT [#id#] [#line#] [#column#] [#end_line#] [#end_column#] [#replacement#]
+        NOTE  [#id#] [#severity#] [#file#] [#line#] [#column#] [#message#]
+        REMOVE [#id#]
+
+   FIXIT and NOTE lines belong to the DIAG before them. The set is a diff
+   against set [#base#]: diagnostics the client already has are not sent
+   again, and the ones which have gone are listed by REMOVE. If [#base#] is
+   0 the whole set is sent, and the client should forget what it had.
+
+   The id of a diagnostic is a hash of its severity, location and message,
+   so it's the same in every generation as long as the diagnostic stays.
+*/
+
+
+/* A diagnostic of the set being sent */
+typedef struct __diagnostics_Entry_struct
+{
+    unsigned long id;
+    unsigned      index;    /* in the translation unit */
+
+} diagnostics_Entry;
+
+
+static const char *__severity_names[] = {
+    "ignored", "note", "warning", "error", "fatal"
+};
+
+
+
+static int __compare_entries(const void *a, const void *b)
+{
+    unsigned long left = ((const diagnostics_Entry*)a)->id;
+    unsigned long right = ((const diagnostics_Entry*)b)->id;
+    return (left < right) ? -1 : (left > right);
+}
+
+static int __contains_id(const unsigned long *ids, size_t n_ids, unsigned long id)
+{
+    size_t low = 0, high = n_ids, middle;
+
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (ids[middle] == id) {
+            return 1;
+        }
+        if (ids[middle] < id) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    return 0;
+}
+
+
+/* Append a tab followed by text, escaped */
+static void __append_field(completion_Output *out, const char *text)
+{
+    completion_appendOutput(out, "\t", 1);
+
+    for ( ; *text != '\0'; text++)
+    {
+        if (*text == '\t') {
+            completion_appendOutput(out, "\\t", 2);
+        }
+        else if (*text == '\n') {
+            completion_appendOutput(out, "\\n", 2);
+        }
+        else if (*text == '\\') {
+            completion_appendOutput(out, "\\\\", 2);
+        }
+        else {
+            completion_appendOutput(out, text, 1);
+        }
+    }
+}
+
+/* Append a tab and a CXString, which is disposed */
+static void __append_string_field(completion_Output *out, CXString string)
+{
+    __append_field(out, clang_getCString(string));
+    clang_disposeString(string);
+}
+
+/* Append the file (optionally), line and column of location */
+static void __append_location(
+    completion_Output *out, CXSourceLocation location, int with_file)
+{
+    CXFile   file;
+    unsigned line, column;
+
+    clang_getExpansionLocation(location, &file, &line, &column, NULL);
+    if (with_file) {
+        __append_string_field(out, clang_getFileName(file));
+    }
+    completion_printOutput(out, "\t%u\t%u", line, column);
+}
+
+static const char *__severity_name(enum CXDiagnosticSeverity severity)
+{
+    return ((unsigned)severity <= CXDiagnostic_Fatal) ? __severity_names[severity] : "error";
+}
+
+
+/* Nonzero if diag is out of the line range of options, only diagnostics of
+   the main file are filtered */
+static int __is_filtered_out(CXDiagnostic diag, const completion_DiagnosticsOptions *options)
+{
+    CXSourceLocation location = clang_getDiagnosticLocation(diag);
+    unsigned line;
+
+    if (options->first_line <= 0 && options->last_line <= 0) {
+        return 0;
+    }
+    if (!clang_Location_isFromMainFile(location)) {
+        return 0;
+    }
+
+    clang_getExpansionLocation(location, NULL, &line, NULL, NULL);
+    return (options->first_line > 0 && line < (unsigned)options->first_line) ||
+           (options->last_line > 0 && line > (unsigned)options->last_line);
+}
+
+/* Id of diag: hash of its severity, location and message */
+static unsigned long __diagnostic_id(CXDiagnostic diag, completion_Output *scratch)
+{
+    completion_resetOutput(scratch);
+    completion_printOutput(scratch, "%d", (int)clang_getDiagnosticSeverity(diag));
+    __append_location(scratch, clang_getDiagnosticLocation(diag), 1);
+    __append_string_field(scratch, clang_getDiagnosticSpelling(diag));
+
+    return completion_hashBytes(scratch->data, scratch->length);
+}
+
+/* Print the DIAG line of diag, and its FIXIT and NOTE lines */
+static void __print_diagnostic(completion_Output *out, CXDiagnostic diag, unsigned long id)
+{
+    CXSourceLocation location = clang_getDiagnosticLocation(diag);
+    CXSourceRange    range;
+    CXDiagnosticSet  children;
+    CXDiagnostic     child;
+    CXString         disabled;
+    unsigned i_fixit = 0, n_fixits = clang_getDiagnosticNumFixIts(diag), i_child = 0;
+    unsigned line, column;
+
+    /* DIAG id severity file line column end_line end_column category option message */
+    completion_printOutput(out, "DIAG\t%016lx", id);
+    __append_field(out, __severity_name(clang_getDiagnosticSeverity(diag)));
+    __append_location(out, location, 1);
+    if (clang_getDiagnosticNumRanges(diag) > 0) {
+        __append_location(out, clang_getRangeEnd(clang_getDiagnosticRange(diag, 0)), 0);
+    }
+    else
+    {
+        clang_getExpansionLocation(location, NULL, &line, &column, NULL);
+        completion_printOutput(out, "\t%u\t%u", line, column);
+    }
+    __append_string_field(out, clang_getDiagnosticCategoryText(diag));
+    __append_string_field(out, clang_getDiagnosticOption(diag, &disabled));
+    clang_disposeString(disabled);
+    __append_string_field(out, clang_getDiagnosticSpelling(diag));
+    completion_appendOutput(out, "\n", 1);
+
+    /* FIXIT id line column end_line end_column replacement */
+    for ( ; i_fixit < n_fixits; i_fixit++)
+    {
+        CXString replacement = clang_getDiagnosticFixIt(diag, i_fixit, &range);
+
+        completion_printOutput(out, "FIXIT\t%016lx", id);
+        __append_location(out, clang_getRangeStart(range), 0);
+        __append_location(out, clang_getRangeEnd(range), 0);
+        __append_string_field(out, replacement);
+        completion_appendOutput(out, "\n", 1);
+    }
+
+    /* NOTE id severity file line column message */
+    children = clang_getChildDiagnostics(diag);
+    for ( ; children != NULL && i_child < clang_getNumDiagnosticsInSet(children); i_child++)
+    {
+        child = clang_getDiagnosticInSet(children, i_child);
+
+        completion_printOutput(out, "NOTE\t%016lx", id);
+        __append_field(out, __severity_name(clang_getDiagnosticSeverity(child)));
+        __append_location(out, clang_getDiagnosticLocation(child), 1);
+        __append_string_field(out, clang_getDiagnosticSpelling(child));
+        completion_appendOutput(out, "\n", 1);
+
+        clang_disposeDiagnostic(child);
+    }
+}
+
+
+/* Print the diagnostics of tu in the line range as they are formatted by
+   clang */
+static void __print_formatted_diagnostics(
+    CXTranslationUnit tu, const completion_DiagnosticsOptions *options,
+    completion_Output *out)
+{
+    unsigned i_diag = 0, n_diags = clang_getNumDiagnostics(tu);
+    CXDiagnostic diag;
+    CXString     dmsg;
+
+    for ( ; i_diag < n_diags; i_diag++)
+    {
+        diag = clang_getDiagnostic(tu, i_diag);
+        if (!__is_filtered_out(diag, options))
+        {
+            dmsg = clang_formatDiagnostic(diag, clang_defaultDiagnosticDisplayOptions());
+            completion_appendString(out, clang_getCString(dmsg));
+            completion_appendOutput(out, "\n", 1);
+            clang_disposeString(dmsg);
+        }
+        clang_disposeDiagnostic(diag);
+    }
+}
+
+/* Print the structured diagnostics of tu in the line range, as a diff against
+   the last set sent if the client has got it */
+static void __print_structured_diagnostics(
+    completion_Session *session, CXTranslationUnit tu,
+    const completion_DiagnosticsOptions *options, completion_Output *out)
+{
+    unsigned i_diag = 0, n_diags = clang_getNumDiagnostics(tu);
+    diagnostics_Entry *entries =
+        (diagnostics_Entry*)malloc((n_diags + 1) * sizeof(diagnostics_Entry));
+    completion_Output scratch = { NULL, 0, 0 };
+    size_t n_entries = 0, i_entry = 0, n_unique = 0;
+    unsigned long base = 0;
+    CXDiagnostic diag;
+
+    for ( ; i_diag < n_diags; i_diag++)
+    {
+        diag = clang_getDiagnostic(tu, i_diag);
+        if (!__is_filtered_out(diag, options))
+        {
+            entries[n_entries].id = __diagnostic_id(diag, &scratch);
+            entries[n_entries].index = i_diag;
+            n_entries++;
+        }
+        clang_disposeDiagnostic(diag);
+    }
+
+    /* identical diagnostics (from a header included twice, say) are sent once */
+    qsort(entries, n_entries, sizeof(diagnostics_Entry), __compare_entries);
+    for ( ; i_entry < n_entries; i_entry++)
+    {
+        if (n_unique == 0 || entries[n_unique - 1].id != entries[i_entry].id) {
+            entries[n_unique++] = entries[i_entry];
+        }
+    }
+
+    if (options->base != 0 && options->base == session->diag_set_id) {
+        base = options->base;    /* the client has the last set */
+    }
+    else {
+        session->n_diag_ids = 0;
+    }
+
+    completion_printOutput(out, "DIAGNOSTICS:%lu %lu\n", session->diag_set_id + 1, base);
+
+    for (i_entry = 0; i_entry < n_unique; i_entry++)
+    {
+        if (__contains_id(session->diag_ids, session->n_diag_ids, entries[i_entry].id)) {
+            continue;    /* the client has it already */
+        }
+
+        diag = clang_getDiagnostic(tu, entries[i_entry].index);
+        __print_diagnostic(out, diag, entries[i_entry].id);
+        clang_disposeDiagnostic(diag);
+    }
+
+    /* the ones which have gone */
+    for (i_entry = 0; i_entry < session->n_diag_ids; i_entry++)
+    {
+        diagnostics_Entry key;
+        key.id = session->diag_ids[i_entry];
+        if (bsearch(&key, entries, n_unique, sizeof(diagnostics_Entry), __compare_entries) == NULL) {
+            completion_printOutput(out, "REMOVE\t%016lx\n", session->diag_ids[i_entry]);
+        }
+    }
+
+    /* remember this set for the next diff */
+    session->diag_ids = (unsigned long*)realloc(
+        session->diag_ids, (n_unique + 1) * sizeof(unsigned long));
+    for (i_entry = 0; i_entry < n_unique; i_entry++) {
+        session->diag_ids[i_entry] = entries[i_entry].id;
+    }
+    session->n_diag_ids = n_unique;
+    session->diag_set_id++;
+
+    completion_freeOutput(&scratch);
+    free(entries);
+}
+
+/* Print the diagnostics of tu to out, as asked for by options */
+void completion_printRequestedDiagnostics(
+    completion_Session *session, CXTranslationUnit tu,
+    const completion_DiagnosticsOptions *options, completion_Output *out)
+{
+    if (options->structured) {
+        __print_structured_diagnostics(session, tu, options, out);
+    }
+    else {
+        __print_formatted_diagnostics(tu, options, out);
+    }
+}
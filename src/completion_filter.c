@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "completion_filter.h"
+
+
+/* Ranking penalties of candidates which are not readily usable, they're added
+   to the completion priority (where lower is better) */
+#define  DEPRECATED_PENALTY       20
+#define  NOT_ACCESSIBLE_PENALTY   40
+
+
+
+/* Append the TypedText chunk of completion_string to the arena of table, and
+   return its offset. Candidates without TypedText get an empty string. */
+static unsigned __append_typed_text(
+    completion_CandidateTable *table, CXCompletionString completion_string,
+    unsigned *length)
+{
+    unsigned i_chunk  = 0;
+    unsigned n_chunks = clang_getNumCompletionChunks(completion_string);
+    unsigned offset   = (unsigned)table->arena_size;
+    const char *text  = "";
+    CXString ac_string;
+    int found = 0;
+
+    for ( ; i_chunk < n_chunks; i_chunk++)
+    {
+        if (clang_getCompletionChunkKind(completion_string, i_chunk) 
+            == CXCompletionChunk_TypedText)
+        {
+            ac_string = clang_getCompletionChunkText(completion_string, i_chunk);
+            text = clang_getCString(ac_string);
+            found = 1;
+            break;
+        }
+    }
+
+    *length = (unsigned)strlen(text);
+    if (table->arena_size + *length + 1 > table->arena_capacity)
+    {
+        /* expand the arena (and its folded copy) two-fold */
+        table->arena_capacity = (table->arena_size + *length + 1) * 2;
+        table->arena  = (char*)realloc(table->arena,  table->arena_capacity);
+        table->folded = (char*)realloc(table->folded, table->arena_capacity);
+    }
+
+    memcpy(table->arena + offset, text, *length + 1);
+    table->arena_size += *length + 1;
+
+    if (found) {
+        clang_disposeString(ac_string);
+    }
+    return offset;
+}
+
+/* Build the candidate table of res, the table doesn't take ownership of res */
+void completion_buildCandidateTable(
+    completion_CandidateTable *table, CXCodeCompleteResults *res)
+{
+    unsigned i = 0;
+    size_t i_byte = 0;
+    CXCompletionString completion_string;
+
+    table->results        = res;
+    table->n_candidates   = res->NumResults;
+    table->candidates     = 
+        (completion_Candidate*)calloc(res->NumResults + 1, sizeof(completion_Candidate));
+    table->arena_size     = 0;
+    table->arena_capacity = 16 * (res->NumResults + 1);  /* a fair guess */
+    table->arena          = (char*)malloc(table->arena_capacity);
+    table->folded         = (char*)malloc(table->arena_capacity);
+
+    for ( ; i < res->NumResults; i++)
+    {
+        completion_string = res->Results[i].CompletionString;
+
+        table->candidates[i].text_offset = 
+            __append_typed_text(table, completion_string, 
+                &table->candidates[i].text_length);
+        table->candidates[i].priority = 
+            clang_getCompletionPriority(completion_string);
+        table->candidates[i].availability = 
+            clang_getCompletionAvailability(completion_string);
+    }
+
+    /* fold the whole arena at once for case-insensitive matching */
+    for ( ; i_byte < table->arena_size; i_byte++) {
+        table->folded[i_byte] = (char)tolower((unsigned char)table->arena[i_byte]);
+    }
+}
+
+/* Release memory held by the candidate table */
+void completion_freeCandidateTable(completion_CandidateTable *table)
+{
+    free(table->candidates);
+    free(table->arena);
+    free(table->folded);
+
+    table->candidates   = NULL;
+    table->arena        = table->folded = NULL;
+    table->n_candidates = 0;
+    table->arena_size   = table->arena_capacity = 0;
+}
+
+/* Return the TypedText of the i-th candidate */
+const char *completion_candidateText(
+    const completion_CandidateTable *table, unsigned i)
+{
+    return table->arena + table->candidates[i].text_offset;
+}
+
+
+/* Match folded_prefix as a subsequence of folded_text. Returns the number of
+   skipped characters between the first and the last matched ones, or -1 if
+   folded_prefix is not a subsequence of folded_text. */
+static int __fuzzy_match(const char *folded_text, const char *folded_prefix)
+{
+    int gaps = 0, started = 0;
+
+    for ( ; *folded_text != '\0' && *folded_prefix != '\0'; folded_text++)
+    {
+        if (*folded_text == *folded_prefix) {
+            started = 1;
+            folded_prefix++;
+        }
+        else if (started) {
+            gaps++;
+        }
+    }
+
+    return (*folded_prefix == '\0') ? gaps : -1;
+}
+
+/* Order of matches: better tier first, then fewer gaps, then lower rank, then
+   alphabetically */
+static int __compare_match(const void *lhs, const void *rhs)
+{
+    const completion_Match *a = (const completion_Match*)lhs;
+    const completion_Match *b = (const completion_Match*)rhs;
+    int by_text;
+
+    if (a->tier != b->tier) return a->tier < b->tier ? -1 : 1;
+    if (a->gaps != b->gaps) return a->gaps < b->gaps ? -1 : 1;
+    if (a->rank != b->rank) return a->rank < b->rank ? -1 : 1;
+
+    if ((by_text = strcmp(a->text, b->text)) != 0) return by_text;
+    return a->index < b->index ? -1 : (a->index > b->index);
+}
+
+/* Group candidates with the same TypedText together, keeping the rank order
+   within the same name */
+static int __compare_match_by_text(const void *lhs, const void *rhs)
+{
+    const completion_Match *a = (const completion_Match*)lhs;
+    const completion_Match *b = (const completion_Match*)rhs;
+    int by_text = strcmp(a->text, b->text);
+
+    if (by_text != 0) return by_text;
+    return a->group < b->group ? -1 : (a->group > b->group);
+}
+
+/* Order by the best position of a name, then by rank within the name */
+static int __compare_match_by_group(const void *lhs, const void *rhs)
+{
+    const completion_Match *a = (const completion_Match*)lhs;
+    const completion_Match *b = (const completion_Match*)rhs;
+
+    if (a->group != b->group) return a->group < b->group ? -1 : 1;
+    return __compare_match(lhs, rhs);
+}
+
+
+/* Restore the max-heap property (the worst match on top) of heap[0..n) from
+   position i downwards */
+static void __sift_down(completion_Match *heap, unsigned n, unsigned i)
+{
+    completion_Match tmp;
+    unsigned worst, child;
+
+    for ( ; ; i = worst)
+    {
+        worst = i;
+        child = 2 * i + 1;
+        if (child < n && __compare_match(&heap[child], &heap[worst]) > 0) {
+            worst = child;
+        }
+        if (child + 1 < n && __compare_match(&heap[child + 1], &heap[worst]) > 0) {
+            worst = child + 1;
+        }
+        if (worst == i) {
+            return;
+        }
+
+        tmp = heap[i]; heap[i] = heap[worst]; heap[worst] = tmp;
+    }
+}
+
+/* Restore the max-heap property of heap[0..i] from position i upwards */
+static void __sift_up(completion_Match *heap, unsigned i)
+{
+    completion_Match tmp;
+    unsigned parent;
+
+    for ( ; i > 0; i = parent)
+    {
+        parent = (i - 1) / 2;
+        if (__compare_match(&heap[i], &heap[parent]) <= 0) {
+            return;
+        }
+
+        tmp = heap[i]; heap[i] = heap[parent]; heap[parent] = tmp;
+    }
+}
+
+/* Score candidate i against prefix, return 0 and fill match if it passed */
+static int __match_candidate(
+    const completion_CandidateTable *table, unsigned i,
+    const char *prefix, const char *folded_prefix, size_t prefix_length,
+    completion_Match *match)
+{
+    const completion_Candidate *candidate = &table->candidates[i];
+    const char *text        = table->arena  + candidate->text_offset;
+    const char *folded_text = table->folded + candidate->text_offset;
+    int gaps = 0;
+
+    if (candidate->availability == CXAvailability_NotAvailable ||
+        candidate->text_length == 0) {
+        return -1;
+    }
+
+    if (candidate->text_length >= prefix_length &&
+        memcmp(text, prefix, prefix_length) == 0) {
+        match->tier = 0;
+    }
+    else if (candidate->text_length >= prefix_length &&
+             memcmp(folded_text, folded_prefix, prefix_length) == 0) {
+        match->tier = 1;
+    }
+    else if ((gaps = __fuzzy_match(folded_text, folded_prefix)) >= 0) {
+        match->tier = 2;
+    }
+    else {
+        return -1;
+    }
+
+    match->index = i;
+    match->text  = text;
+    match->gaps  = (unsigned)gaps;
+    match->rank  = candidate->priority;
+    match->group = 0;
+
+    if (candidate->availability == CXAvailability_Deprecated) {
+        match->rank += DEPRECATED_PENALTY;
+    }
+    else if (candidate->availability == CXAvailability_NotAccessible) {
+        match->rank += NOT_ACCESSIBLE_PENALTY;
+    }
+    return 0;
+}
+
+/* Keep the candidates with the same TypedText next to each other, in the
+   position of the best of them */
+static void __group_overloads(completion_Match *matches, unsigned n_matches)
+{
+    unsigned i = 0, first = 0;
+
+    for ( ; i < n_matches; i++) {
+        matches[i].group = i;
+    }
+
+    qsort(matches, n_matches, sizeof(completion_Match), __compare_match_by_text);
+    for (i = 1; i < n_matches; i++)
+    {
+        if (strcmp(matches[i].text, matches[first].text) == 0) {
+            matches[i].group = matches[first].group;
+        }
+        else {
+            first = i;
+        }
+    }
+    qsort(matches, n_matches, sizeof(completion_Match), __compare_match_by_group);
+}
+
+/* Filter the candidates by prefix, rank them and keep the best limit of them */
+unsigned completion_filterCandidates(
+    const completion_CandidateTable *table, const char *prefix,
+    unsigned limit, completion_Match *matches)
+{
+    size_t   prefix_length = strlen(prefix), i_char = 0;
+    char    *folded_prefix = (char*)malloc(prefix_length + 1);
+    unsigned i = 0, n_matches = 0;
+    completion_Match match;
+
+    for ( ; i_char <= prefix_length; i_char++) {
+        folded_prefix[i_char] = (char)tolower((unsigned char)prefix[i_char]);
+    }
+
+    if (limit == 0 || limit > table->n_candidates) {
+        limit = table->n_candidates;
+    }
+
+    /* keep the best limit matches in a max-heap, so that the worst of them
+       could be replaced in O(log(limit)) */
+    for ( ; i < table->n_candidates; i++)
+    {
+        if (__match_candidate(table, i, prefix, folded_prefix, prefix_length, &match) != 0) {
+            continue;
+        }
+
+        if (n_matches < limit) {
+            matches[n_matches] = match;
+            __sift_up(matches, n_matches++);
+        }
+        else if (__compare_match(&match, &matches[0]) < 0) {
+            matches[0] = match;
+            __sift_down(matches, n_matches, 0);
+        }
+    }
+
+    free(folded_prefix);
+
+    qsort(matches, n_matches, sizeof(completion_Match), __compare_match);
+    __group_overloads(matches, n_matches);
+    return n_matches;
+}
@@ -0,0 +1,75 @@
+#ifndef _COMPLETION_FILTER_H_
+#define _COMPLETION_FILTER_H_
+
+
+#include <stddef.h>
+#include <clang-c/Index.h>
+
+
+/* Everything the filter needs to know about a completion candidate, its
+   TypedText lives in the arena of the candidate table. */
+typedef struct __completion_Candidate_struct
+{
+    unsigned text_offset;     /* offset of the TypedText in arena and folded */
+    unsigned text_length;     /* length of the TypedText */
+    unsigned priority;        /* clang_getCompletionPriority(), lower is better */
+    unsigned availability;    /* enum CXAvailabilityKind */
+
+} completion_Candidate;
+
+/* Flat table of the TypedText strings of a completion result set. It is built
+   once per CXCodeCompleteResults so the candidates could be filtered (again
+   and again) without calling back into libclang. */
+typedef struct __completion_CandidateTable_struct
+{
+    CXCodeCompleteResults *results;   /* result set this table is built from */
+
+    completion_Candidate *candidates; /* candidates[i] describes Results[i] */
+    unsigned n_candidates;
+
+    char   *arena;          /* TypedTexts, each one terminated by '\0' */
+    char   *folded;         /* lower-cased copy of arena */
+    size_t  arena_size;     /* bytes used in arena */
+    size_t  arena_capacity; /* bytes allocated for arena and folded */
+
+} completion_CandidateTable;
+
+/* A candidate that passed the filter, and how well it matched */
+typedef struct __completion_Match_struct
+{
+    unsigned index;     /* index into table->candidates and res->Results */
+    const char *text;   /* TypedText of the candidate */
+    unsigned tier;      /* 0: exact prefix, 1: case-insensitive prefix, 2: fuzzy */
+    unsigned gaps;      /* characters skipped by a fuzzy match */
+    unsigned rank;      /* priority adjusted by availability */
+    unsigned group;     /* best position among candidates with the same name */
+
+} completion_Match;
+
+
+/* Build the candidate table of res, the table doesn't take ownership of res */
+void completion_buildCandidateTable(
+    completion_CandidateTable *table, CXCodeCompleteResults *res);
+
+/* Release memory held by the candidate table */
+void completion_freeCandidateTable(completion_CandidateTable *table);
+
+/* Return the TypedText of the i-th candidate */
+const char *completion_candidateText(
+    const completion_CandidateTable *table, unsigned i);
+
+
+/* Filter the candidates by prefix (exact, case-insensitive or subsequence
+   match), rank them and keep the best limit of them (limit 0 means no
+   limit). matches should have room for table->n_candidates entries, the
+   number of matches stored in it is returned.
+
+   Matches are ordered by rank, except that candidates sharing the same
+   TypedText (overloads) are kept next to each other. */
+unsigned completion_filterCandidates(
+    const completion_CandidateTable *table, const char *prefix,
+    unsigned limit, completion_Match *matches);
+
+
+
+#endif /* _COMPLETION_FILTER_H_ */
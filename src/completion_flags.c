@@ -0,0 +1,360 @@
+#include <clang-c/CXCompilationDatabase.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "completion.h"
+#include "completion_flags.h"
+
+
+/* Flags of a file in the compilation database */
+typedef struct __flags_Entry_struct
+{
+    char   *path;         /* canonical path of the file, NULL if the slot is free */
+    int     num_flags;
+    char  **flags;        /* canonical flags, compiler and output options stripped */
+
+} flags_Entry;
+
+/* The compilation database, indexed by path (open addressing) */
+static flags_Entry *__entries = NULL;
+static size_t       __capacity = 0;    /* a power of 2 */
+static size_t       __n_entries = 0;
+
+
+/* Options whose value is a path, made absolute if it's relative */
+static const char *__path_options[] = {
+    "-I", "-F", "-isystem", "-iquote", "-idirafter", "-include", "-isysroot", NULL
+};
+
+/* Options whose value is joined to them in canonical form */
+static const char *__joined_options[] = { "-I", "-F", "-D", "-U", NULL };
+
+/* Options of a compile command which don't matter to us, followed by a value */
+static const char *__dropped_options[] = { "-o", "-MF", "-MT", "-MQ", NULL };
+
+
+
+static int __is_one_of(const char *arg, const char **options)
+{
+    for ( ; *options != NULL; options++)
+    {
+        if (strcmp(arg, *options) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* path made absolute relative to directory (NULL leaves it alone), malloc'd */
+static char *__absolute_path(const char *path, const char *directory)
+{
+    size_t size;
+    char  *absolute;
+
+    if (directory == NULL || path[0] == '/') {
+        return strdup(path);
+    }
+
+    size = strlen(directory) + strlen(path) + 2;
+    absolute = (char*)malloc(size);
+    snprintf(absolute, size, "%s/%s", directory, path);
+    return absolute;
+}
+
+/* Canonical path of filename (malloc'd), the file may not exist */
+static char *__canonical_path(const char *filename, const char *directory)
+{
+    char  resolved[PATH_MAX];
+    char *path = __absolute_path(filename, directory);
+
+    if (realpath(path, resolved) != NULL)
+    {
+        free(path);
+        path = strdup(resolved);
+    }
+
+    return path;
+}
+
+/* Concatenation of option and value (malloc'd) */
+static char *__join(const char *option, const char *value)
+{
+    size_t size = strlen(option) + strlen(value) + 1;
+    char  *joined = (char*)malloc(size);
+
+    snprintf(joined, size, "%s%s", option, value);
+    return joined;
+}
+
+/* Append the canonical form of num_args args to flags (which has room for
+   all of them), relative paths are resolved against directory */
+static int __canonicalize(
+    int num_args, char **args, const char *directory, char **flags, int num_flags)
+{
+    int  i_arg = 0;
+    char *value;
+    const char **option;
+
+    for ( ; i_arg < num_args; i_arg++)
+    {
+        if (args[i_arg] == NULL || args[i_arg][0] == '\0') {
+            continue;
+        }
+
+        /* separate value */
+        if ((__is_one_of(args[i_arg], __path_options) ||
+             __is_one_of(args[i_arg], __joined_options)) && i_arg + 1 < num_args)
+        {
+            value = __is_one_of(args[i_arg], __path_options) ?
+                __absolute_path(args[i_arg + 1], directory) : strdup(args[i_arg + 1]);
+
+            if (__is_one_of(args[i_arg], __joined_options))
+            {
+                flags[num_flags++] = __join(args[i_arg], value);
+                free(value);
+            }
+            else
+            {
+                flags[num_flags++] = strdup(args[i_arg]);
+                flags[num_flags++] = value;
+            }
+
+            i_arg++;
+            continue;
+        }
+
+        /* joined path value, as in -Idir */
+        for (option = __joined_options; *option != NULL; option++)
+        {
+            if (strncmp(args[i_arg], *option, strlen(*option)) == 0 &&
+                __is_one_of(*option, __path_options)) {
+                break;
+            }
+        }
+
+        if (*option != NULL)
+        {
+            value = __absolute_path(args[i_arg] + strlen(*option), directory);
+            flags[num_flags++] = __join(*option, value);
+            free(value);
+        }
+        else {
+            flags[num_flags++] = strdup(args[i_arg]);
+        }
+    }
+
+    return num_flags;
+}
+
+
+/* Slot of path in the index, either its entry or the free slot it would take */
+static flags_Entry *__find_slot(const char *path)
+{
+    size_t i_slot = completion_hashBytes(path, strlen(path)) & (__capacity - 1);
+
+    while (__entries[i_slot].path != NULL && strcmp(__entries[i_slot].path, path) != 0) {
+        i_slot = (i_slot + 1) & (__capacity - 1);
+    }
+
+    return &__entries[i_slot];
+}
+
+/* Index the flags of the file compiled by command */
+static void __add_command(CXCompileCommand command)
+{
+    CXString directory = clang_CompileCommand_getDirectory(command);
+    CXString filename = clang_CompileCommand_getFilename(command);
+    unsigned i_arg = 1, n_args = clang_CompileCommand_getNumArgs(command);
+    char   **args = (char**)calloc(sizeof(char*), n_args + 1), *path, *arg_path;
+    int      n_kept = 0;
+    flags_Entry *entry;
+    CXString arg;
+
+    path = __canonical_path(clang_getCString(filename), clang_getCString(directory));
+
+    /* args[0] is the compiler, and the file itself isn't a flag */
+    for ( ; i_arg < n_args; i_arg++)
+    {
+        arg = clang_CompileCommand_getArg(command, i_arg);
+        arg_path = __absolute_path(clang_getCString(arg), clang_getCString(directory));
+
+        if (__is_one_of(clang_getCString(arg), __dropped_options)) {
+            i_arg++;
+        }
+        else if (strcmp(clang_getCString(arg), "-c") != 0 &&
+                 strcmp(clang_getCString(arg), clang_getCString(filename)) != 0 &&
+                 strcmp(arg_path, path) != 0) {
+            args[n_kept++] = strdup(clang_getCString(arg));
+        }
+
+        free(arg_path);
+        clang_disposeString(arg);
+    }
+
+    entry = __find_slot(path);
+    if (entry->path == NULL)    /* the first command of a file wins */
+    {
+        entry->path = path;
+        entry->flags = (char**)calloc(sizeof(char*), n_kept + 1);
+        entry->num_flags = __canonicalize(
+            n_kept, args, clang_getCString(directory), entry->flags, 0);
+        __n_entries++;
+    }
+    else {
+        free(path);
+    }
+
+    while (n_kept > 0) {
+        free(args[--n_kept]);
+    }
+    free(args);
+    clang_disposeString(filename);
+    clang_disposeString(directory);
+}
+
+/* Load compile_commands.json in directory */
+int completion_loadCompilationDatabase(const char *directory)
+{
+    CXCompilationDatabase_Error error;
+    CXCompilationDatabase database;
+    CXCompileCommands commands;
+    unsigned i_command = 0, n_commands;
+    char path[PATH_MAX];
+
+    /* libclang would complain on stderr, which could be mixed into the
+       responses of the session */
+    snprintf(path, sizeof(path), "%s/compile_commands.json", directory);
+    if (access(path, R_OK) != 0) {
+        return -1;
+    }
+
+    database = clang_CompilationDatabase_fromDirectory(directory, &error);
+    if (database == NULL || error != CXCompilationDatabase_NoError) {
+        return -1;
+    }
+
+    commands = clang_CompilationDatabase_getAllCompileCommands(database);
+    n_commands = clang_CompileCommands_getSize(commands);
+
+    /* at most half full */
+    for (__capacity = 16; __capacity < (size_t)n_commands * 2; __capacity *= 2) {
+        ;
+    }
+    __entries = (flags_Entry*)calloc(sizeof(flags_Entry), __capacity);
+
+    for ( ; i_command < n_commands; i_command++) {
+        __add_command(clang_CompileCommands_getCommand(commands, i_command));
+    }
+
+    clang_CompileCommands_dispose(commands);
+    clang_CompilationDatabase_dispose(database);
+    return 0;
+}
+
+/* Number of leading bytes of the directories of left and right in common */
+static size_t __common_directory(const char *left, const char *right)
+{
+    size_t i_byte = 0, common = 0;
+
+    for ( ; left[i_byte] != '\0' && left[i_byte] == right[i_byte]; i_byte++)
+    {
+        if (left[i_byte] == '/') {
+            common = i_byte + 1;
+        }
+    }
+
+    return common;
+}
+
+/* Entry of the compilation database for path, or of its closest neighbor */
+static flags_Entry *__lookup(const char *path)
+{
+    flags_Entry *entry, *closest = NULL;
+    size_t i_slot = 0, common, closest_common = 0;
+
+    if (__n_entries == 0) {
+        return NULL;
+    }
+
+    if ((entry = __find_slot(path))->path != NULL) {
+        return entry;
+    }
+
+    /* headers are not in the database, they probably share the flags of the
+       sources next to them */
+    for ( ; i_slot < __capacity; i_slot++)
+    {
+        if (__entries[i_slot].path == NULL) {
+            continue;
+        }
+
+        common = __common_directory(__entries[i_slot].path, path);
+        if (common > closest_common)
+        {
+            closest = &__entries[i_slot];
+            closest_common = common;
+        }
+    }
+
+    return closest;
+}
+
+/* Build the flags to parse filename with */
+int completion_buildCompileFlags(
+    const char *filename, int num_args, char **args, char ***flags)
+{
+    char *path = __canonical_path(filename, NULL);
+    flags_Entry *entry = __lookup(path);
+    int   num_flags = 0, i_flag = 0, num_entry_flags = (entry != NULL) ? entry->num_flags : 0;
+
+    /* joining values never makes a vector longer */
+    *flags = (char**)calloc(sizeof(char*), num_entry_flags + num_args + 1);
+
+    for ( ; i_flag < num_entry_flags; i_flag++) {
+        (*flags)[num_flags++] = strdup(entry->flags[i_flag]);
+    }
+    num_flags = __canonicalize(num_args, args, NULL, *flags, num_flags);
+
+    free(path);
+    return num_flags;
+}
+
+/* Canonical paths of the files in the compilation database */
+int completion_getCompiledFiles(const char ***paths)
+{
+    size_t i_slot = 0;
+    int    n_paths = 0;
+
+    *paths = (const char**)calloc(sizeof(char*), __n_entries + 1);
+    for ( ; i_slot < __capacity; i_slot++)
+    {
+        if (__entries[i_slot].path != NULL) {
+            (*paths)[n_paths++] = __entries[i_slot].path;
+        }
+    }
+
+    return n_paths;
+}
+
+/* Nonzero if two canonical flag vectors are identical */
+int completion_sameFlags(int num_left, char **left, int num_right, char **right)
+{
+    int i_flag = 0;
+
+    if (num_left != num_right) {
+        return 0;
+    }
+
+    for ( ; i_flag < num_left; i_flag++)
+    {
+        if (strcmp(left[i_flag], right[i_flag]) != 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
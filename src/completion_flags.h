@@ -0,0 +1,41 @@
+#ifndef _COMPLETION_FLAGS_H_
+#define _COMPLETION_FLAGS_H_
+
+
+
+/*
+   COMPILE FLAGS: flags given by the client are combined with the ones of the
+   source file in the compilation database (compile_commands.json), if one
+   has been loaded. The database is read once, and indexed by the canonical
+   path of each file.
+
+   Flags are canonicalized before they're used, so that vectors meaning the
+   same thing compare equal: separate option values are joined ("-I" "dir"
+   becomes "-Idir"), relative paths of the database are made absolute, and
+   empty arguments are dropped.
+*/
+
+
+/* Load compile_commands.json in directory and index the flags of every file
+   in it, returns nonzero if it can't be loaded */
+int completion_loadCompilationDatabase(const char *directory);
+
+/* Build the flags to parse filename with: its flags from the compilation
+   database (or the ones of the file sharing the longest directory with it,
+   for headers), followed by num_args client args. All of them are
+   canonicalized. The vector and its strings are malloc'd, and terminated by
+   NULL. Returns the number of flags. */
+int completion_buildCompileFlags(
+    const char *filename, int num_args, char **args, char ***flags);
+
+/* Canonical paths of the files in the compilation database, in no particular
+   order. The vector is malloc'd, its strings belong to the database. Returns
+   the number of files. */
+int completion_getCompiledFiles(const char ***paths);
+
+/* Nonzero if two canonical flag vectors are identical */
+int completion_sameFlags(int num_left, char **left, int num_right, char **right);
+
+
+
+#endif /* _COMPLETION_FLAGS_H_ */
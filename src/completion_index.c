@@ -0,0 +1,697 @@
+#include <clang-c/Index.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "completion.h"
+#include "completion_index.h"
+
+
+#define  INDEX_MAGIC     "CCSYMIDX"
+#define  INDEX_VERSION   1
+
+/* Head of the index file */
+typedef struct __index_Header_struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t n_symbols;
+    uint32_t strings_size;
+    uint32_t reserved;
+
+} index_Header;
+
+/* A symbol of the index file, strings are offsets in the string pool */
+typedef struct __index_Symbol_struct
+{
+    uint32_t name;
+    uint32_t usr;
+    uint32_t file;
+    uint32_t line;
+    uint32_t column;
+    uint16_t kind;             /* CXIdxEntityKind */
+    uint16_t is_definition;
+
+} index_Symbol;
+
+
+/* A declaration collected by an indexing thread */
+typedef struct __index_Entry_struct
+{
+    char    *usr;
+    char    *name;
+    char    *file;
+    unsigned line, column;
+    int      kind;
+    int      is_definition;
+
+} index_Entry;
+
+/* Declarations collected by an indexing thread, one per USR */
+typedef struct __index_Table_struct
+{
+    index_Entry *entries;
+    size_t       n_entries;
+    size_t       capacity;
+    size_t      *slots;        /* entry index + 1 by USR (open addressing), */
+    size_t       n_slots;      /* 0 for a free slot, n_slots is a power of 2 */
+
+} index_Table;
+
+/* Files waiting to be indexed by a thread: the thread takes them from the
+   bottom, the ones with nothing left to do steal them from the top */
+typedef struct __index_Deque_struct
+{
+    pthread_mutex_t lock;
+    const char    **files;
+    int             top, bottom;
+
+} index_Deque;
+
+/* An indexing thread */
+typedef struct __index_Worker_struct
+{
+    int            id;
+    int            n_workers;
+    index_Deque   *deques;     /* of all the threads */
+    index_Table    table;
+    pthread_t      thread;
+
+} index_Worker;
+
+
+static const char *__kind_names[] = {
+    "unexposed", "typedef", "function", "variable", "field", "enum_constant",
+    "objc_class", "objc_protocol", "objc_category", "objc_instance_method",
+    "objc_class_method", "objc_property", "objc_ivar", "enum", "struct", "union",
+    "class", "namespace", "namespace_alias", "static_variable", "static_method",
+    "method", "constructor", "destructor", "conversion_function", "type_alias",
+    "interface"
+};
+
+/* Progress of the indexing threads */
+static pthread_mutex_t __progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static int             __n_indexed = 0;
+static int             __n_files = 0;
+
+/* The index mapped by a server */
+static char          *__index_path = NULL;
+static const char    *__mapped = NULL;
+static size_t         __mapped_size = 0;
+static struct stat    __mapped_stat;
+static const index_Symbol *__symbols = NULL;
+static const uint32_t     *__by_usr = NULL;
+static const char         *__strings = NULL;
+static uint32_t            __n_symbols = 0;
+static uint32_t            __strings_size = 0;
+
+/* Entries being sorted by __compare_*, qsort has no context argument */
+static index_Entry **__sorted_entries = NULL;
+
+
+
+/* Slot of usr in table, either its entry or the free slot it would take */
+static size_t *__find_slot(index_Table *table, const char *usr)
+{
+    size_t i_slot = completion_hashBytes(usr, strlen(usr)) & (table->n_slots - 1);
+
+    while (table->slots[i_slot] != 0 &&
+           strcmp(table->entries[table->slots[i_slot] - 1].usr, usr) != 0) {
+        i_slot = (i_slot + 1) & (table->n_slots - 1);
+    }
+
+    return &table->slots[i_slot];
+}
+
+/* Double the slots of table, keeping it at most half full */
+static void __grow_slots(index_Table *table)
+{
+    size_t i_entry = 0;
+
+    free(table->slots);
+    table->n_slots = (table->n_slots == 0) ? 1024 : table->n_slots * 2;
+    table->slots = (size_t*)calloc(sizeof(size_t), table->n_slots);
+
+    for ( ; i_entry < table->n_entries; i_entry++) {
+        *__find_slot(table, table->entries[i_entry].usr) = i_entry + 1;
+    }
+}
+
+/* Add a declaration to table, the definition of a symbol replaces its
+   declarations */
+static void __add_entry(
+    index_Table *table, const char *usr, const char *name, const char *file,
+    unsigned line, unsigned column, int kind, int is_definition)
+{
+    index_Entry *entry;
+    size_t *slot;
+
+    if ((table->n_entries + 1) * 2 > table->n_slots) {
+        __grow_slots(table);
+    }
+
+    slot = __find_slot(table, usr);
+    if (*slot != 0)
+    {
+        entry = &table->entries[*slot - 1];
+        if (entry->is_definition || !is_definition) {
+            return;
+        }
+        free(entry->file);
+    }
+    else
+    {
+        if (table->n_entries == table->capacity)
+        {
+            table->capacity = (table->capacity == 0) ? 512 : table->capacity * 2;
+            table->entries = (index_Entry*)realloc(
+                table->entries, table->capacity * sizeof(index_Entry));
+        }
+
+        entry = &table->entries[table->n_entries++];
+        entry->usr = strdup(usr);
+        entry->name = strdup(name);
+        *slot = table->n_entries;
+    }
+
+    entry->file = strdup(file);
+    entry->line = line;
+    entry->column = column;
+    entry->kind = kind;
+    entry->is_definition = is_definition;
+}
+
+
+/* indexDeclaration callback of clang_indexSourceFile */
+static void __index_declaration(CXClientData client_data, const CXIdxDeclInfo *decl)
+{
+    index_Worker *worker = (index_Worker*)client_data;
+    const CXIdxEntityInfo *entity = decl->entityInfo;
+    CXFile   file;
+    unsigned line, column;
+    CXString filename;
+
+    /* anonymous and implicit declarations can't be looked up anyway */
+    if (entity == NULL || entity->name == NULL || entity->name[0] == '\0' ||
+        entity->USR == NULL || entity->USR[0] == '\0' || decl->isImplicit) {
+        return;
+    }
+
+    clang_indexLoc_getFileLocation(decl->loc, NULL, &file, &line, &column, NULL);
+    if (file == NULL) {
+        return;
+    }
+
+    filename = clang_getFileName(file);
+    __add_entry(&worker->table, entity->USR, entity->name, clang_getCString(filename),
+                line, column, (int)entity->kind, decl->isDefinition);
+    clang_disposeString(filename);
+}
+
+/* Index the declarations of the file at path */
+static void __index_file(index_Worker *worker, CXIndexAction action, const char *path)
+{
+    IndexerCallbacks callbacks;
+    char **flags;
+    int    num_flags = completion_buildCompileFlags(path, 0, NULL, &flags);
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.indexDeclaration = __index_declaration;
+
+    /* the bodies of the functions of a header are indexed once per thread,
+       local symbols are left out */
+    clang_indexSourceFile(
+        action, worker, &callbacks, sizeof(callbacks),
+        CXIndexOpt_SuppressWarnings | CXIndexOpt_SkipParsedBodiesInSession,
+        path, (const char *const *)flags, num_flags, NULL, 0, NULL,
+        CXTranslationUnit_SkipFunctionBodies);
+
+    while (num_flags > 0) {
+        free(flags[--num_flags]);
+    }
+    free(flags);
+
+    pthread_mutex_lock(&__progress_lock);
+    fprintf(stderr, "\rindexed %d/%d files", ++__n_indexed, __n_files);
+    pthread_mutex_unlock(&__progress_lock);
+}
+
+/* The next file for worker to index: the last one of its own deque, or the
+   first one of somebody else's. NULL when all of them are done. */
+static const char *__next_file(index_Worker *worker)
+{
+    const char  *path = NULL;
+    index_Deque *deque;
+    int i_victim = 0;
+
+    for ( ; i_victim < worker->n_workers && path == NULL; i_victim++)
+    {
+        deque = &worker->deques[(worker->id + i_victim) % worker->n_workers];
+
+        pthread_mutex_lock(&deque->lock);
+        if (deque->bottom > deque->top) {
+            path = (i_victim == 0) ? deque->files[--deque->bottom] : deque->files[deque->top++];
+        }
+        pthread_mutex_unlock(&deque->lock);
+    }
+
+    return path;
+}
+
+/* Indexing thread, every thread has its own CXIndex */
+static void *__index_files(void *arg)
+{
+    index_Worker *worker = (index_Worker*)arg;
+    CXIndex       cx_index = clang_createIndex(0, 0);
+    CXIndexAction action = clang_IndexAction_create(cx_index);
+    const char   *path;
+
+    while ((path = __next_file(worker)) != NULL) {
+        __index_file(worker, action, path);
+    }
+
+    clang_IndexAction_dispose(action);
+    clang_disposeIndex(cx_index);
+    return NULL;
+}
+
+
+static int __compare_by_usr(const void *a, const void *b)
+{
+    const index_Entry *left = *(index_Entry *const *)a, *right = *(index_Entry *const *)b;
+    int order = strcmp(left->usr, right->usr);
+
+    /* definitions first */
+    return (order != 0) ? order : right->is_definition - left->is_definition;
+}
+
+static int __compare_by_name(const void *a, const void *b)
+{
+    const index_Entry *left = *(index_Entry *const *)a, *right = *(index_Entry *const *)b;
+    int order = strcmp(left->name, right->name);
+
+    return (order != 0) ? order : strcmp(left->usr, right->usr);
+}
+
+/* Compare the USRs of two indexes of __sorted_entries */
+static int __compare_indexes_by_usr(const void *a, const void *b)
+{
+    return strcmp(__sorted_entries[*(const uint32_t*)a]->usr,
+                  __sorted_entries[*(const uint32_t*)b]->usr);
+}
+
+
+/* String pool of an index being written, identical strings (file names,
+   mostly) are stored once */
+typedef struct __index_Strings_struct
+{
+    char     *data;
+    size_t    size, capacity;
+    uint32_t *slots;           /* offset + 1 by string (open addressing) */
+    size_t    n_slots, n_strings;
+
+} index_Strings;
+
+/* Offset of string in pool, which is added if it's not there yet */
+static uint32_t __intern(index_Strings *pool, const char *string)
+{
+    size_t length = strlen(string) + 1, i_slot, i_old;
+    uint32_t *old_slots;
+
+    if ((pool->n_strings + 1) * 2 > pool->n_slots)
+    {
+        old_slots = pool->slots;
+        pool->slots = (uint32_t*)calloc(sizeof(uint32_t), pool->n_slots * 2);
+        for (i_old = 0; i_old < pool->n_slots; i_old++)
+        {
+            if (old_slots[i_old] == 0) {
+                continue;
+            }
+            i_slot = completion_hashBytes(pool->data + old_slots[i_old] - 1,
+                                          strlen(pool->data + old_slots[i_old] - 1));
+            for (i_slot &= pool->n_slots * 2 - 1; pool->slots[i_slot] != 0;
+                 i_slot = (i_slot + 1) & (pool->n_slots * 2 - 1)) {
+                ;
+            }
+            pool->slots[i_slot] = old_slots[i_old];
+        }
+        pool->n_slots *= 2;
+        free(old_slots);
+    }
+
+    i_slot = completion_hashBytes(string, length - 1) & (pool->n_slots - 1);
+    for ( ; pool->slots[i_slot] != 0; i_slot = (i_slot + 1) & (pool->n_slots - 1))
+    {
+        if (strcmp(pool->data + pool->slots[i_slot] - 1, string) == 0) {
+            return pool->slots[i_slot] - 1;
+        }
+    }
+
+    if (pool->size + length > pool->capacity)
+    {
+        pool->capacity = (pool->size + length) * 2;
+        pool->data = (char*)realloc(pool->data, pool->capacity);
+    }
+    memcpy(pool->data + pool->size, string, length);
+    pool->slots[i_slot] = (uint32_t)pool->size + 1;
+    pool->size += length;
+    pool->n_strings++;
+
+    return pool->slots[i_slot] - 1;
+}
+
+/* Write the n_entries entries (one per USR, sorted by name) to path */
+static int __write_index(const char *path, index_Entry **entries, size_t n_entries)
+{
+    index_Strings pool;
+    index_Header  header;
+    index_Symbol *symbols = (index_Symbol*)calloc(sizeof(index_Symbol), n_entries + 1);
+    uint32_t     *by_usr = (uint32_t*)malloc((n_entries + 1) * sizeof(uint32_t));
+    size_t i_entry = 0, temp_size = strlen(path) + 32;
+    char  *temp_path = (char*)malloc(temp_size);
+    FILE  *file;
+    int    status = 0;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.n_slots = 1024;
+    pool.slots = (uint32_t*)calloc(sizeof(uint32_t), pool.n_slots);
+
+    for ( ; i_entry < n_entries; i_entry++)
+    {
+        symbols[i_entry].name = __intern(&pool, entries[i_entry]->name);
+        symbols[i_entry].usr = __intern(&pool, entries[i_entry]->usr);
+        symbols[i_entry].file = __intern(&pool, entries[i_entry]->file);
+        symbols[i_entry].line = entries[i_entry]->line;
+        symbols[i_entry].column = entries[i_entry]->column;
+        symbols[i_entry].kind = (uint16_t)entries[i_entry]->kind;
+        symbols[i_entry].is_definition = (uint16_t)entries[i_entry]->is_definition;
+        by_usr[i_entry] = (uint32_t)i_entry;
+    }
+
+    __sorted_entries = entries;
+    qsort(by_usr, n_entries, sizeof(uint32_t), __compare_indexes_by_usr);
+    __sorted_entries = NULL;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.n_symbols = (uint32_t)n_entries;
+    header.strings_size = (uint32_t)pool.size;
+
+    /* servers may be reading the old index, it's replaced in one go */
+    snprintf(temp_path, temp_size, "%s.%d.tmp", path, (int)getpid());
+    if ((file = fopen(temp_path, "wb")) == NULL ||
+        fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(symbols, sizeof(index_Symbol), n_entries, file) != n_entries ||
+        fwrite(by_usr, sizeof(uint32_t), n_entries, file) != n_entries ||
+        fwrite(pool.data, 1, pool.size, file) != pool.size)
+    {
+        status = -1;
+    }
+
+    if (file != NULL && fclose(file) != 0) {
+        status = -1;
+    }
+    if (status == 0 && rename(temp_path, path) != 0) {
+        status = -1;
+    }
+    if (status != 0) {
+        unlink(temp_path);
+    }
+
+    free(temp_path);
+    free(pool.slots);
+    free(pool.data);
+    free(by_usr);
+    free(symbols);
+    return status;
+}
+
+/* Index the files of the compilation database with n_jobs threads, and write
+   the index to path */
+int completion_buildSymbolIndex(const char *path, int n_jobs)
+{
+    const char  **files;
+    index_Worker *workers;
+    index_Deque  *deques;
+    index_Entry **entries;
+    size_t n_entries = 0, n_unique = 0, i_entry;
+    int    i_file = 0, i_worker, status;
+
+    if ((__n_files = completion_getCompiledFiles(&files)) == 0)
+    {
+        free(files);
+        return -1;
+    }
+
+    if (n_jobs <= 0) {
+        n_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (n_jobs > __n_files) {
+        n_jobs = __n_files;
+    }
+    if (n_jobs <= 0) {
+        n_jobs = 1;
+    }
+
+    /* files are dealt out evenly, threads which are done early steal the
+       rest from the others */
+    workers = (index_Worker*)calloc(sizeof(index_Worker), n_jobs);
+    deques = (index_Deque*)calloc(sizeof(index_Deque), n_jobs);
+    for (i_worker = 0; i_worker < n_jobs; i_worker++)
+    {
+        pthread_mutex_init(&deques[i_worker].lock, NULL);
+        deques[i_worker].files = (const char**)calloc(sizeof(char*), __n_files / n_jobs + 1);
+    }
+    for ( ; i_file < __n_files; i_file++)
+    {
+        index_Deque *deque = &deques[i_file % n_jobs];
+        deque->files[deque->bottom++] = files[i_file];
+    }
+
+    for (i_worker = 0; i_worker < n_jobs; i_worker++)
+    {
+        workers[i_worker].id = i_worker;
+        workers[i_worker].n_workers = n_jobs;
+        workers[i_worker].deques = deques;
+        pthread_create(&workers[i_worker].thread, NULL, __index_files, &workers[i_worker]);
+    }
+    for (i_worker = 0; i_worker < n_jobs; i_worker++)
+    {
+        pthread_join(workers[i_worker].thread, NULL);
+        n_entries += workers[i_worker].table.n_entries;
+    }
+    fprintf(stderr, "\n");
+
+    /* threads have seen the same headers, keep one symbol per USR */
+    entries = (index_Entry**)malloc((n_entries + 1) * sizeof(index_Entry*));
+    for (n_entries = 0, i_worker = 0; i_worker < n_jobs; i_worker++)
+    {
+        for (i_entry = 0; i_entry < workers[i_worker].table.n_entries; i_entry++) {
+            entries[n_entries++] = &workers[i_worker].table.entries[i_entry];
+        }
+    }
+
+    qsort(entries, n_entries, sizeof(index_Entry*), __compare_by_usr);
+    for (i_entry = 0; i_entry < n_entries; i_entry++)
+    {
+        if (n_unique == 0 || strcmp(entries[n_unique - 1]->usr, entries[i_entry]->usr) != 0) {
+            entries[n_unique++] = entries[i_entry];
+        }
+    }
+    qsort(entries, n_unique, sizeof(index_Entry*), __compare_by_name);
+
+    status = __write_index(path, entries, n_unique);
+    fprintf(stderr, "%lu symbols written to %s\n", (unsigned long)n_unique, path);
+
+    for (i_worker = 0; i_worker < n_jobs; i_worker++)
+    {
+        index_Table *table = &workers[i_worker].table;
+        for (i_entry = 0; i_entry < table->n_entries; i_entry++)
+        {
+            free(table->entries[i_entry].usr);
+            free(table->entries[i_entry].name);
+            free(table->entries[i_entry].file);
+        }
+        free(table->entries);
+        free(table->slots);
+        free((void*)deques[i_worker].files);
+        pthread_mutex_destroy(&deques[i_worker].lock);
+    }
+    free(entries);
+    free(deques);
+    free(workers);
+    free(files);
+    return status;
+}
+
+
+/* Unmap the index */
+static void __unmap_index(void)
+{
+    if (__mapped != NULL) {
+        munmap((void*)__mapped, __mapped_size);
+    }
+
+    __mapped = NULL;
+    __mapped_size = 0;
+    __n_symbols = 0;
+}
+
+/* Map the index at __index_path if it's not mapped yet or has been replaced,
+   returns nonzero if there's no usable index */
+static int __map_index(void)
+{
+    struct stat   status;
+    index_Header  header;
+    size_t        expected;
+    int           fd;
+    void         *mapped;
+
+    if (__index_path == NULL || stat(__index_path, &status) != 0) {
+        return (__mapped != NULL) ? 0 : -1;    /* keep the old one, if any */
+    }
+
+    if (__mapped != NULL &&
+        status.st_ino == __mapped_stat.st_ino && status.st_dev == __mapped_stat.st_dev &&
+        status.st_mtime == __mapped_stat.st_mtime && status.st_size == __mapped_stat.st_size) {
+        return 0;
+    }
+
+    if ((fd = open(__index_path, O_RDONLY)) < 0) {
+        return (__mapped != NULL) ? 0 : -1;
+    }
+    mapped = (status.st_size >= (off_t)sizeof(index_Header)) ?
+        mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return (__mapped != NULL) ? 0 : -1;
+    }
+
+    /* the sizes must add up, and the strings must be terminated */
+    memcpy(&header, mapped, sizeof(header));
+    expected = sizeof(index_Header) +
+        (size_t)header.n_symbols * (sizeof(index_Symbol) + sizeof(uint32_t)) + header.strings_size;
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != INDEX_VERSION || expected != (size_t)status.st_size ||
+        (header.strings_size > 0 &&
+         ((const char*)mapped)[status.st_size - 1] != '\0'))
+    {
+        munmap(mapped, (size_t)status.st_size);
+        return (__mapped != NULL) ? 0 : -1;
+    }
+
+    __unmap_index();
+    __mapped = (const char*)mapped;
+    __mapped_size = (size_t)status.st_size;
+    __mapped_stat = status;
+    __n_symbols = header.n_symbols;
+    __strings_size = header.strings_size;
+    __symbols = (const index_Symbol*)(__mapped + sizeof(index_Header));
+    __by_usr = (const uint32_t*)(__symbols + __n_symbols);
+    __strings = (const char*)(__by_usr + __n_symbols);
+
+    return 0;
+}
+
+/* Look symbols up in the index at path from now on */
+int completion_openSymbolIndex(const char *path)
+{
+    free(__index_path);
+    __unmap_index();
+    __index_path = strdup(path);
+
+    return __map_index();
+}
+
+
+/* String at offset in the string pool */
+static const char *__string(uint32_t offset)
+{
+    return (offset < __strings_size) ? __strings + offset : "";
+}
+
+static void __print_symbol(const index_Symbol *symbol, completion_Output *out)
+{
+    completion_printOutput(out, "SYMBOL:%s\t%s\t%s\t%u\t%u\t%s\t%s\n",
+        __string(symbol->name),
+        (symbol->kind < sizeof(__kind_names) / sizeof(__kind_names[0])) ?
+            __kind_names[symbol->kind] : "unexposed",
+        __string(symbol->file), (unsigned)symbol->line, (unsigned)symbol->column,
+        symbol->is_definition ? "definition" : "declaration", __string(symbol->usr));
+}
+
+/* Print the symbols whose name starts with prefix */
+int completion_printSymbols(const char *prefix, unsigned limit, completion_Output *out)
+{
+    size_t   length = strlen(prefix);
+    uint32_t low = 0, high, middle;
+    unsigned n_printed = 0;
+
+    if (__map_index() != 0) {
+        return -1;
+    }
+
+    /* the first name not below prefix */
+    for (high = __n_symbols; low < high; )
+    {
+        middle = low + (high - low) / 2;
+        if (strcmp(__string(__symbols[middle].name), prefix) < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    for ( ; low < __n_symbols && (limit == 0 || n_printed < limit); low++, n_printed++)
+    {
+        if (strncmp(__string(__symbols[low].name), prefix, length) != 0) {
+            break;
+        }
+        __print_symbol(&__symbols[low], out);
+    }
+
+    return 0;
+}
+
+/* Print the symbol of usr */
+int completion_printDefinition(const char *usr, completion_Output *out)
+{
+    uint32_t low = 0, high, middle;
+    int order;
+
+    if (__map_index() != 0) {
+        return -1;
+    }
+
+    for (high = __n_symbols; low < high; )
+    {
+        middle = low + (high - low) / 2;
+        if (__by_usr[middle] >= __n_symbols) {
+            break;    /* corrupted */
+        }
+
+        order = strcmp(__string(__symbols[__by_usr[middle]].usr), usr);
+        if (order == 0)
+        {
+            __print_symbol(&__symbols[__by_usr[middle]], out);
+            break;
+        }
+
+        if (order < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    return 0;
+}
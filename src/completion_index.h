@@ -0,0 +1,57 @@
+#ifndef _COMPLETION_INDEX_H_
+#define _COMPLETION_INDEX_H_
+
+
+#include "completion_output.h"
+
+
+
+/*
+   SYMBOL INDEX: the declarations of a whole project (the files of the
+   compilation database, and the headers they include) collected with
+   clang_indexSourceFile, so that symbols out of reach of the includes of a
+   file could be looked up without parsing anything.
+
+   The index is built by "clang-complete --index FILE" (see
+   completion_buildSymbolIndex), and mapped into memory by the servers given
+   --symbol-index FILE. It's a single file, in native byte order:
+
+        index_Header                          magic, version and sizes
+        index_Symbol  symbols[n_symbols]      sorted by name, then by USR
+        uint32        by_usr[n_symbols]       indexes of symbols sorted by USR
+        char          strings[strings_size]   '\0'-terminated, shared
+
+   A symbol is made of the offsets of its name, USR and file in strings, its
+   line, column and kind (CXIdxEntityKind), and whether it's a definition.
+   One symbol is kept per USR: its definition, or one of its declarations if
+   the project doesn't define it. Looking up a name prefix or a USR is a
+   binary search in the mapped file.
+
+   The index is written to a temporary file renamed over FILE, and servers
+   map the new one on their next lookup.
+*/
+
+
+/* Index the files of the compilation database (which must have been loaded)
+   with n_jobs threads, 0 for one per core, and write the index to path.
+   Returns nonzero on failure. */
+int completion_buildSymbolIndex(const char *path, int n_jobs);
+
+/* Look symbols up in the index at path from now on, it's mapped again
+   whenever the file is replaced. Returns nonzero if it can't be used (yet). */
+int completion_openSymbolIndex(const char *path);
+
+/* Print the symbols whose name starts with prefix, at most limit (0 for no
+   limit) of them in alphabetical order, one per line:
+        SYMBOL:[#name#]\t[#kind#]\t[#file#]\t[#line#]\t[#column#]\t[#definition#]\t[#usr#]
+   where [#definition#] is either "definition" or "declaration". Returns
+   nonzero if there's no index. */
+int completion_printSymbols(const char *prefix, unsigned limit, completion_Output *out);
+
+/* Print the symbol of usr like completion_printSymbols, which is its
+   definition if the project has one. Returns nonzero if there's no index. */
+int completion_printDefinition(const char *usr, completion_Output *out);
+
+
+
+#endif /* _COMPLETION_INDEX_H_ */
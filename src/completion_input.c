@@ -0,0 +1,352 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/uio.h>
+
+#include "completion_input.h"
+
+
+
+/* Read input from fd */
+void completion_openInput(completion_Input *in, int fd)
+{
+    in->fd       = fd;
+    in->capacity = INPUT_BUFFER_SIZE;
+    in->data     = (char*)malloc(in->capacity);
+    in->begin    = in->end = 0;
+    in->borrowed = 0;
+    in->eof      = 0;
+    in->record_fd = -1;
+}
+
+/* Read input from length bytes of data, which is used in place */
+void completion_openMemoryInput(completion_Input *in, char *data, size_t length)
+{
+    in->fd       = -1;
+    in->data     = data;
+    in->begin    = 0;
+    in->end      = length;
+    in->capacity = length + 1;    /* data[length] terminates the last line */
+    in->borrowed = 1;
+    in->eof      = 1;
+    in->record_fd = -1;
+}
+
+/* Release the buffer of in (unless it's borrowed) */
+void completion_closeInput(completion_Input *in)
+{
+    if (!in->borrowed) {
+        free(in->data);
+    }
+    in->data = NULL;
+    in->begin = in->end = in->capacity = 0;
+}
+
+/* Record everything read from in to record_fd from now on */
+void completion_recordInput(completion_Input *in, int record_fd)
+{
+    in->record_fd = record_fd;
+}
+
+/* Append length bytes of data just read from in to its trace */
+static void __record(completion_Input *in, const char *data, size_t length)
+{
+    struct timespec now;
+    struct iovec iov[3];
+    char   header[64];
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    iov[0].iov_base = header;
+    iov[0].iov_len  = (size_t)sprintf(header, "%lu %lu\n",
+        (unsigned long)now.tv_sec * 1000000 + (unsigned long)now.tv_nsec / 1000,
+        (unsigned long)length);
+    iov[1].iov_base = (char*)data;
+    iov[1].iov_len  = length;
+    iov[2].iov_base = "\n";
+    iov[2].iov_len  = 1;
+
+    /* a trace is only good for benchmarks, a short write is not worth
+       failing the request for */
+    if (writev(in->record_fd, iov, 3) < 0) {
+        in->record_fd = -1;
+    }
+}
+
+
+/* Read more input into the buffer, returns the number of bytes read, or 0 at
+   end of input. Consumed bytes are dropped, which moves the unconsumed ones
+   (data[begin..end)) to the beginning of the buffer. */
+static size_t __fill(completion_Input *in)
+{
+    ssize_t n_read;
+
+    if (in->fd < 0 || in->eof) {
+        return 0;
+    }
+
+    if (in->begin > 0)
+    {
+        memmove(in->data, in->data + in->begin, in->end - in->begin);
+        in->end  -= in->begin;
+        in->begin = 0;
+    }
+
+    /* a line longer than the buffer, make some room for the rest of it */
+    if (in->capacity - in->end < INPUT_BUFFER_SIZE / 4)
+    {
+        in->capacity *= 2;
+        in->data = (char*)realloc(in->data, in->capacity);
+    }
+
+    /* leave a byte to terminate the last line */
+    do {
+        n_read = read(in->fd, in->data + in->end, in->capacity - in->end - 1);
+    } while (n_read < 0 && errno == EINTR);
+
+    if (n_read <= 0)
+    {
+        in->eof = 1;
+        return 0;
+    }
+
+    if (in->record_fd >= 0) {
+        __record(in, in->data + in->end, (size_t)n_read);
+    }
+
+    in->end += (size_t)n_read;
+    return (size_t)n_read;
+}
+
+/* Return the next byte of in without consuming it, or -1 at end of input */
+int completion_peekInput(completion_Input *in)
+{
+    if (in->begin == in->end && __fill(in) == 0) {
+        return -1;
+    }
+
+    return (unsigned char)in->data[in->begin];
+}
+
+/* Skip whitespaces, returns the next byte like completion_peekInput */
+int completion_skipSpaces(completion_Input *in)
+{
+    int c;
+    while ((c = completion_peekInput(in)) != -1 && isspace(c)) {
+        in->begin++;
+    }
+
+    return c;
+}
+
+/* Hand out data[begin..begin + length) terminated by '\0' in place of the
+   delimiter after it, which is consumed as well */
+static char *__take(completion_Input *in, size_t length, size_t *taken)
+{
+    char *token = in->data + in->begin;
+
+    token[length] = '\0';
+    in->begin += (in->begin + length < in->end) ? length + 1 : length;
+
+    if (taken != NULL) {
+        *taken = length;
+    }
+    return token;
+}
+
+/* Read a line and return it without its '\n', terminated by '\0' in place */
+char *completion_readLine(completion_Input *in, size_t *length)
+{
+    size_t scanned = 0;    /* bytes known not to be '\n' */
+    char *newline;
+
+    for ( ; ; )
+    {
+        newline = (char*)memchr(
+            in->data + in->begin + scanned, '\n', in->end - in->begin - scanned);
+        if (newline != NULL) {
+            return __take(in, (size_t)(newline - (in->data + in->begin)), length);
+        }
+
+        scanned = in->end - in->begin;
+        if (__fill(in) == 0) {
+            break;
+        }
+    }
+
+    /* the last line, without '\n' */
+    return (in->begin < in->end) ? __take(in, in->end - in->begin, length) : NULL;
+}
+
+/* Read a whitespace separated token */
+char *completion_readToken(completion_Input *in, size_t *length)
+{
+    size_t scanned = 0;
+
+    if (completion_skipSpaces(in) == -1) {
+        return NULL;
+    }
+
+    for ( ; ; )
+    {
+        for ( ; in->begin + scanned < in->end; scanned++)
+        {
+            if (isspace((unsigned char)in->data[in->begin + scanned])) {
+                return __take(in, scanned, length);
+            }
+        }
+
+        if (__fill(in) == 0) {
+            return __take(in, scanned, length);
+        }
+    }
+}
+
+/* Read a "key:value" header line of a message, and return its key */
+char *completion_readHeader(completion_Input *in, char **value)
+{
+    char *line = completion_readLine(in, NULL), *colon;
+
+    if (line == NULL) {
+        return NULL;
+    }
+
+    if ((colon = strchr(line, ':')) == NULL) {
+        *value = line + strlen(line);    /* a line without value */
+        return line;
+    }
+
+    *colon = '\0';
+    for (*value = colon + 1; **value == ' '; (*value)++) {
+        ;    /* "key: value" is fine as well */
+    }
+    return line;
+}
+
+/* Read length bytes to dest, the buffered ones are copied, and the rest of
+   them is read from fd right into dest */
+size_t completion_readBytes(completion_Input *in, char *dest, size_t length)
+{
+    size_t  n_copied = in->end - in->begin;
+    ssize_t n_read;
+
+    if (n_copied > length) {
+        n_copied = length;
+    }
+    memcpy(dest, in->data + in->begin, n_copied);
+    in->begin += n_copied;
+
+    while (n_copied < length && in->fd >= 0 && !in->eof)
+    {
+        n_read = read(in->fd, dest + n_copied, length - n_copied);
+        if (n_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n_read <= 0) {
+            in->eof = 1;
+            break;
+        }
+        if (in->record_fd >= 0) {
+            __record(in, dest + n_copied, (size_t)n_read);
+        }
+        n_copied += (size_t)n_read;
+    }
+
+    return n_copied;
+}
+
+/* Consume length bytes, returns the number of bytes skipped */
+size_t completion_skipBytes(completion_Input *in, size_t length)
+{
+    size_t n_skipped = 0, n_buffered;
+
+    for ( ; ; )
+    {
+        n_buffered = in->end - in->begin;
+        if (n_buffered >= length - n_skipped)
+        {
+            in->begin += length - n_skipped;
+            return length;
+        }
+
+        n_skipped += n_buffered;
+        in->begin = in->end;
+        if (__fill(in) == 0) {
+            return n_skipped;
+        }
+    }
+}
+
+/* Consume the buffered lines up to and including a blank line, or up to the
+   first line stop accepts */
+void completion_skipLines(completion_Input *in, int (*stop)(const char *line, size_t length))
+{
+    char *line, *newline;
+    size_t length;
+
+    while (in->begin < in->end)
+    {
+        line = in->data + in->begin;
+        newline = memchr(line, '\n', in->end - in->begin);
+        length = (newline != NULL) ? (size_t)(newline - line) : in->end - in->begin;
+
+        if (length > 0 && stop(line, length)) {
+            return;
+        }
+
+        in->begin += (newline != NULL) ? length + 1 : length;
+        if (length == 0) {
+            return;
+        }
+    }
+}
+
+/* Nonzero if more (non-whitespace) input could be read without blocking */
+int completion_inputPending(completion_Input *in)
+{
+    struct pollfd pfd;
+
+    for ( ; ; )
+    {
+        while (in->begin < in->end && isspace((unsigned char)in->data[in->begin])) {
+            in->begin++;
+        }
+        if (in->begin < in->end) {
+            return 1;
+        }
+
+        if (in->fd < 0 || in->eof) {
+            return 0;
+        }
+
+        pfd.fd = in->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLIN | POLLHUP)) ||
+            __fill(in) == 0) {
+            return 0;
+        }
+    }
+}
+
+/* Wait up to timeout milliseconds for input */
+int completion_waitInput(completion_Input *in, int timeout)
+{
+    struct pollfd pfd;
+    int n_ready;
+
+    if (in->begin < in->end || in->fd < 0 || in->eof) {
+        return 1;
+    }
+
+    pfd.fd = in->fd;
+    pfd.events = POLLIN;
+    while ((n_ready = poll(&pfd, 1, timeout)) < 0 && errno == EINTR) {
+        ;
+    }
+
+    return n_ready != 0;
+}
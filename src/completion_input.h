@@ -0,0 +1,84 @@
+#ifndef _COMPLETION_INPUT_H_
+#define _COMPLETION_INPUT_H_
+
+
+#include <stddef.h>
+
+
+/* Buffered reader of client messages. It's filled with large read() calls,
+   header lines and tokens are handed out in place (no copy), and source code
+   payloads are copied (or read) straight into their destination. */
+typedef struct __completion_Input_struct
+{
+    int     fd;          /* descriptor to read from, -1 if all input is in data */
+    char   *data;        /* data[begin..end) has been read but not consumed */
+    size_t  begin;
+    size_t  end;
+    size_t  capacity;    /* bytes allocated for data */
+    int     borrowed;    /* data belongs to the caller, see completion_openMemoryInput */
+    int     eof;         /* nothing more could be read from fd */
+    int     record_fd;   /* everything read from fd is recorded to it, or -1 */
+
+} completion_Input;
+
+
+#define  INPUT_BUFFER_SIZE   (256 << 10)    /* 256KB */
+
+
+/* Read input from fd */
+void completion_openInput(completion_Input *in, int fd);
+
+/* Read input from length bytes of data, which is used in place: data should
+   stay alive until the input is closed, and data[length] must be writable */
+void completion_openMemoryInput(completion_Input *in, char *data, size_t length);
+
+/* Release the buffer of in (unless it's borrowed) */
+void completion_closeInput(completion_Input *in);
+
+/* Record everything read from in to record_fd from now on, each read() as
+        [#time_us#] [#length#]
+        <# [#length#] BYTES READ #>
+   where time_us is taken from a monotonic clock. A trace starts with the
+   arguments of the server (see main.c), and is replayed by bench/replay. */
+void completion_recordInput(completion_Input *in, int record_fd);
+
+/* Return the next byte of in without consuming it, or -1 at end of input */
+int completion_peekInput(completion_Input *in);
+
+/* Skip whitespaces, returns the next byte like completion_peekInput */
+int completion_skipSpaces(completion_Input *in);
+
+/* Read a line and return it without its '\n', terminated by '\0' in place. The
+   line stays valid until the next read from in. Returns NULL at end of input. */
+char *completion_readLine(completion_Input *in, size_t *length);
+
+/* Read a whitespace separated token, otherwise the same as completion_readLine */
+char *completion_readToken(completion_Input *in, size_t *length);
+
+/* Read length bytes to dest, returns the number of bytes read, which is less
+   than length only at end of input */
+size_t completion_readBytes(completion_Input *in, char *dest, size_t length);
+
+/* Consume length bytes, returns the number of bytes skipped */
+size_t completion_skipBytes(completion_Input *in, size_t length);
+
+/* Read a "key:value" header line of a message, and return its key. Both key
+   and value are terminated by '\0' in place, they stay valid until the next
+   read from in. Returns NULL at end of input. */
+char *completion_readHeader(completion_Input *in, char **value);
+
+/* Consume the buffered lines up to and including a blank line, or up to the
+   first line for which stop(line, length) is nonzero. Only what has already
+   been read is skipped, this never blocks. */
+void completion_skipLines(completion_Input *in, int (*stop)(const char *line, size_t length));
+
+/* Nonzero if more (non-whitespace) input could be read without blocking */
+int completion_inputPending(completion_Input *in);
+
+/* Wait up to timeout milliseconds (-1 for ever) for input, returns 0 if none
+   has come (end of input counts as input) */
+int completion_waitInput(completion_Input *in, int timeout);
+
+
+
+#endif /* _COMPLETION_INPUT_H_ */
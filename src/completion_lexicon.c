@@ -0,0 +1,449 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "completion.h"
+
+
+
+#define  INITIAL_LEXICON_CAPACITY   1024    /* slots, a power of two */
+
+
+/* Nonzero if c could be part of an identifier, bytes of UTF-8 sequences
+   included */
+static int __is_word_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || (unsigned char)c >= 0x80;
+}
+
+/* Slot of the length bytes of name with hash in words (of capacity slots),
+   the free slot it would take if it's not there */
+static completion_LexiconWord *__find_slot(
+    completion_LexiconWord *words, size_t capacity,
+    const char *name, size_t length, unsigned long hash)
+{
+    size_t i_slot = hash & (capacity - 1);
+
+    while (words[i_slot].name != NULL &&
+           !(words[i_slot].hash == hash && words[i_slot].length == length &&
+             memcmp(words[i_slot].name, name, length) == 0)) {
+        i_slot = (i_slot + 1) & (capacity - 1);
+    }
+
+    return &words[i_slot];
+}
+
+/* Nonzero if word has been seen in the headers of the translation unit */
+static int __is_in_headers(const completion_Lexicon *lexicon, const completion_LexiconWord *word)
+{
+    return word->unit_stamp != 0 && word->unit_stamp == lexicon->unit_stamp;
+}
+
+/* Nonzero if word is still found in the source or the headers */
+static int __is_alive(const completion_Lexicon *lexicon, const completion_LexiconWord *word)
+{
+    return word->in_source > 0 || __is_in_headers(lexicon, word);
+}
+
+/* Make room for one more word, the ones which have gone from both the source
+   and the headers (typed prefixes, mostly) are dropped on the way */
+static void __reserve_word(completion_Lexicon *lexicon)
+{
+    completion_LexiconWord *words = lexicon->words, *slot;
+    size_t capacity = lexicon->capacity, i_slot = 0, n_alive = 0;
+
+    if (words != NULL && (lexicon->n_words + 1) * 2 <= capacity) {
+        return;
+    }
+
+    for ( ; i_slot < capacity; i_slot++) {
+        n_alive += (words[i_slot].name != NULL && __is_alive(lexicon, &words[i_slot]));
+    }
+
+    lexicon->capacity = INITIAL_LEXICON_CAPACITY;
+    while ((n_alive + 1) * 4 > lexicon->capacity) {
+        lexicon->capacity *= 2;
+    }
+    lexicon->words = (completion_LexiconWord*)calloc(
+        lexicon->capacity, sizeof(completion_LexiconWord));
+    lexicon->n_words = 0;
+
+    for (i_slot = 0; i_slot < capacity; i_slot++)
+    {
+        if (words[i_slot].name == NULL) {
+            continue;
+        }
+        if (!__is_alive(lexicon, &words[i_slot]))
+        {
+            free(words[i_slot].name);
+            continue;
+        }
+
+        slot = __find_slot(lexicon->words, lexicon->capacity,
+                           words[i_slot].name, words[i_slot].length, words[i_slot].hash);
+        *slot = words[i_slot];
+        lexicon->n_words++;
+    }
+
+    free(words);
+}
+
+/* The entry of the length bytes of name, which is added if it's not there */
+static completion_LexiconWord *__intern_word(
+    completion_Lexicon *lexicon, const char *name, size_t length)
+{
+    unsigned long hash = completion_hashBytes(name, length);
+    completion_LexiconWord *word;
+
+    if (lexicon->words != NULL)
+    {
+        word = __find_slot(lexicon->words, lexicon->capacity, name, length, hash);
+        if (word->name != NULL) {
+            return word;
+        }
+    }
+
+    __reserve_word(lexicon);
+    word = __find_slot(lexicon->words, lexicon->capacity, name, length, hash);
+    word->name = (char*)malloc(length + 1);
+    memcpy(word->name, name, length);
+    word->name[length] = '\0';
+    word->length = length;
+    word->hash = hash;
+    word->in_source = 0;
+    word->unit_stamp = 0;
+    lexicon->n_words++;
+    return word;
+}
+
+/* Count (delta = 1) or uncount (delta = -1) the words of the length bytes of
+   text, which must start and end between two words. Comments and literals
+   are not told apart from code, only numbers are left out, so that any
+   region could be relexed on its own. */
+static void __count_words(completion_Lexicon *lexicon, const char *text, size_t length, int delta)
+{
+    const char *end = text + length, *start;
+    completion_LexiconWord *word;
+
+    while (text < end)
+    {
+        if (!__is_word_char(*text))
+        {
+            text++;
+            continue;
+        }
+
+        for (start = text; text < end && __is_word_char(*text); text++) {
+        }
+        if (*start >= '0' && *start <= '9') {
+            continue;
+        }
+
+        if (delta > 0) {
+            __intern_word(lexicon, start, (size_t)(text - start))->in_source++;
+        }
+        else if (lexicon->words != NULL)
+        {
+            word = __find_slot(lexicon->words, lexicon->capacity, start, (size_t)(text - start),
+                               completion_hashBytes(start, (size_t)(text - start)));
+            if (word->name != NULL && word->in_source > 0) {
+                word->in_source--;
+            }
+        }
+    }
+}
+
+
+/* Count the words of src_buffer again, if it's been replaced since */
+static void __lex_source(completion_Session *session)
+{
+    completion_Lexicon *lexicon = &session->lexicon;
+    size_t i_slot = 0;
+
+    if (lexicon->source_valid) {
+        return;
+    }
+
+    for ( ; lexicon->words != NULL && i_slot < lexicon->capacity; i_slot++) {
+        lexicon->words[i_slot].in_source = 0;
+    }
+
+    __count_words(lexicon, session->src_buffer, session->src_length, 1);
+    lexicon->source_valid = 1;
+}
+
+/* Headers the main file includes, but system headers */
+typedef struct __lexicon_Headers_struct
+{
+    CXTranslationUnit tu;
+    CXFile files[MAX_LEXICON_HEADERS];
+    int    n_files;
+
+} lexicon_Headers;
+
+static void __visit_header(
+    CXFile included_file, CXSourceLocation *inclusion_stack, unsigned include_len,
+    CXClientData client_data)
+{
+    lexicon_Headers *headers = (lexicon_Headers*)client_data;
+    (void) inclusion_stack;
+
+    if (include_len != 1 || headers->n_files == MAX_LEXICON_HEADERS ||
+        clang_Location_isInSystemHeader(
+            clang_getLocationForOffset(headers->tu, included_file, 0))) {
+        return;
+    }
+
+    headers->files[headers->n_files++] = included_file;
+}
+
+/* Size of file as cx_tu has seen it: the length of its overlay, or of the
+   file on disk. 0 if it's not known. */
+static size_t __header_size(completion_Session *session, CXFile file)
+{
+    CXString name = clang_getFileName(file);
+    completion_Overlay *overlay = completion_findOverlay(session, clang_getCString(name));
+    struct stat st;
+    size_t size = 0;
+
+    if (overlay != NULL) {
+        size = overlay->length;
+    }
+    else if (stat(clang_getCString(name), &st) == 0) {
+        size = (size_t)st.st_size;
+    }
+
+    clang_disposeString(name);
+    return size;
+}
+
+/* Add the identifiers of file, tokenized by cx_tu */
+static void __tokenize_header(completion_Session *session, CXFile file)
+{
+    completion_Lexicon *lexicon = &session->lexicon;
+    size_t size = __header_size(session, file);
+    CXSourceLocation begin, end;
+    CXToken *tokens;
+    CXString spelling;
+    const char *name;
+    unsigned n_tokens, i_token = 0;
+
+    if (size == 0 || size > MAX_LEXICON_HEADER_SIZE) {
+        return;
+    }
+
+    begin = clang_getLocationForOffset(session->cx_tu, file, 0);
+    end = clang_getLocationForOffset(session->cx_tu, file, (unsigned)size);
+    if (clang_equalLocations(end, clang_getNullLocation())) {
+        return;    /* it's changed since */
+    }
+
+    clang_tokenize(session->cx_tu, clang_getRange(begin, end), &tokens, &n_tokens);
+    for ( ; i_token < n_tokens; i_token++)
+    {
+        if (clang_getTokenKind(tokens[i_token]) != CXToken_Identifier) {
+            continue;
+        }
+
+        spelling = clang_getTokenSpelling(session->cx_tu, tokens[i_token]);
+        name = clang_getCString(spelling);
+        __intern_word(lexicon, name, strlen(name))->unit_stamp = lexicon->unit_stamp;
+        clang_disposeString(spelling);
+    }
+    clang_disposeTokens(session->cx_tu, tokens, n_tokens);
+}
+
+/* Read the identifiers of the headers again, if cx_tu has changed since.
+   Without a translation unit, the ones of the last good one are kept. */
+static void __lex_headers(completion_Session *session)
+{
+    completion_Lexicon *lexicon = &session->lexicon;
+    lexicon_Headers headers;
+    int i_file = 0;
+
+    if (session->cx_tu == NULL || lexicon->unit_generation == session->tu_generation) {
+        return;
+    }
+
+    /* the words of the previous ones go stale all at once */
+    lexicon->unit_stamp++;
+    lexicon->unit_generation = session->tu_generation;
+
+    headers.tu = session->cx_tu;
+    headers.n_files = 0;
+    clang_getInclusions(session->cx_tu, __visit_header, &headers);
+
+    for ( ; i_file < headers.n_files; i_file++) {
+        __tokenize_header(session, headers.files[i_file]);
+    }
+}
+
+
+/* An identifier starting with the prefix, ranked by the number of times
+   it's been seen */
+typedef struct __lexicon_Match_struct
+{
+    const char *name;
+    unsigned    frequency;
+
+} lexicon_Match;
+
+static int __compare_frequencies(const void *left, const void *right)
+{
+    const lexicon_Match *a = (const lexicon_Match*)left, *b = (const lexicon_Match*)right;
+
+    if (a->frequency != b->frequency) {
+        return (a->frequency > b->frequency) ? -1 : 1;
+    }
+    return strcmp(a->name, b->name);
+}
+
+static int __compare_names(const void *left, const void *right)
+{
+    return strcmp(((const lexicon_Match*)left)->name, ((const lexicon_Match*)right)->name);
+}
+
+/* Offset of (line, column) in src_buffer, both of them start from 1 */
+static size_t __offset_of(const completion_Session *session, int line, int column)
+{
+    const char *newline;
+    size_t offset = 0;
+
+    while (--line > 0 && offset < session->src_length)
+    {
+        newline = (const char*)memchr(
+            session->src_buffer + offset, '\n', session->src_length - offset);
+        if (newline == NULL) {
+            return session->src_length;
+        }
+        offset = (size_t)(newline - session->src_buffer) + 1;
+    }
+
+    if (column > 1) {
+        offset += (size_t)(column - 1);
+    }
+    return (offset < session->src_length) ? offset : session->src_length;
+}
+
+/* Print the identifiers of the lexicon starting with prefix */
+unsigned completion_printLexicalCandidates(
+    completion_Session *session, int line, int column, const char *prefix,
+    unsigned limit, completion_Output *out)
+{
+    completion_Lexicon *lexicon = &session->lexicon;
+    completion_LexiconWord *word, *typed = NULL;
+    lexicon_Match *matches;
+    size_t prefix_length = strlen(prefix), i_slot = 0, start, end;
+    unsigned n_matches = 0, i_match = 0, frequency;
+
+    __lex_source(session);
+    __lex_headers(session);
+    if (lexicon->words == NULL) {
+        return 0;
+    }
+
+    /* the identifier being typed is in src_buffer too */
+    start = end = __offset_of(session, line, column);
+    while (end < session->src_length && __is_word_char(session->src_buffer[end])) {
+        end++;
+    }
+    if (end > start)
+    {
+        word = __find_slot(lexicon->words, lexicon->capacity, session->src_buffer + start,
+                           end - start, completion_hashBytes(session->src_buffer + start, end - start));
+        typed = (word->name != NULL) ? word : NULL;
+    }
+
+    matches = (lexicon_Match*)malloc((lexicon->n_words + 1) * sizeof(lexicon_Match));
+    for ( ; i_slot < lexicon->capacity; i_slot++)
+    {
+        word = &lexicon->words[i_slot];
+        if (word->name == NULL || word->length <= prefix_length ||
+            memcmp(word->name, prefix, prefix_length) != 0) {
+            continue;
+        }
+
+        frequency = word->in_source + __is_in_headers(lexicon, word);
+        if (word == typed && word->in_source > 0) {
+            frequency--;
+        }
+        if (frequency > 0)
+        {
+            matches[n_matches].name = word->name;
+            matches[n_matches].frequency = frequency;
+            n_matches++;
+        }
+    }
+
+    /* keep the most frequent ones, in alphabetical order as libclang's */
+    if (limit > 0 && n_matches > limit)
+    {
+        qsort(matches, n_matches, sizeof(lexicon_Match), __compare_frequencies);
+        n_matches = limit;
+    }
+    qsort(matches, n_matches, sizeof(lexicon_Match), __compare_names);
+
+    for ( ; i_match < n_matches; i_match++) {
+        completion_printOutput(out, "IDENTIFIER:%s\n", matches[i_match].name);
+    }
+
+    free(matches);
+    return n_matches;
+}
+
+
+/* Called after src_buffer has been replaced as a whole */
+void completion_invalidateLexicon(completion_Session *session)
+{
+    session->lexicon.source_valid = 0;
+}
+
+/* Uncount the words the edit touches, from the start of the word it begins
+   in to the end of the one it ends in */
+void completion_noteLexiconEdit(completion_Session *session, size_t offset, size_t deleted_length)
+{
+    completion_Lexicon *lexicon = &session->lexicon;
+    size_t start = offset, end = offset + deleted_length;
+
+    if (!lexicon->source_valid) {
+        return;
+    }
+
+    while (start > 0 && __is_word_char(session->src_buffer[start - 1])) {
+        start--;
+    }
+    while (end < session->src_length && __is_word_char(session->src_buffer[end])) {
+        end++;
+    }
+
+    __count_words(lexicon, session->src_buffer + start, end - start, -1);
+    lexicon->edit_start = start;
+    lexicon->edit_tail = end - (offset + deleted_length);
+}
+
+/* Count the words of the same region, with the inserted text in place */
+void completion_applyLexiconEdit(completion_Session *session, size_t offset, size_t inserted_length)
+{
+    completion_Lexicon *lexicon = &session->lexicon;
+
+    if (!lexicon->source_valid) {
+        return;
+    }
+
+    __count_words(lexicon, session->src_buffer + lexicon->edit_start,
+                  offset + inserted_length + lexicon->edit_tail - lexicon->edit_start, 1);
+}
+
+/* Free the lexicon of session */
+void completion_freeLexicon(completion_Session *session)
+{
+    completion_Lexicon *lexicon = &session->lexicon;
+    size_t i_slot = 0;
+
+    for ( ; lexicon->words != NULL && i_slot < lexicon->capacity; i_slot++) {
+        free(lexicon->words[i_slot].name);
+    }
+
+    free(lexicon->words);
+    memset(lexicon, 0, sizeof(completion_Lexicon));
+}
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "completion_output.h"
+#include "completion_stats.h"
+
+
+/* the background worker sends responses as well, and a write to a pipe larger
+   than PIPE_BUF is not atomic */
+static pthread_mutex_t __output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/* Release the buffer of out */
+void completion_freeOutput(completion_Output *out)
+{
+    free(out->data);
+    out->data = NULL;
+    out->length = out->capacity = 0;
+}
+
+/* Start building a new response in out */
+void completion_resetOutput(completion_Output *out)
+{
+    out->length = 0;
+}
+
+/* Make room for length more bytes at the end of out */
+char *completion_reserveOutput(completion_Output *out, size_t length)
+{
+    if (out->length + length > out->capacity)
+    {
+        out->capacity = (out->length + length) * 2;
+        out->data = (char*)realloc(out->data, out->capacity);
+    }
+
+    return out->data + out->length;
+}
+
+void completion_commitOutput(completion_Output *out, size_t length)
+{
+    out->length += length;
+}
+
+/* Append length bytes of data to out */
+void completion_appendOutput(completion_Output *out, const char *data, size_t length)
+{
+    memcpy(completion_reserveOutput(out, length), data, length);
+    out->length += length;
+}
+
+void completion_appendString(completion_Output *out, const char *string)
+{
+    completion_appendOutput(out, string, strlen(string));
+}
+
+/* Append formatted text to out */
+void completion_printOutput(completion_Output *out, const char *format, ...)
+{
+    va_list args;
+    size_t  room = out->capacity - out->length;
+    int     n_printed;
+
+    va_start(args, format);
+    n_printed = vsnprintf(out->data + out->length, room, format, args);
+    va_end(args);
+
+    if (n_printed < 0) {
+        return;
+    }
+
+    /* it didn't fit, print it again after growing the buffer */
+    if ((size_t)n_printed >= room)
+    {
+        completion_reserveOutput(out, (size_t)n_printed + 1);
+
+        va_start(args, format);
+        vsnprintf(out->data + out->length, (size_t)n_printed + 1, format, args);
+        va_end(args);
+    }
+
+    out->length += (size_t)n_printed;
+}
+
+
+/* Write all iov_count buffers of iov to fd, resuming after partial writes */
+static int __write_all(int fd, struct iovec *iov, int iov_count)
+{
+    ssize_t n_written;
+
+    while (iov_count > 0)
+    {
+        n_written = writev(fd, iov, iov_count);
+        if (n_written < 0)
+        {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        /* skip what has been written */
+        while (iov_count > 0 && (size_t)n_written >= iov->iov_len)
+        {
+            n_written -= (ssize_t)iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + n_written;
+            iov->iov_len -= (size_t)n_written;
+        }
+    }
+
+    return 0;
+}
+
+/* Send the response in out to the client on fd, framed with request_id */
+int completion_sendResponse(int fd, unsigned long request_id, const completion_Output *out)
+{
+    char header[64];
+    struct iovec iov[2];
+    int status;
+    unsigned long started = completion_statsNow();
+
+    iov[0].iov_base = header;
+    iov[0].iov_len  = (size_t)sprintf(header, "%lu %lu\n",
+                                      request_id, (unsigned long)out->length);
+    iov[1].iov_base = out->data;
+    iov[1].iov_len  = out->length;
+
+    pthread_mutex_lock(&__output_lock);
+    status = __write_all(fd, iov, (out->length > 0) ? 2 : 1);
+    pthread_mutex_unlock(&__output_lock);
+
+    completion_recordStats(STATS_WRITE_RESPONSE, started);
+    return status;
+}
@@ -0,0 +1,61 @@
+#ifndef _COMPLETION_OUTPUT_H_
+#define _COMPLETION_OUTPUT_H_
+
+
+#include <stddef.h>
+
+
+/*
+   RESPONSE FRAMING: every response is sent to the client with one write,
+   preceded by a header line:
+        [#request_id#] [#length#]
+        <# RESPONSE BODY: [#length#] bytes #>
+
+   request_id is the id given on the head line of the request (0 if none), so
+   the client could tell which request a response belongs to, and it doesn't
+   have to look into the body to find out where the response ends.
+
+   A session may also send a response nobody asked for, with id 0, once it
+   has started: warnings about the server options it couldn't use, one
+   "NOTICE: [#message#]" line each.
+*/
+
+
+/* A response being built, backed by a growable buffer which is reused from
+   one response to the next */
+typedef struct __completion_Output_struct
+{
+    char   *data;
+    size_t  length;      /* bytes of the response built so far */
+    size_t  capacity;    /* bytes allocated for data */
+
+} completion_Output;
+
+
+/* Release the buffer of out */
+void completion_freeOutput(completion_Output *out);
+
+/* Start building a new response in out */
+void completion_resetOutput(completion_Output *out);
+
+/* Make room for length more bytes at the end of out, and return where they
+   should be written to. completion_commitOutput(out, length) tells how many
+   of them have been written. */
+char *completion_reserveOutput(completion_Output *out, size_t length);
+void completion_commitOutput(completion_Output *out, size_t length);
+
+/* Append length bytes of data (or a string) to out */
+void completion_appendOutput(completion_Output *out, const char *data, size_t length);
+void completion_appendString(completion_Output *out, const char *string);
+
+/* Append formatted text to out */
+void completion_printOutput(completion_Output *out, const char *format, ...);
+
+/* Send the response in out to the client on fd, framed with request_id.
+   Responses sent from different threads never interleave. Returns -1 if the
+   client could not be written to. */
+int completion_sendResponse(int fd, unsigned long request_id, const completion_Output *out);
+
+
+
+#endif /* _COMPLETION_OUTPUT_H_ */
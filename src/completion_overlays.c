@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <string.h>
+#include "completion.h"
+
+
+
+/* Point the unsaved files passed to libclang at the overlays again, after
+   they have changed, the main file keeps the first slot */
+static void __update_unsaved_files(completion_Session *session)
+{
+    int i_overlay = 0;
+
+    session->unsaved_files = (struct CXUnsavedFile*)realloc(
+        session->unsaved_files, (session->n_overlays + 1) * sizeof(struct CXUnsavedFile));
+
+    for ( ; i_overlay < session->n_overlays; i_overlay++)
+    {
+        session->unsaved_files[i_overlay + 1].Filename = session->overlays[i_overlay].path;
+        session->unsaved_files[i_overlay + 1].Contents = session->overlays[i_overlay].contents;
+        session->unsaved_files[i_overlay + 1].Length   = session->overlays[i_overlay].length;
+    }
+}
+
+/* The overlay of the file at path, NULL if there's none */
+completion_Overlay* completion_findOverlay(completion_Session *session, const char *path)
+{
+    int i_overlay = 0;
+
+    for ( ; i_overlay < session->n_overlays; i_overlay++)
+    {
+        if (strcmp(session->overlays[i_overlay].path, path) == 0) {
+            return &session->overlays[i_overlay];
+        }
+    }
+
+    return NULL;
+}
+
+
+/* What __visit_inclusion compares the files included by cx_tu with */
+typedef struct __overlay_Inclusions_struct
+{
+    completion_Session *session;
+    CXFileUniqueID     *ids;       /* ids[i] is the file of overlays[i], */
+    int                *has_ids;   /* if has_ids[i] (it's known to cx_tu) */
+
+} overlay_Inclusions;
+
+/* Mark the overlay of included_file as included, files are told apart by
+   their unique id (the same file could be spelled in many ways), or by
+   their name if the id is not known */
+static void __visit_inclusion(
+    CXFile included_file, CXSourceLocation *inclusion_stack, unsigned include_len,
+    CXClientData client_data)
+{
+    overlay_Inclusions *inclusions = (overlay_Inclusions*)client_data;
+    completion_Overlay *overlays = inclusions->session->overlays;
+    CXFileUniqueID id;
+    CXString name;
+    int has_id = (clang_getFileUniqueID(included_file, &id) == 0);
+    int i_overlay = 0;
+    (void) inclusion_stack; (void) include_len;
+
+    name = clang_getFileName(included_file);
+    for ( ; i_overlay < inclusions->session->n_overlays; i_overlay++)
+    {
+        if (overlays[i_overlay].included) {
+            continue;
+        }
+
+        if (has_id && inclusions->has_ids[i_overlay]) {
+            overlays[i_overlay].included =
+                (memcmp(&id, &inclusions->ids[i_overlay], sizeof(id)) == 0);
+        }
+        else {
+            overlays[i_overlay].included =
+                (strcmp(clang_getCString(name), overlays[i_overlay].path) == 0);
+        }
+    }
+    clang_disposeString(name);
+}
+
+/* Find out which overlays cx_tu includes */
+void completion_noteInclusions(completion_Session *session)
+{
+    overlay_Inclusions inclusions;
+    CXFile file;
+    int i_overlay = 0;
+
+    if (session->n_overlays == 0) {
+        return;
+    }
+
+    inclusions.session = session;
+    inclusions.ids = (CXFileUniqueID*)calloc(session->n_overlays, sizeof(CXFileUniqueID));
+    inclusions.has_ids = (int*)calloc(session->n_overlays, sizeof(int));
+
+    for ( ; i_overlay < session->n_overlays; i_overlay++)
+    {
+        session->overlays[i_overlay].included = 0;
+        if (session->cx_tu != NULL &&
+            (file = clang_getFile(session->cx_tu, session->overlays[i_overlay].path)) != NULL)
+        {
+            inclusions.has_ids[i_overlay] =
+                (clang_getFileUniqueID(file, &inclusions.ids[i_overlay]) == 0);
+        }
+    }
+
+    if (session->cx_tu != NULL) {
+        clang_getInclusions(session->cx_tu, __visit_inclusion, &inclusions);
+    }
+
+    free(inclusions.has_ids);
+    free(inclusions.ids);
+}
+
+
+/* Replace the unsaved contents of the file at path */
+int completion_setOverlay(
+    completion_Session *session, const char *path, unsigned long version,
+    char *contents, size_t length)
+{
+    completion_Overlay *overlay = completion_findOverlay(session, path);
+    unsigned long hash = completion_hashBytes(contents, length);
+    int is_new = (overlay == NULL);
+
+    if (is_new)
+    {
+        session->overlays = (completion_Overlay*)realloc(
+            session->overlays, (session->n_overlays + 1) * sizeof(completion_Overlay));
+        overlay = &session->overlays[session->n_overlays++];
+        overlay->path = strdup(path);
+        overlay->contents = NULL;
+        overlay->included = 0;
+    }
+    else if (overlay->length == length && overlay->hash == hash)
+    {
+        /* say, an edit has been undone */
+        free(contents);
+        overlay->version = version;
+        return overlay->included;
+    }
+
+    free(overlay->contents);
+    overlay->contents = contents;
+    overlay->length   = length;
+    overlay->hash     = hash;
+    overlay->version  = version;
+    __update_unsaved_files(session);
+
+    if (is_new) {
+        completion_noteInclusions(session);
+        overlay = completion_findOverlay(session, path);
+    }
+
+    /* the results were computed with the old contents */
+    if (overlay->included) {
+        completion_invalidateCache(session);
+    }
+    return overlay->included;
+}
+
+/* Go back to the contents of the file at path on disk */
+int completion_dropOverlay(completion_Session *session, const char *path)
+{
+    completion_Overlay *overlay = completion_findOverlay(session, path);
+    int included;
+
+    if (overlay == NULL) {
+        return 0;
+    }
+
+    included = overlay->included;
+    free(overlay->path);
+    free(overlay->contents);
+
+    session->n_overlays--;
+    memmove(overlay, overlay + 1,
+            (size_t)(session->overlays + session->n_overlays - overlay) * sizeof(completion_Overlay));
+    __update_unsaved_files(session);
+
+    if (included) {
+        completion_invalidateCache(session);
+    }
+    return included;
+}
+
+
+/* The unsaved files to pass to libclang, with source as the main file */
+unsigned completion_getUnsavedFiles(
+    completion_Session *session, const char *source, size_t length,
+    struct CXUnsavedFile **files)
+{
+    if (session->unsaved_files == NULL) {
+        __update_unsaved_files(session);
+    }
+
+    session->unsaved_files[0].Filename = session->src_filename;
+    session->unsaved_files[0].Contents = source;
+    session->unsaved_files[0].Length   = length;
+
+    *files = session->unsaved_files;
+    return (unsigned)session->n_overlays + 1;
+}
+
+/* Copy the overlays for the worker, after a free slot for the main file */
+struct CXUnsavedFile* completion_copyOverlays(
+    const completion_Session *session, unsigned *n_files)
+{
+    struct CXUnsavedFile *files = (struct CXUnsavedFile*)calloc(
+        session->n_overlays + 1, sizeof(struct CXUnsavedFile));
+    const completion_Overlay *overlay;
+    char *contents;
+    int i_overlay = 0;
+
+    for ( ; i_overlay < session->n_overlays; i_overlay++)
+    {
+        overlay = &session->overlays[i_overlay];
+        contents = (char*)malloc(overlay->length + 1);
+        memcpy(contents, overlay->contents, overlay->length);
+
+        files[i_overlay + 1].Filename = strdup(overlay->path);
+        files[i_overlay + 1].Contents = contents;
+        files[i_overlay + 1].Length   = overlay->length;
+    }
+
+    *n_files = (unsigned)session->n_overlays + 1;
+    return files;
+}
+
+/* Free files copied by completion_copyOverlays */
+void completion_freeOverlayCopies(struct CXUnsavedFile *files, unsigned n_files)
+{
+    unsigned i_file = 1;
+
+    if (files == NULL) {
+        return;
+    }
+
+    for ( ; i_file < n_files; i_file++)
+    {
+        free((char*)files[i_file].Filename);
+        free((char*)files[i_file].Contents);
+    }
+    free(files);
+}
+
+/* Free the overlays of session */
+void completion_freeOverlays(completion_Session *session)
+{
+    int i_overlay = 0;
+
+    for ( ; i_overlay < session->n_overlays; i_overlay++)
+    {
+        free(session->overlays[i_overlay].path);
+        free(session->overlays[i_overlay].contents);
+    }
+
+    free(session->overlays);
+    free(session->unsaved_files);
+    session->overlays = NULL;
+    session->n_overlays = 0;
+    session->unsaved_files = NULL;
+}
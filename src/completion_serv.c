@@ -1,24 +1,89 @@
 #include <stdlib.h>
 #include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include "completion.h"
 
 
 
-/* Copy command line parameters (except source filename) to cmdline_args  */
+/* Names and parse options of the parse profiles, in the order of PROFILE_* */
+static const char *__profile_names[PROFILE_COUNT] = {
+    "interactive", "accurate", "low-memory"
+};
+static const unsigned __profile_options[PROFILE_COUNT] = {
+    INTERACTIVE_PARSE_OPTIONS, ACCURATE_PARSE_OPTIONS, LOW_MEMORY_PARSE_OPTIONS
+};
+
+/* Profile of the sessions started from now on */
+static int __default_profile = DEFAULT_PARSE_PROFILE;
+
+
+/* Copy command line parameters (except source filename) to cmdline_args, after
+   the flags of the source file in the compilation database */
 static void __copy_cmdlineArgs(int argc, char *argv[], completion_Session *session)
 {
-    int i_arg = 0;
-    session->num_args = argc - 2;  /* argv[0] and argv[argc - 2] should be discarded */
-    session->cmdline_args = (char**)calloc(sizeof(char*), session->num_args);
+    /* argv[0] and argv[argc - 1] should be discarded */
+    session->num_args = completion_buildCompileFlags(
+        argv[argc - 1], argc - 2, argv + 1, &session->cmdline_args);
+}
 
-    /* copy argv[1..argc-1] to cmdline_args */
-    for ( ; i_arg < session->num_args; i_arg++)
-    {
-        session->cmdline_args[i_arg] = 
-            (char*)calloc(sizeof(char), strlen(argv[i_arg + 1]) + 1);
+/* Initialize the source buffer and parser state of session to their defaults */
+static void __initialize_sessionDefaults(completion_Session *session)
+{
+    session->src_length = 0;      /* we haven't read any source code yet. */
+    session->src_version = 0;
+    session->src_updates = 0;
+    session->src_in_sync = 0;     /* client must send a full copy first */
+    memset(&session->preamble, 0, sizeof(session->preamble));
+    session->preamble_hash = 0;
+    session->buffer_capacity = INITIAL_SRC_BUFFER_SIZE;
+    session->src_buffer = (char*)calloc(sizeof(char), session->buffer_capacity);
+    session->overlays = NULL;
+    session->n_overlays = 0;
+    session->unsaved_files = NULL;
 
-        strcpy(session->cmdline_args[i_arg], argv[i_arg + 1]);
-    }
+    /* default parameters */
+    session->parse_profile     = __default_profile;
+    session->ParseOptions      = __profile_options[__default_profile];
+    completion_defaultCompleteAtOptions(session->CompleteAtOptions);
+    session->complete_on = session->complete_off = 0;
+
+    session->cx_tu = NULL;
+    session->tu_generation = 0;
+    session->tu_hash = 0;
+    session->tu_preamble = 0;
+    session->tu_pch = 0;
+    session->hibernated = 0;
+    memset(&session->diagnostics, 0, sizeof(session->diagnostics));
+    session->diagnostics_generation = 0;
+    session->diag_ids = NULL;
+    session->n_diag_ids = 0;
+    session->diag_set_id = 0;
+    session->n_pooled_units = 0;
+    memset(&session->cache, 0, sizeof(session->cache));
+    memset(session->speculations, 0, sizeof(session->speculations));
+    session->n_spec_points = session->i_spec_point = 0;
+    memset(&session->lexicon, 0, sizeof(session->lexicon));
+    memset(session->complete_cost, 0, sizeof(session->complete_cost));
+    memset(&session->response, 0, sizeof(session->response));
+
+    session->reparse_state = 0;
+    session->spare_tu = session->ready_tu = NULL;
+    session->spare_hash = session->ready_hash = 0;
+    session->spare_preamble = session->ready_preamble = 0;
+    session->spare_pch = session->ready_pch = 0;
+    session->snapshot = NULL;
+    session->snapshot_length = 0;
+    session->snapshot_hash = 0;
+    session->snapshot_preamble = 0;
+    session->snapshot_files = NULL;
+    session->n_snapshot_files = 0;
+    session->diag_outs = NULL;
+    session->n_diag_outs = 0;
+    session->reparse_cost = session->preamble_cost = 0;
+    session->reparse_queued_at = session->reparse_due = 0;
+    session->reparse_next = NULL;
 }
 
 /* Initialize basic information for completion, such as source filename, initial source 
@@ -28,72 +93,425 @@ __initialize_completionSession(int argc, char *argv[], completion_Session *sessi
 {
     /* filename shall be the last parameter */
     session->src_filename = argv[argc - 1];
-    session->src_length = 0;      /* we haven't read any source code yet. */
-    session->buffer_capacity = INITIAL_SRC_BUFFER_SIZE;
-    session->src_buffer = (char*)calloc(sizeof(char), session->buffer_capacity);
+    __initialize_sessionDefaults(session);
 
     __copy_cmdlineArgs(argc, argv, session);
 }
 
 
-/* Initialize session object and launch the completion server, preparse the source file and 
-   build the AST for furture code completion requests  
+/* Initialize session object and launch the completion server. The AST is
+   built by the first request which needs it: the source hasn't been sent
+   yet, and a completion is answered from the lexicon meanwhile if the
+   client has given it a budget.
 */
-void startup_completionSession(int argc, char *argv[], completion_Session *session)
+void startup_completionSession(
+    int argc, char *argv[], CXIndex cx_index, completion_Session *session)
 {
     __initialize_completionSession(argc, argv, session);
 
-    /* default parameters */
-    session->ParseOptions      = DEFAULT_PARSE_OPTIONS;
-    session->CompleteAtOptions = DEFAULT_COMPLETEAT_OPTIONS;
+    session->cx_index = cx_index;
+}
 
-    session->cx_index = clang_createIndex(0, 0);
-    completion_parseTranslationUnit(session);
-    completion_reparseTranslationUnit(session);
+/* Initialize session object for filename, which shares cx_index with other
+   sessions. The translation unit is not built until it is needed. */
+void startup_sharedCompletionSession(
+    CXIndex cx_index, const char *filename, int num_args, char **args, 
+    completion_Session *session)
+{
+    session->src_filename = filename;
+    __initialize_sessionDefaults(session);
+
+    session->num_args = completion_buildCompileFlags(
+        filename, num_args, args, &session->cmdline_args);
+
+    session->cx_index = cx_index;
 }
 
 
-/* Simple wrappers for clang parser functions */
+/* dispose num_args arguments of args and the vector itself */
+static void __free_args(int num_args, char **args)
+{
+    int i_arg = 0;
+    for ( ; i_arg < num_args; i_arg++) {
+        free(args[i_arg]);
+    }
+
+    free(args);
+}
+
+/* dispose command line arguments of session */
+void completion_freeCmdlineArgs(completion_Session *session)
+{
+    __free_args(session->num_args, session->cmdline_args);
+}
+
+
+/* Take the translation unit parked with num_args args out of the pool of
+   session (with its tu_hash), returns NULL if there's none */
+static CXTranslationUnit __take_pooled_unit(
+    completion_Session *session, int num_args, char **args, unsigned long *tu_hash,
+    unsigned long *tu_pch)
+{
+    completion_PooledUnit *pool = session->tu_pool;
+    CXTranslationUnit tu;
+    int i_unit = 0;
+
+    for ( ; i_unit < session->n_pooled_units; i_unit++)
+    {
+        if (completion_sameFlags(
+                num_args, args, pool[i_unit].num_args, pool[i_unit].cmdline_args)) {
+            break;
+        }
+    }
+
+    if (i_unit == session->n_pooled_units) {
+        return NULL;
+    }
+
+    tu = pool[i_unit].cx_tu;
+    *tu_hash = pool[i_unit].tu_hash;
+    *tu_pch = pool[i_unit].tu_pch;
+    __free_args(pool[i_unit].num_args, pool[i_unit].cmdline_args);
+
+    session->n_pooled_units--;
+    memmove(pool + i_unit, pool + i_unit + 1,
+            (session->n_pooled_units - i_unit) * sizeof(completion_PooledUnit));
+    return tu;
+}
+
+/* Park tu, parsed with num_args args (the pool takes ownership of both) in the
+   pool of session, the least recently used one goes if the pool is full */
+static void __park_unit(
+    completion_Session *session, CXTranslationUnit tu, unsigned long tu_hash,
+    unsigned long tu_pch, int num_args, char **args)
+{
+    completion_PooledUnit *pool = session->tu_pool;
+
+    if (tu == NULL)
+    {
+        __free_args(num_args, args);
+        return;
+    }
+
+    if (session->n_pooled_units == MAX_POOLED_UNITS)
+    {
+        clang_disposeTranslationUnit(pool[0].cx_tu);
+        __free_args(pool[0].num_args, pool[0].cmdline_args);
+
+        session->n_pooled_units--;
+        memmove(pool, pool + 1, session->n_pooled_units * sizeof(completion_PooledUnit));
+    }
+
+    pool[session->n_pooled_units].cx_tu = tu;
+    pool[session->n_pooled_units].tu_hash = tu_hash;
+    pool[session->n_pooled_units].tu_pch = tu_pch;
+    pool[session->n_pooled_units].num_args = num_args;
+    pool[session->n_pooled_units].cmdline_args = args;
+    session->n_pooled_units++;
+}
+
+/* Use num_args canonical flags from now on */
+int completion_switchCmdlineArgs(completion_Session *session, int num_args, char **args)
+{
+    CXTranslationUnit parked = session->cx_tu;
+
+    if (completion_sameFlags(num_args, args, session->num_args, session->cmdline_args))
+    {
+        __free_args(num_args, args);
+        return 0;
+    }
+
+    /* the worker must be done with the old args before they are parked, and
+       its spare translation units are of the old flags */
+    completion_releaseSpareTranslationUnits(session);
+    completion_invalidateCache(session);
+
+    __park_unit(session, parked, session->tu_hash, session->tu_pch,
+                session->num_args, session->cmdline_args);
+    session->num_args = num_args;
+    session->cmdline_args = args;
+    session->tu_hash = 0;
+    session->tu_preamble = 0;    /* not known for pooled ones */
+    session->tu_pch = 0;
+    session->cx_tu = __take_pooled_unit(
+        session, num_args, args, &session->tu_hash, &session->tu_pch);
+
+    if (session->cx_tu == NULL) {
+        completion_parseTranslationUnit(session);
+    }
+    completion_reparseTranslationUnit(session);  /* dump PCH, or catch up with
+                                                  * the source of a pooled one,
+                                                  * unless it's up to date */
+    return 1;
+}
+
+/* PROFILE_* named name, -1 if there's none */
+int completion_findParseProfile(const char *name)
+{
+    int profile = 0;
+
+    for ( ; profile < PROFILE_COUNT; profile++)
+    {
+        if (strcmp(__profile_names[profile], name) == 0) {
+            return profile;
+        }
+    }
+
+    return -1;
+}
+
+/* Name of profile */
+const char *completion_parseProfileName(int profile)
+{
+    return __profile_names[profile];
+}
 
-static struct CXUnsavedFile __get_CXUnsavedFile(const completion_Session *session)
+/* Profile of the sessions started from now on */
+void completion_setDefaultParseProfile(int profile)
 {
-    struct CXUnsavedFile unsaved_files;
-    unsaved_files.Filename = session->src_filename;
-    unsaved_files.Contents = session->src_buffer;
-    unsaved_files.Length   = session->src_length;
+    __default_profile = profile;
+}
+
+/* Parse the source of session with the options of profile from now on */
+int completion_setParseProfile(completion_Session *session, int profile)
+{
+    int had_unit = (session->cx_tu != NULL);
+
+    if (profile == session->parse_profile) {
+        return 0;
+    }
 
-    return unsaved_files;
+    /* the options of a translation unit are fixed when it's parsed, and the
+       worker must be done with the old ones */
+    completion_releaseTranslationUnit(session);
+    session->parse_profile = profile;
+    session->ParseOptions = __profile_options[profile];
+    session->tu_hash = 0;
+    session->tu_preamble = 0;
+
+    if (had_unit) {
+        completion_ensureTranslationUnit(session);
+    }
+    return 1;
 }
 
+/* Dispose the translation units parked in the pool of session */
+void completion_releasePooledUnits(completion_Session *session)
+{
+    int i_unit = 0;
+    for ( ; i_unit < session->n_pooled_units; i_unit++)
+    {
+        clang_disposeTranslationUnit(session->tu_pool[i_unit].cx_tu);
+        __free_args(session->tu_pool[i_unit].num_args, session->tu_pool[i_unit].cmdline_args);
+    }
+
+    session->n_pooled_units = 0;
+}
+
+/* Free everything owned by session except the (probably shared) cx_index */
+void shutdown_completionSession(completion_Session *session)
+{
+    completion_releaseTranslationUnit(session);
+    completion_freeCmdlineArgs(session);
+    free(session->src_buffer);
+    completion_freeOverlays(session);
+    completion_freeLexicon(session);
+    free(session->snapshot);
+    completion_freeOverlayCopies(session->snapshot_files, session->n_snapshot_files);
+    free(session->diag_outs);
+    completion_freeOutput(&session->response);
+    completion_freeOutput(&session->diagnostics);
+    free(session->diag_ids);
+}
+
+
+/* Make sure that session has a translation unit, it would be rebuilt from
+   src_buffer if it had been released */
+CXTranslationUnit completion_ensureTranslationUnit(completion_Session *session)
+{
+    unsigned long started = completion_statsNow();
+
+    if (session->cx_tu == NULL && completion_parseTranslationUnit(session) != NULL) {
+        completion_reparseTranslationUnit(session);  /* dump PCH for acceleration,
+                                                      * unless it's already done */
+    }
+
+    if (session->hibernated && session->cx_tu != NULL)
+    {
+        session->hibernated = 0;
+        completion_recordStats(STATS_RESTORE, started);
+    }
+
+    return session->cx_tu;
+}
+
+/* Dispose the translation unit of session to save memory, src_buffer and
+   command line arguments are kept so it could be rebuilt later */
+void completion_releaseTranslationUnit(completion_Session *session)
+{
+    completion_releaseSpareTranslationUnits(session);
+    completion_releasePooledUnits(session);
+    completion_freeCache(session);
+    if (session->cx_tu != NULL)
+    {
+        clang_disposeTranslationUnit(session->cx_tu);
+        session->cx_tu = NULL;
+    }
+}
+
+/* Hibernate an idle session */
+int completion_hibernate(completion_Session *session)
+{
+    unsigned long started = completion_statsNow();
+
+    if (session->cx_tu == NULL || completion_isReparsePending(session)) {
+        return 0;
+    }
+
+    /* the restore parses against the PCH of the preamble if the AST cache
+       has it. It's not built here, that would hold up the next request of
+       the session, and in the daemon the requests of every other client. */
+    completion_releaseTranslationUnit(session);
+#ifdef __GLIBC__
+    malloc_trim(0);    /* free() keeps most of what libclang had for later */
+#endif
+
+    session->hibernated = 1;
+    completion_recordStats(STATS_HIBERNATE, started);
+    return 1;
+}
+
+/* Memory used by tu in bytes */
+static unsigned long __get_tu_memory(CXTranslationUnit tu)
+{
+    CXTUResourceUsage usage;
+    unsigned long total = 0;
+    unsigned i_entry = 0;
+
+    if (tu == NULL) {
+        return 0;
+    }
+
+    usage = clang_getCXTUResourceUsage(tu);
+    for ( ; i_entry < usage.numEntries; i_entry++) {
+        total += usage.entries[i_entry].amount;
+    }
+    clang_disposeCXTUResourceUsage(usage);
+
+    return total;
+}
+
+/* Memory used by the translation units of session in bytes, the spare ones
+   are only counted when the worker is not reparsing them */
+unsigned long completion_getTranslationUnitMemory(completion_Session *session)
+{
+    unsigned long total = __get_tu_memory(session->cx_tu);
+    int i_unit = 0;
+
+    for ( ; i_unit < session->n_pooled_units; i_unit++) {
+        total += __get_tu_memory(session->tu_pool[i_unit].cx_tu);
+    }
+
+    if (!completion_isReparsePending(session)) {
+        total += __get_tu_memory(session->spare_tu) + __get_tu_memory(session->ready_tu);
+    }
+
+    return total;
+}
+
+
+/* Simple wrappers for clang parser functions */
+
 CXTranslationUnit 
 completion_parseTranslationUnit(completion_Session *session)
 {
-    struct CXUnsavedFile unsaved_files = __get_CXUnsavedFile(session);
-    session->cx_tu = 
-        clang_parseTranslationUnit(
-            session->cx_index, session->src_filename, 
-            (const char * const *) session->cmdline_args, session->num_args, 
-            &unsaved_files, 1,
-            session->ParseOptions);
+    struct CXUnsavedFile *unsaved_files;
+    unsigned n_files = completion_getUnsavedFiles(
+        session, session->src_buffer, session->src_length, &unsaved_files);
+
+    session->cx_tu = completion_parseWithAstCache(
+        session, unsaved_files, n_files, &session->tu_pch);
+    completion_noteInclusions(session);
+
+    /* the following reparse is needed to build the preamble, unless it's
+       been built by this parse */
+    session->tu_hash = (session->cx_tu != NULL && PREAMBLE_ON_FIRST_PARSE) ?
+        completion_hashUnsavedFiles(session, session->src_buffer, session->src_length) : 0;
+    session->tu_preamble = (session->tu_hash != 0) ? session->preamble_hash : 0;
 
+    session->tu_generation++;
+    completion_invalidateCache(session);
     return session->cx_tu;
 }
 
+/* Reparse cx_tu, which is skipped if it's up to date with src_buffer */
 int completion_reparseTranslationUnit(completion_Session *session)
 {
-    struct CXUnsavedFile unsaved_files = __get_CXUnsavedFile(session);
-    return 
+    struct CXUnsavedFile *unsaved_files;
+    unsigned n_files;
+    unsigned long hash, started;
+    int status, stats_id;
+
+    /* the headers of its PCH have changed, but the PCH would keep them from
+       being seen again */
+    if (session->cx_tu != NULL && completion_isCachedPchStale(session->tu_pch))
+    {
+        clang_disposeTranslationUnit(session->cx_tu);
+        session->cx_tu = NULL;
+    }
+
+    if (session->cx_tu == NULL) {
+        return (completion_ensureTranslationUnit(session) != NULL) ? 0 : -1;
+    }
+
+    hash = completion_hashUnsavedFiles(session, session->src_buffer, session->src_length);
+    if (hash == session->tu_hash) {
+        return 0;
+    }
+
+    session->tu_generation++;
+    completion_invalidateCache(session);
+    n_files = completion_getUnsavedFiles(
+        session, session->src_buffer, session->src_length, &unsaved_files);
+    stats_id = (session->tu_preamble == session->preamble_hash && session->tu_preamble != 0) ?
+        STATS_REPARSE_BODY : STATS_REPARSE_PREAMBLE;
+    started = completion_statsNow();
+    status = 
         clang_reparseTranslationUnit(
-            session->cx_tu, 1, &unsaved_files, session->ParseOptions);
+            session->cx_tu, n_files, unsaved_files, session->ParseOptions);
+    completion_recordStats(STATS_REPARSE_TU, started);
+    completion_recordStats(stats_id, started);
+    completion_sampleMemory(session->cx_tu);
+
+    /* the source may include other overlays now */
+    completion_noteInclusions(session);
+    session->tu_hash = (status == 0) ?
+        completion_hashUnsavedFiles(session, session->src_buffer, session->src_length) : 0;
+    session->tu_preamble = (status == 0) ? session->preamble_hash : 0;
+    return status;
 }
 
 CXCodeCompleteResults* 
 completion_codeCompleteAt(
-    completion_Session *session, int line, int column)
+    completion_Session *session, int line, int column, unsigned options)
 {
-    struct CXUnsavedFile unsaved_files = __get_CXUnsavedFile(session);
-    return 
+    struct CXUnsavedFile *unsaved_files;
+    unsigned n_files;
+    CXCodeCompleteResults *results;
+    unsigned long started;
+
+    if (completion_ensureTranslationUnit(session) == NULL) {
+        return NULL;
+    }
+
+    n_files = completion_getUnsavedFiles(
+        session, session->src_buffer, session->src_length, &unsaved_files);
+    started = completion_statsNow();
+    results = 
         clang_codeCompleteAt(
             session->cx_tu, session->src_filename, line, column, 
-            &unsaved_files, 1, session->CompleteAtOptions);
+            unsaved_files, n_files, options);
+    completion_recordStats(STATS_CODE_COMPLETE, started);
+
+    return results;
 }
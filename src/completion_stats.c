@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "completion_stats.h"
+
+
+/* Values below 2^HISTOGRAM_SUB_BITS have a bucket each, bigger ones share a
+   bucket with the ones within 1/2^(HISTOGRAM_SUB_BITS - 1) of them */
+#define  HISTOGRAM_SUB_BITS   4
+#define  HISTOGRAM_BUCKETS    (64 << (HISTOGRAM_SUB_BITS - 1))
+
+/* Latency histogram of a message type or phase (in microseconds) */
+typedef struct __stats_Histogram_struct
+{
+    unsigned long count;
+    unsigned long total;
+    unsigned long max;
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+    unsigned long results;    /* counted by completion_countResults */
+    unsigned long kept;
+
+} stats_Histogram;
+
+#define  MAX_MEMORY_KINDS   32
+
+
+static const char *__stats_names[STATS_COUNT] = {
+    "COMPLETION", "SOURCEFILE", "SOURCEDELTA", "CMDLINEARGS", "REPARSE",
+    "SYNTAXCHECK", "STATS", "SHUTDOWN", "CURSOR",
+    "SYMBOLS", "DEFINITION", "DETAIL", "UNSAVED", "PROFILE",
+    "read_message", "parse", "reparse", "code_complete", "sort_results",
+    "filter", "print_results", "diagnostics", "write_response", "hibernate", "restore",
+    "speculate", "update_body", "update_preamble", "reparse_body", "reparse_preamble",
+    "complete_global", "complete_member", "complete_qualified", "complete_preprocessor",
+    "lexical"
+};
+
+/* Everything below is guarded by __stats_lock */
+static pthread_mutex_t __stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_Histogram __histograms[STATS_COUNT];
+static unsigned long   __started_at = 0;
+static FILE           *__trace = NULL;
+
+/* memory of the last translation unit sampled */
+static unsigned long          __memory_total = 0;
+static unsigned long          __memory_peak = 0;
+static CXTUResourceUsageEntry __memory_kinds[MAX_MEMORY_KINDS];
+static unsigned               __n_memory_kinds = 0;
+
+
+
+/* Microseconds on a monotonic clock */
+unsigned long completion_statsNow(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long)now.tv_sec * 1000000 + (unsigned long)now.tv_nsec / 1000;
+}
+
+/* Start the clock of the stats, and open the trace file */
+void completion_initStats(void)
+{
+    const char *trace_path = getenv("CLANG_COMPLETE_TRACE");
+    char  path[4096];
+
+    __started_at = completion_statsNow();
+
+    /* every server of a session writes its own file */
+    if (trace_path != NULL && trace_path[0] != '\0')
+    {
+        snprintf(path, sizeof(path), "%s.%d.json", trace_path, (int)getpid());
+        if ((__trace = fopen(path, "w")) != NULL)
+        {
+            /* the closing ']' may be left out, the viewers don't mind */
+            setvbuf(__trace, NULL, _IOLBF, 0);
+            fputs("[\n", __trace);
+        }
+    }
+}
+
+
+static unsigned __bucket_of(unsigned long value)
+{
+    int msb = 0;
+
+    if (value < (1UL << HISTOGRAM_SUB_BITS)) {
+        return (unsigned)value;
+    }
+
+    while ((value >> msb) > 1) {
+        msb++;
+    }
+
+    /* the top HISTOGRAM_SUB_BITS bits of value */
+    return (unsigned)((msb - HISTOGRAM_SUB_BITS + 1) << (HISTOGRAM_SUB_BITS - 1)) +
+           (unsigned)(value >> (msb - HISTOGRAM_SUB_BITS + 1));
+}
+
+/* The highest value of bucket */
+static unsigned long __bucket_limit(unsigned bucket)
+{
+    unsigned shift;
+
+    if (bucket < (1U << HISTOGRAM_SUB_BITS)) {
+        return bucket;
+    }
+
+    shift = (bucket >> (HISTOGRAM_SUB_BITS - 1)) - 1;
+    return (((unsigned long)(bucket & ((1U << (HISTOGRAM_SUB_BITS - 1)) - 1)) +
+             (1UL << (HISTOGRAM_SUB_BITS - 1)) + 1) << shift) - 1;
+}
+
+/* The value below which fraction (per mille) of the values of histogram are */
+static unsigned long __percentile(const stats_Histogram *histogram, unsigned per_mille)
+{
+    unsigned long rank = (histogram->count * per_mille + 999) / 1000, seen = 0;
+    unsigned bucket = 0;
+
+    for ( ; bucket < HISTOGRAM_BUCKETS; bucket++)
+    {
+        seen += histogram->buckets[bucket];
+        if (seen >= rank && seen > 0) {
+            break;
+        }
+    }
+
+    /* the bucket limit could overshoot the largest value seen */
+    return (__bucket_limit(bucket) < histogram->max) ? __bucket_limit(bucket) : histogram->max;
+}
+
+
+/* Record that stats_id took from started until now */
+void completion_recordStats(int stats_id, unsigned long started)
+{
+    unsigned long now = completion_statsNow(), elapsed = now - started;
+    stats_Histogram *histogram = &__histograms[stats_id];
+
+    pthread_mutex_lock(&__stats_lock);
+
+    histogram->count++;
+    histogram->total += elapsed;
+    histogram->buckets[__bucket_of(elapsed)]++;
+    if (elapsed > histogram->max) {
+        histogram->max = elapsed;
+    }
+
+    if (__trace != NULL)
+    {
+        fprintf(__trace,
+                "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,"
+                "\"pid\":%d,\"tid\":%lu},\n",
+                __stats_names[stats_id], (stats_id < STATS_READ_MESSAGE) ? "message" : "phase",
+                started, elapsed, (int)getpid(), (unsigned long)pthread_self());
+    }
+
+    pthread_mutex_unlock(&__stats_lock);
+}
+
+/* Count the results of a phase timed as stats_id */
+void completion_countResults(int stats_id, unsigned n_results, unsigned n_kept)
+{
+    pthread_mutex_lock(&__stats_lock);
+    __histograms[stats_id].results += n_results;
+    __histograms[stats_id].kept += n_kept;
+    pthread_mutex_unlock(&__stats_lock);
+}
+
+/* Record the memory used by tu */
+void completion_sampleMemory(CXTranslationUnit tu)
+{
+    CXTUResourceUsage usage;
+    unsigned i_entry = 0;
+
+    if (tu == NULL) {
+        return;
+    }
+
+    usage = clang_getCXTUResourceUsage(tu);
+    pthread_mutex_lock(&__stats_lock);
+
+    __memory_total = 0;
+    __n_memory_kinds = 0;
+    for ( ; i_entry < usage.numEntries; i_entry++)
+    {
+        __memory_total += usage.entries[i_entry].amount;
+        if (__n_memory_kinds < MAX_MEMORY_KINDS) {
+            __memory_kinds[__n_memory_kinds++] = usage.entries[i_entry];
+        }
+    }
+    if (__memory_total > __memory_peak) {
+        __memory_peak = __memory_total;
+    }
+
+    pthread_mutex_unlock(&__stats_lock);
+    clang_disposeCXTUResourceUsage(usage);
+}
+
+
+/* Print the stats to out */
+void completion_printStats(completion_Output *out)
+{
+    const stats_Histogram *histogram;
+    const char *kind;
+    unsigned i_kind = 0;
+    int stats_id = 0;
+
+    pthread_mutex_lock(&__stats_lock);
+
+    completion_printOutput(out, "uptime_us:%lu\n", completion_statsNow() - __started_at);
+
+    for ( ; stats_id < STATS_COUNT; stats_id++)
+    {
+        histogram = &__histograms[stats_id];
+        if (histogram->count == 0) {
+            continue;
+        }
+
+        completion_printOutput(out,
+            "%s count:%lu mean_us:%lu p50_us:%lu p90_us:%lu p99_us:%lu max_us:%lu",
+            __stats_names[stats_id], histogram->count, histogram->total / histogram->count,
+            __percentile(histogram, 500), __percentile(histogram, 900),
+            __percentile(histogram, 990), histogram->max);
+        if (histogram->results > 0) {
+            completion_printOutput(out, " results:%lu kept:%lu",
+                                   histogram->results, histogram->kept);
+        }
+        completion_appendOutput(out, "\n", 1);
+    }
+
+    completion_printOutput(out, "memory total:%lu peak:%lu", __memory_total, __memory_peak);
+    for ( ; i_kind < __n_memory_kinds; i_kind++)
+    {
+        kind = clang_getTUResourceUsageName(__memory_kinds[i_kind].kind);
+        completion_printOutput(out, " %s:%lu",
+            (kind != NULL) ? kind : "unknown", __memory_kinds[i_kind].amount);
+    }
+    completion_appendOutput(out, "\n", 1);
+
+    pthread_mutex_unlock(&__stats_lock);
+}
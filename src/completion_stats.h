@@ -0,0 +1,92 @@
+#ifndef _COMPLETION_STATS_H_
+#define _COMPLETION_STATS_H_
+
+
+#include <clang-c/Index.h>
+#include "completion_output.h"
+
+
+
+/*
+   STATS: latency of every message type and of every phase of the work done
+   for them, kept in log-linear histograms (values within 1/8 of each other
+   share a bucket, as in HdrHistogram), and the memory used by the last
+   translation unit parsed. They're process-wide, the reparse worker records
+   its phases as well.
+
+   If CLANG_COMPLETE_TRACE names a file, every timed interval is also written
+   to it as a Chrome trace event (chrome://tracing, or ui.perfetto.dev).
+*/
+
+/* Message types, timed from the moment their message is read to the moment
+   their response is sent */
+#define  STATS_COMPLETION        0
+#define  STATS_SOURCEFILE        1
+#define  STATS_SOURCEDELTA       2
+#define  STATS_CMDLINEARGS       3
+#define  STATS_REPARSE           4
+#define  STATS_SYNTAXCHECK       5
+#define  STATS_STATS             6
+#define  STATS_SHUTDOWN          7
+#define  STATS_CURSOR            8
+#define  STATS_SYMBOLS           9
+#define  STATS_DEFINITION       10
+#define  STATS_DETAIL           11
+#define  STATS_UNSAVED          12
+#define  STATS_PROFILE          13
+
+/* Phases */
+#define  STATS_READ_MESSAGE     14    /* reading and parsing a message */
+#define  STATS_PARSE            15    /* clang_parseTranslationUnit */
+#define  STATS_REPARSE_TU       16    /* clang_reparseTranslationUnit */
+#define  STATS_CODE_COMPLETE    17    /* clang_codeCompleteAt */
+#define  STATS_SORT_RESULTS     18    /* clang_sortCodeCompletionResults */
+#define  STATS_FILTER           19    /* filtering and ranking candidates */
+#define  STATS_PRINT_RESULTS    20    /* printing candidates */
+#define  STATS_DIAGNOSTICS      21    /* printing diagnostics */
+#define  STATS_WRITE_RESPONSE   22    /* writing a response to the client */
+#define  STATS_HIBERNATE        23    /* disposing the TUs of an idle session */
+#define  STATS_RESTORE          24    /* rebuilding the TU of a hibernated one */
+#define  STATS_SPECULATE        25    /* completing at a point in advance */
+#define  STATS_UPDATE_BODY      26    /* classifying a source update as an */
+#define  STATS_UPDATE_PREAMBLE  27    /* edit of the body or of the preamble */
+#define  STATS_REPARSE_BODY     28    /* reparsing against the preamble PCH */
+#define  STATS_REPARSE_PREAMBLE 29    /* reparsing and rebuilding the PCH */
+#define  STATS_COMPLETE_GLOBAL  30    /* clang_codeCompleteAt in each */
+#define  STATS_COMPLETE_MEMBER  31    /* completion context, in the order */
+#define  STATS_COMPLETE_QUALIFIED 32  /* of CONTEXT_* */
+#define  STATS_COMPLETE_PREPROC 33
+#define  STATS_LEXICAL          34    /* answering with lexical candidates */
+
+#define  STATS_COUNT            35
+
+
+/* Start the clock of the stats, and open the trace file named by
+   CLANG_COMPLETE_TRACE (if any) */
+void completion_initStats(void);
+
+/* Microseconds on a monotonic clock */
+unsigned long completion_statsNow(void);
+
+/* Record that stats_id took from started (as given by completion_statsNow)
+   until now */
+void completion_recordStats(int stats_id, unsigned long started);
+
+/* Count the n_results results of a phase timed as stats_id, n_kept of
+   which have been kept */
+void completion_countResults(int stats_id, unsigned n_results, unsigned n_kept);
+
+/* Record the memory used by tu, which has just been (re)parsed */
+void completion_sampleMemory(CXTranslationUnit tu);
+
+/* Print the stats to out, one line per histogram:
+       [#name#] count:[#n#] mean_us:[#mean#] p50_us:[#p50#] p90_us:[#p90#]
+                p99_us:[#p99#] max_us:[#max#]
+                results:[#n#] kept:[#n#]     (if results are counted)
+   followed by the memory of the last translation unit:
+       memory total:[#bytes#] peak:[#bytes#] [#kind#]:[#bytes#] ... */
+void completion_printStats(completion_Output *out);
+
+
+
+#endif /* _COMPLETION_STATS_H_ */
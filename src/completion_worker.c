@@ -0,0 +1,516 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "completion.h"
+
+
+/* All background reparse state (the queue and the reparse fields of sessions)
+   is guarded by __worker_lock */
+static pthread_mutex_t __worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  __worker_wakeup = PTHREAD_COND_INITIALIZER;  /* job queued */
+static pthread_cond_t  __worker_done = PTHREAD_COND_INITIALIZER;    /* job finished */
+
+static int __worker_started = 0;
+static completion_Session *__queue_head = NULL, *__queue_tail = NULL;
+
+/* clients the running job is going to send diagnostics to */
+static completion_Receiver *__running_outs = NULL;
+static int __n_running_outs = 0;
+static int __writing_outs = 0;
+
+/* diagnostics of the running job for one client, only touched by the worker */
+static completion_Output __diagnostics;
+
+
+
+/* Current time in milliseconds */
+static unsigned long __now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (unsigned long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Take the first queued session whose reparse is due off the queue, returns
+   NULL and sets next_due to the earliest due time if none of them is due */
+static completion_Session *__take_due_session(unsigned long *next_due)
+{
+    completion_Session **link = &__queue_head, *session, *previous = NULL;
+    unsigned long now = __now_ms();
+
+    *next_due = (unsigned long)-1;
+    for ( ; (session = *link) != NULL; previous = session, link = &session->reparse_next)
+    {
+        if (session->reparse_due > now)
+        {
+            if (session->reparse_due < *next_due) {
+                *next_due = session->reparse_due;
+            }
+            continue;
+        }
+
+        *link = session->reparse_next;
+        if (__queue_tail == session) {
+            __queue_tail = previous;
+        }
+        return session;
+    }
+
+    return NULL;
+}
+
+/* Reparse tu (or parse a new one if tu is NULL) with the n_files unsaved
+   files, the main file first, unless tu_hash tells it's been parsed with the
+   same ones already. keeps_preamble is nonzero if tu has been parsed with the
+   same preamble, pch is the cached PCH it's been parsed over, updated if it's
+   parsed anew. Runs on the worker thread without the lock. */
+static CXTranslationUnit __reparse(
+    completion_Session *session, CXTranslationUnit tu, unsigned long tu_hash,
+    unsigned long *pch, struct CXUnsavedFile *unsaved_files, unsigned n_files,
+    unsigned long hash, int keeps_preamble)
+{
+    unsigned long started;
+
+    if (tu != NULL && completion_isCachedPchStale(*pch))
+    {
+        clang_disposeTranslationUnit(tu);    /* see completion_reparseTranslationUnit */
+        tu = NULL;
+    }
+
+    if (tu == NULL)
+    {
+        tu = completion_parseWithAstCache(session, unsaved_files, n_files, pch);
+
+        if (tu == NULL || PREAMBLE_ON_FIRST_PARSE) {
+            return tu;
+        }
+    }
+    else if (tu_hash == hash) {
+        return tu;    /* say, the edits since it was parsed have been undone */
+    }
+
+    /* the first reparse of a fresh translation unit builds its PCH */
+    started = completion_statsNow();
+    clang_reparseTranslationUnit(tu, n_files, unsaved_files, session->ParseOptions);
+    completion_recordStats(STATS_REPARSE_TU, started);
+    completion_recordStats(keeps_preamble ? STATS_REPARSE_BODY : STATS_REPARSE_PREAMBLE, started);
+    completion_sampleMemory(tu);
+    return tu;
+}
+
+/* Send the diagnostics of tu to the clients waiting for them, each in the
+   format it asked for. It's done without the lock, but completion_detachOutput
+   won't return before we're done. */
+static void __send_diagnostics(completion_Session *session, CXTranslationUnit tu)
+{
+    int i_out = 0;
+    unsigned long started;
+
+    for ( ; i_out < __n_running_outs; i_out++)
+    {
+        if (__running_outs[i_out].fd < 0) {
+            continue;    /* the client has gone */
+        }
+
+        started = completion_statsNow();
+        completion_resetOutput(&__diagnostics);
+        if (tu != NULL) {
+            completion_printRequestedDiagnostics(
+                session, tu, &__running_outs[i_out].options, &__diagnostics);
+        }
+        completion_recordStats(STATS_DIAGNOSTICS, started);
+
+        completion_sendResponse(
+            __running_outs[i_out].fd, __running_outs[i_out].request_id, &__diagnostics);
+        completion_recordStats(STATS_SYNTAXCHECK, __running_outs[i_out].received_at);
+    }
+}
+
+/* Worker thread: take sessions off the queue and reparse them one by one */
+static void *__worker_main(void *unused)
+{
+    completion_Session *session;
+    CXTranslationUnit tu;
+    char *source;
+    struct CXUnsavedFile *files;
+    unsigned n_files;
+    unsigned long tu_hash, tu_pch, hash, preamble, next_due, started, elapsed;
+    int keeps_preamble;
+    struct timespec timeout;
+
+    (void) unused;
+    pthread_mutex_lock(&__worker_lock);
+
+    for ( ; ; )
+    {
+        while ((session = __take_due_session(&next_due)) == NULL)
+        {
+            if (__queue_head == NULL) {
+                pthread_cond_wait(&__worker_wakeup, &__worker_lock);
+                continue;
+            }
+
+            /* sleep until the earliest reparse is due, unless it's rescheduled */
+            timeout.tv_sec  = next_due / 1000;
+            timeout.tv_nsec = (long)(next_due % 1000) * 1000000;
+            pthread_cond_timedwait(&__worker_wakeup, &__worker_lock, &timeout);
+        }
+
+        /* take the job out of the session, further requests could queue
+           another one while we're running */
+        session->reparse_state = REPARSE_RUNNING;
+        preamble = session->snapshot_preamble;
+        if (session->ready_tu != NULL) {
+            tu = session->ready_tu;    /* newer than spare_tu, and nobody uses it */
+            tu_hash = session->ready_hash;
+            tu_pch = session->ready_pch;
+            keeps_preamble = (session->ready_preamble == preamble && preamble != 0);
+            session->ready_tu = NULL;
+        }
+        else {
+            tu = session->spare_tu;
+            tu_hash = session->spare_hash;
+            tu_pch = session->spare_pch;
+            keeps_preamble = (session->spare_preamble == preamble && preamble != 0);
+            session->spare_tu = NULL;
+        }
+
+        source  = session->snapshot;
+        hash    = session->snapshot_hash;
+        files   = session->snapshot_files;
+        n_files = session->n_snapshot_files;
+        session->snapshot = NULL;
+        session->snapshot_files = NULL;
+        session->n_snapshot_files = 0;
+
+        /* the main file goes in the slot left for it */
+        files[0].Filename = session->src_filename;
+        files[0].Contents = source;
+        files[0].Length   = session->snapshot_length;
+
+        __running_outs   = session->diag_outs;
+        __n_running_outs = session->n_diag_outs;
+        session->diag_outs   = NULL;
+        session->n_diag_outs = 0;
+
+        pthread_mutex_unlock(&__worker_lock);
+
+        started = __now_ms();
+        tu = __reparse(session, tu, tu_hash, &tu_pch, files, n_files, hash, keeps_preamble);
+        elapsed = __now_ms() - started;
+
+        pthread_mutex_lock(&__worker_lock);
+        __writing_outs = 1;
+        pthread_mutex_unlock(&__worker_lock);
+
+        __send_diagnostics(session, tu);
+
+        pthread_mutex_lock(&__worker_lock);
+        __writing_outs = 0;
+        free(__running_outs);
+        __running_outs   = NULL;
+        __n_running_outs = 0;
+
+        session->ready_tu = tu;
+        session->ready_hash = hash;
+        session->ready_preamble = preamble;
+        session->ready_pch = tu_pch;
+        session->reparse_state &= ~REPARSE_RUNNING;
+        if (keeps_preamble) {
+            session->reparse_cost = (session->reparse_cost == 0) ? elapsed :
+                (session->reparse_cost * 3 + elapsed) / 4;
+        }
+        else {
+            session->preamble_cost = (session->preamble_cost == 0) ? elapsed :
+                (session->preamble_cost * 3 + elapsed) / 4;
+        }
+
+        completion_freeOverlayCopies(files, n_files);
+
+        /* recycle the snapshot buffer if no newer one is queued */
+        if (session->snapshot == NULL) {
+            session->snapshot = source;
+            session->snapshot_length = 0;
+        }
+        else {
+            free(source);
+        }
+
+        pthread_cond_broadcast(&__worker_done);
+    }
+
+    return NULL;
+}
+
+
+/* Send the diagnostics of cx_tu to receiver, the whole list of them is
+   formatted once per generation */
+static void __send_current_diagnostics(
+    completion_Session *session, const completion_Receiver *receiver)
+{
+    const completion_DiagnosticsOptions *options = &receiver->options;
+    unsigned long started = completion_statsNow();
+
+    if (options->structured || options->first_line > 0 || options->last_line > 0)
+    {
+        completion_resetOutput(&session->diagnostics);
+        completion_printRequestedDiagnostics(
+            session, session->cx_tu, options, &session->diagnostics);
+        session->diagnostics_generation = 0;    /* not the whole list */
+    }
+    else if (session->diagnostics_generation != session->tu_generation)
+    {
+        completion_resetOutput(&session->diagnostics);
+        completion_printDiagnostics(session->cx_tu, &session->diagnostics);
+        session->diagnostics_generation = session->tu_generation;
+    }
+
+    completion_recordStats(STATS_DIAGNOSTICS, started);
+
+    completion_sendResponse(receiver->fd, receiver->request_id, &session->diagnostics);
+    completion_recordStats(STATS_SYNTAXCHECK, receiver->received_at);
+}
+
+/* Queue a reparse of the current src_buffer */
+void completion_scheduleReparse(
+    completion_Session *session, const completion_Receiver *receiver)
+{
+    pthread_t worker;
+    unsigned long now = __now_ms(), delay, max_delay;
+    unsigned long hash = 
+        completion_hashUnsavedFiles(session, session->src_buffer, session->src_length);
+
+    pthread_mutex_lock(&__worker_lock);
+
+    /* nothing has changed since cx_tu was reparsed, the worker doesn't touch
+       cx_tu and tu_hash, so they could be used without the lock */
+    if (session->reparse_state == 0 && session->cx_tu != NULL &&
+        session->tu_hash == hash)
+    {
+        pthread_mutex_unlock(&__worker_lock);
+        if (receiver != NULL) {
+            __send_current_diagnostics(session, receiver);
+        }
+        return;
+    }
+
+    if (!__worker_started)
+    {
+        if (pthread_create(&worker, NULL, __worker_main, NULL) != 0)
+        {
+            /* no worker to wait for, reparse in place rather than queue a
+               job nobody would ever run */
+            pthread_mutex_unlock(&__worker_lock);
+            completion_reparseTranslationUnit(session);
+            if (receiver != NULL && session->cx_tu != NULL) {
+                __send_current_diagnostics(session, receiver);
+            }
+            return;
+        }
+
+        pthread_detach(worker);
+        __worker_started = 1;
+    }
+
+    /* (re)take a snapshot of the source, a queued reparse which hasn't
+       started yet just picks up the newer source */
+    session->snapshot = (char*)realloc(session->snapshot, session->src_length + 1);
+    memcpy(session->snapshot, session->src_buffer, session->src_length);
+    session->snapshot_length = session->src_length;
+    session->snapshot_hash = hash;
+    session->snapshot_preamble = session->preamble_hash;
+    completion_freeOverlayCopies(session->snapshot_files, session->n_snapshot_files);
+    session->snapshot_files = completion_copyOverlays(session, &session->n_snapshot_files);
+
+    if (receiver != NULL)
+    {
+        session->diag_outs = (completion_Receiver*)realloc(
+            session->diag_outs, (session->n_diag_outs + 1) * sizeof(completion_Receiver));
+        session->diag_outs[session->n_diag_outs] = *receiver;
+        session->n_diag_outs++;
+    }
+
+    if (!(session->reparse_state & REPARSE_QUEUED))
+    {
+        session->reparse_state |= REPARSE_QUEUED;
+        session->reparse_queued_at = now;
+        session->reparse_next = NULL;
+        if (__queue_tail != NULL) {
+            __queue_tail->reparse_next = session;
+        }
+        else {
+            __queue_head = session;
+        }
+        __queue_tail = session;
+    }
+
+    /* postpone the reparse while the source keeps changing, unless somebody
+       is waiting for its diagnostics. Edits of the preamble are held back
+       longer, their reparse rebuilds the PCH. */
+    if (session->preamble_hash != session->tu_preamble)
+    {
+        delay = (session->preamble_cost > MIN_PREAMBLE_DELAY) ?
+            session->preamble_cost : MIN_PREAMBLE_DELAY;
+        max_delay = MAX_PREAMBLE_DELAY;
+    }
+    else
+    {
+        delay = session->reparse_cost / REPARSE_DELAY_RATIO;
+        max_delay = MAX_REPARSE_DELAY;
+    }
+
+    if (session->n_diag_outs > 0) {
+        session->reparse_due = now;
+    }
+    else if (now + delay < session->reparse_queued_at + max_delay) {
+        session->reparse_due = now + delay;
+    }
+    else {
+        session->reparse_due = session->reparse_queued_at + max_delay;
+    }
+
+    pthread_cond_signal(&__worker_wakeup);
+
+    pthread_mutex_unlock(&__worker_lock);
+}
+
+/* Swap the translation unit reparsed by the worker in */
+int completion_swapTranslationUnit(completion_Session *session)
+{
+    CXTranslationUnit old_spare = NULL;
+
+    pthread_mutex_lock(&__worker_lock);
+    if (session->ready_tu == NULL)
+    {
+        pthread_mutex_unlock(&__worker_lock);
+        return 0;
+    }
+
+    /* the current translation unit becomes the spare one, recycled by the
+       next background reparse */
+    old_spare = session->spare_tu;
+    session->spare_tu       = session->cx_tu;
+    session->spare_hash     = session->tu_hash;
+    session->spare_preamble = session->tu_preamble;
+    session->spare_pch      = session->tu_pch;
+    session->cx_tu          = session->ready_tu;
+    session->tu_hash        = session->ready_hash;
+    session->tu_preamble    = session->ready_preamble;
+    session->tu_pch         = session->ready_pch;
+    session->ready_tu       = NULL;
+    session->hibernated     = 0;    /* restored in background, timed as a parse */
+    pthread_mutex_unlock(&__worker_lock);
+
+    if (old_spare != NULL) {
+        clang_disposeTranslationUnit(old_spare);
+    }
+
+    session->tu_generation++;
+    completion_invalidateCache(session);
+    completion_noteInclusions(session);
+    return 1;
+}
+
+/* Nonzero if a background reparse of session is queued or running */
+int completion_isReparsePending(completion_Session *session)
+{
+    int pending;
+
+    pthread_mutex_lock(&__worker_lock);
+    pending = (session->reparse_state != 0);
+    pthread_mutex_unlock(&__worker_lock);
+
+    return pending;
+}
+
+/* Moving average of the reparses of session which rebuilt its preamble */
+unsigned long completion_preambleCost(completion_Session *session)
+{
+    unsigned long cost;
+
+    pthread_mutex_lock(&__worker_lock);
+    cost = session->preamble_cost;
+    pthread_mutex_unlock(&__worker_lock);
+
+    return cost;
+}
+
+/* Wait until the background reparses of session are done */
+void completion_waitReparse(completion_Session *session)
+{
+    pthread_mutex_lock(&__worker_lock);
+    while (session->reparse_state != 0) {
+        pthread_cond_wait(&__worker_done, &__worker_lock);
+    }
+    pthread_mutex_unlock(&__worker_lock);
+}
+
+/* Dispose the spare translation units of session */
+void completion_releaseSpareTranslationUnits(completion_Session *session)
+{
+    completion_waitReparse(session);
+
+    /* the worker is done with this session, nobody else touches these */
+    if (session->spare_tu != NULL) {
+        clang_disposeTranslationUnit(session->spare_tu);
+    }
+    if (session->ready_tu != NULL) {
+        clang_disposeTranslationUnit(session->ready_tu);
+    }
+
+    session->spare_tu = session->ready_tu = NULL;
+}
+
+/* Dispose the spare translation unit of session, unless the worker has
+   taken it */
+int completion_dropSpareTranslationUnit(completion_Session *session)
+{
+    CXTranslationUnit spare;
+
+    pthread_mutex_lock(&__worker_lock);
+    spare = session->spare_tu;
+    session->spare_tu = NULL;
+    pthread_mutex_unlock(&__worker_lock);
+
+    if (spare == NULL) {
+        return 0;
+    }
+
+    clang_disposeTranslationUnit(spare);
+    return 1;
+}
+
+/* Forget about out before it is closed */
+void completion_detachOutput(int out)
+{
+    completion_Session *session;
+    int i_out;
+
+    pthread_mutex_lock(&__worker_lock);
+
+    while (__writing_outs) {
+        pthread_cond_wait(&__worker_done, &__worker_lock);
+    }
+
+    for (i_out = 0; i_out < __n_running_outs; i_out++)
+    {
+        if (__running_outs[i_out].fd == out) {
+            __running_outs[i_out].fd = -1;
+        }
+    }
+
+    for (session = __queue_head; session != NULL; session = session->reparse_next)
+    {
+        for (i_out = 0; i_out < session->n_diag_outs; i_out++)
+        {
+            if (session->diag_outs[i_out].fd == out) {
+                session->diag_outs[i_out].fd = -1;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&__worker_lock);
+}
@@ -2,40 +2,478 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <unistd.h>
 
 #include "completion.h"
+#include "completion_input.h"
 #include "msg_callback.h"
+#include "completion_daemon.h"
+#include "completion_index.h"
 
 
-/* This function is intended to help debugging transmition issues, and should 
-   not be called in the final release version. */
-void __dump_session(const completion_Session *session, FILE *fp)
+/* Server settings given on the command line */
+static const char   *__compile_commands_directory = NULL;
+static const char   *__ast_cache_directory = NULL;
+static unsigned long __ast_cache_size = DEFAULT_AST_CACHE_SIZE;
+static unsigned long __ast_cache_age = DEFAULT_AST_CACHE_MAX_AGE;
+static const char   *__record_path = NULL;
+static unsigned long __hibernate_after = 0;    /* ms, 0 for never */
+static const char   *__symbol_index = NULL;
+static const char   *__parse_profile = NULL;
+
+/* Settings which couldn't be used, see __warn */
+static completion_Output __notices;
+static int __notices_to_client = 0;
+
+
+/* Warn about a server setting which can't be used. A session sends the
+   warnings to its client in a response of its own (see __send_notices), as
+   its stderr could be mixed into its responses. The daemon and the indexer
+   print them to stderr. */
+static void __warn(const char *format, ...)
 {
-    int i_arg = 0;
-    for ( ; i_arg < session->num_args; i_arg++) {
-        fprintf(fp, "[%-2d]: %s\n", i_arg, session->cmdline_args[i_arg]);
+    char    line[PATH_MAX + 64];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (__notices_to_client) {
+        completion_printOutput(&__notices, "NOTICE: %s\n", line);
     }
+    else {
+        fprintf(stderr, "%s\n", line);
+    }
+}
 
-    fprintf(fp, "filename: %s\n"
-                "code:\n%s\n", 
-        session->src_filename, session->src_buffer); fflush(fp);
+/* Send the warnings of the session to its client, as a response with id 0
+   made of "NOTICE: [#message#]" lines */
+static void __send_notices(int out)
+{
+    if (__notices.length > 0) {
+        completion_sendResponse(out, 0, &__notices);
+    }
+    completion_freeOutput(&__notices);
 }
 
 
-int main(int argc, char *argv[])
+/* Parse the server option at argv[i_arg]:
+       --compile-commands directory (of compile_commands.json)
+       --ast-cache directory  --ast-cache-size megabytes  --ast-cache-age days
+       --record trace (of the messages read from stdin)
+       --hibernate-after seconds (of idleness)
+       --symbol-index file (built by --index)
+       --profile interactive|accurate|low-memory (parse profile of the sessions)
+   returns the number of arguments it takes, 0 if it's not one of them */
+static int __parse_server_option(int argc, char *argv[], int i_arg)
+{
+    if (i_arg + 1 >= argc) {
+        return 0;
+    }
+
+    if (strcmp(argv[i_arg], "--compile-commands") == 0) {
+        __compile_commands_directory = argv[i_arg + 1];
+    }
+    else if (strcmp(argv[i_arg], "--ast-cache") == 0) {
+        __ast_cache_directory = argv[i_arg + 1];
+    }
+    else if (strcmp(argv[i_arg], "--ast-cache-size") == 0) {
+        __ast_cache_size = strtoul(argv[i_arg + 1], NULL, 10) << 20;
+    }
+    else if (strcmp(argv[i_arg], "--ast-cache-age") == 0) {
+        __ast_cache_age = strtoul(argv[i_arg + 1], NULL, 10) * 24 * 3600;
+    }
+    else if (strcmp(argv[i_arg], "--record") == 0) {
+        __record_path = argv[i_arg + 1];
+    }
+    else if (strcmp(argv[i_arg], "--hibernate-after") == 0) {
+        __hibernate_after = strtoul(argv[i_arg + 1], NULL, 10) * 1000;
+    }
+    else if (strcmp(argv[i_arg], "--symbol-index") == 0) {
+        __symbol_index = argv[i_arg + 1];
+    }
+    else if (strcmp(argv[i_arg], "--profile") == 0) {
+        __parse_profile = argv[i_arg + 1];
+    }
+    else {
+        return 0;
+    }
+
+    return 2;
+}
+
+static void __configure_server(void)
+{
+    static char default_cache[PATH_MAX];
+    const char *tmpdir = getenv("TMPDIR");
+    int profile;
+
+    /* restoring a hibernated session is only fast with preamble PCHs */
+    if (__hibernate_after > 0 && __ast_cache_directory == NULL)
+    {
+        snprintf(default_cache, sizeof(default_cache), "%s/clang-complete-cache-%d",
+                 (tmpdir != NULL) ? tmpdir : "/tmp", (int)getuid());
+        __ast_cache_directory = default_cache;
+    }
+
+    if (__compile_commands_directory != NULL &&
+        completion_loadCompilationDatabase(__compile_commands_directory) != 0) {
+        __warn("Cannot load compile_commands.json in %s", __compile_commands_directory);
+    }
+
+    if (__ast_cache_directory != NULL &&
+        completion_configureAstCache(
+            __ast_cache_directory, __ast_cache_size, __ast_cache_age) != 0) {
+        __warn("Cannot use %s as AST cache", __ast_cache_directory);
+    }
+
+    if (__parse_profile != NULL)
+    {
+        if ((profile = completion_findParseProfile(__parse_profile)) < 0) {
+            __warn("Unknown parse profile %s", __parse_profile);
+        }
+        else {
+            completion_setDefaultParseProfile(profile);
+        }
+    }
+
+    /* it's fine if it hasn't been built yet, it's looked for again later */
+    if (__symbol_index != NULL) {
+        completion_openSymbolIndex(__symbol_index);
+    }
+}
+
+
+/* clang-complete --daemon socket_path [--memory-budget megabytes] 
+                  [server options] */
+static int __run_daemon(int argc, char *argv[])
+{
+    unsigned long memory_budget = DEFAULT_DAEMON_MEMORY_BUDGET;
+    int i_arg = 3, n_taken;
+
+    if (argc < 3) {
+        printf("Socket path must be specified after --daemon\n");
+        exit(-1);
+    }
+
+    for ( ; i_arg < argc; i_arg += n_taken)
+    {
+        if (strcmp(argv[i_arg], "--memory-budget") == 0 && i_arg + 1 < argc)
+        {
+            memory_budget = strtoul(argv[i_arg + 1], NULL, 10) << 20;
+            n_taken = 2;
+        }
+        else if ((n_taken = __parse_server_option(argc, argv, i_arg)) == 0) {
+            n_taken = 1;    /* ignore unknown options */
+        }
+    }
+    __configure_server();
+
+    if (completion_runDaemon(argv[2], memory_budget, __hibernate_after) != 0) {
+        printf("Cannot listen on %s\n", argv[2]);
+        exit(-1);
+    }
+
+    return 0;
+}
+
+
+/* clang-complete --index file --compile-commands directory [--jobs n] */
+static int __run_indexer(int argc, char *argv[])
+{
+    int n_jobs = 0, i_arg = 3, n_taken;
+
+    if (argc < 3) {
+        printf("Index file must be specified after --index\n");
+        exit(-1);
+    }
+
+    for ( ; i_arg < argc; i_arg += n_taken)
+    {
+        if (strcmp(argv[i_arg], "--jobs") == 0 && i_arg + 1 < argc)
+        {
+            n_jobs = atoi(argv[i_arg + 1]);
+            n_taken = 2;
+        }
+        else if ((n_taken = __parse_server_option(argc, argv, i_arg)) == 0) {
+            n_taken = 1;    /* ignore unknown options */
+        }
+    }
+
+    if (__compile_commands_directory == NULL) {
+        printf("The files to index are taken from --compile-commands\n");
+        exit(-1);
+    }
+    __configure_server();
+
+    if (completion_buildSymbolIndex(argv[2], n_jobs) != 0) {
+        printf("Cannot build the symbol index %s\n", argv[2]);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Start recording the messages read from in to __record_path, the trace
+   starts with the argc - 1 arguments after argv[0] to run the server with:
+        clang-complete-trace [#n_args#]
+        [#arg#]
+        ...                  (one per line) */
+static FILE *__start_recording(completion_Input *in, int argc, char *argv[])
+{
+    FILE *trace;
+    int   i_arg = 1;
+
+    if (__record_path == NULL) {
+        return NULL;
+    }
+
+    if ((trace = fopen(__record_path, "w")) == NULL)
+    {
+        __warn("Cannot record to %s", __record_path);
+        return NULL;
+    }
+
+    fprintf(trace, "clang-complete-trace %d\n", argc - 1);
+    for ( ; i_arg < argc; i_arg++) {
+        fprintf(trace, "%s\n", argv[i_arg]);
+    }
+    fflush(trace);
+
+    completion_recordInput(in, fileno(trace));
+    return trace;
+}
+
+/* Wait for the next request. Meanwhile the completions around the cursor
+   are precomputed, the spare translation unit is dropped if none comes within
+   SPARE_IDLE_TIMEOUT, and the session hibernates if none comes within
+   __hibernate_after */
+static void __wait_for_request(completion_Session *session, completion_Input *in)
+{
+    int timeout = (__hibernate_after > 0 && __hibernate_after < SPARE_IDLE_TIMEOUT) ?
+                  (int)__hibernate_after : SPARE_IDLE_TIMEOUT;
+
+    /* one point at a time, a request could come in between */
+    while (completion_isSpeculating(session) && !completion_inputPending(in)) {
+        completion_speculate(session);
+    }
+
+    if (completion_waitInput(in, timeout)) {
+        return;
+    }
+    completion_dropSpareTranslationUnit(session);
+
+    if (__hibernate_after == 0) {
+        return;
+    }
+
+    timeout = (int)__hibernate_after - timeout;
+
+    while (!completion_waitInput(in, timeout))
+    {
+        if (session->cx_tu == NULL || completion_hibernate(session))
+        {
+            completion_waitInput(in, -1);
+            return;
+        }
+
+        timeout = 1000;    /* busy reparsing, try again later */
+    }
+}
+
+/* Serve the session of the file named by the last of the argc - 1 arguments
+   after argv[0] (server options, then clang args) on in, responses are
+   written to out. Returns when the client has gone. */
+static int __serve_session(
+    int argc, char *argv[], CXIndex cx_index, completion_Input *in, int out)
 {
     completion_Session session;
+    FILE *trace;
+    int n_options = 0, n_taken;
 
-    if (argc < 2) {
+    /* our own options come before the ones passed to clang */
+    while ((n_taken = __parse_server_option(argc - 1, argv, n_options + 1)) > 0) {
+        n_options += n_taken;
+    }
+    __notices_to_client = 1;
+    __configure_server();
+
+    if (argc - n_options < 2) {
         printf("Source file name must be specified as the last commandline argument\n");
         exit(-1);
     }
-    
-    startup_completionSession(argc, argv, &session);
 
-    for ( ; ; ) {
-        completion_AcceptRequest(&session, stdin);
-    }
+    /* argv[n_options] takes the place of argv[0] */
+    startup_completionSession(argc - n_options, argv + n_options, cx_index, &session);
+
+    trace = __start_recording(in, argc - n_options, argv + n_options);
+    __send_notices(out);
+    do {
+        __wait_for_request(&session, in);
+    } while (completion_AcceptRequest(&session, in, out) == 0);
 
+    /* emacs has gone without saying SHUTDOWN */
+    completion_closeInput(in);
+    if (trace != NULL) {
+        fclose(trace);
+    }
+    shutdown_completionSession(&session);
+    clang_disposeIndex(session.cx_index);
     return 0;
 }
+
+
+/* Precompile the prelude at path, a file including the headers most source
+   files include, with num_args clang args, next to socket_path. Sessions
+   forked from the zygote find libclang initialized, the headers in the page
+   cache, and parse over the PCH of the prelude if their preamble fits (see
+   completion_precompilePrelude). The PCH is kept as long as the zygote
+   runs, its pages are shared by every session using it. */
+static void __precompile_prelude(
+    CXIndex cx_index, const char *path, int num_args, char **args, const char *socket_path)
+{
+    completion_Session session;
+    FILE *fp = fopen(path, "rb");
+    unsigned long started = completion_statsNow();
+    size_t n_read;
+    char   prefix[PATH_MAX];
+
+    if (fp == NULL)
+    {
+        fprintf(stderr, "Cannot read the prelude %s\n", path);
+        return;
+    }
+
+    startup_sharedCompletionSession(cx_index, path, num_args, args, &session);
+
+    do {
+        if (session.buffer_capacity - session.src_length < 4096)
+        {
+            session.buffer_capacity *= 2;
+            session.src_buffer = (char*)realloc(session.src_buffer, session.buffer_capacity);
+        }
+        n_read = fread(session.src_buffer + session.src_length, 1,
+                       session.buffer_capacity - session.src_length - 1, fp);
+        session.src_length += n_read;
+    } while (n_read > 0);
+    fclose(fp);
+
+    snprintf(prefix, sizeof(prefix), "%s.prelude", socket_path);
+    if (completion_precompilePrelude(&session, prefix) != 0) {
+        fprintf(stderr, "Cannot precompile the prelude %s, sessions won't share it\n", path);
+    }
+    else {
+        fprintf(stderr, "Prelude %s precompiled in %lu ms\n",
+                path, (completion_statsNow() - started) / 1000);
+    }
+
+    /* only its PCH is used by the sessions */
+    shutdown_completionSession(&session);
+}
+
+/* Read the SPAWN message a client of the zygote starts with (see
+   completion_daemon.h), returns the arguments as an argv after program, and
+   their number (program included) in argc. Returns NULL if the client has
+   sent something else. */
+static char **__read_spawn_message(completion_Input *in, char *program, int *argc)
+{
+    char **argv, *key, *value, *arg;
+    int num_args, i_arg = 0;
+
+    completion_skipSpaces(in);
+    if ((arg = completion_readLine(in, NULL)) == NULL || strcmp(arg, "SPAWN") != 0 ||
+        (key = completion_readHeader(in, &value)) == NULL || strcmp(key, "num_args") != 0) {
+        return NULL;
+    }
+
+    if ((num_args = atoi(value)) < 0) {
+        num_args = 0;
+    }
+    argv = (char**)calloc(sizeof(char*), num_args + 2);
+    argv[0] = program;
+
+    for ( ; i_arg < num_args && (arg = completion_readToken(in, NULL)) != NULL; i_arg++) {
+        argv[i_arg + 1] = strdup(arg);
+    }
+
+    *argc = i_arg + 1;
+    return argv;
+}
+
+/* clang-complete --zygote socket_path [--prelude file] [clang args of the prelude]
+
+   Server options are given to each session in its SPAWN message, not to the
+   zygote. */
+static int __run_zygote(int argc, char *argv[])
+{
+    completion_Input input;
+    CXIndex cx_index;
+    char  **prelude_args, **spawn_args;
+    const char *prelude = NULL;
+    int n_prelude_args = 0, n_spawn_args, i_arg = 3, client;
+
+    if (argc < 3) {
+        printf("Socket path must be specified after --zygote\n");
+        exit(-1);
+    }
+
+    prelude_args = (char**)calloc(sizeof(char*), argc);
+    for ( ; i_arg < argc; i_arg++)
+    {
+        if (strcmp(argv[i_arg], "--prelude") == 0 && i_arg + 1 < argc) {
+            prelude = argv[++i_arg];
+        }
+        else {
+            prelude_args[n_prelude_args++] = argv[i_arg];
+        }
+    }
+
+    /* everything done from here on is inherited by the sessions */
+    cx_index = clang_createIndex(0, 0);
+    if (prelude != NULL) {
+        __precompile_prelude(cx_index, prelude, n_prelude_args, prelude_args, argv[2]);
+    }
+    free(prelude_args);
+
+    if ((client = completion_runZygote(argv[2])) < 0) {
+        printf("Cannot listen on %s\n", argv[2]);
+        exit(-1);
+    }
+
+    /* in a session forked for client */
+    completion_initStats();
+    completion_openInput(&input, client);
+    if ((spawn_args = __read_spawn_message(&input, argv[0], &n_spawn_args)) == NULL)
+    {
+        completion_closeInput(&input);
+        return -1;
+    }
+
+    return __serve_session(n_spawn_args, spawn_args, cx_index, &input, client);
+}
+
+
+/* clang-complete [server options] [clang args] filename */
+int main(int argc, char *argv[])
+{
+    completion_Input input;
+
+    completion_initStats();
+
+    if (argc >= 2 && strcmp(argv[1], "--daemon") == 0) {
+        return __run_daemon(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--index") == 0) {
+        return __run_indexer(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--zygote") == 0) {
+        return __run_zygote(argc, argv);
+    }
+
+    completion_openInput(&input, STDIN_FILENO);
+    return __serve_session(argc, argv, clang_createIndex(0, 0), &input, STDOUT_FILENO);
+}
@@ -4,10 +4,62 @@
 
 
 #include "completion.h"
+#include "completion_input.h"
+#include "completion_stats.h"
 
 
-/* Dispatch different messages to their corresponding message handlers */
-void completion_AcceptRequest(completion_Session *session, FILE *fp);
+/* A request whose message has been read, but whose work (if any) is deferred
+   until all pending input has been read, so that requests superseded by newer
+   ones could be dropped */
+typedef struct __completion_Request_struct
+{
+    unsigned long id;    /* request id from the message head line, 0 if none */
+    int  kind;           /* REQUEST_NONE if the message needs no further work */
+    int  discarded;      /* superseded by a newer request, or cancelled */
+
+    /* carry out the request, called even if it's discarded so that it could
+       still send an (empty) response */
+    void (*run)(completion_Session*, struct __completion_Request_struct*, int);
+
+    int           stats_id;       /* STATS_* of the message type */
+    unsigned long received_at;    /* completion_statsNow() when it was read */
+    unsigned long src_updates;    /* session->src_updates once it was read */
+
+    /* parameters of COMPLETION */
+    int      row, column;
+    char     prefix[256];
+    unsigned limit;
+    int      do_filter;
+    int      lazy_details;   /* send CANDIDATE lines instead of COMPLETION ones */
+    int      sexp_results;   /* send a SEXP response instead of either */
+    unsigned complete_on;    /* clang_codeCompleteAt options forced on */
+    unsigned complete_off;   /* and off, whatever the completion context */
+    unsigned long budget;    /* milliseconds before lexical candidates are sent,
+                              * 0 if they're not */
+
+    /* parameters of SYNTAXCHECK */
+    completion_DiagnosticsOptions diagnostics;
+
+} completion_Request;
+
+#define  REQUEST_NONE          0
+#define  REQUEST_COMPLETION    1
+#define  REQUEST_REPARSE       2
+#define  REQUEST_SYNTAXCHECK   3
+#define  REQUEST_SHUTDOWN      4
+#define  REQUEST_STATS         5
+
+/* Symbols sent back by SYMBOLS unless it says otherwise */
+#define  DEFAULT_SYMBOLS_LIMIT 100
+
+/* Maximum number of requests read ahead before carrying them out */
+#define  MAX_PENDING_REQUESTS  64
+
+
+/* Read the messages available on in and dispatch them to their corresponding
+   message handlers, then carry out the requests that haven't been superseded
+   by newer ones. Responses are written to out. Returns -1 at end of input. */
+int completion_AcceptRequest(completion_Session *session, completion_Input *in, int out);
 
 
 /* 
@@ -17,38 +69,178 @@ void completion_AcceptRequest(completion_Session *session, FILE *fp);
    Message format: 
         row:[#row#]
         column:[#column#]
+        details:lazy                (optional)
+        format:sexp                 (optional)
+        macros:[#yes|no#]           (optional)
+        patterns:[#yes|no#]         (optional)
+        preamble:[#skip|load#]      (optional)
+        budget:[#milliseconds#]     (optional)
         source_length:[#src_length#]
         <# SOURCE CODE #>
 
+   Candidates are sent one per line as "COMPLETION: [#typed_text#] : [#terms#]",
+   or with details:lazy, as CANDIDATE lines which only carry the typed text,
+   the cursor kind and a candidate id (see completion_printCandidateLine).
+   With format:sexp, they're sent as a "SEXP" line followed by a single Lisp
+   list of (NAME OVERLOAD...), whose overloads carry the kind, priority,
+   result type, chunks and id of each result (see
+   completion_printSexpCandidate).
+   The options of clang_codeCompleteAt are picked by the context of the
+   completion point, macros, code patterns and the declarations of the
+   preamble could be asked for or left out whatever the context.
+   With budget, the client gets a "LEXICAL" response of IDENTIFIER:[#name#]
+   lines first if libclang would take longer than that (see
+   completion_printLexicalCandidates), or if it has no results.
+
    SOURCEFILE: Update the source code in the source buffer (session->src_buffer)
    Message format:
         source_length:[#src_length#]
         <# SOURCE CODE #>
 
+   SOURCEDELTA: Replace a region of the source buffer in place
+   Message format:
+        base_version:[#version#]
+        offset:[#offset#]
+        deleted_length:[#del_len#]
+        result_length:[#src_length_after_edit#]
+        inserted_length:[#ins_len#]
+        <# INSERTED TEXT #>
+
+   UNSAVED: Set the unsaved contents of another file than the main one (say
+   a header being edited), used in place of the file on disk by every parse,
+   reparse and completion from now on, or drop them (see completion_setOverlay)
+   Message format:
+        path:[#path#]
+        version:[#version#]
+        length:[#length#]
+        <# CONTENTS #>
+   or
+        path:[#path#]
+        drop:yes
+
    CMDLINEARGS: Specify command line arguments passing to clang parser.
    Message format:
         num_args:[#n_args#]
         arg1 arg2 ...... (there should be n_args items here)
 
+   PROFILE: Parse the source code with another set of options from now on
+   (see completion_setParseProfile)
+   Message format:
+        profile:[#interactive|accurate|low-memory#]
+
+   There's no response, unless the profile is unknown: then it responds
+   with ERROR: UNKNOWN PROFILE and the profile is left as it was.
+
    REPARSE: Reparse the source code
    [no message body]
 
    SYNTAXCHECK: Retrieve diagnostic messages
    Message format:
+        diagnostics:structured      (optional)
+        base:[#set_id#]             (optional)
+        first_line:[#line#]         (optional)
+        last_line:[#line#]          (optional)
         source_length:[#src_length#]
         <# SOURCE CODE #>
 
+   Diagnostics are sent as formatted by clang, one per line, unless the
+   structured format is asked for (see completion_diagnostics.c), which is a
+   diff against the set [#set_id#] if it's the last one sent. Only the
+   diagnostics of the main file between first_line and last_line are sent.
+
    SHUTDOWN: Shut down the completion server (this program)
    [no message body]
+
+   STATS: Retrieve latency histograms, memory usage (completion_stats.h) and
+   the hits and misses of the completion cache
+   [no message body]
+
+   CURSOR: Report where the cursor is, so that the completions around it
+   are computed while the client is idle (see completion_speculate)
+   Message format:
+        row:[#row#]
+        column:[#column#]
+        source_length:[#src_length#]
+        <# SOURCE CODE #>
+
+   SYMBOLS: Look up the symbols of the whole project whose name starts with
+   [#prefix#] in the symbol index (completion_index.h)
+   Message format:
+        limit:[#max_symbols#]       (optional, 100 by default, 0 for no limit)
+        prefix:[#prefix#]
+
+   DEFINITION: Look up the definition of a symbol in the symbol index
+   Message format:
+        usr:[#usr#]
+
+   Both respond with one SYMBOL line per symbol found (see
+   completion_printSymbols), or with ERROR: NO SYMBOL INDEX.
+
+   DETAIL: Render the signature, placeholders, brief comment and parent of a
+   candidate sent in a CANDIDATE line (see completion_printCandidateDetail)
+   Message format:
+        id:[#candidate_id#]
+
+   It responds with ERROR: UNKNOWN CANDIDATE if the results of the candidate
+   have been dropped since: they are kept, whatever has been edited or
+   reparsed, until the next COMPLETION or until the session is hibernated.
+
+   CANCEL: Discard the request [#id#] if it hasn't been carried out yet, a
+   discarded COMPLETION is answered with an empty candidate list. Only the
+   requests read together with the CANCEL (see below) could be discarded,
+   the ones of earlier reads have been carried out already.
+   Message format:
+        CANCEL [#id#]
+        [no message body]
+
+   The head line of every message may carry a request id after the message
+   name, e.g. "COMPLETION 42", which could be referred to by CANCEL. The
+   response to the message is framed with the same id (completion_output.h).
+
+   All messages already sent by the client are read before any of them is
+   carried out: a COMPLETION followed by another COMPLETION, or by a message
+   changing the source code (SOURCEFILE, SOURCEDELTA, or any message carrying
+   source_length), is answered with an empty candidate list, and a REPARSE
+   followed by another REPARSE or a SYNTAXCHECK is dropped, as their results
+   would be out of date anyway.
+
+   In COMPLETION, SOURCEFILE, SYNTAXCHECK and CURSOR messages, source_length and the
+   source code could be replaced by source_version:[#version#] to refer to the
+   source buffer maintained by SOURCEDELTA messages. If the source buffer is not
+   at that version, COMPLETION and SYNTAXCHECK respond with RESYNC and the
+   client should send the full source code again.
 */
 
-/* message handlers */
-void completion_doCompletion(completion_Session *session, FILE *fp);   /* COMPLETION */
-void completion_doSourcefile(completion_Session *session, FILE *fp);   /* SOURCEFILE */
-void completion_doCmdlineArgs(completion_Session *session, FILE *fp);  /* CMDLINEARGS */
-void completion_doReparse(completion_Session *session, FILE *fp);      /* REPARSE */
-void completion_doSyntaxCheck(completion_Session *session, FILE *fp);  /* SYNTAXCHECK */
-void completion_doShutdown(completion_Session *session, FILE *fp);     /* SHUTDOWN */
+/* message handlers, they read their message from in, and either respond to
+   out right away or leave the rest of the work to request->run */
+void completion_doCompletion(                                   /* COMPLETION */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
+void completion_doSourcefile(                                   /* SOURCEFILE */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
+void completion_doSourceDelta(                                  /* SOURCEDELTA */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
+void completion_doUnsaved(                                      /* UNSAVED */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
+void completion_doCmdlineArgs(                                  /* CMDLINEARGS */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
+void completion_doProfile(                                      /* PROFILE */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
+void completion_doReparse(                                      /* REPARSE */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
+void completion_doSyntaxCheck(                                  /* SYNTAXCHECK */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
+void completion_doShutdown(                                     /* SHUTDOWN */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
+void completion_doStats(                                        /* STATS */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
+void completion_doCursor(                                       /* CURSOR */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
+void completion_doSymbols(                                      /* SYMBOLS */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
+void completion_doDefinition(                                   /* DEFINITION */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
+void completion_doDetail(                                       /* DETAIL */
+    completion_Session *session, completion_Request *request, completion_Input *in, int out);
 
 
 #endif /* _COMPLETION_PROTOCOL_H_ */
@@ -1,34 +1,96 @@
 #include <stdlib.h>
 #include <string.h>
-#include <limits.h>
 #include "msg_callback.h"
 
 
 /* command - message tuple for commander pattern */
 struct __command_dispatch_entry {
     const char *command;
-    void (*command_handler)(completion_Session*, FILE*);
+    void (*command_handler)(completion_Session*, completion_Request*, completion_Input*, int);
+    int stats_id;
 };
 
 /* message dispatch table */
 struct __command_dispatch_entry 
 __command_dispatch_table[] = 
 {
-    {"COMPLETION",   completion_doCompletion},
-    {"SOURCEFILE",   completion_doSourcefile},
-    {"CMDLINEARGS",  completion_doCmdlineArgs},
-    {"SYNTAXCHECK",  completion_doSyntaxCheck},
-    {"REPARSE",      completion_doReparse},
-    {"SHUTDOWN",     completion_doShutdown}
+    {"COMPLETION",   completion_doCompletion,   STATS_COMPLETION},
+    {"SOURCEFILE",   completion_doSourcefile,   STATS_SOURCEFILE},
+    {"SOURCEDELTA",  completion_doSourceDelta,  STATS_SOURCEDELTA},
+    {"UNSAVED",      completion_doUnsaved,      STATS_UNSAVED},
+    {"CMDLINEARGS",  completion_doCmdlineArgs,  STATS_CMDLINEARGS},
+    {"PROFILE",      completion_doProfile,      STATS_PROFILE},
+    {"SYNTAXCHECK",  completion_doSyntaxCheck,  STATS_SYNTAXCHECK},
+    {"REPARSE",      completion_doReparse,      STATS_REPARSE},
+    {"STATS",        completion_doStats,        STATS_STATS},
+    {"CURSOR",       completion_doCursor,       STATS_CURSOR},
+    {"SYMBOLS",      completion_doSymbols,      STATS_SYMBOLS},
+    {"DEFINITION",   completion_doDefinition,   STATS_DEFINITION},
+    {"DETAIL",       completion_doDetail,       STATS_DETAIL},
+    {"SHUTDOWN",     completion_doShutdown,     STATS_SHUTDOWN}
 };
 
 
-/* Dispatch different messages to their corresponding message handlers */
-void completion_AcceptRequest(completion_Session *session, FILE *fp)
+/* Nonzero if line starts with command, followed by the end of the line or by
+   a request id */
+static int __starts_with_command(const char *line, size_t length, const char *command)
+{
+    size_t command_length = strlen(command);
+    return length >= command_length && strncmp(line, command, command_length) == 0 &&
+        (length == command_length || line[command_length] == ' ');
+}
+
+/* Nonzero if line is the head of a message */
+static int __is_request_head(const char *line, size_t length)
+{
+    unsigned int i_entry = 0;
+
+    if (__starts_with_command(line, length, "CANCEL")) {
+        return 1;
+    }
+
+    for ( ; i_entry < 
+              sizeof(__command_dispatch_table)/
+              sizeof(__command_dispatch_table[0]); i_entry++)
+    {
+        if (__starts_with_command(line, length, __command_dispatch_table[i_entry].command)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Read a message from in and dispatch it to its message handler, the head of
+   the message is stored to msg_head (of size bytes). Returns -1 at end of
+   input. */
+static int __read_request(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out,
+    char *msg_head, size_t size)
 {
     unsigned int i_entry = 0;
-    char msg_head[LINE_MAX];
-    fscanf(fp, "%s", msg_head);
+    char *head_line, *request_id;
+
+    memset(request, 0, sizeof(completion_Request));
+    msg_head[0] = '\0';
+
+    completion_skipSpaces(in);
+    request->received_at = completion_statsNow();
+    if ((head_line = completion_readLine(in, NULL)) == NULL) {
+        return -1;
+    }
+
+    /* the rest of the head line may carry the request id */
+    if ((request_id = strchr(head_line, ' ')) != NULL)
+    {
+        *request_id++ = '\0';
+        request->id = strtoul(request_id, NULL, 10);
+    }
+    strncpy(msg_head, head_line, size - 1);
+    msg_head[size - 1] = '\0';
+
+    if (strcmp(msg_head, "CANCEL") == 0) {
+        return 0;    /* handled by completion_AcceptRequest */
+    }
 
     /* find corresponded message handler to dispatch message to */
     for ( ; i_entry < 
@@ -38,12 +100,119 @@ void completion_AcceptRequest(completion_Session *session, FILE *fp)
         if (strcmp(msg_head, 
                 __command_dispatch_table[i_entry].command) == 0)
         {
-            fgets(msg_head, sizeof(msg_head), fp); /* skip trailing '\n' */
-            __command_dispatch_table[i_entry].command_handler(session, fp);
-            return;
+            request->stats_id = __command_dispatch_table[i_entry].stats_id;
+            __command_dispatch_table[i_entry].command_handler(session, request, in, out);
+            request->src_updates = session->src_updates;
+            completion_recordStats(STATS_READ_MESSAGE, request->received_at);
+
+            /* the others are timed when they're carried out */
+            if (request->kind == REQUEST_NONE) {
+                completion_recordStats(request->stats_id, request->received_at);
+            }
+            return 0;
         }
     }
 
     /* no message handler was found */
-    printf("ERROR: UNKNOWN COMMAND: %s", msg_head); fflush(stdout);
+    completion_resetOutput(&session->response);
+    completion_printOutput(&session->response, "ERROR: UNKNOWN COMMAND: %s\n", msg_head);
+    completion_sendResponse(out, request->id, &session->response);
+
+    /* the body of the message can't be parsed, skip it to the blank line
+       ending it or to the head of the next message */
+    completion_skipLines(in, __is_request_head);
+    return 0;
+}
+
+/* Nonzero if request is made useless by a newer request */
+static int __is_superseded(const completion_Request *request, const completion_Request *newer)
+{
+    switch (request->kind)
+    {
+    case REQUEST_COMPLETION:
+        return newer->kind == REQUEST_COMPLETION;
+
+    case REQUEST_REPARSE:    /* a syntax check reparses the source as well */
+        return newer->kind == REQUEST_REPARSE || newer->kind == REQUEST_SYNTAXCHECK;
+
+    default:
+        return 0;
+    }
+}
+
+/* Discard the pending request with id */
+static void __cancel_request(completion_Request *requests, int n_requests, unsigned long id)
+{
+    int i_request = 0;
+    for ( ; i_request < n_requests; i_request++)
+    {
+        if (requests[i_request].id == id && id != 0) {
+            requests[i_request].discarded = 1;
+        }
+    }
+}
+
+
+/* Read the messages available on in and dispatch them to their corresponding
+   message handlers, then carry out the requests that haven't been superseded
+   by newer ones. Responses are written to out. Returns -1 at end of input. */
+int completion_AcceptRequest(completion_Session *session, completion_Input *in, int out)
+{
+    completion_Request requests[MAX_PENDING_REQUESTS];
+    int i_request, i_newer, n_requests = 0, status = 0;
+    char msg_head[32];
+
+    /* speculative work gives way to whatever the client has sent */
+    completion_cancelSpeculation(session);
+
+    /* read everything the client has sent so far, source updates are applied
+       right away, other work is deferred */
+    do {
+        if (__read_request(session, &requests[n_requests], in, out,
+                           msg_head, sizeof(msg_head)) != 0)
+        {
+            status = -1;
+            break;
+        }
+
+        if (strcmp(msg_head, "CANCEL") == 0) {
+            __cancel_request(requests, n_requests, requests[n_requests].id);
+        }
+        else if (requests[n_requests].kind != REQUEST_NONE) {
+            n_requests++;
+        }
+    } while (n_requests < MAX_PENDING_REQUESTS && completion_inputPending(in));
+
+    /* drop the requests which would be out of date by the time they're done */
+    for (i_request = 0; i_request < n_requests; i_request++)
+    {
+        /* a completion would run on the source as edited by the messages
+           read after it, at positions which no longer match */
+        if (requests[i_request].kind == REQUEST_COMPLETION &&
+            requests[i_request].src_updates != session->src_updates) {
+            requests[i_request].discarded = 1;
+        }
+
+        for (i_newer = i_request + 1; i_newer < n_requests; i_newer++)
+        {
+            if (__is_superseded(&requests[i_request], &requests[i_newer])) {
+                requests[i_request].discarded = 1;
+            }
+        }
+    }
+
+    /* pick up the translation unit reparsed in background */
+    completion_swapTranslationUnit(session);
+
+    for (i_request = 0; i_request < n_requests; i_request++)
+    {
+        requests[i_request].run(session, &requests[i_request], out);
+
+        /* syntax checks are timed when their diagnostics are sent */
+        if (requests[i_request].kind != REQUEST_SYNTAXCHECK) {
+            completion_recordStats(requests[i_request].stats_id, requests[i_request].received_at);
+        }
+    }
+
+    return status;
 }
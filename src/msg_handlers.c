@@ -1,199 +1,843 @@
 #include <stdlib.h>
 #include <string.h>
-#include <limits.h>
-#include <unistd.h>
 #include "msg_callback.h"
+#include "completion_filter.h"
+#include "completion_index.h"
 
 
-/* discard all remaining contents on this line, jump to the beginning of the
-   next line */
-static void __skip_the_rest(FILE *fp)
+/* make sure src_buffer of session could hold at least required_length bytes */
+static void __reserve_src_buffer(completion_Session *session, size_t required_length)
 {
-    char crlf[LINE_MAX];
-    fgets(crlf, LINE_MAX, fp);
+    if (required_length >= session->buffer_capacity) /* we're running out of space */
+    {
+        /* expand the buffer two-fold of source size */
+        session->buffer_capacity = required_length * 2;
+        session->src_buffer = 
+            (char*)realloc(session->src_buffer, session->buffer_capacity);
+    }
 }
 
-/* read len bytes from fp to buffer */
-static void __read_n_bytes(FILE *fp, char *buffer, int len)
+/* parse a size or counter in the header value */
+static size_t __parse_size(const char *value)
 {
-    while (len-- != 0) {
-        *buffer++ = (char)fgetc(fp);
-    }
+    return (size_t)strtoull(value, NULL, 10);
 }
 
 
 /* Read the source file portion of the message to the source code buffer in 
-   specified session object. 
+   specified session object, its header line (key:value) has been read.
 
-   Sourcefile segment always starts with source_length: [#len#], followed by a
-   newline character, then the actual source code. Length of the source code is
-   indicated by [#len#] so we know how much bytes we should read from fp.
+   Sourcefile segment starts either with source_length: [#len#] or with
+   source_version: [#version#], followed by a newline character.
+
+   source_length: the actual source code follows, length of the source code is
+   indicated by [#len#] so we know how much bytes we should read from in.
+
+   source_version: no source code follows, the client has been keeping
+   src_buffer up to date with SOURCEDELTA messages and expects it to be at
+   [#version#].
+
+   Returns 0 if src_buffer holds the client's source code, or -1 if it's out of
+   sync and the client should send a full copy again.
 */
-static void completion_readSourcefile(completion_Session *session, FILE *fp)
+static int completion_readSourceSegment(
+    completion_Session *session, completion_Input *in, const char *key, const char *value)
 {
-    int source_length;
-    fscanf(fp, "source_length:%d", &source_length);
-    __skip_the_rest(fp);
+    size_t length;
 
-    if (source_length >= session->buffer_capacity) /* we're running out of space */
+    if (strcmp(key, "source_version") == 0)
     {
-        /* expand the buffer two-fold of source size */
-        session->buffer_capacity = source_length * 2;
-        session->src_buffer = 
-            (char*)realloc(session->src_buffer, session->buffer_capacity);
+        return (session->src_in_sync && 
+                session->src_version == strtoul(value, NULL, 10)) ? 0 : -1;
+    }
+
+    if (strcmp(key, "source_length") != 0) {
+        return -1;    /* malformed message */
+    }
+
+    length = __parse_size(value);
+    __reserve_src_buffer(session, length);
+
+    /* read source code from in right into the buffer */
+    session->src_length = completion_readBytes(in, session->src_buffer, length);
+
+    /* a full copy puts us back in sync with the client, deltas would be based
+       on this version from now on */
+    session->src_version = 0;
+    session->src_in_sync = (session->src_length == length);
+    session->src_updates++;
+
+    completion_classifyEdit(session, 0);
+    completion_validateCache(session);
+    completion_invalidateLexicon(session);
+    return session->src_in_sync ? 0 : -1;
+}
+
+/* Read the header line of the source file portion and the source after it */
+static int completion_readSourcefile(completion_Session *session, completion_Input *in)
+{
+    char *key, *value;
+
+    if ((key = completion_readHeader(in, &value)) == NULL) {
+        return -1;
+    }
+    return completion_readSourceSegment(session, in, key, value);
+}
+
+/* Inform the client that src_buffer went out of sync, it should retry with a
+   full copy of its source code */
+static void completion_sendResyncRequest(
+    completion_Session *session, completion_Request *request, int out)
+{
+    completion_resetOutput(&session->response);
+    completion_appendString(&session->response, "RESYNC\n");
+    completion_sendResponse(out, request->id, &session->response);
+}
+
+
+/* Print the index-th candidate of the cached results to out, in the short
+   form if the client fetches the details with DETAIL. *previous is the index
+   of the last candidate printed (-1 if none), overloads are grouped by name
+   in a SEXP response. */
+static void __print_candidate(
+    completion_Session *session, const completion_Request *request, unsigned index,
+    long *previous, completion_Output *out)
+{
+    CXCompletionResult *results = session->cache.results->Results;
+
+    if (request->sexp_results)
+    {
+        if (completion_printSexpCandidate(
+                &results[index], (*previous >= 0) ? &results[*previous] : NULL,
+                session->cache.results_id, index, out)) {
+            *previous = index;
+        }
+    }
+    else if (request->lazy_details) {
+        completion_printCandidateLine(&results[index], session->cache.results_id, index, out);
+    }
+    else {
+        completion_printCompletionLine(results[index].CompletionString, out);
+    }
+}
+
+/* Filter completion candidates by prefix on the server side, and only print
+   the best limit (0 for no limit) of them to out */
+static void completion_printFilteredResults(
+    completion_Session *session, const completion_Request *request,
+    completion_CandidateTable *table, long *previous, completion_Output *out)
+{
+    completion_Match *matches = 
+        (completion_Match*)malloc((table->n_candidates + 1) * sizeof(completion_Match));
+    unsigned i_match = 0, n_matches;
+    unsigned long started = completion_statsNow();
+
+    n_matches = completion_filterCandidates(table, request->prefix, request->limit, matches);
+    completion_recordStats(STATS_FILTER, started);
+    for ( ; i_match < n_matches; i_match++) {
+        __print_candidate(session, request, matches[i_match].index, previous, out);
+    }
+
+    free(matches);
+}
+
+/* Answer request with the identifiers of the lexicon starting with its
+   prefix, ahead of (or instead of) the semantic results */
+static void __send_lexical_candidates(
+    completion_Session *session, const completion_Request *request, int out)
+{
+    completion_Output *response = &session->response;
+
+    completion_resetOutput(response);
+    completion_appendString(response, "LEXICAL\n");
+    completion_printLexicalCandidates(
+        session, request->row, request->column, request->prefix, request->limit, response);
+    completion_sendResponse(out, request->id, response);
+    completion_recordStats(STATS_LEXICAL, request->received_at);
+}
+
+/* Calculate completion candidates of a COMPLETION request read before, it's
+   answered with no candidates if a newer request has superseded it */
+static void __run_completion(
+    completion_Session *session, completion_Request *request, int out)
+{
+    completion_CandidateTable *candidates = NULL;
+    completion_Output *response = &session->response;
+    unsigned long started;
+    unsigned i_candidate = 0;
+    long previous = -1;
+    int answered = 0;
+
+    /* calculate (or reuse the cached) code completion results, the client
+       gets the identifiers of the source meanwhile if it would take longer
+       than it's willing to wait */
+    if (!request->discarded)
+    {
+        session->complete_on = request->complete_on;
+        session->complete_off = request->complete_off;
+        if (request->budget > 0 &&
+            completion_expectedCompletionTime(session, request->row, request->column) >
+            request->budget)
+        {
+            __send_lexical_candidates(session, request, out);
+            answered = 1;
+        }
+        candidates = completion_cachedCompleteAt(session, request->row, request->column);
+    }
+
+    /* libclang makes nothing of a badly broken source, the identifiers are
+       better than nothing. They're not sent twice. */
+    if (request->budget > 0 && !request->discarded &&
+        (candidates == NULL || candidates->n_candidates == 0))
+    {
+        if (!answered) {
+            __send_lexical_candidates(session, request, out);
+        }
+        return;
+    }
+
+    completion_resetOutput(response);
+
+    /* let the client know that the translation unit is being rebuilt, and the
+       results come from the last good one */
+    if (candidates != NULL && completion_isReparsePending(session)) {
+        completion_appendString(response, "STALE\n");
     }
 
-    /* read source code from fp to buffer */
-    session->src_length = source_length;
-    __read_n_bytes(fp, session->src_buffer, source_length);
+    /* show the candidates, the results are already sorted */
+    if (candidates != NULL)
+    {
+        started = completion_statsNow();
+        if (request->sexp_results) {
+            completion_appendString(response, "SEXP\n(");
+        }
+        if (request->do_filter) {
+            completion_printFilteredResults(session, request, candidates, &previous, response);
+        }
+        else if (request->lazy_details || request->sexp_results)
+        {
+            for ( ; i_candidate < candidates->n_candidates; i_candidate++) {
+                __print_candidate(session, request, i_candidate, &previous, response);
+            }
+        }
+        else {
+	        completion_printCodeCompletionResults(candidates->results, response);
+        }
+        if (request->sexp_results) {
+            completion_appendString(response, (previous >= 0) ? "))\n" : ")\n");
+        }
+        completion_recordStats(STATS_PRINT_RESULTS, started);
+    }
+    
+    /* all candidates are sent to emacs at once */
+    completion_sendResponse(out, request->id, response);
 }
 
+/* Force the clang_codeCompleteAt option on (or off) for request */
+static void __force_option(completion_Request *request, unsigned option, int on)
+{
+    if (on)
+    {
+        request->complete_on |= option;
+        request->complete_off &= ~option;
+    }
+    else
+    {
+        request->complete_off |= option;
+        request->complete_on &= ~option;
+    }
+}
 
 /* Read completion request (where to complete at and current source code) from message 
-   header and calculate completion candidates.
+   header, candidates are calculated later by __run_completion.
 
    Message format:
        row: [#row_number#]
        column: [#column_number#]
+       prefix: [#typed_prefix#]        (optional)
+       limit: [#max_candidates#]       (optional)
+       details: lazy                   (optional)
+       format: sexp                    (optional)
+       macros: [#yes|no#]              (optional)
+       patterns: [#yes|no#]            (optional)
+       preamble: [#skip|load#]         (optional)
+       budget: [#milliseconds#]        (optional)
        source_length: [#src_length#]
        <# SOURCE CODE #>
+   
+   source_length and the source code could be replaced by source_version:
+   [#version#] if the client keeps src_buffer updated with SOURCEDELTA.
+
+   If prefix or limit is present, candidates are filtered and ranked by the
+   server and at most limit (0 for unlimited) of them are sent back, otherwise
+   all candidates are sent in alphabetical order.
+
+   With details: lazy, candidates are sent as CANDIDATE lines (the TypedText,
+   kind and id of each one), and the rest of a candidate is sent by DETAIL,
+   which is the only one to show brief comments, so they're only asked for
+   then.
+
+   With format: sexp, candidates are sent as a "SEXP" line followed by one
+   Lisp list, which Emacs loads with a single read. Each candidate is a
+   name and the overloads of that name, with their kind, priority, result
+   type, chunks and id (see completion_printSexpCandidate), there's nothing
+   left for the client to parse but brief comments, which come from DETAIL.
+
+   macros, patterns and preamble override the clang_codeCompleteAt options
+   of the completion context (see completion_classifyContext): macros, code
+   patterns, and the declarations of the preamble (which libclang 8 and
+   later could skip) are included or left out whatever the context.
+
+   With budget, a completion libclang isn't expected to answer within that
+   many milliseconds is answered right away with the identifiers of the
+   lexicon, which start with LEXICAL, and again with the semantic results
+   when they're in, under the same request id. So is one which libclang has
+   no results for, without the second response.
 */
-void completion_doCompletion(completion_Session *session, FILE *fp)
+void completion_doCompletion(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
 {
-    CXCodeCompleteResults *res;
+    char *key, *value;
+
+    request->row = request->column = 1;
+    request->prefix[0] = '\0';
+    request->limit = 0;
+    request->do_filter = 0;
+    request->lazy_details = 0;
+    request->sexp_results = 0;
+    request->complete_on = request->complete_off = 0;
+    request->budget = 0;
+
+    /* get where to complete at and the optional filtering parameters, the
+       source file portion comes last */
+    while ((key = completion_readHeader(in, &value)) != NULL)
+    {
+        if (strcmp(key, "row") == 0) {
+            request->row = atoi(value);
+        }
+        else if (strcmp(key, "column") == 0) {
+            request->column = atoi(value);
+        }
+        else if (strcmp(key, "prefix") == 0) {
+            strncpy(request->prefix, value, sizeof(request->prefix) - 1);
+            request->prefix[sizeof(request->prefix) - 1] = '\0';
+            request->do_filter = 1;
+        }
+        else if (strcmp(key, "limit") == 0) {
+            request->limit = (unsigned)strtoul(value, NULL, 10);
+            request->do_filter = 1;
+        }
+        else if (strcmp(key, "details") == 0) {
+            request->lazy_details = (strcmp(value, "lazy") == 0);
+        }
+        else if (strcmp(key, "format") == 0) {
+            request->sexp_results = (strcmp(value, "sexp") == 0);
+        }
+        else if (strcmp(key, "macros") == 0) {
+            __force_option(request, CXCodeComplete_IncludeMacros, strcmp(value, "yes") == 0);
+        }
+        else if (strcmp(key, "patterns") == 0) {
+            __force_option(request, CXCodeComplete_IncludeCodePatterns,
+                           strcmp(value, "yes") == 0);
+        }
+        else if (strcmp(key, "preamble") == 0) {
+            __force_option(request, SKIP_PREAMBLE_DECLS, strcmp(value, "skip") == 0);
+        }
+        else if (strcmp(key, "budget") == 0) {
+            request->budget = strtoul(value, NULL, 10);
+        }
+        else {
+            break;
+        }
+    }
 
-    /* get where to complete at */
-    int row, column;
-    fscanf(fp, "row:%d",    &row);    __skip_the_rest(fp);
-    fscanf(fp, "column:%d", &column); __skip_the_rest(fp);
+    if (request->lazy_details || request->sexp_results) {
+        __force_option(request, CXCodeComplete_IncludeBriefComments, 1);
+    }
 
     /* get a copy of fresh source file */
-    completion_readSourcefile(session, fp);
+    if (key == NULL || completion_readSourceSegment(session, in, key, value) != 0)
+    {
+        completion_sendResyncRequest(session, request, out);
+        return;
+    }
+
+    request->kind = REQUEST_COMPLETION;
+    request->run  = __run_completion;
+}
 
-    /* calculate and show code completions results */
-    res = completion_codeCompleteAt(session, row, column);
-    if (res != NULL)
+
+/* Note where the cursor of the client is, the completions around it are
+   precomputed while the client is idle (see completion_speculate). Message
+   format:
+       row: [#row_number#]
+       column: [#column_number#]
+       source_length: [#src_length#]
+       <# SOURCE CODE #>
+   or
+       source_version: [#version#]
+
+   CURSOR has no response, and is ignored if src_buffer is out of sync.
+*/
+void completion_doCursor(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
+{
+    int   row = 1, column = 1;
+    char *key, *value;
+    (void) request; (void) out;    /* CURSOR has no response */
+
+    while ((key = completion_readHeader(in, &value)) != NULL)
     {
-	    /* code completion completed successfully, so we sort and dump these
-         * completion candidates back to client */
-	    clang_sortCodeCompletionResults(res->Results, res->NumResults);
-	    completion_printCodeCompletionResults(res, stdout);
-        clang_disposeCodeCompleteResults(res);
+        if (strcmp(key, "row") == 0) {
+            row = atoi(value);
+        }
+        else if (strcmp(key, "column") == 0) {
+            column = atoi(value);
+        }
+        else {
+            break;
+        }
+    }
+
+    if (key != NULL && completion_readSourceSegment(session, in, key, value) == 0) {
+        completion_setSpeculationPoints(session, row, column);
     }
-    
-    fprintf(stdout, "$"); fflush(stdout);    /* we need to inform emacs that all 
-                                                candidates has already been sent */
 }
 
 
-/* Reparse the source code to refresh the translation unit */
-void completion_doReparse(completion_Session *session, FILE *fp)
+/* Queue a background reparse unless a newer request has superseded it */
+static void __run_reparse(
+    completion_Session *session, completion_Request *request, int out)
+{
+    (void) out;    /* REPARSE has no response */
+    if (!request->discarded) {
+        completion_scheduleReparse(session, NULL);
+    }
+}
+
+/* Reparse the source code to refresh the translation unit, it's done by the
+   background worker so that completion requests are not blocked */
+void completion_doReparse(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
 {
-    (void) fp;     /* get rid of unused parameter warning */
-    completion_reparseTranslationUnit(session);
+    (void) session; (void) in; (void) out;    /* get rid of unused parameter warning */
+    request->kind = REQUEST_REPARSE;
+    request->run  = __run_reparse;
 }
 
 /* Update source code in src_buffer */
-void completion_doSourcefile(completion_Session *session, FILE *fp)
+void completion_doSourcefile(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
+{
+    (void) request; (void) out;    /* get rid of unused parameter warning  */
+    completion_readSourcefile(session, in);
+}
+
+/* Apply an edit to src_buffer in place, message format:
+       base_version: [#version#]
+       offset: [#offset#]
+       deleted_length: [#del_len#]
+       result_length: [#src_length_after_edit#]
+       inserted_length: [#ins_len#]
+       <# INSERTED TEXT #>
+
+   The edit replaces [#del_len#] bytes at [#offset#] with the inserted text. It
+   is only applied if src_buffer is at [#version#] and the resulting length
+   agrees with the client's, otherwise src_buffer is marked out of sync and the
+   next request carrying source_version would ask the client to resync.
+*/
+void completion_doSourceDelta(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
 {
-    (void) fp;     /* get rid of unused parameter warning  */
-    completion_readSourcefile(session, fp);
+    unsigned long base_version = 0;
+    size_t offset = 0, deleted_length = 0, result_length = 0, inserted_length = 0;
+    char *key, *value;
+    (void) request; (void) out;    /* SOURCEDELTA has no response */
+
+    /* inserted_length is the last header, the inserted text follows */
+    while ((key = completion_readHeader(in, &value)) != NULL)
+    {
+        if (strcmp(key, "base_version") == 0) {
+            base_version = strtoul(value, NULL, 10);
+        }
+        else if (strcmp(key, "offset") == 0) {
+            offset = __parse_size(value);
+        }
+        else if (strcmp(key, "deleted_length") == 0) {
+            deleted_length = __parse_size(value);
+        }
+        else if (strcmp(key, "result_length") == 0) {
+            result_length = __parse_size(value);
+        }
+        else if (strcmp(key, "inserted_length") == 0) {
+            inserted_length = __parse_size(value);
+            break;
+        }
+    }
+
+    if (!session->src_in_sync || session->src_version != base_version ||
+        offset > session->src_length ||
+        deleted_length > session->src_length - offset ||
+        session->src_length - deleted_length + inserted_length != result_length)
+    {
+        /* we've lost track of the client's buffer, drop this edit and wait
+           for a full copy */
+        completion_skipBytes(in, inserted_length);
+        session->src_in_sync = 0;
+        return;
+    }
+
+    completion_noteSourceEdit(session, offset);
+    completion_noteLexiconEdit(session, offset, deleted_length);
+    __reserve_src_buffer(session, result_length);
+
+    /* move the text after the edited region into place, then read the
+       inserted text right into the gap */
+    memmove(session->src_buffer + offset + inserted_length,
+            session->src_buffer + offset + deleted_length,
+            session->src_length - offset - deleted_length);
+    if (completion_readBytes(in, session->src_buffer + offset, inserted_length) 
+        != inserted_length) {
+        session->src_in_sync = 0;    /* the client has gone in the middle */
+    }
+
+    session->src_length = result_length;
+    if (session->src_in_sync) {
+        completion_applyLexiconEdit(session, offset, inserted_length);
+    }
+    else {
+        completion_invalidateLexicon(session);
+    }
+    session->src_version++;
+    session->src_updates++;
+
+    /* an edit of the preamble holds the next reparse back (see
+       completion_scheduleReparse) */
+    completion_classifyEdit(session, offset);
 }
 
 
-/* dispose command line arguments of session */
-static void completion_freeCmdlineArgs(completion_Session *session)
+/* Set or drop the unsaved contents of another file than the main one, a
+   header the client is editing (see completion_setOverlay). Message format:
+       path: [#path#]
+       version: [#version#]
+       length: [#length#]
+       <# CONTENTS #>
+   or, to go back to the contents of the file on disk:
+       path: [#path#]
+       drop: yes
+
+   The contents are skipped if the overlay of path is at [#version#] already.
+*/
+void completion_doUnsaved(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
 {
-    /* free each command line arguments */
-    int i_arg = 0;
-    for ( ; i_arg < session->num_args; i_arg++) {
-        free(session->cmdline_args[i_arg]);
+    char *key, *value, *contents, path[4096] = "";
+    unsigned long version = 0;
+    size_t length;
+    completion_Overlay *overlay;
+    (void) request; (void) out;    /* UNSAVED has no response */
+
+    /* length is the last header, the contents follow */
+    while ((key = completion_readHeader(in, &value)) != NULL)
+    {
+        if (strcmp(key, "path") == 0)
+        {
+            strncpy(path, value, sizeof(path) - 1);
+            path[sizeof(path) - 1] = '\0';
+        }
+        else if (strcmp(key, "version") == 0) {
+            version = strtoul(value, NULL, 10);
+        }
+        else if (strcmp(key, "drop") == 0)
+        {
+            completion_dropOverlay(session, path);
+            return;
+        }
+        else if (strcmp(key, "length") == 0) {
+            break;
+        }
+    }
+
+    if (key == NULL) {
+        return;
     }
 
-    /* and dispose the arg vector */
-    free(session->cmdline_args);
+    length = __parse_size(value);
+    overlay = completion_findOverlay(session, path);
+    if (path[0] == '\0' || (overlay != NULL && overlay->version == version))
+    {
+        completion_skipBytes(in, length);
+        return;
+    }
+
+    contents = (char*)malloc(length + 1);
+    if (completion_readBytes(in, contents, length) != length)
+    {
+        free(contents);    /* the client has gone in the middle */
+        return;
+    }
+    completion_setOverlay(session, path, version, contents, length);
 }
 
+
 /* Update command line arguments passing to clang translation unit. Format
    of the coming CMDLINEARGS message is as follows:
    
        num_args: [#n_args#]
        arg1 arg2 ... (there should be n_args items here)
 */
-void completion_doCmdlineArgs(completion_Session *session, FILE *fp)
+void completion_doCmdlineArgs(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
 {
-    int i_arg = 0;
-    char arg[LINE_MAX];
-
-    /* destroy command line args, and we will rebuild it later */
-    completion_freeCmdlineArgs(session);
+    int i_arg = 0, num_args, num_flags;
+    char *key, *value = "", *arg, **args, **flags;
+    (void) request; (void) out;    /* CMDLINEARGS has no response */
 
     /* get number of arguments */
-    fscanf(fp, "num_args:%d", &(session->num_args)); __skip_the_rest(fp);
-    session->cmdline_args = (char**)calloc(sizeof(char*), session->num_args);
+    key = completion_readHeader(in, &value);
+    num_args = (key != NULL) ? atoi(value) : 0;
+    if (num_args < 0) {
+        num_args = 0;
+    }
+    args = (char**)calloc(sizeof(char*), num_args + 1);
 
-    /* rebuild command line arguments vector according to the message */
-    for ( ; i_arg < session->num_args; i_arg++)
+    /* build command line arguments vector according to the message */
+    for ( ; i_arg < num_args; i_arg++)
     {
         /* fetch an argument from message */
-        fscanf(fp, "%s", arg);
+        if ((arg = completion_readToken(in, NULL)) == NULL) {
+            break;
+        }
+        args[i_arg] = strdup(arg);
+    }
+    num_args = i_arg;
 
-        /* and add it to cmdline_args */
-        session->cmdline_args[i_arg] = (char*)calloc(sizeof(char), strlen(arg) + 1);
-        strcpy(session->cmdline_args[i_arg], arg);
+    num_flags = completion_buildCompileFlags(session->src_filename, num_args, args, &flags);
+    while (i_arg > 0) {
+        free(args[--i_arg]);
     }
+    free(args);
+
+    /* translation units are rebuilt (or taken from the pool) only if the
+       flags have actually changed */
+    completion_switchCmdlineArgs(session, num_flags, flags);
+}
+
+/* Switch to another parse profile, message format:
+       profile: [#name#]
+
+   The translation unit is parsed again with the options of the profile,
+   unless it's the current one. Only an unknown profile is answered.
+*/
+void completion_doProfile(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
+{
+    char *key, *value = "";
+    int   profile;
+
+    key = completion_readHeader(in, &value);
+    if (key == NULL || strcmp(key, "profile") != 0 ||
+        (profile = completion_findParseProfile(value)) < 0)
+    {
+        completion_resetOutput(&session->response);
+        completion_appendString(&session->response, "ERROR: UNKNOWN PROFILE\n");
+        completion_sendResponse(out, request->id, &session->response);
+        return;
+    }
+
+    completion_setParseProfile(session, profile);
+}
+
+/* Reparse the source in background to retrieve diagnostic messages, the
+   worker dumps them to out when it's done. Syntax checks are never dropped,
+   the ones read together share a single reparse of the newest source. */
+static void __run_syntaxCheck(
+    completion_Session *session, completion_Request *request, int out)
+{
+    completion_Receiver receiver;
 
-    /* we have to rebuild our translation units to make these cmdline args changes 
-       take place */
-    clang_disposeTranslationUnit(session->cx_tu);
-    completion_parseTranslationUnit(session);
-    completion_reparseTranslationUnit(session);  /* dump PCH for acceleration */
+    receiver.fd = out;
+    receiver.request_id = request->id;
+    receiver.received_at = request->received_at;
+    receiver.options = request->diagnostics;
+    completion_scheduleReparse(session, &receiver);
 }
 
-/* Handle syntax checking request, message format:
+/* Handle syntax checking request, the response is sent by the background
+   worker after reparsing. Message format:
+       diagnostics: structured         (optional)
+       base: [#set_id#]                (optional)
+       first_line: [#line#]            (optional)
+       last_line: [#line#]             (optional)
        source_length: [#src_length#]
        <# SOURCE CODE #>
+   or
+       source_version: [#version#]
 */
-void completion_doSyntaxCheck(completion_Session *session, FILE *fp)
+void completion_doSyntaxCheck(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
 {
-    unsigned int i_diag = 0, n_diag;
-    CXDiagnostic diag;
-    CXString     dmsg;
+    char *key, *value;
 
-    /* get a copy of fresh source file */
-    completion_readSourcefile(session, fp);
+    memset(&request->diagnostics, 0, sizeof(request->diagnostics));
 
-    /* reparse the source to retrieve diagnostic message */
-    completion_reparseTranslationUnit(session);
+    while ((key = completion_readHeader(in, &value)) != NULL)
+    {
+        if (strcmp(key, "diagnostics") == 0) {
+            request->diagnostics.structured = (strcmp(value, "structured") == 0);
+        }
+        else if (strcmp(key, "base") == 0) {
+            request->diagnostics.base = strtoul(value, NULL, 10);
+        }
+        else if (strcmp(key, "first_line") == 0) {
+            request->diagnostics.first_line = atoi(value);
+        }
+        else if (strcmp(key, "last_line") == 0) {
+            request->diagnostics.last_line = atoi(value);
+        }
+        else {
+            break;
+        }
+    }
 
-    /* dump all diagnostic messages to fp */
-    n_diag = clang_getNumDiagnostics(session->cx_tu);
-    for ( ; i_diag < n_diag; i_diag++)
+    /* get a copy of fresh source file */
+    if (key == NULL || completion_readSourceSegment(session, in, key, value) != 0)
     {
-        diag = clang_getDiagnostic(session->cx_tu, i_diag);
-        dmsg = clang_formatDiagnostic(diag, clang_defaultDiagnosticDisplayOptions());
-        fprintf(stdout, "%s\n", clang_getCString(dmsg));
-        clang_disposeString(dmsg);
-        clang_disposeDiagnostic(diag);
+        completion_sendResyncRequest(session, request, out);
+        return;
     }
 
-    fprintf(stdout, "$"); fflush(stdout);    /* end of output */
+    request->kind = REQUEST_SYNTAXCHECK;
+    request->run  = __run_syntaxCheck;
+}
+
+/* Terminate the server after the requests read before SHUTDOWN are done */
+static void __run_shutdown(
+    completion_Session *session, completion_Request *request, int out)
+{
+    (void) request; (void) out;   /* these parameters are unused, the server will
+                                   * shutdown directly without sending any messages
+                                   * to its client */
+
+    /* free session properties and clang parser infrastructures */
+    shutdown_completionSession(session);
+    clang_disposeIndex(session->cx_index);
+
+    exit(0);   /* terminate completion process */
 }
 
 /* When emacs buffer is killed, a SHUTDOWN message is sent automatically by a hook 
    function to inform the completion server (this program) to terminate. */
-void completion_doShutdown(completion_Session *session, FILE *fp)
+void completion_doShutdown(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
 {
-    (void) fp;    /* this parameter is unused, the server will shutdown
-                   * directly without sending any messages to its client */
+    (void) session; (void) in; (void) out;   /* get rid of unused parameter warning */
+    request->kind = REQUEST_SHUTDOWN;
+    request->run  = __run_shutdown;
+}
 
-    /* free clang parser infrastructures */
-    clang_disposeTranslationUnit(session->cx_tu);
-    clang_disposeIndex(session->cx_index);
+/* Send the stats, after the requests read before STATS are done */
+static void __run_stats(
+    completion_Session *session, completion_Request *request, int out)
+{
+    completion_resetOutput(&session->response);
+    completion_printStats(&session->response);
+    completion_printOutput(&session->response,
+        "completion_cache hits:%lu speculative_hits:%lu misses:%lu\n",
+        session->cache.hits, session->cache.speculative_hits, session->cache.misses);
+    completion_sendResponse(out, request->id, &session->response);
+}
 
-    /* free session properties */
-    completion_freeCmdlineArgs(session);
-    free(session->src_buffer);
+/* Report the latency of every message type and phase, and the memory used by
+   the last translation unit parsed, see completion_printStats, then the hits
+   and misses of the completion cache of the session */
+void completion_doStats(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
+{
+    (void) session; (void) in; (void) out;   /* get rid of unused parameter warning */
+    request->kind = REQUEST_STATS;
+    request->run  = __run_stats;
+}
 
-    exit(0);   /* terminate completion process */
+
+/* Look symbols up project-wide in the symbol index (completion_index.h), by
+   prefix of their name. Message format:
+       limit: [#max_symbols#]          (optional)
+       prefix: [#prefix#]
+*/
+void completion_doSymbols(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
+{
+    char    *key, *value, prefix[256] = "";
+    unsigned limit = DEFAULT_SYMBOLS_LIMIT;
+
+    /* prefix is the last header */
+    while ((key = completion_readHeader(in, &value)) != NULL)
+    {
+        if (strcmp(key, "limit") == 0) {
+            limit = (unsigned)strtoul(value, NULL, 10);
+        }
+        else if (strcmp(key, "prefix") == 0)
+        {
+            strncpy(prefix, value, sizeof(prefix) - 1);
+            prefix[sizeof(prefix) - 1] = '\0';
+            break;
+        }
+    }
+
+    completion_resetOutput(&session->response);
+    if (completion_printSymbols(prefix, limit, &session->response) != 0) {
+        completion_appendString(&session->response, "ERROR: NO SYMBOL INDEX\n");
+    }
+    completion_sendResponse(out, request->id, &session->response);
+}
+
+/* Look the symbol of a USR up in the symbol index, which is its definition
+   if the project has one. Message format:
+       usr: [#usr#]
+*/
+void completion_doDefinition(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
+{
+    char *key, *value = "";
+
+    key = completion_readHeader(in, &value);
+
+    completion_resetOutput(&session->response);
+    if (completion_printDefinition((key != NULL) ? value : "", &session->response) != 0) {
+        completion_appendString(&session->response, "ERROR: NO SYMBOL INDEX\n");
+    }
+    completion_sendResponse(out, request->id, &session->response);
+}
+
+/* Render the parts of a candidate left out of its CANDIDATE line, see
+   completion_printCandidateDetail. The results it comes from are kept until
+   the next COMPLETION at another point. Message format:
+       id: [#results_id#].[#index#]
+*/
+void completion_doDetail(
+    completion_Session *session, completion_Request *request, completion_Input *in, int out)
+{
+    char *key, *value = "", *end;
+    unsigned long results_id;
+    unsigned index = 0;
+    CXCompletionResult *result = NULL;
+
+    key = completion_readHeader(in, &value);
+    results_id = strtoul(value, &end, 10);
+    if (key != NULL && *end == '.')
+    {
+        index = (unsigned)strtoul(end + 1, NULL, 10);
+        result = completion_cachedCandidate(session, results_id, index);
+    }
+
+    completion_resetOutput(&session->response);
+    if (result != NULL) {
+        completion_printCandidateDetail(result->CompletionString, &session->response);
+    }
+    else {
+        completion_appendString(&session->response, "ERROR: UNKNOWN CANDIDATE\n");
+    }
+    completion_sendResponse(out, request->id, &session->response);
 }
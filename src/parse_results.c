@@ -7,8 +7,27 @@
 
 
 
+/* Index of the TypedText chunk of completion_string, or -1 if there's none */
+static int __find_typed_text(CXCompletionString completion_string)
+{
+    int i_chunk  = 0;
+    int n_chunks = clang_getNumCompletionChunks(completion_string);
+
+    /* inspect all chunks only to find the TypedText chunk */
+    for ( ; i_chunk < n_chunks; i_chunk++)
+    {
+        if (clang_getCompletionChunkKind(completion_string, i_chunk)
+            == CXCompletionChunk_TypedText) {
+            return i_chunk;
+        }
+    }
+
+    return -1;
+}
+
+
 /* Print "COMPLETION: " followed by the TypedText chunk of the completion
- * string to fp, that's the text that a user would be expected to type to get
+ * string to out, that's the text that a user would be expected to type to get
  * this code-completion result. TypedText is the keyword for the client program
  * (emacs script in this case) to filter completion results.
  * 
@@ -16,27 +35,21 @@
  * would return an -1 if no TypedText chunk was found.
  */
 static int completion_printCompletionHeadTerm(
-    CXCompletionString completion_string, FILE *fp)
+    CXCompletionString completion_string, completion_Output *out)
 {
-    int i_chunk  = 0;
-    int n_chunks = clang_getNumCompletionChunks(completion_string);
+    int i_chunk  = __find_typed_text(completion_string);
     CXString ac_string;
 
-    /* inspect all chunks only to find the TypedText chunk */
-    for ( ; i_chunk < n_chunks; i_chunk++)
-    {
-        if (clang_getCompletionChunkKind(completion_string, i_chunk) 
-            == CXCompletionChunk_TypedText)
-        {
-            /* We got it, just dump it to fp */
-            ac_string = clang_getCompletionChunkText(completion_string, i_chunk);
-            fprintf(fp, "COMPLETION: %s", clang_getCString(ac_string));
-            clang_disposeString(ac_string);
-            return n_chunks;    /* care package on the way */
-        }
+    if (i_chunk < 0) {
+        return -1;   /* We haven't found TypedText chunk in completion_string */
     }
 
-    return -1;   /* We haven't found TypedText chunk in completion_string */
+    /* We got it, just dump it to out */
+    ac_string = clang_getCompletionChunkText(completion_string, i_chunk);
+    completion_appendString(out, "COMPLETION: ");
+    completion_appendString(out, clang_getCString(ac_string));
+    clang_disposeString(ac_string);
+    return clang_getNumCompletionChunks(completion_string);    /* care package on the way */
 }
 
 
@@ -55,7 +68,7 @@ static int completion_printCompletionHeadTerm(
  * script would simply drop those pattern lines with an regexp T T
  */
 static void completion_printAllCompletionTerms(
-    CXCompletionString completion_string, FILE *fp)
+    CXCompletionString completion_string, completion_Output *out)
 {
     int i_chunk  = 0;
     int n_chunks = clang_getNumCompletionChunks(completion_string);
@@ -73,24 +86,28 @@ static void completion_printAllCompletionTerms(
         switch (chk_kind)
         {
         case CXCompletionChunk_Placeholder:
-            fprintf(fp, "<#%s#>", clang_getCString(chk_text));
+            completion_appendOutput(out, "<#", 2);
+            completion_appendString(out, clang_getCString(chk_text));
+            completion_appendOutput(out, "#>", 2);
             break;
                 
         case CXCompletionChunk_ResultType:
-            fprintf(fp, "[#%s#]", clang_getCString(chk_text));
+            completion_appendOutput(out, "[#", 2);
+            completion_appendString(out, clang_getCString(chk_text));
+            completion_appendOutput(out, "#]", 2);
             break;
 
         case CXCompletionChunk_Optional:
             /* print optional term in a recursive way */
-            fprintf(fp, "{#");
+            completion_appendOutput(out, "{#", 2);
             completion_printAllCompletionTerms(
                 clang_getCompletionChunkCompletionString(completion_string, i_chunk),
-                fp);
-            fprintf(fp, "#}");
+                out);
+            completion_appendOutput(out, "#}", 2);
             break;
                 
         default:
-            fprintf(fp, "%s", clang_getCString(chk_text));
+            completion_appendString(out, clang_getCString(chk_text));
         }
 
         clang_disposeString(chk_text);
@@ -98,30 +115,318 @@ static void completion_printAllCompletionTerms(
 }
 
 
-/* Print specified completion string to fp. */
+/* Print specified completion string to out. */
 void completion_printCompletionLine(
-    CXCompletionString completion_string, FILE *fp)
+    CXCompletionString completion_string, completion_Output *out)
 {
     /* print completion item head: COMPLETION: typed_string */
-    if (completion_printCompletionHeadTerm(completion_string, fp) > 1)
+    if (completion_printCompletionHeadTerm(completion_string, out) > 1)
     {
         /* If there's not only one TypedText chunk in this completion string,
          * we still have a lot of info to dump: 
          *
          *     COMPLETION: typed_text : ##infos## 
          */
-        fprintf(fp, " : ");
-        completion_printAllCompletionTerms(completion_string, fp);
+        completion_appendOutput(out, " : ", 3);
+        completion_printAllCompletionTerms(completion_string, out);
     }
 
-    printf("\n");
+    completion_appendOutput(out, "\n", 1);
 }
 
-/* Print all completion results to fp */
-void completion_printCodeCompletionResults(CXCodeCompleteResults *res, FILE *fp)
+/* Print all completion results to out */
+void completion_printCodeCompletionResults(CXCodeCompleteResults *res, completion_Output *out)
 {
     unsigned int i = 0;
     for ( ; i < res->NumResults; i++) {
-        completion_printCompletionLine(res->Results[i].CompletionString, fp);
+        completion_printCompletionLine(res->Results[i].CompletionString, out);
+    }
+}
+
+
+/* Print "CANDIDATE:" followed by the TypedText of result, the name of its
+ * cursor kind and its candidate id to out, tab separated. The rest of the
+ * completion string is left for DETAIL to render, when the client wants to
+ * show it:
+ *
+ *     CANDIDATE:static_cast\tNotImplemented\t12.40
+ */
+void completion_printCandidateLine(
+    const CXCompletionResult *result, unsigned long results_id, unsigned index,
+    completion_Output *out)
+{
+    int i_chunk = __find_typed_text(result->CompletionString);
+    CXString chk_text, kind;
+
+    if (i_chunk < 0) {
+        return;
+    }
+
+    chk_text = clang_getCompletionChunkText(result->CompletionString, i_chunk);
+    kind = clang_getCursorKindSpelling(result->CursorKind);
+    completion_appendString(out, "CANDIDATE:");
+    completion_appendString(out, clang_getCString(chk_text));
+    completion_printOutput(out, "\t%s\t%lu.%u\n", clang_getCString(kind), results_id, index);
+    clang_disposeString(kind);
+    clang_disposeString(chk_text);
+}
+
+/* Append text to out as an Emacs Lisp string literal */
+static void __append_lisp_string(completion_Output *out, const char *text)
+{
+    size_t length;
+
+    completion_appendOutput(out, "\"", 1);
+    while (text != NULL && *text != '\0')
+    {
+        length = strcspn(text, "\"\\");
+        completion_appendOutput(out, text, length);
+        text += length;
+        if (*text != '\0')
+        {
+            completion_appendOutput(out, "\\", 1);
+            completion_appendOutput(out, text, 1);
+            text++;
+        }
+    }
+    completion_appendOutput(out, "\"", 1);
+}
+
+/* Print the chunks of completion_string as the elements of a Lisp list, see
+   completion_printSexpCandidate. The first one is preceded by a space if
+   anything comes before it in the list. */
+static void __print_sexp_chunks(
+    CXCompletionString completion_string, int separate, completion_Output *out)
+{
+    int i_chunk  = 0;
+    int n_chunks = clang_getNumCompletionChunks(completion_string);
+    enum CXCompletionChunkKind chk_kind;
+    CXString chk_text;
+
+    for ( ; i_chunk < n_chunks; i_chunk++)
+    {
+        chk_kind = clang_getCompletionChunkKind(completion_string, i_chunk);
+        if (chk_kind == CXCompletionChunk_ResultType) {
+            continue;    /* it has a field of its own */
+        }
+
+        if (separate) {
+            completion_appendOutput(out, " ", 1);
+        }
+        separate = 1;
+        if (chk_kind == CXCompletionChunk_Optional)
+        {
+            completion_appendOutput(out, "(o", 2);
+            __print_sexp_chunks(
+                clang_getCompletionChunkCompletionString(completion_string, i_chunk), 1, out);
+            completion_appendOutput(out, ")", 1);
+            continue;
+        }
+        if (chk_kind == CXCompletionChunk_TypedText)
+        {
+            completion_appendOutput(out, "name", 4);
+            continue;
+        }
+
+        chk_text = clang_getCompletionChunkText(completion_string, i_chunk);
+        switch (chk_kind)
+        {
+        case CXCompletionChunk_Placeholder:
+        case CXCompletionChunk_CurrentParameter:
+            completion_appendOutput(out, "(p ", 3);
+            __append_lisp_string(out, clang_getCString(chk_text));
+            completion_appendOutput(out, ")", 1);
+            break;
+
+        case CXCompletionChunk_Informative:
+            completion_appendOutput(out, "(i ", 3);
+            __append_lisp_string(out, clang_getCString(chk_text));
+            completion_appendOutput(out, ")", 1);
+            break;
+
+        default:
+            __append_lisp_string(out, clang_getCString(chk_text));
+        }
+        clang_disposeString(chk_text);
+    }
+}
+
+/* Print the first ResultType chunk of completion_string as a Lisp string,
+   or nil if it has none */
+static void __print_sexp_result_type(CXCompletionString completion_string, completion_Output *out)
+{
+    int i_chunk  = 0;
+    int n_chunks = clang_getNumCompletionChunks(completion_string);
+    CXString chk_text;
+
+    for ( ; i_chunk < n_chunks; i_chunk++)
+    {
+        if (clang_getCompletionChunkKind(completion_string, i_chunk)
+            == CXCompletionChunk_ResultType)
+        {
+            chk_text = clang_getCompletionChunkText(completion_string, i_chunk);
+            __append_lisp_string(out, clang_getCString(chk_text));
+            clang_disposeString(chk_text);
+            return;
+        }
+    }
+
+    completion_appendOutput(out, "nil", 3);
+}
+
+/* Print result, the index-th one of the result set results_id, as an
+ * overload of the s-expression of a SEXP response:
+ *
+ *     ("push_back" ("CXXMethod" 35 "void" (name "(" (p "const T &x") ")") "12.40")
+ *                  ("CXXMethod" 35 "void" (name "(" (p "T &&x") ")") "12.41"))
+ *
+ * that is, (NAME OVERLOAD...) with one (KIND PRIORITY RESULT-TYPE CHUNKS ID)
+ * for each result of that name. In CHUNKS, the symbol name stands for the
+ * typed text, (p TEXT) is a placeholder, (i TEXT) informative text and
+ * (o CHUNK...) an optional part, the rest are strings. Results of the same
+ * name are expected in a row, previous is the last result printed before
+ * (NULL if none), a new candidate is opened when the name changes.
+ *
+ * Returns 0 if result has no TypedText chunk and is left out.
+ */
+int completion_printSexpCandidate(
+    const CXCompletionResult *result, const CXCompletionResult *previous,
+    unsigned long results_id, unsigned index, completion_Output *out)
+{
+    int i_chunk = __find_typed_text(result->CompletionString), i_previous;
+    CXString chk_text, previous_text, kind;
+    int same_name = 0;
+
+    if (i_chunk < 0) {
+        return 0;
+    }
+
+    chk_text = clang_getCompletionChunkText(result->CompletionString, i_chunk);
+    if (previous != NULL)
+    {
+        i_previous = __find_typed_text(previous->CompletionString);
+        previous_text = clang_getCompletionChunkText(previous->CompletionString, i_previous);
+        same_name = (strcmp(clang_getCString(chk_text), clang_getCString(previous_text)) == 0);
+        clang_disposeString(previous_text);
+        if (!same_name) {
+            completion_appendOutput(out, ")\n", 2);
+        }
+    }
+    if (!same_name)
+    {
+        completion_appendOutput(out, "(", 1);
+        __append_lisp_string(out, clang_getCString(chk_text));
+    }
+    clang_disposeString(chk_text);
+
+    kind = clang_getCursorKindSpelling(result->CursorKind);
+    completion_appendOutput(out, " (", 2);
+    __append_lisp_string(out, clang_getCString(kind));
+    completion_printOutput(out, " %u ", clang_getCompletionPriority(result->CompletionString));
+    __print_sexp_result_type(result->CompletionString, out);
+    completion_appendOutput(out, " (", 2);
+    __print_sexp_chunks(result->CompletionString, 0, out);
+    completion_printOutput(out, ") \"%lu.%u\")", results_id, index);
+    clang_disposeString(kind);
+    return 1;
+}
+
+/* Print "[#key#]:" and text on a line of its own, unless text is empty */
+static void __print_detail_line(completion_Output *out, const char *key, CXString text)
+{
+    const char *cursor = clang_getCString(text);
+    size_t length;
+
+    if (cursor == NULL || cursor[0] == '\0') {
+        return;
+    }
+
+    completion_appendString(out, key);
+    while (*cursor != '\0')
+    {
+        /* comments may span lines, they're joined into one */
+        length = strcspn(cursor, "\r\n");
+        completion_appendOutput(out, cursor, length);
+        cursor += length;
+        if (*cursor != '\0')
+        {
+            completion_appendOutput(out, " ", 1);
+            cursor++;
+        }
+    }
+    completion_appendOutput(out, "\n", 1);
+}
+
+/* Print a PLACEHOLDER line for each placeholder of completion_string,
+ * optional ones included, in the order they appear */
+static void __print_placeholders(CXCompletionString completion_string, completion_Output *out)
+{
+    int i_chunk  = 0;
+    int n_chunks = clang_getNumCompletionChunks(completion_string);
+    CXString chk_text;
+
+    for ( ; i_chunk < n_chunks; i_chunk++)
+    {
+        switch (clang_getCompletionChunkKind(completion_string, i_chunk))
+        {
+        case CXCompletionChunk_Placeholder:
+            chk_text = clang_getCompletionChunkText(completion_string, i_chunk);
+            __print_detail_line(out, "PLACEHOLDER:", chk_text);
+            clang_disposeString(chk_text);
+            break;
+
+        case CXCompletionChunk_Optional:
+            __print_placeholders(
+                clang_getCompletionChunkCompletionString(completion_string, i_chunk), out);
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+/* Print the details of a candidate sent by completion_printCandidateLine:
+ *
+ *     SIGNATURE:[#terms as in COMPLETION lines#]
+ *     PLACEHOLDER:[#placeholder#]      (one per placeholder)
+ *     BRIEF:[#brief comment#]          (if it's documented)
+ *     PARENT:[#parent context#]        (if it's a member)
+ */
+void completion_printCandidateDetail(
+    CXCompletionString completion_string, completion_Output *out)
+{
+    CXString text;
+
+    completion_appendString(out, "SIGNATURE:");
+    completion_printAllCompletionTerms(completion_string, out);
+    completion_appendOutput(out, "\n", 1);
+
+    __print_placeholders(completion_string, out);
+
+    text = clang_getCompletionBriefComment(completion_string);
+    __print_detail_line(out, "BRIEF:", text);
+    clang_disposeString(text);
+
+    text = clang_getCompletionParent(completion_string, NULL);
+    __print_detail_line(out, "PARENT:", text);
+    clang_disposeString(text);
+}
+
+/* Print all diagnostic messages of tu to out */
+void completion_printDiagnostics(CXTranslationUnit tu, completion_Output *out)
+{
+    unsigned int i_diag = 0, n_diag = clang_getNumDiagnostics(tu);
+    CXDiagnostic diag;
+    CXString     dmsg;
+
+    for ( ; i_diag < n_diag; i_diag++)
+    {
+        diag = clang_getDiagnostic(tu, i_diag);
+        dmsg = clang_formatDiagnostic(diag, clang_defaultDiagnosticDisplayOptions());
+        completion_appendString(out, clang_getCString(dmsg));
+        completion_appendOutput(out, "\n", 1);
+        clang_disposeString(dmsg);
+        clang_disposeDiagnostic(diag);
     }
 }
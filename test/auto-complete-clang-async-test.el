@@ -0,0 +1,90 @@
+;;; auto-complete-clang-async-test.el --- Tests of the client  -*- coding: utf-8 -*-
+
+;; Feeds responses of the server, as it frames them, through the process
+;; buffer and `ac-clang-take-response'. Run them with `make test', or
+;;
+;;     emacs -Q --batch -L . -l test/auto-complete-clang-async-test.el \
+;;           -f ert-run-tests-batch-and-exit
+;;
+;; auto-complete is taken from the installed packages.
+
+(require 'package)
+(package-initialize)
+(require 'ert)
+(require 'cl-lib)
+(require 'auto-complete-clang-async)
+
+(defconst ac-clang-test-frame
+  (concat
+   "7 377\n"
+   "SEXP\n"
+   "((\"café\" (\"FieldDecl\" 35 \"int\" (name) \"1.0\"))\n"
+   "(\"f\" (\"CXXMethod\" 34 \"void\" (name \"(\" (o (p \"const char *s = \\\"a\\\\\\\"b\\\\\\\\c\\\"\")) \")\") \"1.1\"))\n"
+   "(\"operator=\" (\"CXXMethod\" 79 \"S &\" (name \"(\" (p \"const S &\") \")\") \"1.2\") (\"CXXMethod\" 79 \"S &\" (name \"(\" (p \"S &&\") \")\") \"1.3\"))\n"
+   "(\"S\" (\"StructDecl\" 75 nil (name \"::\") \"1.4\"))\n"
+   "(\"~S\" (\"CXXDestructor\" 79 \"void\" (name \"(\" \")\") \"1.5\")))\n")
+  "A SEXP completion response of the server, frame header included. It was
+taken from the completion of a struct with a field named café and a method
+whose default argument is a string holding quotes and backslashes.")
+
+(defconst ac-clang-test-notice
+  "0 45\nNOTICE: Cannot use /nonexistent as AST cache\n"
+  "A notice the server sends on its own.")
+
+(defmacro ac-clang-test-with-process-buffer (&rest body)
+  "Run BODY with a temporary buffer as the process buffer of every process."
+  (declare (indent 0))
+  `(let ((buffer (generate-new-buffer " *clang-complete-test*")))
+     (unwind-protect
+         (cl-letf (((symbol-function 'process-buffer) (lambda (_proc) buffer)))
+           ,@body)
+       (kill-buffer buffer))))
+
+(defun ac-clang-test-receive (&rest strings)
+  "Append STRINGS to the process buffer, as the process filter would."
+  (with-current-buffer (process-buffer nil)
+    (goto-char (point-max))
+    (apply 'insert strings)))
+
+(defun ac-clang-test-body (frame)
+  "The body of FRAME, after its header line."
+  (substring frame (1+ (string-match "\n" frame))))
+
+
+(ert-deftest ac-clang-test-sexp-round-trip ()
+  "A SEXP response comes out of the process buffer as the server sent it."
+  (ac-clang-test-with-process-buffer
+    (ac-clang-test-receive ac-clang-test-frame)
+    (let* ((response (ac-clang-take-response 'server))
+           (candidates (progn
+                         (should (string-match "^SEXP\n" response))
+                         (ac-clang-parse-sexp-results response (match-end 0) "")))
+           (f (car (member "f" candidates))))
+      (should (equal response (ac-clang-test-body ac-clang-test-frame)))
+      (should (eql ac-clang-response-id 7))
+      (should (zerop (buffer-size buffer)))
+      (should (member "café" candidates))
+      (should (equal (nth 3 (car (get-text-property 0 'ac-clang-overloads f)))
+                     '(name "(" (o (p "const char *s = \"a\\\"b\\\\c\"")) ")"))))))
+
+(ert-deftest ac-clang-test-partial-frame ()
+  "A response is only taken once all the bytes its header counts are in."
+  (ac-clang-test-with-process-buffer
+    (ac-clang-test-receive (substring ac-clang-test-frame 0 -20))
+    (should-not (ac-clang-take-response 'server))
+    (ac-clang-test-receive (substring ac-clang-test-frame -20))
+    (should (equal (ac-clang-take-response 'server)
+                   (ac-clang-test-body ac-clang-test-frame)))))
+
+(ert-deftest ac-clang-test-notice-skipped ()
+  "Notices are shown as messages, the response after them is taken."
+  (ac-clang-test-with-process-buffer
+    (let (messages)
+      (cl-letf (((symbol-function 'message)
+                 (lambda (string &rest args) (push (apply 'format string args) messages))))
+        (ac-clang-test-receive ac-clang-test-notice ac-clang-test-frame)
+        (should (equal (ac-clang-take-response 'server)
+                       (ac-clang-test-body ac-clang-test-frame))))
+      (should (equal messages '("clang-complete: Cannot use /nonexistent as AST cache"))))))
+
+;;; auto-complete-clang-async-test.el ends here